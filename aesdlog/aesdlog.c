@@ -0,0 +1,367 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "aesdlog.h"
+
+#define BATCH       64          // records per sendmmsg()/writev()
+#define HEADER_MAX  96
+
+/**
+ * Ring slot (Vyukov's bounded queue): seq == position while free for the
+ * producer claiming that position, position + 1 once the record is in,
+ * and position + slots after the flusher took it
+ */
+struct slot {
+    atomic_size_t seq;
+    int prio;
+    struct timespec ts;
+    unsigned len;
+    char msg[AESDLOG_MSG_MAX];
+} __attribute__((aligned(64)));
+
+static struct {
+    char ident[64];
+    pid_t pid;
+    struct aesdlog_options opts;
+    atomic_int level;
+
+    struct slot *ring;
+    size_t mask;
+    atomic_size_t tail;         // next position producers claim
+    size_t head;                // next position the flusher reads
+    atomic_size_t head_seen;    // head as last published, for the fill check
+
+    atomic_uint_fast64_t dropped;
+    uint64_t dropped_reported;
+
+    int fd;                     // /dev/log socket or log file, -1 if none
+    bool stream;                // fd is a SOCK_STREAM socket, see write_batch()
+    pthread_t flusher;
+    atomic_bool running;        // flusher started, read by producers
+    atomic_int kick;            // futex the flusher sleeps on
+    atomic_int stopping;
+} lg = { .fd = -1, .level = LOG_DEBUG };
+
+static void futex_wait(atomic_int *addr, int val, const struct timespec *timeout) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void futex_wake(atomic_int *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * (Re)connect to the syslog socket, datagram first as syslogd and
+ * journald listen
+ */
+static void syslog_connect(void) {
+    if (lg.fd >= 0) {
+        close(lg.fd);
+        lg.fd = -1;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = "/dev/log" };
+    int types[] = { SOCK_DGRAM, SOCK_STREAM };
+    for (int i = 0; i < 2; i++) {
+        int fd = socket(AF_UNIX, types[i] | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            lg.fd = fd;
+            lg.stream = types[i] == SOCK_STREAM;
+            return;
+        }
+        close(fd);
+    }
+}
+
+int aesdlog_open(const char *ident, const struct aesdlog_options *opts) {
+    if (opts) {
+        lg.opts = *opts;
+    }
+    snprintf(lg.ident, sizeof(lg.ident), "%s", ident);
+    lg.pid = getpid();
+    size_t slots = lg.opts.ring_slots ? lg.opts.ring_slots : AESDLOG_RING_SLOTS;
+    size_t cap = 2;
+    while (cap < slots) {
+        cap *= 2;
+    }
+    if (posix_memalign((void **)&lg.ring, 64, cap * sizeof(struct slot)) != 0) {
+        lg.ring = NULL;
+        return -1;
+    }
+    for (size_t i = 0; i < cap; i++) {
+        atomic_init(&lg.ring[i].seq, i);
+    }
+    lg.mask = cap - 1;
+    atomic_store(&lg.tail, 0);
+    lg.head = 0;
+    tzset();
+
+    if (lg.opts.file) {
+        lg.fd = open(lg.opts.file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (lg.fd < 0) {
+            return -1;
+        }
+    } else {
+        syslog_connect();
+    }
+    return 0;
+}
+
+void aesdlog_set_level(int prio) {
+    atomic_store_explicit(&lg.level, prio, memory_order_relaxed);
+}
+
+uint64_t aesdlog_dropped(void) {
+    return atomic_load_explicit(&lg.dropped, memory_order_relaxed);
+}
+
+void aesdlog_write(int prio, const char *fmt, ...) {
+    if (lg.ring == NULL || prio > atomic_load_explicit(&lg.level, memory_order_relaxed)) {
+        return;
+    }
+    // Claim a position
+    size_t pos = atomic_load_explicit(&lg.tail, memory_order_relaxed);
+    struct slot *slot;
+    while (1) {
+        slot = &lg.ring[pos & lg.mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&lg.tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (dif < 0) {
+            atomic_fetch_add_explicit(&lg.dropped, 1, memory_order_relaxed);
+            return; // full
+        } else {
+            pos = atomic_load_explicit(&lg.tail, memory_order_relaxed);
+        }
+    }
+
+    slot->prio = prio;
+    clock_gettime(CLOCK_REALTIME, &slot->ts);
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(slot->msg, sizeof(slot->msg), fmt, ap);
+    va_end(ap);
+    if (len < 0) len = 0;
+    if (len >= (int)sizeof(slot->msg)) len = sizeof(slot->msg) - 1;
+    // syslog adds its own line end
+    while (len > 0 && slot->msg[len - 1] == '\n') {
+        len--;
+    }
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+
+    // Past half full, do not wait for the flusher's next interval
+    size_t head = atomic_load_explicit(&lg.head_seen, memory_order_relaxed);
+    if (pos - head > lg.mask / 2 &&
+        atomic_load_explicit(&lg.running, memory_order_acquire) &&
+        atomic_exchange_explicit(&lg.kick, 1, memory_order_relaxed) == 0) {
+        futex_wake(&lg.kick);
+    }
+}
+
+/**
+ * Format the header of @param slot into @param buf: the syslog wire format
+ * ("<PRI>Mmm dd hh:mm:ss ident[pid]: ") or a file line prefix
+ */
+static int format_header(const struct slot *slot, char *buf) {
+    static const char *const names[] = { "EMERG", "ALERT", "CRIT", "ERROR", "WARNING",
+                                         "NOTICE", "INFO", "DEBUG" };
+    struct tm tm;
+    localtime_r(&slot->ts.tv_sec, &tm);
+    if (lg.opts.file) {
+        char stamp[32];
+        strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        return snprintf(buf, HEADER_MAX, "%s.%03ld %s[%d] %s: ", stamp, slot->ts.tv_nsec / 1000000,
+                        lg.ident, (int)lg.pid, names[LOG_PRI(slot->prio)]);
+    }
+    char stamp[16];
+    strftime(stamp, sizeof(stamp), "%b %e %T", &tm);
+    return snprintf(buf, HEADER_MAX, "<%d>%s %s[%d]: ", LOG_USER | LOG_PRI(slot->prio), stamp,
+                    lg.ident, (int)lg.pid);
+}
+
+/**
+ * Last resort for records the sink did not take
+ */
+static void write_fallback(const struct slot *slot) {
+    if (lg.opts.file == NULL) {
+        syslog(slot->prio, "%.*s", (int)slot->len, slot->msg);
+    }
+    if (lg.opts.console) {
+        fprintf(stderr, "%s: %.*s\n", lg.ident, (int)slot->len, slot->msg);
+    }
+}
+
+/**
+ * Send @param n records in one system call
+ */
+static void write_batch(struct slot **slots, int n) {
+    char headers[BATCH][HEADER_MAX];
+    struct iovec iov[BATCH * 3];
+    static const char newline = '\n';
+    for (int i = 0; i < n; i++) {
+        int hlen = format_header(slots[i], headers[i]);
+        if (hlen < 0) hlen = 0;
+        if (hlen >= HEADER_MAX) hlen = HEADER_MAX - 1;
+        iov[i * 3] = (struct iovec) { headers[i], hlen };
+        iov[i * 3 + 1] = (struct iovec) { slots[i]->msg, slots[i]->len };
+        iov[i * 3 + 2] = (struct iovec) { (void *)&newline, 1 };
+    }
+
+    if (lg.opts.file) {
+        // One writev of whole lines; O_APPEND keeps them together
+        int done = lg.fd >= 0 ? 0 : n;
+        while (done < n) {
+            int cnt = (n - done) * 3;
+            if (cnt > IOV_MAX) cnt = IOV_MAX / 3 * 3;
+            if (writev(lg.fd, &iov[done * 3], cnt) < 0 && errno != EINTR) {
+                break;
+            }
+            done += cnt / 3;
+        }
+        for (int i = done; i < n; i++) {
+            write_fallback(slots[i]);
+        }
+        return;
+    }
+
+    // One datagram per record, all in one sendmmsg.  A stream socket keeps
+    // no record boundaries, so there every record ends with its newline.
+    struct mmsghdr msgs[BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < n; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov[i * 3];
+    }
+    int done = 0;
+    for (int attempt = 0; done < n && attempt < 2; ) {
+        // Set on every attempt, a reconnect may change the socket type
+        for (int i = done; i < n; i++) {
+            msgs[i].msg_hdr.msg_iovlen = lg.stream ? 3 : 2;
+        }
+        int r = lg.fd >= 0 ? sendmmsg(lg.fd, msgs + done, n - done, MSG_NOSIGNAL) : -1;
+        if (r > 0) {
+            done += r;
+            continue;
+        }
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        // syslogd restarted, or never was there: reconnect once
+        syslog_connect();
+        attempt++;
+    }
+    for (int i = done; i < n; i++) {
+        write_fallback(slots[i]);
+    }
+}
+
+/**
+ * Write out every record queued so far (flusher thread, or the closing
+ * thread once the flusher is gone)
+ * @return the number of records written
+ */
+static size_t drain(void) {
+    size_t total = 0;
+    while (1) {
+        struct slot *slots[BATCH];
+        int n = 0;
+        while (n < BATCH) {
+            struct slot *slot = &lg.ring[(lg.head + n) & lg.mask];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != lg.head + n + 1) {
+                break;
+            }
+            slots[n++] = slot;
+        }
+        if (n == 0) {
+            break;
+        }
+        write_batch(slots, n);
+        for (int i = 0; i < n; i++) {
+            atomic_store_explicit(&slots[i]->seq, lg.head + i + lg.mask + 1, memory_order_release);
+        }
+        lg.head += n;
+        atomic_store_explicit(&lg.head_seen, lg.head, memory_order_relaxed);
+        total += n;
+    }
+
+    uint64_t dropped = aesdlog_dropped();
+    if (dropped != lg.dropped_reported) {
+        struct slot note = { .prio = LOG_WARNING };
+        clock_gettime(CLOCK_REALTIME, &note.ts);
+        note.len = snprintf(note.msg, sizeof(note.msg), "Log ring full, dropped %llu messages",
+                            (unsigned long long)(dropped - lg.dropped_reported));
+        struct slot *one = &note;
+        write_batch(&one, 1);
+        lg.dropped_reported = dropped;
+    }
+    return total;
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+    int ms = lg.opts.flush_ms > 0 ? lg.opts.flush_ms : 100;
+    struct timespec interval = { ms / 1000, (ms % 1000) * 1000000L };
+    while (!atomic_load(&lg.stopping)) {
+        if (atomic_load_explicit(&lg.kick, memory_order_relaxed) == 0) {
+            futex_wait(&lg.kick, 0, &interval);
+        }
+        atomic_store_explicit(&lg.kick, 0, memory_order_relaxed);
+        drain();
+    }
+    return NULL;
+}
+
+int aesdlog_start(void) {
+    if (lg.ring == NULL || atomic_load(&lg.running)) {
+        return lg.ring ? 0 : -1;
+    }
+    lg.pid = getpid();  // after daemonizing, this is the daemon
+    atomic_store(&lg.stopping, 0);
+    if (pthread_create(&lg.flusher, NULL, flusher_main, NULL) != 0) {
+        return -1;
+    }
+    atomic_store(&lg.running, true);
+    return 0;
+}
+
+void aesdlog_close(void) {
+    if (lg.ring == NULL) {
+        return;
+    }
+    if (atomic_load(&lg.running)) {
+        atomic_store(&lg.stopping, 1);
+        atomic_store(&lg.kick, 1);
+        futex_wake(&lg.kick);
+        pthread_join(lg.flusher, NULL);
+        atomic_store(&lg.running, false);
+    }
+    drain();
+    // Late writers find no ring rather than a freed one
+    struct slot *ring = lg.ring;
+    lg.ring = NULL;
+    free(ring);
+    if (lg.fd >= 0) {
+        close(lg.fd);
+        lg.fd = -1;
+    }
+}
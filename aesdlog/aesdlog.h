@@ -0,0 +1,80 @@
+#ifndef AESDLOG_H
+#define AESDLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <syslog.h>
+
+/**
+ * Asynchronous logging shared by aesdsocket and writer.
+ * aesdlog() formats the record on the calling thread into a slot of a
+ * lock-free multi-producer ring and returns; it never blocks and never
+ * makes a system call, except a futex wake when the ring fills past half.
+ * One flusher thread drains the ring in batches: to syslog as one
+ * sendmmsg() of datagrams to /dev/log, or to a file as one writev().
+ * When the ring is full the record is dropped and counted, and the
+ * flusher reports the count.
+ *
+ * Levels are syslog priorities.  Calls less severe than AESDLOG_LEVEL
+ * (LOG_INFO unless defined before including this header) compile to
+ * nothing; aesdlog_set_level() filters the rest at run time.
+ */
+
+#ifndef AESDLOG_LEVEL
+#define AESDLOG_LEVEL       LOG_INFO
+#endif
+
+#define AESDLOG_MSG_MAX     240         // longer messages are truncated
+#define AESDLOG_RING_SLOTS  4096        // default ring size, a power of two
+
+struct aesdlog_options {
+    const char *file;           // append here instead of sending to syslog
+    unsigned ring_slots;        // 0 for AESDLOG_RING_SLOTS, rounded up to a power of two
+    int flush_ms;               // flusher wakeup interval, 0 for 100
+    bool console;               // copy records to stderr when syslog is unreachable (LOG_CONS)
+};
+
+#define aesdlog(prio, ...) do { \
+        if ((prio) <= AESDLOG_LEVEL) { \
+            aesdlog_write((prio), __VA_ARGS__); \
+        } \
+    } while (0)
+
+/**
+ * Set up logging as @param ident with @param opts (NULL for defaults).
+ * Records are queued from now on, but only written once aesdlog_start()
+ * has run or by aesdlog_close().
+ * @return 0, or -1 if memory ran out or the file could not be opened.
+ */
+int aesdlog_open(const char *ident, const struct aesdlog_options *opts);
+
+/**
+ * Start the flusher thread.  A process that forks to daemonize calls this
+ * in the child, since threads do not survive fork().
+ * @return 0, or -1 if the thread could not be created (records are then
+ * written by aesdlog_close()).
+ */
+int aesdlog_start(void);
+
+/**
+ * Stop the flusher, write out every queued record and release the ring
+ */
+void aesdlog_close(void);
+
+/**
+ * Queue one record; use the aesdlog() macro so that disabled levels
+ * compile out
+ */
+void aesdlog_write(int prio, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Drop records less severe than @param prio at run time (like setlogmask)
+ */
+void aesdlog_set_level(int prio);
+
+/**
+ * @return the number of records dropped because the ring was full
+ */
+uint64_t aesdlog_dropped(void);
+
+#endif // AESDLOG_H
@@ -1,10 +1,18 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <spawn.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 
+extern char **environ;
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -29,6 +37,116 @@ bool do_system(const char *cmd)
     return true;
 }
 
+/**
+ * Start @param command (full path first, NULL terminated) without copying
+ * the parent: posix_spawn() runs the child on the parent's memory until it
+ * execs (glibc uses clone(CLONE_VM | CLONE_VFORK)), so launching costs the
+ * same however large the parent is, where fork() copies every page table.
+ * @param in_fd, @param out_fd if not -1, descriptors that become the child's
+ *   standard in and out.  They should be close-on-exec, like every other
+ *   descriptor the child must not keep.
+ * @param pid set to the child's PID.
+ * @return 0 on success, or the errno of the failure, including exec
+ *   failures in the child, which posix_spawn() reports back.
+ */
+static int spawn_stage(char *const command[], int in_fd, int out_fd, pid_t *pid)
+{
+    // Check if the command is an absolute path
+    if (command == NULL || command[0] == NULL || command[0][0] != '/') {
+        return EINVAL; // Command must be specified with an absolute path
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+#ifdef POSIX_SPAWN_USEVFORK
+    // Older glibc only takes the vfork path when asked to
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_USEVFORK);
+#endif
+
+    int err = posix_spawn(pid, command[0], &actions, &attr, command, environ);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return err;
+}
+
+/**
+ * Open @param outputfile for a command's output, truncating it
+ * @return the descriptor (close-on-exec), or -1 with errno set.
+ */
+static int open_output(const char *outputfile)
+{
+    int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC, 0644);
+    if (fd < 0) {
+        int err = errno;
+        perror("Failed to open output file");
+        errno = err;
+    }
+    return fd;
+}
+
+/**
+ * Start @param command with standard out redirected to @param outputfile
+ * if not NULL, see spawn_stage()
+ */
+static int spawn_command(char *const command[], const char *outputfile, pid_t *pid)
+{
+    int fd = -1;
+    if (outputfile != NULL && (fd = open_output(outputfile)) < 0) {
+        return errno;
+    }
+    int err = spawn_stage(command, -1, fd, pid);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return err;
+}
+
+/**
+ * @return true if the wait status @param status is a normal exit with code 0
+ */
+static bool exit_success(int status)
+{
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Reap child @param pid, storing its wait status in @param status
+ * @return true on success, false if waitpid() failed.
+ */
+static bool reap_command(pid_t pid, int *status)
+{
+    while (waitpid(pid, status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid failed");
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Run @param command, redirected to @param outputfile if not NULL, and wait for it
+ * @return true if it ran and exited with status 0.
+ */
+static bool exec_command(char *const command[], const char *outputfile)
+{
+    pid_t pid;
+    if (spawn_command(command, outputfile, &pid) != 0) {
+        return false;
+    }
+    int status;
+    return reap_command(pid, &status) && exit_success(status);
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -69,42 +187,8 @@ bool do_exec(int count, ...)
 */
 
     va_end(args); // clean up
-    
-    // Check if the command is an absolute path
-    if (command[0][0] != '/') {
-        return false; // Command must be specified with an absolute path
-    }
-
-    pid_t pid = fork(); // Create a new process (create a child process), and save process identifier (PID) in pid
-    // A negative value if the fork failed
-    // Note: The fork() function creates a new child process. After this call, you have two processes: the parent and the child.
-    if (pid < 0) {
-        perror("Fork failed");
-        return false; // Fork failed
-    } 
-    // 0 in the child process
-    else if (pid == 0) {
-        // Notes: In the child process (where pid == 0), you typically replace its execution context with a new 
-        // program using execv() (or another exec variant). This is where you actually execute the command.
-        // If execv() is successful, the child process stops executing the current code and runs the 
-        // specified program. If execv() fails, the child can handle the error (e.g., by calling perror and exiting).
-
-        execv(command[0], command); // Execute the command (replace the current image with the new program specified)
-        // perror("execv failed"); // If execv fails
-        // exit(EXIT_FAILURE); // Exit child process with failure
-        return false; // Execute failed
-    } 
-    // The child's PID in the parent process
-    else {
-        // Notes: At this point, the parent needs to wait for the child to finish executing the command 
-        // (whether it succeeded or failed) by calling waitpid(). This prevents the child from 
-        // becoming a zombie process and allows the parent to get the exit status of the child.
-        int status;
-        waitpid(pid, &status, 0); // Wait for child process to finish
-        return WIFEXITED(status) && WEXITSTATUS(status) == 0; // Return success if child exited normally
-    }
 
-    return false;
+    return exec_command(command, NULL);
 }
 
 /**
@@ -138,36 +222,295 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
 
     va_end(args); // clean up
 
-    // Check if the command is an absolute path
-    if (command[0][0] != '/') {
-        return false; // Command must be specified with an absolute path
+    return exec_command(command, outputfile);
+}
+
+/**
+ * @return a pidfd for child @param pid, readable once it has exited, or -1
+ *   if the kernel has no pidfd_open() (before Linux 5.3)
+ */
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return (int) syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void) pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Mark in @param pfds every one of the @param n children @param pids that has
+ *   exited, for kernels without pidfds.  The children are not reaped, so that
+ *   their status is collected as with a pidfd.  If none has exited yet, wait
+ *   for the first one.  A child that cannot be waited for is marked too, for
+ *   reap_command() to report.
+ */
+static void mark_exited(struct pollfd *pfds, const pid_t *pids, nfds_t n)
+{
+    while (1) {
+        bool marked = false;
+        for (nfds_t i = 0; i < n; i++) {
+            siginfo_t info;
+            info.si_pid = 0;
+            pfds[i].revents = 0;
+            if (waitid(P_PID, pids[i], &info, WEXITED|WNOHANG|WNOWAIT) < 0 || info.si_pid != 0) {
+                pfds[i].revents = POLLIN;
+                marked = true;
+            }
+        }
+        if (marked) {
+            return;
+        }
+        siginfo_t info;
+        while (waitid(P_PID, pids[0], &info, WEXITED|WNOWAIT) < 0 && errno == EINTR) {
+        }
     }
-    
-    // Open the output file
-    int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
-    if (fd < 0) {
-        perror("Failed to open output file");
+}
+
+/**
+* @param jobs - The commands to run, see struct exec_job.  The error and status
+*   members of every job are filled in.
+* @param count - The number of jobs.
+* @param max_parallel - The most commands running at once, or 0 for one per online CPU.
+* Commands are started in order with spawn_command() as slots free up.  Their
+*   completions are collected in whatever order they finish through a pidfd
+*   per child, polled together, or on kernels without pidfds by checking every
+*   child with waitid(), see mark_exited().
+* @return true if every command was started and exited with status 0.
+*/
+bool do_exec_batch(struct exec_job *jobs, int count, int max_parallel)
+{
+    if (max_parallel <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_parallel = cpus > 0 ? (int) cpus : 1;
+    }
+    if (max_parallel > count) {
+        max_parallel = count;
+    }
+    if (count <= 0) {
+        return true;
+    }
+
+    // Running children: pfds[i] waits on the child of jobs[running[i]]
+    struct pollfd *pfds = calloc(max_parallel, sizeof(*pfds));
+    int *running = calloc(max_parallel, sizeof(*running));
+    pid_t *pids = calloc(max_parallel, sizeof(*pids));
+    if (pfds == NULL || running == NULL || pids == NULL) {
+        perror("Failed to allocate batch state");
+        free(pfds);
+        free(running);
+        free(pids);
         return false;
     }
 
-    pid_t pid = fork(); // Create a new process (create a child process), and save process identifier (PID) in pid
-    if (pid < 0) {
-        perror("Fork failed");
-        close(fd);
-        return false; // Fork failed
-    } 
-    else if (pid == 0) {
-        dup2(fd, STDOUT_FILENO); // Redirect stdout to the file
-        close(fd); // Close the original file descriptor
-        execv(command[0], command); // Execute the command (replace the current image with the new program specified)
-        return false; // Execute failed
-    } 
-    else {
-        close(fd);
-        int status;
-        waitpid(pid, &status, 0); // Wait for child process to finish
-        return WIFEXITED(status) && WEXITSTATUS(status) == 0; // Return success if child exited normally
+    bool success = true;
+    int next = 0;
+    nfds_t nrunning = 0;
+    while (next < count || nrunning > 0) {
+        while (nrunning < (nfds_t) max_parallel && next < count) {
+            struct exec_job *job = &jobs[next];
+            job->status = -1;
+            job->error = spawn_command(job->argv, job->outputfile, &pids[nrunning]);
+            if (job->error != 0) {
+                success = false;
+                next++;
+                continue;
+            }
+            pfds[nrunning].fd = open_pidfd(pids[nrunning]);
+            pfds[nrunning].events = POLLIN;
+            pfds[nrunning].revents = 0;
+            running[nrunning++] = next++;
+        }
+        if (nrunning == 0) {
+            break;
+        }
+
+        int polled = 1;
+        for (nfds_t i = 0; i < nrunning; i++) {
+            if (pfds[i].fd < 0) {
+                polled = 0;
+                break;
+            }
+        }
+        if (!polled) {
+            mark_exited(pfds, pids, nrunning);
+        }
+        if (polled && poll(pfds, nrunning, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll failed");
+            // Fall back to reaping every running child in turn
+            for (nfds_t i = 0; i < nrunning; i++) {
+                pfds[i].revents = POLLIN;
+            }
+        }
+
+        for (nfds_t i = 0; i < nrunning; ) {
+            if (pfds[i].revents == 0) {
+                i++;
+                continue;
+            }
+            struct exec_job *job = &jobs[running[i]];
+            if (!reap_command(pids[i], &job->status) || !exit_success(job->status)) {
+                success = false;
+            }
+            if (pfds[i].fd >= 0) {
+                close(pfds[i].fd);
+            }
+            nrunning--;
+            pfds[i] = pfds[nrunning];
+            running[i] = running[nrunning];
+            pids[i] = pids[nrunning];
+        }
     }
 
-    return false;
+    free(pfds);
+    free(running);
+    free(pids);
+    return success;
+}
+
+/**
+ * Read the output of a pipeline from @param fd into @param capture until
+ * the last writer closes it.  Output that does not fit is spliced to
+ * /dev/null, so it is discarded without being copied out of the kernel and
+ * the commands still run to completion instead of dying of SIGPIPE.
+ * @return true on success, false if reading failed.
+ */
+static bool capture_output(int fd, struct exec_capture *capture)
+{
+    capture->len = 0;
+    capture->truncated = false;
+    while (capture->len < capture->size) {
+        ssize_t n = read(fd, capture->buf + capture->len, capture->size - capture->len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Failed to read pipeline output");
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        capture->len += n;
+    }
+
+    int null_fd = open("/dev/null", O_WRONLY|O_CLOEXEC);
+    char scratch[4096];
+    while (1) {
+        ssize_t n = -1;
+        if (null_fd >= 0) {
+            n = splice(fd, NULL, null_fd, NULL, 1 << 16, SPLICE_F_MOVE);
+        }
+        if (n < 0 && errno != EINTR) {
+            n = read(fd, scratch, sizeof(scratch));
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Failed to drain pipeline output");
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        capture->truncated = true;
+    }
+    if (null_fd >= 0) {
+        close(null_fd);
+    }
+    return true;
+}
+
+/**
+* @param nstages - The number of commands in the pipeline.
+* @param stages - For each command, its full path followed by its arguments and NULL,
+*   as the arguments of do_exec() would be.
+* @param outputfile - If not NULL, the file the last command's standard out is written to,
+*   as with do_exec_redirect().
+* @param capture - If not NULL (and outputfile is NULL), the last command's standard out is
+*   captured into the caller's buffer instead, see struct exec_capture.
+* Runs stages[0] | stages[1] | ... like a shell would, but without starting one: every
+*   command is spawned directly (see spawn_stage()) with pipe2() pipes wired to its standard
+*   in and out.  Data flows from command to command through the kernel; when the output
+*   goes to a file, the last command writes it there itself.
+* @return true if every command was started and exited with status 0 (like pipefail in bash).
+*/
+bool do_exec_pipeline(int nstages, char *const *stages[], const char *outputfile,
+                      struct exec_capture *capture)
+{
+    if (nstages <= 0 || (outputfile != NULL && capture != NULL)) {
+        return false;
+    }
+
+    // out_fd is the last command's standard out, capture_fd our end of it
+    int out_fd = -1, capture_fd = -1;
+    if (outputfile != NULL) {
+        out_fd = open_output(outputfile);
+        if (out_fd < 0) {
+            return false;
+        }
+    } else if (capture != NULL) {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0) {
+            perror("pipe2 failed");
+            return false;
+        }
+        capture_fd = fds[0];
+        out_fd = fds[1];
+    }
+
+    pid_t pids[nstages];
+    int started = 0;
+    bool success = true;
+    int in_fd = -1; // read end of the previous command's pipe
+    for (int i = 0; i < nstages; i++) {
+        int fds[2] = { -1, -1 };
+        int stage_out = out_fd;
+        if (i < nstages - 1) {
+            if (pipe2(fds, O_CLOEXEC) < 0) {
+                perror("pipe2 failed");
+                success = false;
+                break;
+            }
+            stage_out = fds[1];
+        }
+        int err = spawn_stage(stages[i], in_fd, stage_out, &pids[i]);
+        // The children have their own copies now
+        if (in_fd >= 0) {
+            close(in_fd);
+        }
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        in_fd = fds[0];
+        if (err != 0) {
+            // The commands already started see EOF or EPIPE and finish
+            fprintf(stderr, "Failed to start stage %d: %s\n", i, strerror(err));
+            success = false;
+            break;
+        }
+        started++;
+    }
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    if (out_fd >= 0) {
+        close(out_fd);
+    }
+    if (capture_fd >= 0) {
+        if (!capture_output(capture_fd, capture)) {
+            success = false;
+        }
+        close(capture_fd);
+    }
+
+    for (int i = 0; i < started; i++) {
+        int status;
+        if (!reap_command(pids[i], &status) || !exit_success(status)) {
+            success = false;
+        }
+    }
+    return success;
 }
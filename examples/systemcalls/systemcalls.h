@@ -7,3 +7,28 @@ bool do_system(const char *command);
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * One command of a do_exec_batch() call
+ */
+struct exec_job {
+    char *const *argv;          // full path to the command, its arguments, NULL
+    const char *outputfile;     // file to redirect standard out to, or NULL
+    int error;                  // set to the errno if the command could not be started, else 0
+    int status;                 // set to the waitpid() status once the command finished
+};
+
+bool do_exec_batch(struct exec_job *jobs, int count, int max_parallel);
+
+/**
+ * Output of a do_exec_pipeline() call kept in memory
+ */
+struct exec_capture {
+    char *buf;                  // buffer provided by the caller
+    size_t size;                // its size
+    size_t len;                 // set to the number of bytes captured
+    bool truncated;             // set if more output came than fits; the rest was discarded
+};
+
+bool do_exec_pipeline(int nstages, char *const *stages[], const char *outputfile,
+                      struct exec_capture *capture);
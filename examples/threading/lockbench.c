@@ -0,0 +1,174 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include "proflock.h"
+
+/**
+ * Lock contention stress benchmark: every thread loops taking one shared
+ * lock, touching the protected data for -c iterations, releasing it and
+ * working -o iterations outside, for -d milliseconds.  A raw
+ * pthread_mutex_t and each proflock mode run at 1, 2, 4, ... threads up to
+ * -t, and report throughput and fairness (fewest over most acquisitions of
+ * any thread).  -P turns on the profiler and prints its report per run.
+ */
+
+#define MAX_THREADS     256
+#define SHARED_WORDS    16
+
+enum bench_mode {
+    BENCH_RAW,                  // pthread_mutex_t, no proflock layer
+    BENCH_PTHREAD,
+    BENCH_ADAPTIVE,
+    BENCH_TICKET,
+    BENCH_MODES,
+};
+
+static const char *mode_names[BENCH_MODES] = { "raw-mutex", "pthread", "adaptive", "ticket" };
+
+struct bench {
+    enum bench_mode mode;
+    pthread_mutex_t raw;
+    struct proflock lock;
+    int cs_work;
+    int out_work;
+    int pin;
+    atomic_int stop;
+    volatile uint64_t shared[SHARED_WORDS];
+};
+
+struct worker {
+    struct bench *bench;
+    int cpu;
+    uint64_t ops;
+    pthread_t thread;
+};
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct bench *b = w->bench;
+    if (b->pin) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    uint64_t ops = 0;
+    volatile uint64_t local = 0;
+    while (!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+        if (b->mode == BENCH_RAW) pthread_mutex_lock(&b->raw);
+        else proflock_lock(&b->lock);
+        for (int i = 0; i < b->cs_work; i++) {
+            b->shared[i % SHARED_WORDS]++;
+        }
+        if (b->mode == BENCH_RAW) pthread_mutex_unlock(&b->raw);
+        else proflock_unlock(&b->lock);
+        for (int i = 0; i < b->out_work; i++) {
+            local++;
+        }
+        ops++;
+    }
+    w->ops = ops;
+    return NULL;
+}
+
+static void run(struct bench *b, int nthreads, int duration_ms, int profile)
+{
+    static const enum proflock_mode lock_modes[BENCH_MODES] = {
+        PROFLOCK_PTHREAD, PROFLOCK_PTHREAD, PROFLOCK_ADAPTIVE, PROFLOCK_TICKET,
+    };
+    static struct worker workers[MAX_THREADS];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    pthread_mutex_init(&b->raw, NULL);
+    proflock_init(&b->lock, mode_names[b->mode], lock_modes[b->mode], profile);
+    proflock_reset();
+    b->stop = 0;
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].bench = b;
+        workers[i].cpu = cpus > 0 ? i % cpus : 0;
+        workers[i].ops = 0;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    struct timespec ts = { duration_ms / 1000, (duration_ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+    b->stop = 1;
+
+    uint64_t total = 0, min = UINT64_MAX, max = 0;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].ops;
+        if (workers[i].ops < min) min = workers[i].ops;
+        if (workers[i].ops > max) max = workers[i].ops;
+    }
+    printf("%-10s %7d %10.2f %10.3f\n", mode_names[b->mode], nthreads,
+           total / (duration_ms * 1e3), max ? (double) min / max : 0.0);
+    if (profile) {
+        proflock_report(stdout);
+    }
+    proflock_destroy(&b->lock);
+    pthread_mutex_destroy(&b->raw);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t max_threads] [-d duration_ms] [-c cs_work] [-o outside_work]\n"
+            "        [-m raw-mutex|pthread|adaptive|ticket] [-a] [-P]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct bench bench;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = cpus > 0 ? (int) cpus : 1;
+    int duration_ms = 1000;
+    int only = -1;
+    int profile = 0;
+    bench.cs_work = 50;
+    bench.out_work = 200;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:c:o:m:aP")) != -1) {
+        switch (opt) {
+        case 't': max_threads = atoi(optarg); break;
+        case 'd': duration_ms = atoi(optarg); break;
+        case 'c': bench.cs_work = atoi(optarg); break;
+        case 'o': bench.out_work = atoi(optarg); break;
+        case 'a': bench.pin = 1; break;
+        case 'P': profile = 1; break;
+        case 'm':
+            for (int i = 0; i < BENCH_MODES; i++) {
+                if (strcmp(optarg, mode_names[i]) == 0) only = i;
+            }
+            if (only < 0) usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (max_threads < 1 || max_threads > MAX_THREADS || duration_ms < 1) {
+        usage(argv[0]);
+    }
+
+    printf("%-10s %7s %10s %10s\n", "mode", "threads", "Mops/s", "fairness");
+    for (int mode = 0; mode < BENCH_MODES; mode++) {
+        if (only >= 0 && mode != only) continue;
+        bench.mode = mode;
+        for (int n = 1; ; n *= 2) {
+            if (n > max_threads) n = max_threads;
+            run(&bench, n, duration_ms, profile);
+            if (n == max_threads) break;
+        }
+    }
+    return 0;
+}
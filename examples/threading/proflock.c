@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include "proflock.h"
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Optional: use these functions to add debug or error prints to your application
+#define DEBUG_LOG(msg,...)
+//#define DEBUG_LOG(msg,...) printf("proflock: " msg "\n" , ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) printf("proflock ERROR: " msg "\n" , ##__VA_ARGS__)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+// Every call site seen so far
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct proflock_site *sites;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void futex_wait(void *addr, int val) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(void *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/**
+ * @return the histogram bucket of @param ns: bucket b counts [2^(b-1), 2^b)
+ */
+static int bucket_of(uint64_t ns) {
+    int b = ns ? 64 - __builtin_clzll(ns) : 0;
+    return b < PROFLOCK_BUCKETS ? b : PROFLOCK_BUCKETS - 1;
+}
+
+/**
+ * Add @param ns to a total, max and histogram; relaxed atomics, so that a
+ * call site shared by several locks stays exact
+ */
+static void record(uint64_t *total, uint64_t *max, uint64_t *hist, uint64_t ns) {
+    __atomic_fetch_add(total, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+    uint64_t cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while (ns > cur && !__atomic_compare_exchange_n(max, &cur, ns, true,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void site_register(struct proflock_site *site, struct proflock *lock) {
+    pthread_mutex_lock(&sites_lock);
+    if (!atomic_load(&site->registered)) {
+        site->lock_name = lock->name;
+        site->next = sites;
+        sites = site;
+        atomic_store(&site->registered, true);
+    }
+    pthread_mutex_unlock(&sites_lock);
+}
+
+/**
+ * Spin for about as long as the last acquisitions needed, then sleep on
+ * the futex (Drepper, "Futexes Are Tricky", mutex #2)
+ */
+static void adaptive_wait(struct proflock *lock) {
+    int spins = atomic_load_explicit(&lock->spins, memory_order_relaxed);
+    int limit = 2 * spins + 10;
+    if (limit > PROFLOCK_MAX_SPIN) limit = PROFLOCK_MAX_SPIN;
+
+    int cnt;
+    for (cnt = 0; cnt < limit; cnt++) {
+        int expected = 0;
+        if (atomic_load_explicit(&lock->state, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_weak(&lock->state, &expected, 1)) {
+            break;
+        }
+        cpu_relax();
+    }
+    if (cnt == limit) {
+        while (atomic_exchange(&lock->state, 2) != 0) {
+            futex_wait(&lock->state, 2);
+        }
+    }
+    // Held now, so the average is ours to update
+    atomic_store_explicit(&lock->spins, spins + (cnt - spins) / 8, memory_order_relaxed);
+}
+
+static void ticket_wait(struct proflock *lock, unsigned ticket) {
+    for (int i = 0; i < PROFLOCK_MAX_SPIN; i++) {
+        if (atomic_load_explicit(&lock->serving, memory_order_acquire) == ticket) {
+            return;
+        }
+        cpu_relax();
+    }
+    while (1) {
+        unsigned serving = atomic_load(&lock->serving);
+        if (serving == ticket) {
+            return;
+        }
+        // Pairs with the sleepers check in proflock_unlock()
+        atomic_fetch_add(&lock->sleepers, 1);
+        futex_wait(&lock->serving, (int) serving);
+        atomic_fetch_sub(&lock->sleepers, 1);
+    }
+}
+
+void proflock_init(struct proflock *lock, const char *name, enum proflock_mode mode, bool profile)
+{
+    memset(lock, 0, sizeof(*lock));
+    lock->mode = mode;
+    lock->name = name;
+    lock->profile = profile;
+    pthread_mutex_init(&lock->mutex, NULL);
+}
+
+void proflock_destroy(struct proflock *lock)
+{
+    pthread_mutex_destroy(&lock->mutex);
+}
+
+void proflock_lock_at(struct proflock *lock, struct proflock_site *site)
+{
+    uint64_t start = 0;
+    bool contended = false;
+    switch (lock->mode) {
+    case PROFLOCK_PTHREAD:
+        if (pthread_mutex_trylock(&lock->mutex) != 0) {
+            contended = true;
+            if (lock->profile) start = now_ns();
+            pthread_mutex_lock(&lock->mutex);
+        }
+        break;
+    case PROFLOCK_ADAPTIVE: {
+        int expected = 0;
+        if (!atomic_compare_exchange_strong(&lock->state, &expected, 1)) {
+            contended = true;
+            if (lock->profile) start = now_ns();
+            adaptive_wait(lock);
+        }
+        break;
+    }
+    case PROFLOCK_TICKET: {
+        unsigned ticket = atomic_fetch_add_explicit(&lock->next, 1, memory_order_relaxed);
+        if (atomic_load_explicit(&lock->serving, memory_order_acquire) != ticket) {
+            contended = true;
+            if (lock->profile) start = now_ns();
+            ticket_wait(lock, ticket);
+        }
+        break;
+    }
+    }
+
+    if (!lock->profile) {
+        return;
+    }
+    uint64_t now = now_ns();
+    if (!atomic_load_explicit(&site->registered, memory_order_acquire)) {
+        site_register(site, lock);
+    }
+    __atomic_fetch_add(&site->acquisitions, 1, __ATOMIC_RELAXED);
+    if (contended) {
+        __atomic_fetch_add(&site->contended, 1, __ATOMIC_RELAXED);
+    }
+    record(&site->wait_ns, &site->wait_max, site->wait_hist, contended ? now - start : 0);
+    lock->acquired_ns = now;
+    lock->holder = site;
+}
+
+void proflock_unlock(struct proflock *lock)
+{
+    if (lock->profile) {
+        struct proflock_site *site = lock->holder;
+        record(&site->hold_ns, &site->hold_max, site->hold_hist, now_ns() - lock->acquired_ns);
+    }
+    switch (lock->mode) {
+    case PROFLOCK_PTHREAD:
+        pthread_mutex_unlock(&lock->mutex);
+        break;
+    case PROFLOCK_ADAPTIVE:
+        if (atomic_exchange(&lock->state, 0) == 2) {
+            futex_wake(&lock->state, 1);
+        }
+        break;
+    case PROFLOCK_TICKET:
+        atomic_fetch_add(&lock->serving, 1);
+        if (atomic_load(&lock->sleepers) > 0) {
+            // Only the next ticket may go, but which sleeper holds it is unknown
+            futex_wake(&lock->serving, INT_MAX);
+        }
+        break;
+    }
+}
+
+/**
+ * Format @param ns into @param buf with a readable unit
+ */
+static const char *fmt_ns(char *buf, size_t len, uint64_t ns) {
+    if (ns < 1000) snprintf(buf, len, "%lluns", (unsigned long long) ns);
+    else if (ns < 1000000) snprintf(buf, len, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, len, "%.1fms", ns / 1e6);
+    else snprintf(buf, len, "%.2fs", ns / 1e9);
+    return buf;
+}
+
+/**
+ * @return the upper bound of the bucket holding quantile @param q of @param hist
+ */
+static uint64_t hist_quantile(const uint64_t *hist, uint64_t count, double q) {
+    uint64_t want = (uint64_t) (q * count), seen = 0;
+    for (int b = 0; b < PROFLOCK_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > want) {
+            return b ? 1ull << b : 0;
+        }
+    }
+    return 1ull << (PROFLOCK_BUCKETS - 1);
+}
+
+static void report_line(FILE *out, const char *what, const uint64_t *hist, uint64_t count,
+                        uint64_t total, uint64_t max) {
+    char avg[16], p50[16], p99[16], mx[16];
+    fprintf(out, "  %s  avg %-8s p50 <%-8s p99 <%-8s max %s\n", what,
+            fmt_ns(avg, sizeof(avg), count ? total / count : 0),
+            fmt_ns(p50, sizeof(p50), hist_quantile(hist, count, 0.50)),
+            fmt_ns(p99, sizeof(p99), hist_quantile(hist, count, 0.99)),
+            fmt_ns(mx, sizeof(mx), max));
+}
+
+void proflock_report(FILE *out)
+{
+    pthread_mutex_lock(&sites_lock);
+    fprintf(out, "lock contention report\n");
+    for (struct proflock_site *site = sites; site; site = site->next) {
+        uint64_t n = site->acquisitions;
+        fprintf(out, "%s at %s:%d (%s)\n", site->lock_name ? site->lock_name : "?",
+                site->file, site->line, site->func);
+        fprintf(out, "  acquisitions %llu, contended %llu (%.1f%%)\n",
+                (unsigned long long) n, (unsigned long long) site->contended,
+                n ? 100.0 * site->contended / n : 0.0);
+        report_line(out, "wait", site->wait_hist, n, site->wait_ns, site->wait_max);
+        report_line(out, "hold", site->hold_hist, n, site->hold_ns, site->hold_max);
+        fprintf(out, "  %-10s %12s %12s\n", "below", "waits", "holds");
+        for (int b = 0; b < PROFLOCK_BUCKETS; b++) {
+            if (site->wait_hist[b] == 0 && site->hold_hist[b] == 0) {
+                continue;
+            }
+            char bound[16];
+            if (b == PROFLOCK_BUCKETS - 1) snprintf(bound, sizeof(bound), "longer");
+            else fmt_ns(bound, sizeof(bound), b ? 1ull << b : 1);
+            fprintf(out, "  %-10s %12llu %12llu\n", bound,
+                    (unsigned long long) site->wait_hist[b], (unsigned long long) site->hold_hist[b]);
+        }
+    }
+    pthread_mutex_unlock(&sites_lock);
+}
+
+void proflock_reset(void)
+{
+    pthread_mutex_lock(&sites_lock);
+    for (struct proflock_site *site = sites; site; site = site->next) {
+        site->acquisitions = site->contended = 0;
+        site->wait_ns = site->hold_ns = 0;
+        site->wait_max = site->hold_max = 0;
+        memset(site->wait_hist, 0, sizeof(site->wait_hist));
+        memset(site->hold_hist, 0, sizeof(site->hold_hist));
+    }
+    pthread_mutex_unlock(&sites_lock);
+}
+
+const char *proflock_mode_name(enum proflock_mode mode)
+{
+    switch (mode) {
+    case PROFLOCK_PTHREAD: return "pthread";
+    case PROFLOCK_ADAPTIVE: return "adaptive";
+    case PROFLOCK_TICKET: return "ticket";
+    }
+    return "?";
+}
@@ -0,0 +1,105 @@
+#ifndef PROFLOCK_H
+#define PROFLOCK_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/**
+ * Instrumented lock: records how long every call site waited for the lock
+ * and then held it, and how often it found the lock taken, in log2
+ * histograms that proflock_report() dumps.  The statistics are updated by
+ * the holder with relaxed atomics, which stay uncontended unless one call
+ * site serves several locks at once.
+ *
+ * Three ways of waiting:
+ *  PROFLOCK_PTHREAD   a plain pthread_mutex_t, for comparison
+ *  PROFLOCK_ADAPTIVE  spin for about as long as recent acquisitions took,
+ *                     then park on a futex
+ *  PROFLOCK_TICKET    fair: granted strictly in arrival order, spinning
+ *                     briefly and then parking on a futex
+ */
+
+#define PROFLOCK_BUCKETS    40          // log2 ns buckets, the last one open ended
+#define PROFLOCK_MAX_SPIN   1000        // adaptive spin limit, in pause instructions
+
+enum proflock_mode {
+    PROFLOCK_PTHREAD,
+    PROFLOCK_ADAPTIVE,
+    PROFLOCK_TICKET,
+};
+
+/**
+ * Statistics of one proflock_lock() call site, registered on first use
+ */
+struct proflock_site {
+    const char *file;
+    int line;
+    const char *func;
+    const char *lock_name;      // of the first lock taken here
+    atomic_bool registered;
+    uint64_t acquisitions;
+    uint64_t contended;         // found the lock taken
+    uint64_t wait_ns, hold_ns;  // totals
+    uint64_t wait_max, hold_max;
+    uint64_t wait_hist[PROFLOCK_BUCKETS];
+    uint64_t hold_hist[PROFLOCK_BUCKETS];
+    struct proflock_site *next;
+};
+
+#define PROFLOCK_SITE_INIT { .file = __FILE__, .line = __LINE__, .func = __func__ }
+
+struct proflock {
+    enum proflock_mode mode;
+    const char *name;
+    bool profile;               // record statistics
+    pthread_mutex_t mutex;      // PROFLOCK_PTHREAD
+    atomic_int state;           // PROFLOCK_ADAPTIVE: 0 free, 1 taken, 2 taken with sleepers
+    atomic_int spins;           // PROFLOCK_ADAPTIVE: running average, set by the holder
+    atomic_uint next, serving;  // PROFLOCK_TICKET
+    atomic_int sleepers;        // PROFLOCK_TICKET
+    // Current holder, under the lock
+    uint64_t acquired_ns;
+    struct proflock_site *holder;
+};
+
+/**
+ * Initialise @param lock, named @param name in reports, waiting as @param mode.
+ * Statistics are recorded unless @param profile is false.
+ */
+void proflock_init(struct proflock *lock, const char *name, enum proflock_mode mode, bool profile);
+
+void proflock_destroy(struct proflock *lock);
+
+/**
+ * Take @param lock, attributing the wait and hold to this call site
+ */
+#define proflock_lock(lock) do { \
+        static struct proflock_site proflock_site_ = PROFLOCK_SITE_INIT; \
+        proflock_lock_at((lock), &proflock_site_); \
+    } while (0)
+
+void proflock_lock_at(struct proflock *lock, struct proflock_site *site);
+
+void proflock_unlock(struct proflock *lock);
+
+/**
+ * Print the statistics of every call site seen so far to @param out.
+ * Sites still in use are read without synchronisation, so a report
+ * taken under load is approximate.
+ */
+void proflock_report(FILE *out);
+
+/**
+ * Clear the statistics of every call site
+ */
+void proflock_reset(void);
+
+/**
+ * @return the name of @param mode
+ */
+const char *proflock_mode_name(enum proflock_mode mode);
+
+#endif // PROFLOCK_H
@@ -30,3 +30,10 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* Thread entry point used by start_thread_obtaining_mutex(), taking and returning the
+* thread_data structure.  It can also run as a threadpool task (see ../../threadpool/threadpool.h), in which
+* case tp_future_get() returns the thread_data structure instead of pthread_join().
+*/
+void* threadfunc(void* thread_param);
@@ -0,0 +1,170 @@
+#include "timed_threading.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Optional: use these functions to add debug or error prints to your application
+#define DEBUG_LOG(msg,...)
+//#define DEBUG_LOG(msg,...) printf("timed_threading: " msg "\n" , ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) printf("timed_threading ERROR: " msg "\n" , ##__VA_ARGS__)
+
+#define HELD_BUCKETS    1024
+
+struct timed_task {
+    struct tw_timer timer;
+    struct timerwheel *wheel;
+    struct thread_data *data;
+    struct tp_future *future;
+    struct timed_task *next_waiter;
+};
+
+/**
+ * A mutex held by a timed task, with the timed tasks waiting for it.  All
+ * timers of one mutex run on the same wheel thread, so only the table
+ * itself needs held_lock.
+ */
+struct held_mutex {
+    pthread_mutex_t *mutex;
+    struct timed_task *head, *tail;
+    struct held_mutex *next;
+};
+
+static pthread_mutex_t held_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct held_mutex *held[HELD_BUCKETS];
+
+static struct held_mutex **held_find(pthread_mutex_t *mutex) {
+    struct held_mutex **p = &held[((uintptr_t) mutex >> 4) % HELD_BUCKETS];
+    while (*p && (*p)->mutex != mutex) {
+        p = &(*p)->next;
+    }
+    return p;
+}
+
+static void timed_acquire(struct tw_timer *timer);
+static void timed_release(struct tw_timer *timer);
+
+static void timed_schedule(struct timed_task *task, void (*fn)(struct tw_timer *), int delay_ms) {
+    task->timer.fn = fn;
+    timerwheel_add(task->wheel, &task->timer, delay_ms > 0 ? delay_ms : 0, (uintptr_t) task->data->mutex);
+}
+
+static void timed_finish(struct timed_task *task, bool success) {
+    task->data->thread_complete_success = success;
+    tp_promise_set(task->future, task->data);
+    free(task);
+}
+
+/**
+ * wait_to_obtain_ms is over: take the mutex, or queue behind the timed
+ * task holding it
+ */
+static void timed_acquire(struct tw_timer *timer) {
+    struct timed_task *task = (struct timed_task *) timer;
+    pthread_mutex_t *mutex = task->data->mutex;
+
+    pthread_mutex_lock(&held_lock);
+    struct held_mutex **p = held_find(mutex);
+    if (*p) {
+        task->next_waiter = NULL;
+        if ((*p)->tail) (*p)->tail->next_waiter = task;
+        else (*p)->head = task;
+        (*p)->tail = task;
+        pthread_mutex_unlock(&held_lock);
+        return;
+    }
+    int rc = pthread_mutex_trylock(mutex);
+    if (rc == 0) {
+        struct held_mutex *h = calloc(1, sizeof(*h));
+        if (h == NULL) {
+            pthread_mutex_unlock(&held_lock);
+            ERROR_LOG("Failed to allocate memory for held mutex");
+            pthread_mutex_unlock(mutex);
+            timed_finish(task, false);
+            return;
+        }
+        h->mutex = mutex;
+        *p = h;
+    }
+    pthread_mutex_unlock(&held_lock);
+
+    if (rc == 0) {
+        DEBUG_LOG("Timed task obtained mutex");
+        timed_schedule(task, timed_release, task->data->wait_to_release_ms);
+    } else if (rc == EBUSY) {
+        // Held from outside the wheel: nothing to queue behind, poll
+        timed_schedule(task, timed_acquire, TW_TICK_MS);
+    } else {
+        ERROR_LOG("Error locking mutex.");
+        timed_finish(task, false);
+    }
+}
+
+/**
+ * wait_to_release_ms is over: release the mutex and hand it to the next
+ * timed task waiting for it
+ */
+static void timed_release(struct tw_timer *timer) {
+    struct timed_task *task = (struct timed_task *) timer;
+    pthread_mutex_t *mutex = task->data->mutex;
+    bool success = pthread_mutex_unlock(mutex) == 0;
+    if (!success) {
+        ERROR_LOG("Error unlocking mutex.");
+    }
+
+    struct timed_task *next = NULL, *retry = NULL;
+    pthread_mutex_lock(&held_lock);
+    struct held_mutex **p = held_find(mutex);
+    struct held_mutex *h = *p;
+    next = h->head;
+    if (next && pthread_mutex_trylock(mutex) == 0) {
+        h->head = next->next_waiter;
+        if (h->head == NULL) h->tail = NULL;
+    } else {
+        // Nobody waits, or an outside thread took it in between and every
+        // waiter goes back to polling
+        retry = next;
+        next = NULL;
+        *p = h->next;
+        free(h);
+    }
+    pthread_mutex_unlock(&held_lock);
+
+    timed_finish(task, success);
+    if (next) {
+        timed_schedule(next, timed_release, next->data->wait_to_release_ms);
+    }
+    while (retry) {
+        struct timed_task *t = retry;
+        retry = retry->next_waiter;
+        timed_schedule(t, timed_acquire, TW_TICK_MS);
+    }
+}
+
+struct tp_future *start_timed_obtaining_mutex(struct timerwheel *wheel, pthread_mutex_t *mutex,
+                                              int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    struct timed_task *task = malloc(sizeof(*task));
+    struct thread_data *p_tdata = malloc(sizeof(struct thread_data));
+    struct tp_future *future = tp_promise_create();
+    if (task == NULL || p_tdata == NULL || future == NULL) {
+        ERROR_LOG("Failed to allocate memory for timed task");
+        free(task);
+        free(p_tdata);
+        if (future) {
+            tp_promise_set(future, NULL);
+            tp_future_detach(future);
+        }
+        return NULL;
+    }
+    p_tdata->mutex = mutex;
+    p_tdata->thread_complete_success = false;
+    p_tdata->wait_to_obtain_ms = wait_to_obtain_ms;
+    p_tdata->wait_to_release_ms = wait_to_release_ms;
+
+    task->wheel = wheel;
+    task->data = p_tdata;
+    task->future = future;
+    timed_schedule(task, timed_acquire, wait_to_obtain_ms);
+    return future;
+}
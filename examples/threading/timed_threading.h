@@ -0,0 +1,23 @@
+#ifndef TIMED_THREADING_H
+#define TIMED_THREADING_H
+
+#include "threading.h"
+#include "../../threadpool/threadpool.h"
+#include "timerwheel.h"
+
+/**
+* Same contract as start_thread_obtaining_mutex(), but the waits are timer events on
+* @param wheel instead of usleep() calls on a thread of their own: after @param wait_to_obtain_ms
+* the mutex in @param mutex is obtained, held for @param wait_to_release_ms, then released.
+* The function does not block.  A mutex held by another timed task is handed over in
+* request order when that task releases it; one held from outside is retried every tick.
+* The mutex is locked and unlocked on the wheel thread that serves it, so it may also be
+* used by ordinary threads, but not by timed tasks of another wheel.
+* @return a future that tp_future_get() resolves to the dynamically allocated thread_data
+* structure once the mutex was released, with thread_complete_success set; the caller frees
+* it as after pthread_join().  NULL if memory ran out.
+*/
+struct tp_future *start_timed_obtaining_mutex(struct timerwheel *wheel, pthread_mutex_t *mutex,
+                                              int wait_to_obtain_ms, int wait_to_release_ms);
+
+#endif // TIMED_THREADING_H
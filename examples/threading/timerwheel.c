@@ -0,0 +1,252 @@
+#include "timerwheel.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Optional: use these functions to add debug or error prints to your application
+#define DEBUG_LOG(msg,...)
+//#define DEBUG_LOG(msg,...) printf("timerwheel: " msg "\n" , ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) printf("timerwheel ERROR: " msg "\n" , ##__VA_ARGS__)
+
+#define TW_MASK     (TW_SLOTS - 1)
+#define TW_SPAN     (1ull << (TW_BITS * TW_LEVELS))
+
+struct tw_shard {
+    struct timerwheel *wheel;
+    pthread_t thread;
+
+    // Timers added from other threads, filed by the shard thread
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct tw_timer *incoming;
+    bool stopping;
+
+    // Owned by the shard thread
+    uint64_t now;               // next tick to run
+    long pending;               // timers filed in the wheels
+    struct tw_timer *slots[TW_LEVELS][TW_SLOTS];
+};
+
+struct timerwheel {
+    int nshards;
+    struct tw_shard *shards;
+    struct timespec epoch;
+};
+
+// The shard served by this thread, if any
+static __thread struct tw_shard *tw_self;
+
+/**
+ * @return the current tick of @param wheel
+ */
+static uint64_t wheel_tick(struct timerwheel *wheel) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t ms = (now.tv_sec - wheel->epoch.tv_sec) * 1000 +
+                 (now.tv_nsec - wheel->epoch.tv_nsec) / 1000000;
+    return ms / TW_TICK_MS;
+}
+
+/**
+ * @return the CLOCK_MONOTONIC time at which @param tick starts
+ */
+static struct timespec tick_time(struct timerwheel *wheel, uint64_t tick) {
+    uint64_t ms = tick * TW_TICK_MS;
+    struct timespec ts = wheel->epoch;
+    ts.tv_sec += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+/**
+ * File @param timer into the coarsest wheel of @param shard that resolves
+ * its expiry; timers already due go to the slot about to run
+ */
+static void shard_file(struct tw_shard *shard, struct tw_timer *timer) {
+    uint64_t at = timer->expires;
+    if ((int64_t)(at - shard->now) < 0) {
+        at = shard->now;
+    } else if (at - shard->now >= TW_SPAN) {
+        // Parked in the last wheel, refiled from its expires when cascaded
+        at = shard->now + TW_SPAN - 1;
+    }
+    int level = 0;
+    while (level < TW_LEVELS - 1 && at - shard->now >= (1ull << (TW_BITS * (level + 1)))) {
+        level++;
+    }
+    struct tw_timer **slot = &shard->slots[level][(at >> (TW_BITS * level)) & TW_MASK];
+    timer->next = *slot;
+    *slot = timer;
+}
+
+/**
+ * Refile every timer of slot @param index of wheel @param level into the finer wheels
+ * @return @param index, so that a wrapped wheel cascades the next one too.
+ */
+static unsigned shard_cascade(struct tw_shard *shard, int level, unsigned index) {
+    struct tw_timer *timer = shard->slots[level][index];
+    shard->slots[level][index] = NULL;
+    while (timer) {
+        struct tw_timer *next = timer->next;
+        shard_file(shard, timer);
+        timer = next;
+    }
+    return index;
+}
+
+/**
+ * Run every tick of @param shard up to and including @param target
+ */
+static void shard_run(struct tw_shard *shard, uint64_t target) {
+    while ((int64_t)(target - shard->now) >= 0) {
+        unsigned index = shard->now & TW_MASK;
+        if (index == 0) {
+            for (int level = 1; level < TW_LEVELS; level++) {
+                if (shard_cascade(shard, level, (shard->now >> (TW_BITS * level)) & TW_MASK) != 0) {
+                    break;
+                }
+            }
+        }
+        // Callbacks may add timers due right away, to this very slot
+        struct tw_timer *timer;
+        while ((timer = shard->slots[0][index]) != NULL) {
+            shard->slots[0][index] = timer->next;
+            shard->pending--;
+            timer->fn(timer);
+        }
+        shard->now++;
+    }
+}
+
+static void* shard_main(void* shard_param)
+{
+    struct tw_shard *shard = (struct tw_shard *) shard_param;
+    struct timerwheel *wheel = shard->wheel;
+    tw_self = shard;
+
+    while (1) {
+        pthread_mutex_lock(&shard->lock);
+        while (shard->incoming == NULL) {
+            if (shard->pending > 0) {
+                if (wheel_tick(wheel) >= shard->now) {
+                    break;
+                }
+                struct timespec deadline = tick_time(wheel, shard->now);
+                pthread_cond_timedwait(&shard->cond, &shard->lock, &deadline);
+            } else if (shard->stopping) {
+                pthread_mutex_unlock(&shard->lock);
+                DEBUG_LOG("shard exiting");
+                return NULL;
+            } else {
+                pthread_cond_wait(&shard->cond, &shard->lock);
+            }
+        }
+        struct tw_timer *timer = shard->incoming;
+        shard->incoming = NULL;
+        pthread_mutex_unlock(&shard->lock);
+
+        if (shard->pending == 0) {
+            // Idle wheels do not tick; catch up before filing
+            shard->now = wheel_tick(wheel);
+        }
+        while (timer) {
+            struct tw_timer *next = timer->next;
+            shard_file(shard, timer);
+            shard->pending++;
+            timer = next;
+        }
+        shard_run(shard, wheel_tick(wheel));
+    }
+}
+
+static void wheel_free(struct timerwheel *wheel, int started) {
+    for (int i = 0; i < started; i++) {
+        struct tw_shard *shard = &wheel->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->stopping = true;
+        pthread_cond_signal(&shard->cond);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(wheel->shards[i].thread, NULL);
+    }
+    for (int i = 0; i < wheel->nshards; i++) {
+        pthread_cond_destroy(&wheel->shards[i].cond);
+        pthread_mutex_destroy(&wheel->shards[i].lock);
+    }
+    free(wheel->shards);
+    free(wheel);
+}
+
+struct timerwheel *timerwheel_create(int nshards)
+{
+    if (nshards <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nshards = cpus > 0 ? (int) cpus : 1;
+    }
+    struct timerwheel *wheel = calloc(1, sizeof(*wheel));
+    if (wheel == NULL) {
+        ERROR_LOG("Failed to allocate memory for timerwheel");
+        return NULL;
+    }
+    wheel->shards = calloc(nshards, sizeof(*wheel->shards));
+    if (wheel->shards == NULL) {
+        ERROR_LOG("Failed to allocate memory for shards");
+        free(wheel);
+        return NULL;
+    }
+    wheel->nshards = nshards;
+    clock_gettime(CLOCK_MONOTONIC, &wheel->epoch);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    for (int i = 0; i < nshards; i++) {
+        wheel->shards[i].wheel = wheel;
+        pthread_mutex_init(&wheel->shards[i].lock, NULL);
+        pthread_cond_init(&wheel->shards[i].cond, &attr);
+    }
+    pthread_condattr_destroy(&attr);
+
+    for (int i = 0; i < nshards; i++) {
+        if (pthread_create(&wheel->shards[i].thread, NULL, shard_main, &wheel->shards[i]) != 0) {
+            ERROR_LOG("Failed to create shard thread.");
+            wheel_free(wheel, i);
+            return NULL;
+        }
+    }
+    return wheel;
+}
+
+void timerwheel_add(struct timerwheel *wheel, struct tw_timer *timer, unsigned delay_ms, uintptr_t key)
+{
+    uint64_t hash = (uint64_t) key * 0x9E3779B97F4A7C15ull;
+    struct tw_shard *shard = &wheel->shards[(hash >> 32) % wheel->nshards];
+    timer->expires = wheel_tick(wheel) + (delay_ms + TW_TICK_MS - 1) / TW_TICK_MS;
+    timer->shard = shard - wheel->shards;
+
+    if (tw_self == shard) {
+        shard_file(shard, timer);
+        shard->pending++;
+        return;
+    }
+    pthread_mutex_lock(&shard->lock);
+    timer->next = shard->incoming;
+    shard->incoming = timer;
+    if (timer->next == NULL) {
+        pthread_cond_signal(&shard->cond);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void timerwheel_destroy(struct timerwheel *wheel)
+{
+    wheel_free(wheel, wheel->nshards);
+}
@@ -0,0 +1,53 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+/**
+ * Hierarchical timer wheel (Varghese & Lauck): timed events run on a
+ * small fixed set of shard threads instead of one sleeping thread each.
+ * Every shard keeps TW_LEVELS wheels of TW_SLOTS slots with a 1 ms tick;
+ * a timer is filed into the coarsest wheel that still resolves it and
+ * cascaded into finer wheels as its time approaches, so adding, expiring
+ * and cascading are all O(1) per timer however many are pending.
+ */
+
+#define TW_TICK_MS  1
+#define TW_BITS     6
+#define TW_SLOTS    (1 << TW_BITS)
+#define TW_LEVELS   4           // 2^24 ticks (4.6 hours) before re-cascading
+
+struct timerwheel;
+
+/**
+ * A pending event, embedded in the caller's own structure.  Only fn needs
+ * to be set before timerwheel_add(); the rest belongs to the wheel.
+ */
+struct tw_timer {
+    void (*fn)(struct tw_timer *timer);
+    uint64_t expires;           // tick
+    unsigned shard;
+    struct tw_timer *next;
+};
+
+/**
+ * Start a wheel served by @param nshards threads (0 for one per online CPU)
+ * @return the wheel, or NULL on failure.
+ */
+struct timerwheel *timerwheel_create(int nshards);
+
+/**
+ * Run @param timer->fn(@param timer) about @param delay_ms from now, on the
+ * shard thread chosen by @param key.  Timers with the same key always run
+ * on the same thread, one at a time, so they may share state (or a held
+ * mutex) without locking.  Callbacks must not block, and may add timers.
+ */
+void timerwheel_add(struct timerwheel *wheel, struct tw_timer *timer, unsigned delay_ms, uintptr_t key);
+
+/**
+ * Wait until every pending timer has run, then stop and free @param wheel.
+ * No timer may be added from outside its callbacks once this is called.
+ */
+void timerwheel_destroy(struct timerwheel *wheel);
+
+#endif // TIMERWHEEL_H
@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#endif
+#include "bulkwrite.h"
+
+#define CHUNK           64          // files a worker claims, and ring entries
+#define DIRECT_ALIGN    4096        // O_DIRECT buffer, offset and length alignment
+#define OPEN_FLAGS      (O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC)
+
+struct bulk {
+    const struct bulk_job *jobs;
+    size_t njobs;
+    const struct bulk_options *opts;
+    void (*report)(const char *path, int err);
+    atomic_size_t next;             // first job not claimed yet
+    atomic_size_t failed;
+};
+
+// State of one file of the chunk in flight
+struct slot {
+    int fd;
+    int err;
+    bool direct;                    // opened with O_DIRECT
+    size_t len;                     // content length
+    void *bounce;                   // aligned, padded copy for O_DIRECT
+    size_t bounce_cap;
+    struct iovec bounce_iov;
+};
+
+struct worker {
+    struct bulk *bulk;
+    struct slot slots[CHUNK];
+    pthread_t thread;
+#ifdef HAVE_IO_URING
+    bool ring_ok;
+    int ring_fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_tail, *sq_mask;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+#endif
+};
+
+static size_t iov_length(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+// ------------------------------------------------
+// slot_prepare: size the slot for its job; with O_DIRECT the content is
+// copied into an aligned buffer padded to a whole block, and the file is
+// truncated back to its real length after the write
+// ------------------------------------------------
+static void slot_prepare(struct slot *slot, const struct bulk_job *job, bool direct) {
+    slot->fd = -1;
+    slot->err = 0;
+    slot->direct = direct;
+    slot->len = iov_length(job->iov, job->iovcnt);
+    if (!direct) {
+        return;
+    }
+    size_t padded = (slot->len + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    if (padded > slot->bounce_cap) {
+        free(slot->bounce);
+        slot->bounce_cap = 0;
+        if (posix_memalign(&slot->bounce, DIRECT_ALIGN, padded) != 0) {
+            slot->bounce = NULL;
+            slot->direct = false;
+            return;
+        }
+        slot->bounce_cap = padded;
+    }
+    char *p = slot->bounce;
+    for (int i = 0; i < job->iovcnt; i++) {
+        memcpy(p, job->iov[i].iov_base, job->iov[i].iov_len);
+        p += job->iov[i].iov_len;
+    }
+    memset(p, 0, padded - slot->len);
+    slot->bounce_iov = (struct iovec) { slot->bounce, padded };
+}
+
+// The content as written: the job's own iovecs, or the padded copy
+static const struct iovec *slot_iov(const struct slot *slot, const struct bulk_job *job, int *iovcnt) {
+    if (slot->direct) {
+        *iovcnt = 1;
+        return &slot->bounce_iov;
+    }
+    *iovcnt = job->iovcnt;
+    return job->iov;
+}
+
+// ------------------------------------------------
+// slot_open: open synchronously, without O_DIRECT if the file system
+// refuses it (older tmpfs does)
+// ------------------------------------------------
+static void slot_open(struct slot *slot, const struct bulk_job *job) {
+    if (slot->direct) {
+        slot->fd = open(job->path, OPEN_FLAGS | O_DIRECT, 0644);
+        if (slot->fd >= 0 || errno != EINVAL) {
+            slot->err = slot->fd < 0 ? errno : 0;
+            return;
+        }
+        slot->direct = false;
+    }
+    slot->fd = open(job->path, OPEN_FLAGS, 0644);
+    slot->err = slot->fd < 0 ? errno : 0;
+}
+
+// ------------------------------------------------
+// slot_write_rest: finish the write synchronously from byte @done on,
+// pwritev() until everything is out, then cut O_DIRECT padding
+// ------------------------------------------------
+static void slot_write_rest(struct slot *slot, const struct bulk_job *job, size_t done) {
+    int iovcnt;
+    const struct iovec *src = slot_iov(slot, job, &iovcnt);
+    size_t total = iov_length(src, iovcnt);
+    while (done < total) {
+        // Skip what is already written
+        struct iovec iov[IOV_MAX];
+        int n = 0;
+        size_t skip = done;
+        for (int i = 0; i < iovcnt && n < IOV_MAX; i++) {
+            if (skip >= src[i].iov_len) {
+                skip -= src[i].iov_len;
+                continue;
+            }
+            iov[n].iov_base = (char *) src[i].iov_base + skip;
+            iov[n].iov_len = src[i].iov_len - skip;
+            skip = 0;
+            n++;
+        }
+        ssize_t r = pwritev(slot->fd, iov, n, done);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            slot->err = errno;
+            return;
+        }
+        done += r;
+    }
+    if (slot->direct && total != slot->len && ftruncate(slot->fd, slot->len) < 0) {
+        slot->err = errno;
+    }
+}
+
+static void slot_close(struct slot *slot) {
+    if (slot->fd >= 0 && close(slot->fd) < 0 && slot->err == 0) {
+        slot->err = errno;
+    }
+    slot->fd = -1;
+}
+
+// ------------------------------------------------
+// chunk_sync: create the files of one chunk with plain system calls
+// ------------------------------------------------
+static void chunk_sync(struct worker *w, size_t first, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        struct slot *slot = &w->slots[i];
+        const struct bulk_job *job = &w->bulk->jobs[first + i];
+        slot_open(slot, job);
+        if (slot->fd >= 0) {
+            slot_write_rest(slot, job, 0);
+        }
+        slot_close(slot);
+    }
+}
+
+#ifdef HAVE_IO_URING
+static void ring_exit(struct worker *w) {
+    if (w->sqes && w->sqes != MAP_FAILED) munmap(w->sqes, w->sqes_len);
+    if (w->cq_ptr && w->cq_ptr != MAP_FAILED && w->cq_ptr != w->sq_ptr) munmap(w->cq_ptr, w->cq_len);
+    if (w->sq_ptr && w->sq_ptr != MAP_FAILED) munmap(w->sq_ptr, w->sq_len);
+    if (w->ring_fd >= 0) close(w->ring_fd);
+    w->ring_ok = false;
+}
+
+// ------------------------------------------------
+// ring_supports: check that the kernel knows every opcode a chunk uses
+// ------------------------------------------------
+static bool ring_supports(int fd) {
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    if (probe == NULL) {
+        return false;
+    }
+    bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    static const int ops[] = { IORING_OP_OPENAT, IORING_OP_WRITEV, IORING_OP_CLOSE };
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++) {
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return ok;
+}
+
+// ------------------------------------------------
+// ring_init: a ring of CHUNK entries, SQEs used in ring order
+// ------------------------------------------------
+static void ring_init(struct worker *w) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    w->ring_fd = (int) syscall(__NR_io_uring_setup, CHUNK, &p);
+    if (w->ring_fd < 0) {
+        return; // ENOSYS, or blocked by seccomp
+    }
+    w->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    w->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (w->cq_len > w->sq_len) w->sq_len = w->cq_len;
+        w->cq_len = w->sq_len;
+    }
+    w->sq_ptr = mmap(NULL, w->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     w->ring_fd, IORING_OFF_SQ_RING);
+    if (w->sq_ptr == MAP_FAILED) {
+        ring_exit(w);
+        return;
+    }
+    w->cq_ptr = w->sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        w->cq_ptr = mmap(NULL, w->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         w->ring_fd, IORING_OFF_CQ_RING);
+        if (w->cq_ptr == MAP_FAILED) {
+            ring_exit(w);
+            return;
+        }
+    }
+    w->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    w->sqes = mmap(NULL, w->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   w->ring_fd, IORING_OFF_SQES);
+    if (w->sqes == MAP_FAILED || !ring_supports(w->ring_fd)) {
+        ring_exit(w);
+        return;
+    }
+    char *sq = w->sq_ptr, *cq = w->cq_ptr;
+    w->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    w->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    w->cq_head = (unsigned *) (cq + p.cq_off.head);
+    w->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    w->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    w->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    unsigned *array = (unsigned *) (sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    w->ring_ok = true;
+}
+
+static struct io_uring_sqe *ring_sqe(struct worker *w, unsigned n, unsigned slot) {
+    struct io_uring_sqe *sqe = &w->sqes[(*w->sq_tail + n) & *w->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = slot;
+    return sqe;
+}
+
+// ------------------------------------------------
+// ring_run: submit the @n SQEs filled in and wait for all of them;
+// @res[slot] receives each result
+// return: false if the ring itself failed
+// ------------------------------------------------
+static bool ring_run(struct worker *w, unsigned n, int *res) {
+    if (n == 0) {
+        return true;
+    }
+    __atomic_store_n(w->sq_tail, *w->sq_tail + n, __ATOMIC_RELEASE);
+    unsigned submitted = 0, reaped = 0;
+    while (reaped < n) {
+        int r = (int) syscall(__NR_io_uring_enter, w->ring_fd, n - submitted, n - reaped,
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        submitted += r;
+        unsigned head = *w->cq_head;
+        unsigned tail = __atomic_load_n(w->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++, reaped++) {
+            struct io_uring_cqe *cqe = &w->cqes[head & *w->cq_mask];
+            res[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(w->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+// ------------------------------------------------
+// chunk_ring: create the files of one chunk in three submissions: open
+// all, write all, close all
+// return: false if the ring failed and the chunk must go the sync way
+// ------------------------------------------------
+static bool chunk_ring(struct worker *w, size_t first, size_t count) {
+    const struct bulk_job *jobs = &w->bulk->jobs[first];
+    int res[CHUNK];
+    unsigned n = 0;
+
+    for (unsigned i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = ring_sqe(w, n++, i);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t) (uintptr_t) jobs[i].path;
+        sqe->open_flags = OPEN_FLAGS | (w->slots[i].direct ? O_DIRECT : 0);
+        sqe->len = 0644;
+    }
+    if (!ring_run(w, n, res)) {
+        return false;
+    }
+    n = 0;
+    for (unsigned i = 0; i < count; i++) {
+        struct slot *slot = &w->slots[i];
+        if (res[i] == -EINVAL && slot->direct) {
+            slot->direct = false;
+            slot_open(slot, &jobs[i]);
+        } else if (res[i] < 0) {
+            slot->err = -res[i];
+        } else {
+            slot->fd = res[i];
+        }
+        int iovcnt;
+        const struct iovec *iov = slot_iov(slot, &jobs[i], &iovcnt);
+        if (slot->fd < 0 || iovcnt == 0 || iovcnt > IOV_MAX) {
+            res[i] = 0;
+            continue;
+        }
+        struct io_uring_sqe *sqe = ring_sqe(w, n++, i);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = slot->fd;
+        sqe->addr = (uint64_t) (uintptr_t) iov;
+        sqe->len = iovcnt;
+        sqe->off = 0;
+    }
+    if (!ring_run(w, n, res)) {
+        return false; // the files are open, chunk_sync() reopens and rewrites them
+    }
+    n = 0;
+    for (unsigned i = 0; i < count; i++) {
+        struct slot *slot = &w->slots[i];
+        if (slot->fd < 0) {
+            continue;
+        }
+        // Short writes, and content past what one writev takes, end here
+        if (res[i] < 0) {
+            slot->err = -res[i];
+        } else {
+            slot_write_rest(slot, &jobs[i], res[i]);
+        }
+        struct io_uring_sqe *sqe = ring_sqe(w, n++, i);
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = slot->fd;
+        slot->fd = -1;
+    }
+    if (!ring_run(w, n, res)) {
+        return false;
+    }
+    return true;
+}
+#endif
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    struct bulk *bulk = w->bulk;
+#ifdef HAVE_IO_URING
+    w->ring_fd = -1;
+    if (bulk->opts->use_uring) {
+        ring_init(w);
+    }
+#endif
+    while (1) {
+        size_t first = atomic_fetch_add(&bulk->next, CHUNK);
+        if (first >= bulk->njobs) {
+            break;
+        }
+        size_t count = bulk->njobs - first < CHUNK ? bulk->njobs - first : CHUNK;
+        for (size_t i = 0; i < count; i++) {
+            slot_prepare(&w->slots[i], &bulk->jobs[first + i], bulk->opts->direct);
+        }
+#ifdef HAVE_IO_URING
+        if (!w->ring_ok || !chunk_ring(w, first, count)) {
+            if (w->ring_ok) {
+                ring_exit(w);
+            }
+            for (size_t i = 0; i < count; i++) {
+                slot_close(&w->slots[i]);
+                slot_prepare(&w->slots[i], &bulk->jobs[first + i], bulk->opts->direct);
+            }
+            chunk_sync(w, first, count);
+        }
+#else
+        chunk_sync(w, first, count);
+#endif
+        for (size_t i = 0; i < count; i++) {
+            if (w->slots[i].err) {
+                atomic_fetch_add(&bulk->failed, 1);
+                if (bulk->report) {
+                    bulk->report(bulk->jobs[first + i].path, w->slots[i].err);
+                }
+            }
+        }
+    }
+#ifdef HAVE_IO_URING
+    if (w->ring_ok) {
+        ring_exit(w);
+    }
+#endif
+    for (int i = 0; i < CHUNK; i++) {
+        free(w->slots[i].bounce);
+    }
+    return NULL;
+}
+
+size_t bulk_write(const struct bulk_job *jobs, size_t njobs, const struct bulk_options *opts,
+                  void (*report)(const char *path, int err)) {
+    struct bulk bulk = { .jobs = jobs, .njobs = njobs, .opts = opts, .report = report };
+    long nthreads = opts->threads > 0 ? opts->threads : sysconf(_SC_NPROCESSORS_ONLN);
+    long chunks = (njobs + CHUNK - 1) / CHUNK;
+    if (nthreads > chunks) nthreads = chunks;
+    if (nthreads < 1) nthreads = 1;
+
+    struct worker *workers = calloc(nthreads, sizeof(*workers));
+    if (workers == NULL) {
+        return njobs;
+    }
+    long started = 0;
+    for (long i = 0; i < nthreads; i++) {
+        workers[i].bulk = &bulk;
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        // No threads to be had: do the work here
+        workers[0].bulk = &bulk;
+        worker_main(&workers[0]);
+    }
+    for (long i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    free(workers);
+    return atomic_load(&bulk.failed);
+}
@@ -0,0 +1,34 @@
+#ifndef BULKWRITE_H
+#define BULKWRITE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Bulk mode of writer: creates many files from a pool of worker threads.
+// Each worker claims a chunk of files at a time and, where io_uring is
+// available, opens, writes and closes the whole chunk in one submission
+// per step instead of three system calls per file.
+
+// One file to create (or truncate) with the given content
+struct bulk_job {
+    const char *path;
+    const struct iovec *iov;    // content, written with one pwritev()
+    int iovcnt;
+};
+
+struct bulk_options {
+    int threads;                // 0: one per online CPU
+    bool direct;                // O_DIRECT where the file system allows it
+    bool use_uring;             // false: plain system calls
+};
+
+// ------------------------------------------------
+// bulk_write: create every file of @jobs, calling @report for each one that
+// failed with its errno
+// return: the number of files that failed
+// ------------------------------------------------
+size_t bulk_write(const struct bulk_job *jobs, size_t njobs, const struct bulk_options *opts,
+                  void (*report)(const char *path, int err));
+
+#endif // BULKWRITE_H
@@ -0,0 +1,561 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <regex.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "threadpool.h"
+#include "finder_index.h"
+
+// Native replacement for finder.sh: counts the regular files under a
+// directory (find -type f | wc -l) and the lines matching a string in them
+// (grep -r -n | wc -l) in a single parallel pass, printing the same lines.
+// Given several strings it counts the matching lines of each one, still
+// reading every file once.  With FINDER_INDEX set to a file path it keeps
+// an content_index there and only reads the files that changed or may match.
+
+#define DIRENT_BUF      (64 * 1024)     // getdents64 batch
+#define READ_MAX        (1024 * 1024)   // files up to this are read, larger ones mapped
+#define BINARY_BLOCK    32768           // grep's binary-file check granularity
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct pattern {
+    const char *str;
+    size_t len;
+    bool use_regex;             // has BRE special characters
+    regex_t regex;
+    int alias;                  // first pattern with the same literal string
+};
+
+// Aho-Corasick automaton over the literal patterns, as a full DFA:
+// one 256-entry transition row per trie node, state 0 is the root
+struct automaton {
+    uint32_t (*next)[256];
+    int *out;                   // pattern ending at the state, or -1
+    uint32_t *dict;             // nearest state on the fail chain with an output, 0 if none
+    uint32_t *match;            // the state itself if it has an output, else dict
+    uint32_t nstates;
+};
+
+// What to look for, shared read-only by every worker
+static struct pattern *patterns;
+static int npatterns;
+static struct automaton *automaton;    // set when there are several literal strings
+
+// FINDER_INDEX, or NULL, and the length of the root path its paths skip
+static struct finder_index *content_index;
+static size_t root_len;
+
+static struct threadpool *pool;
+static atomic_long file_count;
+static atomic_long *line_counts;        // per pattern
+
+// Directory tasks not finished yet; main waits for zero
+static atomic_long dirs_pending;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+// Per-thread read buffer for small files
+static __thread char *read_buf;
+
+// Per-thread line of the last match of every pattern, so that a line is
+// counted once; the line number keeps growing across files
+static __thread uint64_t *last_line;
+static __thread uint64_t line_no;
+
+// ------------------------------------------------
+// find_literal: first occurrence of @pat in [hay, hay + len)
+// note: SSE2 compares the pattern's first and last bytes against 16
+//       positions at once and only calls memcmp() where both match
+// ------------------------------------------------
+static const char *find_literal(const struct pattern *pat, const char *hay, size_t len) {
+    const char *pattern = pat->str;
+    size_t pattern_len = pat->len;
+    if (pattern_len == 1) {
+        return memchr(hay, pattern[0], len);
+    }
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(pattern[0]);
+    const __m128i last = _mm_set1_epi8(pattern[pattern_len - 1]);
+    for (; i + pattern_len - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (hay + i + pattern_len - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, pattern + 1, pattern_len - 2) == 0) {
+                return hay + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return memmem(hay + i, len - i, pattern, pattern_len);
+}
+
+// ------------------------------------------------
+// count_regex: number of lines in [p, end) matching a regex pattern
+// ------------------------------------------------
+static long count_regex(const struct pattern *pat, const char *p, const char *end) {
+    long count = 0;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *line_end = nl ? nl : end;
+        regmatch_t m = { .rm_so = 0, .rm_eo = line_end - p };
+        if (regexec(&pat->regex, p, 1, &m, REG_STARTEND) == 0) {
+            count++;
+        }
+        p = line_end + 1;
+    }
+    return count;
+}
+
+// ------------------------------------------------
+// count_literal: number of lines in [p, end) containing a literal pattern
+// ------------------------------------------------
+static long count_literal(const struct pattern *pat, const char *p, const char *end) {
+    long count = 0;
+    while (p < end) {
+        const char *hit = find_literal(pat, p, end - p);
+        if (hit == NULL) {
+            break;
+        }
+        count++;
+        // Count each line once, however many times it matches
+        const char *nl = memchr(hit, '\n', end - hit);
+        if (nl == NULL) {
+            break;
+        }
+        p = nl + 1;
+    }
+    return count;
+}
+
+// ------------------------------------------------
+// automaton_build: Aho-Corasick DFA over the literal patterns
+// note: no pattern holds a newline (those go through regexec), so every
+//       state moves back to the root on '\n'
+// ------------------------------------------------
+static struct automaton *automaton_build(void) {
+    size_t total = 1;
+    for (int i = 0; i < npatterns; i++) {
+        if (!patterns[i].use_regex && patterns[i].alias == i) {
+            total += patterns[i].len;
+        }
+    }
+    struct automaton *ac = calloc(1, sizeof(*ac));
+    uint32_t *fail = calloc(total, sizeof(uint32_t));
+    uint32_t *queue = calloc(total, sizeof(uint32_t));
+    if (ac == NULL || fail == NULL || queue == NULL ||
+        (ac->next = calloc(total, sizeof(*ac->next))) == NULL ||
+        (ac->out = malloc(total * sizeof(int))) == NULL ||
+        (ac->dict = calloc(total, sizeof(uint32_t))) == NULL ||
+        (ac->match = calloc(total, sizeof(uint32_t))) == NULL) {
+        return NULL;
+    }
+
+    // Trie: an edge to 0 means none, nothing but the root goes back to it
+    memset(ac->out, -1, total * sizeof(int));
+    ac->nstates = 1;
+    for (int i = 0; i < npatterns; i++) {
+        if (patterns[i].use_regex || patterns[i].alias != i) {
+            continue;
+        }
+        uint32_t s = 0;
+        for (size_t j = 0; j < patterns[i].len; j++) {
+            unsigned char c = patterns[i].str[j];
+            if (ac->next[s][c] == 0) {
+                ac->next[s][c] = ac->nstates++;
+            }
+            s = ac->next[s][c];
+        }
+        ac->out[s] = i;
+    }
+
+    // Breadth first, filling the missing edges from the fail state's row
+    size_t head = 0, tail = 0;
+    for (int c = 0; c < 256; c++) {
+        if (ac->next[0][c]) {
+            queue[tail++] = ac->next[0][c];
+        }
+    }
+    while (head < tail) {
+        uint32_t s = queue[head++];
+        uint32_t f = fail[s];
+        ac->dict[s] = ac->out[f] >= 0 ? f : ac->dict[f];
+        ac->match[s] = ac->out[s] >= 0 ? s : ac->dict[s];
+        for (int c = 0; c < 256; c++) {
+            uint32_t t = ac->next[s][c];
+            if (t) {
+                fail[t] = ac->next[f][c];
+                queue[tail++] = t;
+            } else {
+                ac->next[s][c] = ac->next[f][c];
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    return ac;
+}
+
+// ------------------------------------------------
+// automaton_scan: add the lines in [p, end) matching each literal pattern
+// to @counts, in one pass over the bytes
+// ------------------------------------------------
+static void automaton_scan(const struct automaton *ac, const char *p, const char *end, long *counts) {
+    if (last_line == NULL) {
+        last_line = calloc(npatterns, sizeof(uint64_t));
+        if (last_line == NULL) {
+            return;
+        }
+    }
+    uint64_t line = ++line_no;
+    uint32_t s = 0;
+    for (; p < end; p++) {
+        unsigned char c = *p;
+        if (c == '\n') {
+            line++;
+            s = 0;
+            continue;
+        }
+        s = ac->next[s][c];
+        for (uint32_t m = ac->match[s]; m; m = ac->dict[m]) {
+            int i = ac->out[m];
+            if (last_line[i] != line) {
+                last_line[i] = line;
+                counts[i]++;
+            }
+        }
+    }
+    line_no = line;
+}
+
+// ------------------------------------------------
+// count_lines: add the number of lines in [data, data + len) matching
+// each pattern to @counts
+// note: like grep, a file with a NUL byte is binary and its matches from
+//       the block holding the first NUL on are not printed (and so not counted)
+// ------------------------------------------------
+static void count_lines(const char *data, size_t len, long *counts) {
+    const char *nul = memchr(data, '\0', len);
+    if (nul) {
+        len = (nul - data) / BINARY_BLOCK * BINARY_BLOCK;
+    }
+    const char *end = data + len;
+
+    for (int i = 0; i < npatterns; i++) {
+        const struct pattern *pat = &patterns[i];
+        if (pat->use_regex) {
+            counts[i] += count_regex(pat, data, end);
+        } else if (automaton == NULL && pat->alias == i) {
+            counts[i] += count_literal(pat, data, end);
+        }
+    }
+    if (automaton) {
+        automaton_scan(automaton, data, end, counts);
+    }
+}
+
+// ------------------------------------------------
+// scan_file: add the matching lines of one regular file to @counts, and
+// collect its trigrams into @learn unless that is NULL
+// note: small files are read whole into a per-thread buffer, large ones
+//       are mapped, so the search always sees contiguous memory
+// ------------------------------------------------
+static void scan_file(int dirfd, const char *name, long *counts, struct index_trigrams *learn) {
+    if (learn) {
+        *learn = (struct index_trigrams) { .flags = INDEX_UNREADABLE };
+    }
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        return; // unreadable: grep reports it and counts nothing
+    }
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (regular && st.st_size == 0 && learn) {
+        learn->flags = 0;
+    } else if (regular && st.st_size > 0) {
+        if (st.st_size <= READ_MAX) {
+            if (read_buf == NULL) {
+                read_buf = malloc(READ_MAX);
+            }
+            size_t len = 0;
+            ssize_t n;
+            while (read_buf && len < READ_MAX &&
+                   (n = read(fd, read_buf + len, READ_MAX - len)) > 0) {
+                len += n;
+            }
+            if (read_buf) {
+                count_lines(read_buf, len, counts);
+                if (learn) {
+                    finder_index_trigrams(read_buf, len, learn);
+                }
+            }
+        } else {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                count_lines(map, st.st_size, counts);
+                if (learn) {
+                    finder_index_trigrams(map, st.st_size, learn);
+                }
+                munmap(map, st.st_size);
+            }
+        }
+    }
+    close(fd);
+}
+
+static void dir_done(void) {
+    if (atomic_fetch_sub(&dirs_pending, 1) == 1) {
+        pthread_mutex_lock(&done_lock);
+        pthread_cond_signal(&done_cond);
+        pthread_mutex_unlock(&done_lock);
+    }
+}
+
+// ------------------------------------------------
+// scan_indexed: scan_file() for a file the content_index may already know
+// ------------------------------------------------
+static void scan_indexed(int dirfd, const char *dir, const char *name, long *counts) {
+    // Index paths are relative to the root, without a leading slash
+    const char *rel = dir + root_len;
+    while (*rel == '/') {
+        rel++;
+    }
+    char relpath[PATH_MAX];
+    struct stat st;
+    if (snprintf(relpath, sizeof(relpath), "%s%s%s", rel, *rel ? "/" : "", name) >= (int) sizeof(relpath) ||
+        fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        scan_file(dirfd, name, counts, NULL);
+        return;
+    }
+    // Status first: a change while reading shows up in the next run
+    int32_t id;
+    struct index_trigrams learned;
+    switch (finder_index_lookup(content_index, relpath, &st, &id)) {
+    case INDEX_SKIP:
+        finder_index_keep(content_index, relpath, &st, id);
+        break;
+    case INDEX_SCAN:
+        scan_file(dirfd, name, counts, NULL);
+        finder_index_keep(content_index, relpath, &st, id);
+        break;
+    case INDEX_LEARN:
+        scan_file(dirfd, name, counts, &learned);
+        finder_index_learn(content_index, relpath, &st, &learned);
+        break;
+    }
+}
+
+static void *scan_dir(void *arg);
+
+// ------------------------------------------------
+// submit_dir: queue a directory task; the path is owned by the task
+// note: a worker pushes onto its own deque, idle workers steal from it
+// ------------------------------------------------
+static void submit_dir(char *path) {
+    atomic_fetch_add(&dirs_pending, 1);
+    struct tp_future *task = threadpool_submit(pool, scan_dir, path);
+    if (task == NULL) {
+        scan_dir(path); // out of memory: walk it here instead
+        return;
+    }
+    tp_future_detach(task);
+}
+
+// ------------------------------------------------
+// scan_dir: read one directory with getdents64, scanning its files here
+// and handing its subdirectories to the pool
+// ------------------------------------------------
+static void *scan_dir(void *arg) {
+    char *path = arg;
+    int dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    long files = 0;
+    long *lines = calloc(npatterns, sizeof(long));
+    char *buf = dirfd >= 0 && lines ? malloc(DIRENT_BUF) : NULL;
+    size_t path_len = strlen(path);
+
+    long n;
+    while (buf && (n = syscall(SYS_getdents64, dirfd, buf, DIRENT_BUF)) > 0) {
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *) (buf + off);
+            off += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+            }
+            if (type == DT_REG) {
+                files++;
+                if (content_index) {
+                    scan_indexed(dirfd, path, name, lines);
+                } else {
+                    scan_file(dirfd, name, lines, NULL);
+                }
+            } else if (type == DT_DIR) {
+                // Neither find nor grep -r follows symlinks below the top
+                size_t name_len = strlen(name);
+                char *sub = malloc(path_len + name_len + 2);
+                if (sub == NULL) {
+                    continue;
+                }
+                memcpy(sub, path, path_len);
+                sub[path_len] = '/';
+                memcpy(sub + path_len + 1, name, name_len + 1);
+                submit_dir(sub);
+            }
+        }
+    }
+
+    free(buf);
+    if (dirfd >= 0) {
+        close(dirfd);
+    }
+    free(path);
+    atomic_fetch_add(&file_count, files);
+    for (int i = 0; lines && i < npatterns; i++) {
+        atomic_fetch_add(&line_counts[i], lines[i]);
+    }
+    free(lines);
+    dir_done();
+    return NULL;
+}
+
+// ------------------------------------------------
+// main: same arguments, checks and output as finder.sh; every string past
+// the first adds a pattern, each reported on its own line
+// ------------------------------------------------
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("ERROR: please include the required arguments next time!\n");
+        return 1;
+    }
+    const char *filesdir = argv[1];
+
+    struct stat st;
+    if (stat(filesdir, &st) == 0 && S_ISDIR(st.st_mode)) {
+        printf("Path is valid\n");
+    } else {
+        printf("ERROR: the path is not valid!\n");
+        return 1;
+    }
+
+    npatterns = argc - 2;
+    patterns = calloc(npatterns, sizeof(*patterns));
+    line_counts = calloc(npatterns, sizeof(*line_counts));
+    if (patterns == NULL || line_counts == NULL) {
+        printf("ERROR: out of memory\n");
+        return 1;
+    }
+    int nliterals = 0;
+    for (int i = 0; i < npatterns; i++) {
+        struct pattern *pat = &patterns[i];
+        pat->str = argv[i + 2];
+        pat->len = strlen(pat->str);
+        pat->alias = i;
+        // grep takes the string as a basic regular expression; only strings
+        // free of its special characters go through the literal search
+        pat->use_regex = strpbrk(pat->str, ".[]*^$\\\n") != NULL;
+        if (pat->len == 0 ||
+            (pat->use_regex && regcomp(&pat->regex, pat->str, REG_NOSUB) != 0)) {
+            printf("ERROR: the string for search is not valid!\n");
+            return 1;
+        }
+        for (int j = 0; j < i && !pat->use_regex; j++) {
+            if (!patterns[j].use_regex && strcmp(patterns[j].str, pat->str) == 0) {
+                pat->alias = j;
+                break;
+            }
+        }
+        if (!pat->use_regex && pat->alias == i) {
+            nliterals++;
+        }
+    }
+    printf("The string for search is valid\n");
+
+    // One string is faster through the SIMD search, several through one
+    // automaton pass instead of a pass per string
+    if (nliterals > 1 && (automaton = automaton_build()) == NULL) {
+        printf("ERROR: out of memory\n");
+        return 1;
+    }
+
+    const char *index_path = getenv("FINDER_INDEX");
+    if (index_path && *index_path) {
+        content_index = finder_index_open(index_path, filesdir);
+        const char **strs = calloc(npatterns, sizeof(*strs));
+        size_t *lens = calloc(npatterns, sizeof(*lens));
+        if (content_index == NULL || strs == NULL || lens == NULL) {
+            printf("ERROR: out of memory\n");
+            return 1;
+        }
+        for (int i = 0; i < npatterns; i++) {
+            strs[i] = patterns[i].use_regex ? NULL : patterns[i].str;
+            lens[i] = patterns[i].len;
+        }
+        finder_index_query(content_index, strs, lens, npatterns);
+        free(strs);
+        free(lens);
+        root_len = strlen(filesdir);
+    }
+
+    pool = threadpool_create(0);
+    char *root = strdup(filesdir);
+    if (pool == NULL || root == NULL) {
+        printf("ERROR: out of memory\n");
+        return 1;
+    }
+    submit_dir(root);
+    pthread_mutex_lock(&done_lock);
+    while (atomic_load(&dirs_pending) > 0) {
+        pthread_cond_wait(&done_cond, &done_lock);
+    }
+    pthread_mutex_unlock(&done_lock);
+    threadpool_destroy(pool);
+    if (content_index && !finder_index_commit(content_index)) {
+        fprintf(stderr, "finder: could not write the index %s\n", index_path);
+    }
+
+    long files = atomic_load(&file_count);
+    if (npatterns == 1) {
+        printf("The number of files are %ld and the number of matching lines are %ld\n",
+               files, atomic_load(&line_counts[0]));
+        return 0;
+    }
+    for (int i = 0; i < npatterns; i++) {
+        printf("The number of files are %ld and the number of matching lines for %s are %ld\n",
+               files, patterns[i].str, atomic_load(&line_counts[patterns[i].alias]));
+    }
+    return 0;
+}
@@ -1,13 +1,21 @@
 #!/bin/bash
 
-# Check if there is 2 runtime arguments when run this script
-if [ "$#" -ne 2 ]; then
+# Hand over to the native finder when it has been built next to this script,
+# it prints the same lines in a single parallel pass
+finder="$(dirname "$0")/finder"
+if [ -x "$finder" ]; then
+    exec "$finder" "$@"
+fi
+
+# Check if there is at least 2 runtime arguments when run this script
+# note: every argument after the first is a string to search for
+if [ "$#" -lt 2 ]; then
     echo "ERROR: please include the required arguments next time!"
     exit 1
 fi
 
 filesdir=$1
-searchstr=$2
+shift
 
 # Check if the first runtime argument is directory
 if [ -d "$filesdir" ]; then
@@ -17,17 +25,25 @@ else
     exit 1
 fi
 
-# Check if the first runtime argument is directory
-if [ -z "$searchstr" ]; then
-    echo "ERROR: the string for search is not valid!"
-    exit 1
-else
-    echo "The string for search is valid"
-fi
+# Check that no string for search is empty
+for searchstr in "$@"; do
+    if [ -z "$searchstr" ]; then
+        echo "ERROR: the string for search is not valid!"
+        exit 1
+    fi
+done
+echo "The string for search is valid"
 
 # note: wc -l is count the number of lines from the output of the command 1
 #       because whe  we do command1 | command2 , the command1 create output
 #       then the command 2 takes that output as input
 X=$(find "$filesdir" -type f | wc -l)
-Y=$(grep -r -n "$searchstr" "$filesdir" | wc -l)
-echo "The number of files are $X and the number of matching lines are $Y"
\ No newline at end of file
+if [ "$#" -eq 1 ]; then
+    Y=$(grep -r -n "$1" "$filesdir" | wc -l)
+    echo "The number of files are $X and the number of matching lines are $Y"
+    exit 0
+fi
+for searchstr in "$@"; do
+    Y=$(grep -r -n -e "$searchstr" "$filesdir" | wc -l)
+    echo "The number of files are $X and the number of matching lines for $searchstr are $Y"
+done
\ No newline at end of file
@@ -0,0 +1,674 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "finder_index.h"
+
+// Index file layout, all sections 8-byte aligned:
+//   header | files[nfiles] | hash[hash_cap] | root | paths | postings | trigrams[ntrigrams]
+// Files are sorted by path, their id is their position.  hash holds id + 1
+// (0 free), probed linearly from the FNV-1a of the path.  Trigrams are
+// sorted and each points at its run of postings: the ascending ids of the
+// files holding it, as LEB128 varints of the gaps between them.
+
+#define INDEX_MAGIC     "FNDIDX01"
+#define RACY_NS         1000000000LL    // mtime granularity we do not trust
+
+struct index_header {
+    char magic[8];
+    uint64_t total_size;
+    uint32_t nfiles;
+    uint32_t ntrigrams;
+    uint32_t hash_cap;
+    uint32_t root_len;
+    uint64_t files_off, hash_off, paths_off, postings_off, trigrams_off;
+    uint64_t root_off;
+    uint64_t postings_len;
+};
+
+struct index_file {
+    uint64_t ino, dev, size;
+    int64_t mtime_ns, ctime_ns;
+    uint64_t path_off;
+    uint32_t path_len;
+    uint32_t flags;
+};
+
+struct index_trigram {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t off;       // in postings bytes, up to the next trigram's
+};
+
+// A file seen in this run, in the index to write
+struct index_entry {
+    char *path;
+    struct index_file meta;
+    int32_t old_id;     // its trigrams are those of this old file, or -1
+    uint32_t *tri;
+    uint32_t ntri;
+};
+
+struct finder_index {
+    char *path;
+    char *root;
+    int64_t start_ns;
+
+    // The old index, mapped
+    void *map;
+    size_t map_size;
+    const struct index_header *hdr;
+    const struct index_file *files;
+    const uint32_t *hash;
+    const char *paths;
+    const uint8_t *postings;
+    const struct index_trigram *trigrams;
+    uint32_t nfiles;
+
+    uint8_t *candidates;    // old ids that may match, NULL when all may
+
+    pthread_mutex_t lock;
+    struct index_entry *entries;
+    size_t nentries, cap;
+    size_t kept;            // old files still there and unchanged
+    bool dirty;
+};
+
+// Per-thread set of trigrams seen in the current file
+static __thread uint64_t *trigram_bits;
+
+static uint64_t path_hash(const char *path, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) path[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static int64_t stat_ns(const struct timespec *ts) {
+    return (int64_t) ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static void fill_meta(struct index_file *meta, const struct stat *st) {
+    meta->ino = st->st_ino;
+    meta->dev = st->st_dev;
+    meta->size = st->st_size;
+    meta->mtime_ns = stat_ns(&st->st_mtim);
+    meta->ctime_ns = stat_ns(&st->st_ctim);
+}
+
+// ------------------------------------------------
+// index_map: map and check the old index; anything off leaves it empty
+// ------------------------------------------------
+static void index_map(struct finder_index *index) {
+    int fd = open(index->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct index_header)) {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    const struct index_header *hdr = map;
+    uint64_t size = st.st_size;
+    bool ok = memcmp(hdr->magic, INDEX_MAGIC, 8) == 0 && hdr->total_size == size &&
+        hdr->files_off + (uint64_t) hdr->nfiles * sizeof(struct index_file) <= size &&
+        hdr->hash_off + (uint64_t) hdr->hash_cap * sizeof(uint32_t) <= size &&
+        hdr->trigrams_off + (uint64_t) hdr->ntrigrams * sizeof(struct index_trigram) <= size &&
+        hdr->paths_off <= size && hdr->postings_off <= size &&
+        hdr->root_off + hdr->root_len <= size &&
+        hdr->root_len == strlen(index->root) &&
+        memcmp((const char *) map + hdr->root_off, index->root, hdr->root_len) == 0 &&
+        (hdr->hash_cap & (hdr->hash_cap - 1)) == 0 && hdr->hash_cap > hdr->nfiles;
+    // Posting runs must stay inside the file, or a damaged index could
+    // hide a file that matches
+    const struct index_trigram *trigrams = (const void *) ((const char *) map + hdr->trigrams_off);
+    ok = ok && hdr->postings_off + hdr->postings_len <= size;
+    for (uint32_t i = 0; ok && i < hdr->ntrigrams; i++) {
+        ok = trigrams[i].off <= hdr->postings_len &&
+            (i == 0 || (trigrams[i - 1].trigram < trigrams[i].trigram &&
+                        trigrams[i - 1].off <= trigrams[i].off));
+    }
+    if (!ok) {
+        munmap(map, size);
+        return;
+    }
+    index->map = map;
+    index->map_size = size;
+    index->hdr = hdr;
+    index->files = (const struct index_file *) ((const char *) map + hdr->files_off);
+    index->hash = (const uint32_t *) ((const char *) map + hdr->hash_off);
+    index->paths = (const char *) map + hdr->paths_off;
+    index->postings = (const uint8_t *) map + hdr->postings_off;
+    index->trigrams = (const struct index_trigram *) ((const char *) map + hdr->trigrams_off);
+    index->nfiles = hdr->nfiles;
+}
+
+struct finder_index *finder_index_open(const char *path, const char *root) {
+    struct finder_index *index = calloc(1, sizeof(*index));
+    if (index == NULL) {
+        return NULL;
+    }
+    index->path = strdup(path);
+    index->root = realpath(root, NULL);
+    if (index->path == NULL || index->root == NULL) {
+        free(index->path);
+        free(index->root);
+        free(index);
+        return NULL;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    index->start_ns = stat_ns(&now);
+    pthread_mutex_init(&index->lock, NULL);
+    index_map(index);
+    return index;
+}
+
+// Reads the posting run of one trigram
+struct posting_iter {
+    const uint8_t *p, *end;
+    uint32_t left;
+    uint32_t id;
+    bool started;
+};
+
+static void posting_begin(const struct finder_index *index, const struct index_trigram *tg,
+                          struct posting_iter *it) {
+    const struct index_trigram *next = tg + 1;
+    uint64_t end = next < index->trigrams + index->hdr->ntrigrams ? next->off : index->hdr->postings_len;
+    it->p = index->postings + tg->off;
+    it->end = index->postings + end;
+    it->left = tg->count;
+    it->id = 0;
+    it->started = false;
+}
+
+static bool posting_next(struct posting_iter *it, uint32_t *id) {
+    if (it->left == 0) {
+        return false;
+    }
+    uint64_t gap = 0;
+    for (int shift = 0; ; shift += 7) {
+        if (it->p == it->end || shift > 28) {
+            it->left = 0;
+            return false;
+        }
+        uint8_t b = *it->p++;
+        gap |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            break;
+        }
+    }
+    it->id = it->started ? it->id + gap : gap;
+    it->started = true;
+    it->left--;
+    *id = it->id;
+    return true;
+}
+
+static const struct index_trigram *find_trigram(const struct finder_index *index, uint32_t t) {
+    size_t lo = 0, hi = index->hdr->ntrigrams;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        uint32_t v = index->trigrams[mid].trigram;
+        if (v == t) {
+            return &index->trigrams[mid];
+        }
+        if (v < t) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+// ------------------------------------------------
+// candidates_of: mark in @out the old files holding every trigram of one
+// string (the intersection of its posting lists)
+// ------------------------------------------------
+static void candidates_of(const struct finder_index *index, const char *s, size_t len,
+                          uint8_t *out, uint8_t *tmp) {
+    uint32_t n = index->nfiles;
+    memset(tmp, 1, n);
+    for (size_t i = 0; i + 2 < len; i++) {
+        uint32_t t = (unsigned char) s[i] << 16 | (unsigned char) s[i + 1] << 8 | (unsigned char) s[i + 2];
+        const struct index_trigram *tg = find_trigram(index, t);
+        if (tg == NULL) {
+            return; // no indexed file has it
+        }
+        // Bump the ids in this list, keep those present in every list so far
+        struct posting_iter it;
+        uint32_t id;
+        posting_begin(index, tg, &it);
+        while (posting_next(&it, &id)) {
+            if (id < n && tmp[id] == 1) {
+                tmp[id] = 2;
+            }
+        }
+        for (uint32_t id = 0; id < n; id++) {
+            tmp[id] = tmp[id] == 2;
+        }
+    }
+    for (uint32_t id = 0; id < n; id++) {
+        out[id] |= tmp[id];
+    }
+}
+
+void finder_index_query(struct finder_index *index, const char *const strs[],
+                        const size_t lens[], int n) {
+    if (index->nfiles == 0) {
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (strs[i] == NULL || lens[i] < 3) {
+            return; // could match any file
+        }
+    }
+    uint8_t *out = calloc(index->nfiles, 1);
+    uint8_t *tmp = malloc(index->nfiles);
+    if (out == NULL || tmp == NULL) {
+        free(out);
+        free(tmp);
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        candidates_of(index, strs[i], lens[i], out, tmp);
+    }
+    free(tmp);
+    index->candidates = out;
+}
+
+enum index_action finder_index_lookup(struct finder_index *index, const char *relpath,
+                                      const struct stat *st, int32_t *id) {
+    *id = -1;
+    if (index->nfiles == 0) {
+        return INDEX_LEARN;
+    }
+    size_t len = strlen(relpath);
+    uint32_t mask = index->hdr->hash_cap - 1;
+    for (uint32_t slot = path_hash(relpath, len) & mask; ; slot = (slot + 1) & mask) {
+        uint32_t v = index->hash[slot];
+        if (v == 0) {
+            return INDEX_LEARN;
+        }
+        if (v > index->nfiles) {
+            return INDEX_LEARN; // damaged
+        }
+        const struct index_file *f = &index->files[v - 1];
+        if (f->path_len == len && f->path_off + len <= index->map_size - index->hdr->paths_off &&
+            memcmp(index->paths + f->path_off, relpath, len) == 0) {
+            struct index_file now;
+            fill_meta(&now, st);
+            if (f->ino != now.ino || f->dev != now.dev || f->size != now.size ||
+                f->mtime_ns != now.mtime_ns || f->ctime_ns != now.ctime_ns ||
+                (f->flags & (INDEX_RACY | INDEX_UNREADABLE))) {
+                return INDEX_LEARN;
+            }
+            *id = v - 1;
+            if (f->flags & INDEX_TOO_MANY) {
+                return INDEX_SCAN;
+            }
+            if (index->candidates && !index->candidates[v - 1]) {
+                return INDEX_SKIP;
+            }
+            return INDEX_SCAN;
+        }
+    }
+}
+
+void finder_index_trigrams(const char *data, size_t len, struct index_trigrams *out) {
+    out->list = NULL;
+    out->count = 0;
+    out->flags = 0;
+    if (trigram_bits == NULL) {
+        trigram_bits = calloc((1 << 24) / 64, sizeof(uint64_t));
+        if (trigram_bits == NULL) {
+            out->flags = INDEX_TOO_MANY;
+            return;
+        }
+    }
+    uint32_t cap = 0;
+    const unsigned char *p = (const unsigned char *) data;
+    for (size_t i = 0; i + 2 < len; i++) {
+        uint32_t t = p[i] << 16 | p[i + 1] << 8 | p[i + 2];
+        uint64_t bit = 1ULL << (t & 63);
+        if (trigram_bits[t >> 6] & bit) {
+            continue;
+        }
+        if (out->count == INDEX_MAX_TRIGRAMS) {
+            out->flags = INDEX_TOO_MANY;
+            break;
+        }
+        if (out->count == cap) {
+            cap = cap ? cap * 2 : 256;
+            if (cap > INDEX_MAX_TRIGRAMS) {
+                cap = INDEX_MAX_TRIGRAMS;
+            }
+            uint32_t *list = realloc(out->list, cap * sizeof(uint32_t));
+            if (list == NULL) {
+                out->flags = INDEX_TOO_MANY;
+                break;
+            }
+            out->list = list;
+        }
+        trigram_bits[t >> 6] |= bit;
+        out->list[out->count++] = t;
+    }
+    // Leave the bitmap clear for the next file
+    for (uint32_t i = 0; i < out->count; i++) {
+        trigram_bits[out->list[i] >> 6] = 0;
+    }
+    if (out->flags) {
+        free(out->list);
+        out->list = NULL;
+        out->count = 0;
+    }
+}
+
+static void add_entry(struct finder_index *index, struct index_entry *entry) {
+    pthread_mutex_lock(&index->lock);
+    if (index->nentries == index->cap) {
+        size_t cap = index->cap ? index->cap * 2 : 1024;
+        struct index_entry *entries = realloc(index->entries, cap * sizeof(*entries));
+        if (entries == NULL) {
+            // Without room the index cannot be complete: do not write it
+            index->dirty = false;
+            index->kept = SIZE_MAX;
+            pthread_mutex_unlock(&index->lock);
+            free(entry->path);
+            free(entry->tri);
+            return;
+        }
+        index->entries = entries;
+        index->cap = cap;
+    }
+    if (index->kept != SIZE_MAX) {
+        index->entries[index->nentries++] = *entry;
+        if (entry->old_id >= 0) {
+            index->kept++;
+        } else {
+            index->dirty = true;
+        }
+    } else {
+        free(entry->path);
+        free(entry->tri);
+    }
+    pthread_mutex_unlock(&index->lock);
+}
+
+void finder_index_keep(struct finder_index *index, const char *relpath,
+                       const struct stat *st, int32_t id) {
+    struct index_entry entry = { .path = strdup(relpath), .old_id = id };
+    if (entry.path == NULL) {
+        return;
+    }
+    fill_meta(&entry.meta, st);
+    entry.meta.flags = index->files[id].flags;
+    add_entry(index, &entry);
+}
+
+void finder_index_learn(struct finder_index *index, const char *relpath,
+                        const struct stat *st, struct index_trigrams *learned) {
+    struct index_entry entry = { .path = strdup(relpath), .old_id = -1 };
+    if (entry.path == NULL) {
+        free(learned->list);
+        return;
+    }
+    fill_meta(&entry.meta, st);
+    entry.meta.flags = learned->flags;
+    // A change within the mtime granularity of this run would go unnoticed
+    if (entry.meta.mtime_ns + RACY_NS >= index->start_ns ||
+        entry.meta.ctime_ns + RACY_NS >= index->start_ns) {
+        entry.meta.flags |= INDEX_RACY;
+    }
+    if (entry.meta.flags == 0) {
+        entry.tri = learned->list;
+        entry.ntri = learned->count;
+    } else {
+        free(learned->list);
+    }
+    learned->list = NULL;
+    add_entry(index, &entry);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static bool write_all(FILE *out, const void *data, size_t len) {
+    return len == 0 || fwrite(data, 1, len, out) == len;
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    return strcmp(((const struct index_entry *) a)->path, ((const struct index_entry *) b)->path);
+}
+
+// ------------------------------------------------
+// write_posting: append @id to the run being written, after @prev
+// (-1 at the start of the run), counting bytes into @len
+// ------------------------------------------------
+static bool write_posting(FILE *out, int64_t *prev, uint32_t id, uint64_t *len) {
+    uint32_t gap = *prev < 0 ? id : id - (uint32_t) *prev;
+    *prev = id;
+    do {
+        uint8_t b = gap & 0x7f;
+        gap >>= 7;
+        if (gap) {
+            b |= 0x80;
+        }
+        if (putc(b, out) == EOF) {
+            return false;
+        }
+        (*len)++;
+    } while (gap);
+    return true;
+}
+
+static bool write_pad(FILE *out, uint64_t *off) {
+    static const char zero[8];
+    size_t pad = (8 - *off % 8) % 8;
+    *off += pad;
+    return write_all(out, zero, pad);
+}
+
+// ------------------------------------------------
+// index_write: write the entries of this run as a new index into @out
+// note: postings of unchanged files are carried over from the old index
+//       with their ids renumbered, merged by trigram with the pairs of the
+//       files learned in this run; both sides sort by path, so the old
+//       runs stay ascending once renumbered
+// ------------------------------------------------
+static bool index_write(struct finder_index *index, FILE *out) {
+    uint32_t n = index->nentries;
+    qsort(index->entries, n, sizeof(*index->entries), cmp_entry);
+    int32_t *remap = malloc((index->nfiles + 1) * sizeof(int32_t));
+    size_t npairs = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        npairs += index->entries[i].ntri;
+    }
+    uint64_t *pairs = malloc((npairs + 1) * sizeof(uint64_t));
+    uint32_t cap = 2;
+    while (cap <= n * 2) {
+        cap *= 2;
+    }
+    uint32_t *hash = calloc(cap, sizeof(uint32_t));
+    struct index_file *files = malloc((n + 1) * sizeof(*files));
+    size_t trigrams_cap = 1024, ntrigrams = 0;
+    struct index_trigram *trigrams = malloc(trigrams_cap * sizeof(*trigrams));
+    bool ok = remap && pairs && hash && files && trigrams;
+
+    uint64_t paths_len = 0;
+    for (uint32_t i = 0; ok && i < index->nfiles; i++) {
+        remap[i] = -1;
+    }
+    for (uint32_t i = 0, k = 0; ok && i < n; i++) {
+        struct index_entry *e = &index->entries[i];
+        files[i] = e->meta;
+        files[i].path_len = strlen(e->path);
+        files[i].path_off = paths_len;
+        paths_len += files[i].path_len;
+        if (e->old_id >= 0) {
+            remap[e->old_id] = i;
+        }
+        for (uint32_t j = 0; j < e->ntri; j++) {
+            pairs[k++] = (uint64_t) e->tri[j] << 32 | i;
+        }
+        uint32_t slot = path_hash(e->path, files[i].path_len) & (cap - 1);
+        while (hash[slot]) {
+            slot = (slot + 1) & (cap - 1);
+        }
+        hash[slot] = i + 1;
+    }
+    if (ok) {
+        qsort(pairs, npairs, sizeof(uint64_t), cmp_u64);
+    }
+
+    size_t root_len = strlen(index->root);
+    struct index_header hdr = { .magic = INDEX_MAGIC, .nfiles = n, .hash_cap = cap,
+                                .root_len = root_len };
+    uint64_t off = sizeof(hdr);
+    hdr.files_off = off;
+    off += (uint64_t) n * sizeof(*files);
+    hdr.hash_off = off;
+    off += (uint64_t) cap * sizeof(uint32_t);
+    hdr.root_off = off;
+    hdr.paths_off = off + root_len;
+    ok = ok && write_all(out, &hdr, sizeof(hdr)) &&
+        write_all(out, files, (size_t) n * sizeof(*files)) &&
+        write_all(out, hash, (size_t) cap * sizeof(uint32_t)) &&
+        write_all(out, index->root, root_len);
+    for (uint32_t i = 0; ok && i < n; i++) {
+        ok = write_all(out, index->entries[i].path, files[i].path_len);
+    }
+    off += root_len + paths_len;
+    ok = ok && write_pad(out, &off);
+
+    // Postings, trigram by trigram in order
+    hdr.postings_off = off;
+    uint64_t written = 0;
+    size_t oi = 0, pi = 0;
+    uint32_t nold = index->nfiles ? index->hdr->ntrigrams : 0;
+    while (ok && (oi < nold || pi < npairs)) {
+        uint32_t t;
+        if (pi == npairs || (oi < nold && index->trigrams[oi].trigram <= pairs[pi] >> 32)) {
+            t = index->trigrams[oi].trigram;
+        } else {
+            t = pairs[pi] >> 32;
+        }
+        uint64_t start = written;
+        uint32_t count = 0;
+        int64_t prev = -1;
+        struct posting_iter it = { .left = 0 };
+        if (oi < nold && index->trigrams[oi].trigram == t) {
+            posting_begin(index, &index->trigrams[oi++], &it);
+        }
+        // Merge the renumbered old run with the new files, both ascending
+        uint32_t old_id;
+        int64_t old_next = -1;
+        do {
+            while (old_next < 0 && posting_next(&it, &old_id)) {
+                if (old_id < index->nfiles && remap[old_id] >= 0) {
+                    old_next = remap[old_id];
+                }
+            }
+            bool have_new = pi < npairs && pairs[pi] >> 32 == t;
+            if (old_next < 0 && !have_new) {
+                break;
+            }
+            uint32_t id;
+            if (have_new && (old_next < 0 || (uint32_t) pairs[pi] < old_next)) {
+                id = (uint32_t) pairs[pi++];
+            } else {
+                id = old_next;
+                old_next = -1;
+            }
+            ok = write_posting(out, &prev, id, &written);
+            count++;
+        } while (ok);
+        if (count == 0) {
+            continue; // only deleted or changed files had it
+        }
+        if (ntrigrams == trigrams_cap) {
+            trigrams_cap *= 2;
+            struct index_trigram *grown = realloc(trigrams, trigrams_cap * sizeof(*trigrams));
+            if (grown == NULL) {
+                ok = false;
+                break;
+            }
+            trigrams = grown;
+        }
+        trigrams[ntrigrams++] = (struct index_trigram) {
+            .trigram = t, .count = count, .off = start };
+    }
+    hdr.postings_len = written;
+    off += written;
+    ok = ok && write_pad(out, &off);
+
+    hdr.trigrams_off = off;
+    hdr.ntrigrams = ntrigrams;
+    ok = ok && write_all(out, trigrams, ntrigrams * sizeof(*trigrams));
+    off += ntrigrams * sizeof(*trigrams);
+    hdr.total_size = off;
+    ok = ok && fflush(out) == 0 && fseek(out, 0, SEEK_SET) == 0 &&
+        write_all(out, &hdr, sizeof(hdr)) && fflush(out) == 0;
+
+    free(remap);
+    free(pairs);
+    free(hash);
+    free(files);
+    free(trigrams);
+    return ok;
+}
+
+bool finder_index_commit(struct finder_index *index) {
+    bool ok = true;
+    if (index->kept != SIZE_MAX && (index->dirty || index->kept != index->nfiles)) {
+        // Written aside and renamed over, so readers never see half an index
+        size_t len = strlen(index->path) + 32;
+        char *tmp = malloc(len);
+        FILE *out = NULL;
+        ok = false;
+        if (tmp) {
+            snprintf(tmp, len, "%s.%d", index->path, (int) getpid());
+            out = fopen(tmp, "w");
+        }
+        if (out) {
+            static char buf[1 << 16];
+            setvbuf(out, buf, _IOFBF, sizeof(buf));
+            ok = index_write(index, out);
+            ok = fclose(out) == 0 && ok;
+            ok = ok && rename(tmp, index->path) == 0;
+            if (!ok) {
+                unlink(tmp);
+            }
+        }
+        free(tmp);
+    }
+
+    for (size_t i = 0; i < index->nentries; i++) {
+        free(index->entries[i].path);
+        free(index->entries[i].tri);
+    }
+    free(index->entries);
+    free(index->candidates);
+    if (index->map) {
+        munmap(index->map, index->map_size);
+    }
+    pthread_mutex_destroy(&index->lock);
+    free(index->path);
+    free(index->root);
+    free(index);
+    return ok;
+}
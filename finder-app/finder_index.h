@@ -0,0 +1,88 @@
+#ifndef FINDER_INDEX_H
+#define FINDER_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+// Optional on-disk index for finder, so that repeated queries over a
+// mostly unchanged tree only read what they must.  For every regular file
+// it keeps a fingerprint (inode, device, size, mtime, ctime) and the set
+// of byte trigrams in the file, stored as one posting list of file ids per
+// trigram.  A file whose fingerprint still matches and that lacks one of a
+// query string's trigrams cannot contain the string and is not read; any
+// other file is scanned as usual, so results are those of a full scan.
+// The index is memory-mapped as is, nothing is parsed at startup.
+
+// Why a file has no trigram set, so that it is always scanned
+#define INDEX_RACY          0x1     // changed too recently to trust its mtime
+#define INDEX_UNREADABLE    0x2
+#define INDEX_TOO_MANY      0x4     // more distinct trigrams than worth keeping
+
+#define INDEX_MAX_TRIGRAMS  20000
+
+struct finder_index;
+
+// What to do with one file
+enum index_action {
+    INDEX_SKIP,     // unchanged and cannot match: counts nothing
+    INDEX_SCAN,     // unchanged, but must be scanned
+    INDEX_LEARN,    // new or changed: scan it and learn its trigrams
+};
+
+// Trigram set of a file just scanned
+struct index_trigrams {
+    uint32_t *list;
+    uint32_t count;
+    int flags;      // INDEX_* reason when there is no list
+};
+
+// ------------------------------------------------
+// finder_index_open: map the index at @path for the tree at @root; a
+// missing, damaged or foreign index starts out empty
+// return: NULL only if memory ran out
+// ------------------------------------------------
+struct finder_index *finder_index_open(const char *path, const char *root);
+
+// ------------------------------------------------
+// finder_index_query: set the strings of this run; strs[i] is NULL for a
+// pattern that is not a plain literal and so may match anywhere
+// ------------------------------------------------
+void finder_index_query(struct finder_index *index, const char *const strs[],
+                        const size_t lens[], int n);
+
+// ------------------------------------------------
+// finder_index_lookup: decide about the file at @relpath (relative to the
+// root) with status @st; @id receives the id to pass to finder_index_keep()
+// ------------------------------------------------
+enum index_action finder_index_lookup(struct finder_index *index, const char *relpath,
+                                      const struct stat *st, int32_t *id);
+
+// ------------------------------------------------
+// finder_index_trigrams: collect the distinct trigrams of [data, data + len)
+// into @out (uses a per-thread bitmap)
+// ------------------------------------------------
+void finder_index_trigrams(const char *data, size_t len, struct index_trigrams *out);
+
+// ------------------------------------------------
+// finder_index_keep: the file kept the trigrams it has in the index
+// ------------------------------------------------
+void finder_index_keep(struct finder_index *index, const char *relpath,
+                       const struct stat *st, int32_t id);
+
+// ------------------------------------------------
+// finder_index_learn: record the file with new trigrams, taking over
+// learned->list
+// ------------------------------------------------
+void finder_index_learn(struct finder_index *index, const char *relpath,
+                        const struct stat *st, struct index_trigrams *learned);
+
+// ------------------------------------------------
+// finder_index_commit: rewrite the index if this run found new, changed
+// or deleted files, then release @index
+// return: false if writing failed (the old index stays in place)
+// ------------------------------------------------
+bool finder_index_commit(struct finder_index *index);
+
+#endif // FINDER_INDEX_H
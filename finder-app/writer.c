@@ -1,29 +1,218 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <syslog.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include "bulkwrite.h"
+#include "aesdlog.h"
 
 // ------------------------------------------------
 // log_message: log messages via syslog
 // note: to check the syslog use: 
 // $ tail -f /var/log/syslog 
+// note: messages are queued and sent by the aesdlog flusher thread, so the
+//       bulk mode workers never wait on syslog (see startLog)
 // ------------------------------------------------
 void debugLog(int priority, const char *message) {
-    // Open syslog connection with process ID and console output
-    // Notes: - logging session identifier is writer
-    //       - flags: set LOG_PID (includes the process ID in log messages) 
-    //                and LOG_CONS (directs messages to standard error if syslog is unavailable)
-    openlog("writer", LOG_PID | LOG_CONS, LOG_USER);
-    syslog(priority, "%s", message);
-    closelog(); // Close the syslog connection
+    aesdlog(priority, "%s", message);
+}
+
+// ------------------------------------------------
+// startLog: start the asynchronous logger, identifier writer
+// note: console copies messages to standard error if syslog is unavailable
+//       (like LOG_CONS), the queue is flushed at exit
+// ------------------------------------------------
+static void startLog(void) {
+    struct aesdlog_options opts = { .console = true };
+    if (aesdlog_open("writer", &opts) == 0) {
+        aesdlog_start();
+        atexit(aesdlog_close);
+    }
+}
+
+// ------------------------------------------------
+// report_failure: log one file the bulk mode could not write
+// ------------------------------------------------
+static void report_failure(const char *path, int err) {
+    char log_buffer[512];
+    snprintf(log_buffer, sizeof(log_buffer), "ERROR: Could not write '%s': %s", path, strerror(err));
+    debugLog(LOG_ERR, log_buffer);
+}
+
+// ------------------------------------------------
+// usage: bulk mode help, to stderr
+// ------------------------------------------------
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s <file> <string>\n"
+            "       %s [options] -n <count> -t <template> <string>\n"
+            "       %s [options] -m <manifest> [<string>]\n"
+            "  -n count     create count files from the template, %%d becomes 1..count\n"
+            "  -t template  path of each file, with one %%d\n"
+            "  -m manifest  one file per line: <path>[<TAB><string>], the string\n"
+            "               defaults to the one on the command line\n"
+            "  -r repeat    write the string repeat times into each file\n"
+            "  -j threads   worker threads (default: one per CPU)\n"
+            "  -D           O_DIRECT where the file system supports it\n"
+            "  -S           plain system calls instead of io_uring\n",
+            prog, prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+// ------------------------------------------------
+// read_manifest: split the manifest at @path into jobs, the content of a
+// line without a tab being @writestr
+// note: the jobs point into the manifest buffer, which is never freed
+// ------------------------------------------------
+static size_t read_manifest(const char *path, const char *writestr, struct bulk_job **jobs,
+                            char ***contents) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        debugLog(LOG_ERR, "ERROR: Could not open the manifest.");
+        exit(EXIT_FAILURE);
+    }
+    size_t njobs = 0, cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_cap, file)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        char *tab = strchr(line, '\t');
+        if (tab) {
+            *tab = '\0';
+        } else if (writestr == NULL) {
+            debugLog(LOG_ERR, "ERROR: the string for writing is not valid.");
+            exit(EXIT_FAILURE);
+        }
+        if (njobs == cap) {
+            cap = cap ? cap * 2 : 1024;
+            *jobs = realloc(*jobs, cap * sizeof(**jobs));
+            *contents = realloc(*contents, cap * sizeof(**contents));
+            if (*jobs == NULL || *contents == NULL) {
+                debugLog(LOG_ERR, "ERROR: Out of memory.");
+                exit(EXIT_FAILURE);
+            }
+        }
+        (*jobs)[njobs].path = strdup(line);
+        (*contents)[njobs] = tab ? strdup(tab + 1) : (char *) writestr;
+        if ((*jobs)[njobs].path == NULL || (*contents)[njobs] == NULL) {
+            debugLog(LOG_ERR, "ERROR: Out of memory.");
+            exit(EXIT_FAILURE);
+        }
+        njobs++;
+    }
+    free(line);
+    fclose(file);
+    return njobs;
+}
+
+// ------------------------------------------------
+// bulk_main: create many files in one run
+// note: unlike the single-file mode the files need not exist beforehand,
+//       they are created or truncated
+// ------------------------------------------------
+static int bulk_main(int argc, char *argv[]) {
+    struct bulk_options opts = { .use_uring = true };
+    long count = -1, repeat = 1;
+    const char *template = NULL, *manifest = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:t:m:r:j:DS")) != -1) {
+        switch (opt) {
+        case 'n': count = atol(optarg); break;
+        case 't': template = optarg; break;
+        case 'm': manifest = optarg; break;
+        case 'r': repeat = atol(optarg); break;
+        case 'j': opts.threads = atoi(optarg); break;
+        case 'D': opts.direct = true; break;
+        case 'S': opts.use_uring = false; break;
+        default: usage(argv[0]);
+        }
+    }
+    const char *writestr = optind < argc ? argv[optind] : NULL;
+    if (optind + 1 < argc || repeat < 1 || opts.threads < 0 ||
+        (manifest == NULL) == (template == NULL) || (template && count < 0)) {
+        usage(argv[0]);
+    }
+    if (template && (writestr == NULL || strlen(writestr) == 0)) {
+        debugLog(LOG_ERR, "ERROR: the string for writing is not valid.");
+        exit(EXIT_FAILURE);
+    }
+
+    struct bulk_job *jobs = NULL;
+    char **contents = NULL;
+    size_t njobs;
+    if (manifest) {
+        njobs = read_manifest(manifest, writestr, &jobs, &contents);
+    } else {
+        // Expand the template: %d is the file number, counted from 1
+        const char *mark = strstr(template, "%d");
+        if (mark == NULL || strstr(mark + 2, "%d")) {
+            debugLog(LOG_ERR, "ERROR: the template needs exactly one %d.");
+            exit(EXIT_FAILURE);
+        }
+        njobs = count;
+        jobs = calloc(njobs ? njobs : 1, sizeof(*jobs));
+        contents = calloc(njobs ? njobs : 1, sizeof(*contents));
+        if (jobs == NULL || contents == NULL) {
+            debugLog(LOG_ERR, "ERROR: Out of memory.");
+            exit(EXIT_FAILURE);
+        }
+        int prefix = mark - template;
+        for (size_t i = 0; i < njobs; i++) {
+            char *path;
+            if (asprintf(&path, "%.*s%zu%s", prefix, template, i + 1, mark + 2) < 0) {
+                debugLog(LOG_ERR, "ERROR: Out of memory.");
+                exit(EXIT_FAILURE);
+            }
+            jobs[i].path = path;
+            contents[i] = (char *) writestr;
+        }
+    }
+
+    // The repeated content is one iovec per copy, written by one pwritev
+    struct iovec *iov = calloc(njobs * repeat + 1, sizeof(*iov));
+    if (iov == NULL) {
+        debugLog(LOG_ERR, "ERROR: Out of memory.");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < njobs; i++) {
+        size_t len = strlen(contents[i]);
+        jobs[i].iov = &iov[i * repeat];
+        jobs[i].iovcnt = len ? repeat : 0;
+        for (long r = 0; r < repeat; r++) {
+            iov[i * repeat + r] = (struct iovec) { contents[i], len };
+        }
+    }
+
+    size_t failed = bulk_write(jobs, njobs, &opts, report_failure);
+
+    char log_buffer[256];
+    snprintf(log_buffer, sizeof(log_buffer), "Wrote %zu of %zu files", njobs - failed, njobs);
+    debugLog(failed ? LOG_ERR : LOG_DEBUG, log_buffer);
+    if (failed) {
+        exit(EXIT_FAILURE);
+    }
+    printf("The writing process passed correctly.\n");
+    return EXIT_SUCCESS;
 }
 
 // ------------------------------------------------
 // main: 
 // ------------------------------------------------
 int main(int argc, char *argv[]) {
+    startLog();
+
+    // Options select the bulk mode, two plain arguments write one file
+    if (argc > 1 && argv[1][0] == '-') {
+        return bulk_main(argc, argv);
+    }
+
     // Check for correct number of arguments (expecting 3)
     if (argc != 3) {
         debugLog(LOG_ERR,"ERROR: please include the required arguments next time!\n");
@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "admission.h"
+#include "bufpool.h"
+#include "protocol.h"
+#include "aesdlog.h"
+
+// Open connections per client IP slot, see ADMIT_IP_SLOTS
+static int ip_conns[ADMIT_IP_SLOTS];
+
+static unsigned ip_slot(uint32_t ip) {
+    return (ip * 2654435761u) >> 16;
+}
+
+void codel_init(struct codel *codel, int target_ms) {
+    memset(codel, 0, sizeof(*codel));
+    codel->target_ns = (uint64_t)target_ms * 1000000;
+    codel->min_delay = UINT64_MAX;
+}
+
+/**
+ * Close the interval if @param now is past it: a queue whose delay never
+ * fell below target in it is a standing one
+ */
+static void codel_roll(struct codel *codel, uint64_t now) {
+    if (now < codel->interval_end) {
+        return;
+    }
+    int was_shedding = codel->shedding;
+    codel->shedding = codel->samples > 0 && codel->min_delay > codel->target_ns;
+    if (codel->shedding && !was_shedding && now - codel->last_log >= 1000000000ull) {
+        aesdlog(LOG_WARNING, "Queue delay %llu ms above target, shedding new connections",
+                (unsigned long long)(codel->min_delay / 1000000));
+        codel->last_log = now;
+    }
+    codel->min_delay = UINT64_MAX;
+    codel->samples = 0;
+    codel->interval_end = now + CODEL_INTERVAL_MS * 1000000ull;
+}
+
+void codel_sample(struct codel *codel, uint64_t now, uint64_t delay) {
+    if (!codel->target_ns) {
+        return;
+    }
+    codel_roll(codel, now);
+    if (delay < codel->min_delay) {
+        codel->min_delay = delay;
+    }
+    codel->samples++;
+}
+
+const char *admission_accept(const struct loop_options *opts, struct codel *codel,
+                             struct metrics_shard *metrics, uint32_t ip, int *counted) {
+    *counted = 0;
+    if (codel->target_ns) {
+        codel_roll(codel, metrics_now());
+        if (codel->shedding) {
+            metrics_add(metrics, MC_SHED_BUSY, 1);
+            return PROTO_ERR_BUSY;
+        }
+    }
+    if (admission_over_budget(opts)) {
+        metrics_add(metrics, MC_REJECT_MEMORY, 1);
+        return PROTO_ERR_MEMORY;
+    }
+    if (opts->max_per_ip > 0 && ip) {
+        int *slot = &ip_conns[ip_slot(ip)];
+        if (__atomic_add_fetch(slot, 1, __ATOMIC_RELAXED) > opts->max_per_ip) {
+            __atomic_sub_fetch(slot, 1, __ATOMIC_RELAXED);
+            metrics_add(metrics, MC_REJECT_PER_IP, 1);
+            return PROTO_ERR_PER_IP;
+        }
+        *counted = 1;
+    }
+    return NULL;
+}
+
+void admission_release(uint32_t ip) {
+    __atomic_sub_fetch(&ip_conns[ip_slot(ip)], 1, __ATOMIC_RELAXED);
+}
+
+int admission_over_budget(const struct loop_options *opts) {
+    return opts->mem_budget > 0 && bufpool_in_use() >= opts->mem_budget;
+}
+
+void admission_refuse(int fd, const char *line) {
+    ssize_t rc = send(fd, line, strlen(line), MSG_DONTWAIT | MSG_NOSIGNAL);
+    (void)rc;
+    shutdown(fd, SHUT_WR);
+    char sink[4096];
+    for (int i = 0; i < 16 && recv(fd, sink, sizeof(sink), MSG_DONTWAIT) > 0; i++) {
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+
+#include "eventloop.h"
+#include "metrics.h"
+
+/**
+ * Admission control, shared by both backends.  Under overload, work is
+ * refused as early as possible instead of queueing until every client
+ * times out: the connection gets one of the PROTO_ERR_* lines (see
+ * protocol.h) and is closed.  Limits come from struct loop_options:
+ *   - new connections while the worker's queue delay is too high,
+ *   - new connections beyond the per-client-IP limit,
+ *   - new connections, and receives needing more buffer, while all
+ *     connections together buffer more than the memory budget,
+ *   - connections sending a packet longer than the maximum packet size.
+ * Queue delay is measured CoDel-style: a worker sheds while the delay
+ * from receiving packets to having them committed did not drop below the
+ * target once in the last CODEL_INTERVAL_MS.  A short burst queues as
+ * before, only a standing queue is shed.
+ */
+
+// How long the queue delay has to stay above target before shedding
+#define CODEL_INTERVAL_MS   100
+// Slots of the per-IP connection counts; IPs hashing alike share a count
+#define ADMIT_IP_SLOTS      65536
+
+// Per-worker queue delay state, not shared
+struct codel {
+    uint64_t target_ns;     // 0: never shed
+    uint64_t interval_end;
+    uint64_t min_delay;     // lowest delay seen this interval
+    int samples;            // delays seen this interval
+    int shedding;           // the last interval had a standing queue
+    uint64_t last_log;
+};
+
+void codel_init(struct codel *codel, int target_ms);
+
+/**
+ * Record that packets waited @param delay ns to be committed, at @param now
+ */
+void codel_sample(struct codel *codel, uint64_t now, uint64_t delay);
+
+/**
+ * Decide about a connection just accepted from @param ip (network order,
+ * 0 if unknown) by the worker with @param codel, counting refusals in
+ * @param metrics
+ * @return NULL to serve it, with *@param counted set if it now counts
+ * against the IP's limit (undo with admission_release()), or the error
+ * line to refuse it with.
+ */
+const char *admission_accept(const struct loop_options *opts, struct codel *codel,
+                             struct metrics_shard *metrics, uint32_t ip, int *counted);
+
+/**
+ * A connection counted by admission_accept() closed
+ */
+void admission_release(uint32_t ip);
+
+/**
+ * @return 1 if a receive needing another buffer segment must be refused,
+ * because all connections together hold @param opts->mem_budget
+ */
+int admission_over_budget(const struct loop_options *opts);
+
+/**
+ * Send @param line on @param fd without blocking and shut the sending
+ * side down, taking in what the client already sent so that the close
+ * does not reset the connection before the line arrives.  The caller
+ * closes @param fd.
+ */
+void admission_refuse(int fd, const char *line);
+
+#endif // ADMISSION_H
@@ -12,7 +12,46 @@
 
 DAEMON_PATH="./aesdsocket"
 DAEMON_NAME="aesdsocket"
-DAEMON_OPTS="-d"
+# Worker threads, each with its own SO_REUSEPORT listener (e.g. $(nproc))
+DAEMON_WORKERS="${AESDSOCKET_WORKERS:-1}"
+# Data file durability: none, batch (fdatasync per group commit) or periodic
+DAEMON_SYNC="${AESDSOCKET_SYNC:-none}"
+# No -d: start-stop-daemon --background detaches it already, and the
+# pidfile it makes must name the server, not a parent that forks and exits
+DAEMON_OPTS="-w $DAEMON_WORKERS -s $DAEMON_SYNC"
+# Loopback port for Prometheus-style metrics, unset to disable
+if [ -n "$AESDSOCKET_METRICS_PORT" ]; then
+    DAEMON_OPTS="$DAEMON_OPTS -m $AESDSOCKET_METRICS_PORT"
+fi
+# Set to 1 to keep the data log across restarts instead of deleting it on exit
+if [ "$AESDSOCKET_KEEP_HISTORY" = "1" ]; then
+    DAEMON_OPTS="$DAEMON_OPTS -k"
+fi
+# Set to 1 to serve clients from io_uring (falls back to epoll if unsupported)
+if [ "$AESDSOCKET_IO_URING" = "1" ]; then
+    DAEMON_OPTS="$DAEMON_OPTS -u"
+fi
+# Overload protection, each unset to leave it off: longest packet in bytes,
+# connections per client IP, receive buffer budget in bytes, and the queue
+# delay in milliseconds above which new connections are shed
+if [ -n "$AESDSOCKET_MAX_PACKET" ]; then
+    DAEMON_OPTS="$DAEMON_OPTS -P $AESDSOCKET_MAX_PACKET"
+fi
+if [ -n "$AESDSOCKET_MAX_PER_IP" ]; then
+    DAEMON_OPTS="$DAEMON_OPTS -I $AESDSOCKET_MAX_PER_IP"
+fi
+if [ -n "$AESDSOCKET_MEM_BUDGET" ]; then
+    DAEMON_OPTS="$DAEMON_OPTS -M $AESDSOCKET_MEM_BUDGET"
+fi
+if [ -n "$AESDSOCKET_DELAY_TARGET_MS" ]; then
+    DAEMON_OPTS="$DAEMON_OPTS -D $AESDSOCKET_DELAY_TARGET_MS"
+fi
+# Unix socket through which "reload" hands the running daemon's listeners
+# and data log to a new one, so that no connection is refused (e.g.
+# /var/run/aesdsocket.handoff), unset to leave hot restart off
+if [ -n "$AESDSOCKET_HANDOFF" ]; then
+    DAEMON_OPTS="$DAEMON_OPTS -H $AESDSOCKET_HANDOFF"
+fi
 PIDFILE="/var/run/$DAEMON_NAME.pid"
 
 start() {
@@ -28,6 +67,21 @@ stop() {
     echo "$DAEMON_NAME stopped."
 }
 
+reload() {
+    if [ -z "$AESDSOCKET_HANDOFF" ]; then
+        echo "Hot restart needs AESDSOCKET_HANDOFF, use restart instead."
+        exit 1
+    fi
+    echo "Hot restarting $DAEMON_NAME..."
+    # The new daemon takes over from the running one, which drains its
+    # clients and exits by itself; a fresh pidfile keeps start-stop-daemon
+    # from finding the old one
+    start-stop-daemon --start --background --make-pidfile --pidfile $PIDFILE.new \
+        --exec $DAEMON_PATH -- $DAEMON_OPTS
+    mv $PIDFILE.new $PIDFILE
+    echo "$DAEMON_NAME restarted."
+}
+
 status() {
     if [ -f $PIDFILE ]; then
         PID=$(cat $PIDFILE)
@@ -56,11 +110,14 @@ case "$1" in
         sleep 1  # Ensure the process has time to terminate before restarting
         start
         ;;
+    reload)
+        reload
+        ;;
     status)
         status
         ;;
     *)
-        echo "Usage: $0 {start|stop|restart|status}"
+        echo "Usage: $0 {start|stop|restart|reload|status}"
         exit 2
         ;;
 esac
\ No newline at end of file
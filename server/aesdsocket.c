@@ -7,24 +7,58 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <syslog.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+
+#include "eventloop.h"
+#include "datalog.h"
+#include "metrics.h"
+#include "handoff.h"
+#include "aesdlog.h"
+#ifdef HAVE_IO_URING
+#include "uringloop.h"
+#endif
 
 #define PORT        9000
-#define BACKLOG     10
 #define FILE_PATH   "/var/tmp/aesdsocketdata"
-#define BUFFER_SIZE 1024
+#define MAX_WORKERS 64
 
 // Global variables for cleanup
-int sockfd = -1, clientfd = -1, filefd = -1;
+int sockfds[MAX_WORKERS];
+int num_workers = 1;
+int wake_fd = -1;
 volatile sig_atomic_t exit_flag = 0;
+// Set by signal_handler(), which must not log itself: aesdlog() is not
+// async-signal-safe, so main() logs it once the workers returned
+volatile sig_atomic_t caught_signal = 0;
+volatile sig_atomic_t drain_flag = 0;
+int use_uring = 0;
+int keep_history = 0;
+// Hot restart: the successor took the listeners and the data log over
+int handed_off = 0;
+// Pending connections per listener; the kernel caps it at net.core.somaxconn
+int backlog = SOMAXCONN;
+struct loop_options loop_opts = {
+    .send_timeout_ms = DEFAULT_SEND_TIMEOUT_MS,
+    .client_sndbuf = DEFAULT_CLIENT_SNDBUF,
+};
 
 /**
  * Signal handler for SIGINT and SIGTERM
  */
 void signal_handler(int signo) {
-    syslog(LOG_INFO, "Caught signal, exiting");
+    caught_signal = signo;
     exit_flag = 1;
+
+    // Wake every worker blocked in epoll_wait, not just this thread
+    if (wake_fd >= 0) {
+        uint64_t one = 1;
+        ssize_t rc = write(wake_fd, &one, sizeof(one));
+        (void)rc;
+    }
 }
 
 /**
@@ -74,49 +108,44 @@ void daemonize() {
  * Clean up resources and exit gracefully
  */
 void clean_exit() {
-    if (clientfd >= 0) close(clientfd);
-    if (sockfd >= 0) close(sockfd);
-    if (filefd >= 0) close(filefd);
-    unlink(FILE_PATH);
-    closelog();
+    for (int i = 0; i < num_workers; i++) {
+        if (sockfds[i] >= 0) close(sockfds[i]);
+    }
+    if (wake_fd >= 0) close(wake_fd);
+    metrics_stop();
+    handoff_close(handed_off);
+    datalog_close(!keep_history && !handed_off);
+    aesdlog_close();
     exit(0);
 }
 
 /**
- * Main server function
+ * Create a socket bound to PORT and listening.  With @param reuseport set,
+ * several sockets can share the port and the kernel spreads incoming
+ * connections across them.
+ * @return the socket, or -1 on failure (already logged).
  */
-int main(int argc, char *argv[]) {
-    int daemon_mode = 0;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-
-    // Parse command-line arguments
-    if (argc == 2 && strcmp(argv[1], "-d") == 0) {
-        daemon_mode = 1;
-    }
-
-    // Open syslog for logging
-    openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
-
-    // Set up signal handling with sigaction
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = signal_handler;
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+int open_listener(int reuseport) {
+    struct sockaddr_in server_addr;
 
     // Create the server socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        syslog(LOG_ERR, "Socket creation failed: %s", strerror(errno));
-        clean_exit();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        aesdlog(LOG_ERR, "Socket creation failed: %s", strerror(errno));
+        return -1;
     }
 
     // Enable socket options for address reuse
     int optval = 1;
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
-        syslog(LOG_ERR, "Setsockopt failed: %s", strerror(errno));
-        clean_exit();
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+        aesdlog(LOG_ERR, "Setsockopt failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        aesdlog(LOG_ERR, "Setsockopt SO_REUSEPORT failed: %s", strerror(errno));
+        close(fd);
+        return -1;
     }
 
     // Configure server address structure
@@ -126,109 +155,355 @@ int main(int argc, char *argv[]) {
     server_addr.sin_port = htons(PORT);
 
     // Bind the socket
-    if (bind(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        syslog(LOG_ERR, "Bind failed: %s", strerror(errno));
-        clean_exit();
+    if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        aesdlog(LOG_ERR, "Bind failed: %s", strerror(errno));
+        close(fd);
+        return -1;
     }
 
     // Listen for incoming connections
-    if (listen(sockfd, BACKLOG) < 0) {
-        syslog(LOG_ERR, "Listen failed: %s", strerror(errno));
-        clean_exit();
+    if (listen(fd, backlog) < 0) {
+        aesdlog(LOG_ERR, "Listen failed: %s", strerror(errno));
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    // Daemonize if the "-d" flag is set
-    if (daemon_mode) {
-        daemonize();
+/**
+ * Worker thread entry point, @param arg is the worker's listening socket
+ */
+void *worker_thread(void *arg) {
+    int listenfd = (int)(intptr_t)arg;
+#ifdef HAVE_IO_URING
+    if (use_uring) {
+        if (uring_loop_run(listenfd, wake_fd, &loop_opts) == 0) {
+            return NULL;
+        }
+        aesdlog(LOG_WARNING, "io_uring loop failed to start, falling back to epoll");
     }
+#endif
+    if (event_loop_run(listenfd, wake_fd, &loop_opts) < 0) {
+        aesdlog(LOG_ERR, "Event loop failed to start");
+    }
+    return NULL;
+}
 
-    // Main loop to handle client connections
-    while (!exit_flag) {
-        // Accept an incoming connection
-        clientfd = accept(sockfd, (struct sockaddr *)&client_addr, &addr_len);
-        if (clientfd < 0) {
-            if (errno == EINTR) break; // Exit on signal interruption
-            syslog(LOG_ERR, "Accept failed: %s", strerror(errno));
-            continue;
+/**
+ * Run the workers until they all returned, on a signal or after draining
+ * for a successor
+ */
+void serve() {
+    // Workers 1..N-1 get their own thread, worker 0 runs on the main thread
+    pthread_t workers[MAX_WORKERS];
+    int started = 1;
+    for (int i = 1; i < num_workers; i++, started++) {
+        if (pthread_create(&workers[i], NULL, worker_thread, (void *)(intptr_t)sockfds[i]) != 0) {
+            aesdlog(LOG_ERR, "Failed to create worker thread %d", i);
+            exit_flag = 1;
+            break;
         }
+    }
 
-        // Log client connection
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
-        syslog(LOG_INFO, "Accepted connection from %s", client_ip);
-
-        // Open the file for appending data
-        filefd = open(FILE_PATH, O_RDWR | O_CREAT | O_APPEND, 0644);
-        if (filefd < 0) {
-            syslog(LOG_ERR, "File open failed: %s", strerror(errno));
-            close(clientfd);
-            clientfd = -1;
-            continue;
+    // Serve all clients from the event loop until a signal arrives
+    if (!exit_flag) {
+        worker_thread((void *)(intptr_t)sockfds[0]);
+    }
+
+    // Make sure the other workers stop even if worker 0 failed early;
+    // draining ones return on their own
+    if (!drain_flag) {
+        exit_flag = 1;
+    }
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+        aesdlog(LOG_ERR, "eventfd write failed: %s", strerror(errno));
+    }
+    for (int i = 1; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+/**
+ * Print the command line of @param prog and exit with an error
+ */
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-w workers] [-s none|batch|periodic] [-g window_us] [-m metrics_port]\n"
+                    "       [-T send_timeout_ms] [-b client_sndbuf] [-u] [-S segment_bytes]\n"
+                    "       [-R retain_bytes] [-A retain_secs] [-k] [-L log_file] [-z] [-H handoff_socket]\n"
+                    "       [-q backlog] [-P max_packet] [-I max_per_ip] [-M mem_budget] [-D delay_target_ms]\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Parse the option argument @param arg, which must be a whole decimal
+ * number between @param min and @param max.  Otherwise print what
+ * @param what must be and the usage of @param prog, and exit.
+ * @return the number.
+ */
+long long option_number(const char *arg, long long min, long long max, const char *what, const char *prog) {
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || value < min || value > max) {
+        if (max == LLONG_MAX) {
+            fprintf(stderr, "%s must be a number of at least %lld\n", what, min);
+        } else {
+            fprintf(stderr, "%s must be a number between %lld and %lld\n", what, min, max);
         }
+        usage(prog);
+    }
+    return value;
+}
 
-        // Receive data from client
-        char temp_buffer[BUFFER_SIZE];
-        char *recv_buffer = NULL;
-        ssize_t bytes_received;
-        int total_received = 0;
-
-        do {
-            bytes_received = recv(clientfd, temp_buffer, sizeof(temp_buffer), 0);
-            if (bytes_received < 0) {
-                syslog(LOG_ERR, "Receive failed: %s", strerror(errno));
-                break;
-            } else if (bytes_received == 0) {
-                // Connection closed
-                break;
+/**
+ * Main server function
+ */
+int main(int argc, char *argv[]) {
+    int daemon_mode = 0;
+    struct datalog_options log_opts = {
+        .sync = DATALOG_SYNC_NONE,
+        .segment_bytes = DATALOG_SEGMENT_BYTES,
+    };
+    int metrics_port = 0;
+    struct aesdlog_options syslog_opts = { .console = 1 };
+    const char *handoff_path = NULL;
+    int opt;
+
+    // Parse command-line arguments: -d daemonize, -w N worker threads,
+    // -s durability of the data file, -g group-commit window in microseconds,
+    // -m loopback port for the metrics endpoint, -T reply send timeout in
+    // milliseconds, -b per-client socket send buffer in bytes, -u serve
+    // clients from io_uring instead of epoll, -S data log segment size in
+    // bytes, -R/-A retention in bytes/seconds, -k keep the log on exit,
+    // -L write diagnostics to a file instead of syslog, -z compress sealed
+    // segments of the data log, -H hot restart through this Unix socket,
+    // -q listen backlog, and the admission limits (see admission.h): -P
+    // longest packet in bytes, -I connections per client IP, -M memory
+    // budget in bytes, -D queue delay target in milliseconds
+    int segment_set = 0;
+    while ((opt = getopt(argc, argv, "dw:s:g:m:T:b:uS:R:A:kL:zH:q:P:I:M:D:")) != -1) {
+        switch (opt) {
+        case 'd':
+            daemon_mode = 1;
+            break;
+        case 'w':
+            num_workers = atoi(optarg);
+            if (num_workers < 1 || num_workers > MAX_WORKERS) {
+                fprintf(stderr, "Worker count must be between 1 and %d\n", MAX_WORKERS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's':
+            if (strcmp(optarg, "none") == 0) {
+                log_opts.sync = DATALOG_SYNC_NONE;
+            } else if (strcmp(optarg, "batch") == 0) {
+                log_opts.sync = DATALOG_SYNC_BATCH;
+            } else if (strcmp(optarg, "periodic") == 0) {
+                log_opts.sync = DATALOG_SYNC_PERIODIC;
             } else {
-                // Expand dynamic buffer
-                char *new_recv_buffer = realloc(recv_buffer, total_received + bytes_received);
-                if (!new_recv_buffer) {
-                    syslog(LOG_ERR, "Memory allocation failed");
-                    free(recv_buffer);
-                    recv_buffer = NULL;
-                    break;
-                }
-                recv_buffer = new_recv_buffer;
-
-                // Append received data
-                memcpy(recv_buffer + total_received, temp_buffer, bytes_received);
-                total_received += bytes_received;
-
-                // Stop on newline
-                if (memchr(temp_buffer, '\n', bytes_received)) {
-                    break;
-                }
+                fprintf(stderr, "Durability must be none, batch or periodic\n");
+                exit(EXIT_FAILURE);
             }
-        } while (1);
-
-        // Write received data to file
-        if (recv_buffer && total_received > 0) {
-            if (write(filefd, recv_buffer, total_received) != total_received) {
-                syslog(LOG_ERR, "Write to file failed: %s", strerror(errno));
+            break;
+        case 'g':
+            log_opts.window_us = atol(optarg);
+            if (log_opts.window_us < 0) {
+                fprintf(stderr, "Group-commit window must not be negative\n");
+                exit(EXIT_FAILURE);
             }
+            break;
+        case 'm':
+            metrics_port = atoi(optarg);
+            if (metrics_port < 1 || metrics_port > 65535) {
+                fprintf(stderr, "Metrics port must be between 1 and 65535\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            loop_opts.send_timeout_ms = option_number(optarg, 0, INT_MAX, "Send timeout", argv[0]);
+            break;
+        case 'b':
+            loop_opts.client_sndbuf = option_number(optarg, 0, INT_MAX, "Client send buffer", argv[0]);
+            break;
+        case 'u':
+            use_uring = 1;
+            break;
+        case 'S':
+            log_opts.segment_bytes = option_number(optarg, 0, LLONG_MAX, "Segment size", argv[0]);
+            segment_set = 1;
+            break;
+        case 'R':
+            log_opts.retain_bytes = option_number(optarg, 0, LLONG_MAX, "Retained bytes", argv[0]);
+            break;
+        case 'A':
+            log_opts.retain_secs = option_number(optarg, 0, LONG_MAX, "Retention window", argv[0]);
+            break;
+        case 'k':
+            keep_history = 1;
+            break;
+        case 'L':
+            syslog_opts.file = optarg;
+            break;
+        case 'z':
+            log_opts.compress = 1;
+            break;
+        case 'H':
+            handoff_path = optarg;
+            break;
+        case 'q':
+            backlog = option_number(optarg, 1, INT_MAX, "Listen backlog", argv[0]);
+            break;
+        case 'P':
+            loop_opts.max_packet = option_number(optarg, 0, LLONG_MAX, "Packet size limit", argv[0]);
+            break;
+        case 'I':
+            loop_opts.max_per_ip = option_number(optarg, 0, INT_MAX, "Per-IP connection limit", argv[0]);
+            break;
+        case 'M':
+            loop_opts.mem_budget = option_number(optarg, 0, LLONG_MAX, "Memory budget", argv[0]);
+            break;
+        case 'D':
+            loop_opts.codel_target_ms = option_number(optarg, 0, INT_MAX, "Queue delay target", argv[0]);
+            break;
+        default:
+            usage(argv[0]);
         }
+    }
+    // Only sealed segments are compressed, so seal them sooner
+    if (log_opts.compress && !segment_set) {
+        log_opts.segment_bytes = DATALOG_PACKED_SEGMENT_BYTES;
+    }
+    for (int i = 0; i < MAX_WORKERS; i++) {
+        sockfds[i] = -1;
+    }
 
-        // Send file content back to client
-        lseek(filefd, 0, SEEK_SET);
-        while ((bytes_received = read(filefd, temp_buffer, sizeof(temp_buffer))) > 0) {
-            if (send(clientfd, temp_buffer, bytes_received, 0) != bytes_received) {
-                syslog(LOG_ERR, "Send to client failed: %s", strerror(errno));
-                break;
-            }
+    // Diagnostics are queued from here on; the flusher thread that writes
+    // them starts after daemonize()
+    if (aesdlog_open("aesdsocket", &syslog_opts) < 0) {
+        perror("aesdlog_open");
+        exit(EXIT_FAILURE);
+    }
+
+    // Set up signal handling with sigaction
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = signal_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // A client that hangs up mid-reply must not kill the server
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+#ifdef HAVE_IO_URING
+    if (use_uring && !uring_loop_supported()) {
+        aesdlog(LOG_WARNING, "io_uring is not usable on this kernel, using epoll");
+        use_uring = 0;
+    }
+#else
+    if (use_uring) {
+        aesdlog(LOG_WARNING, "Built without io_uring support, using epoll");
+        use_uring = 0;
+    }
+#endif
+
+    wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        aesdlog(LOG_ERR, "eventfd failed: %s", strerror(errno));
+        clean_exit();
+    }
+
+    // Hot restart: take the listeners and the data log over from the server
+    // on the handoff socket, if one is running.  Blocks while it drains.
+    int taken_over = 0;
+    if (handoff_path) {
+        int n = 0;
+        taken_over = handoff_take_over(handoff_path, FILE_PATH, sockfds, MAX_WORKERS, &n);
+        if (taken_over < 0) {
+            // The old server keeps serving, leave everything to it
+            aesdlog_close();
+            exit(EXIT_FAILURE);
         }
+        if (taken_over && n != num_workers) {
+            aesdlog(LOG_NOTICE, "Keeping the %d workers of the previous server", n);
+        }
+        if (taken_over) {
+            num_workers = n;
+        }
+    }
+    // Listening again only resizes the backlog of a taken-over listener
+    for (int i = 0; i < num_workers && taken_over; i++) {
+        listen(sockfds[i], backlog);
+    }
 
-        // Clean up resources for this client
-        free(recv_buffer);
-        recv_buffer = NULL;
+    // One listener per worker; SO_REUSEPORT lets the kernel shard accepts
+    for (int i = 0; i < num_workers && !taken_over; i++) {
+        sockfds[i] = open_listener(num_workers > 1);
+        if (sockfds[i] < 0) {
+            clean_exit();
+        }
+    }
+    // Hot restart is optional: without its socket the server serves on,
+    // it just cannot hand over to a successor
+    if (handoff_path && handoff_listen(handoff_path) < 0) {
+        aesdlog(LOG_WARNING, "Hot restart unavailable, serving without it");
+        handoff_path = NULL;
+    }
 
-        close(clientfd);
-        clientfd = -1;
+    // Daemonize if the "-d" flag is set
+    if (daemon_mode) {
+        daemonize();
+    }
 
-        close(filefd);
-        filefd = -1;
+    // These start threads, so they come after daemonize(): threads do not
+    // survive its fork().  The data log stays open for the whole process.
+    aesdlog_start();
+    if (datalog_open(FILE_PATH, &log_opts) < 0) {
+        clean_exit();
+    }
+    if (metrics_port && metrics_start(metrics_port) < 0) {
+        clean_exit();
+    }
+    if (handoff_path && handoff_start(wake_fd) < 0) {
+        aesdlog(LOG_WARNING, "Hot restart unavailable, serving without it");
+        handoff_close(0);
+        handoff_path = NULL;
+    }
+
+    while (1) {
+        serve();
+        if (exit_flag || !drain_flag) {
+            break;
+        }
+
+        // Drained for a successor: hand it everything, the metrics port too
+        metrics_stop();
+        if (handoff_give(sockfds, num_workers) == 0) {
+            handed_off = 1;
+            break;
+        }
+
+        // The successor failed before taking over, so carry on serving
+        aesdlog(LOG_WARNING, "Handoff failed, serving on");
+        drain_flag = 0;
+        uint64_t count;
+        if (read(wake_fd, &count, sizeof(count)) < 0) {
+            aesdlog(LOG_ERR, "eventfd read failed: %s", strerror(errno));
+        }
+        if (datalog_open(FILE_PATH, &log_opts) < 0 ||
+            (metrics_port && metrics_start(metrics_port) < 0)) {
+            break;
+        }
+        if (handoff_listen(handoff_path) < 0 || handoff_start(wake_fd) < 0) {
+            aesdlog(LOG_WARNING, "Hot restart unavailable, serving without it");
+            handoff_close(0);
+        }
+    }
 
-        syslog(LOG_INFO, "Closed connection from %s", client_ip);
+    if (caught_signal) {
+        aesdlog(LOG_INFO, "Caught signal, exiting");
     }
 
     // Clean up and exit
@@ -0,0 +1,709 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/**
+ * Load generator and latency benchmark for aesdsocket.
+ * Each thread drives its share of the connections from its own epoll loop.
+ * In closed-loop mode every connection keeps -P packets in flight; in
+ * open-loop mode (-r) packets are issued on a fixed schedule and latency is
+ * measured from the scheduled time, so a stalled server is not hidden by
+ * the client backing off.
+ *
+ * Every packet starts with a unique tag.  The server answers a packet with
+ * the data file up to and including it, so a reply is complete exactly when
+ * a line starting with that tag comes back.
+ */
+
+#define DEFAULT_PORT    9000
+#define MAX_THREADS     256
+#define TAG_LEN         18          // "#%016lx "
+#define RECV_CHUNK      (64 * 1024)
+
+// Latency histogram: 2048 linear sub-buckets per power of two, ~0.1% error
+#define HIST_SUB_BITS   11
+#define HIST_SUB_COUNT  (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_MAX_SHIFT  40          // values up to ~2^50 ns
+#define HIST_SIZE       (HIST_SUB_COUNT + HIST_MAX_SHIFT * HIST_HALF_COUNT)
+
+enum size_dist {
+    SIZE_FIXED,
+    SIZE_UNIFORM,
+    SIZE_EXP,
+};
+
+struct bench_config {
+    const char *host;
+    int port;
+    int threads;
+    int connections;
+    int pipeline;
+    double duration_s;
+    double rate;               // packets/s over all threads, 0 for closed loop
+    enum size_dist dist;
+    size_t size_min, size_max; // SIZE_FIXED uses size_min, SIZE_EXP its mean
+    const char *hist_path;
+    const char *json_path;
+};
+
+struct histogram {
+    uint64_t counts[HIST_SIZE];
+    uint64_t total;
+    uint64_t min, max;
+    double sum, sum_sq;
+};
+
+// A packet sent and not yet answered
+struct inflight {
+    uint64_t tag;
+    uint64_t start_ns;
+};
+
+struct bench_conn {
+    int fd;
+    struct bench_thread *thread;
+
+    // Bytes of packets not accepted by the socket yet
+    char *out;
+    size_t out_len, out_cap;
+
+    // FIFO of unanswered packets, capacity config.pipeline
+    struct inflight *queue;
+    int q_head, q_len;
+
+    // Reply scanner: tag bytes matched at the current line start, -1 when
+    // the line cannot be the awaited one
+    int match_pos;
+    char want[TAG_LEN];
+};
+
+struct bench_thread {
+    int id;
+    pthread_t tid;
+    const struct bench_config *cfg;
+    struct bench_conn *conns;
+    int nconns;
+    uint64_t rng;
+    uint64_t next_tag;
+    struct histogram hist;
+    uint64_t requests, errors;
+    uint64_t bytes_out, bytes_in;
+    char *packet;              // scratch for building one packet
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t rng_next(uint64_t *state) {
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Histogram                                                                */
+/* ------------------------------------------------------------------------ */
+
+static int hist_index(uint64_t v) {
+    if (v < HIST_SUB_COUNT) {
+        return (int)v;
+    }
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - (HIST_SUB_BITS - 1);
+    if (shift > HIST_MAX_SHIFT) {
+        return HIST_SIZE - 1;
+    }
+    return HIST_SUB_COUNT + (shift - 1) * HIST_HALF_COUNT + (int)((v >> shift) - HIST_HALF_COUNT);
+}
+
+/**
+ * @return the highest value counted in bucket @param idx
+ */
+static uint64_t hist_value(int idx) {
+    if (idx < HIST_SUB_COUNT) {
+        return idx;
+    }
+    int shift = (idx - HIST_SUB_COUNT) / HIST_HALF_COUNT + 1;
+    uint64_t sub = (idx - HIST_SUB_COUNT) % HIST_HALF_COUNT + HIST_HALF_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(struct histogram *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    if (h->total == 0 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->total++;
+    h->sum += v;
+    h->sum_sq += (double)v * v;
+}
+
+static void hist_merge(struct histogram *into, const struct histogram *from) {
+    for (int i = 0; i < HIST_SIZE; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    if (from->total) {
+        if (into->total == 0 || from->min < into->min) into->min = from->min;
+        if (from->max > into->max) into->max = from->max;
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    into->sum_sq += from->sum_sq;
+}
+
+/**
+ * @return the value at @param percentile (0-100)
+ */
+static uint64_t hist_percentile(const struct histogram *h, double percentile) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)ceil(percentile / 100.0 * h->total);
+    if (target == 0) target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_SIZE; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/**
+ * Write @param h in HdrHistogram's percentile distribution format, values
+ * in microseconds, five reporting ticks per halving of the remaining tail
+ */
+static void hist_print(const struct histogram *h, FILE *out) {
+    fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+
+    uint64_t seen = 0;
+    double level = 0.0;
+    for (int i = 0; i < HIST_SIZE && h->total; i++) {
+        if (h->counts[i] == 0) continue;
+        seen += h->counts[i];
+        double pct = 100.0 * seen / h->total;
+        // Stop ticking once the remaining tail is finer than one sample
+        while (pct >= level && (100.0 - level) * h->total >= 100.0) {
+            uint64_t v = hist_value(i);
+            if (v > h->max) v = h->max;
+            double q = level / 100.0;
+            fprintf(out, "%12.3f %2.12f %10llu %14.2f\n", v / 1000.0, q,
+                    (unsigned long long)seen, 1.0 / (1.0 - q));
+            // Halve the distance to 100% every 5 ticks
+            double half = 100.0 / pow(2.0, floor(log2(100.0 / (100.0 - level))) + 1);
+            level += half / 5.0;
+        }
+        if (seen == h->total) {
+            fprintf(out, "%12.3f %2.12f %10llu %14s\n", h->max / 1000.0, 1.0,
+                    (unsigned long long)seen, "inf");
+            break;
+        }
+    }
+
+    double mean = h->total ? h->sum / h->total : 0.0;
+    double var = h->total ? h->sum_sq / h->total - mean * mean : 0.0;
+    fprintf(out, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1000.0,
+            sqrt(var > 0 ? var : 0) / 1000.0);
+    fprintf(out, "#[Max     = %12.3f, Total count    = %12llu]\n", h->max / 1000.0,
+            (unsigned long long)h->total);
+    fprintf(out, "#[Buckets = %12d, SubBuckets     = %12d]\n", HIST_MAX_SHIFT + 1, HIST_SUB_COUNT);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Connections                                                              */
+/* ------------------------------------------------------------------------ */
+
+static size_t pick_size(struct bench_thread *t) {
+    const struct bench_config *cfg = t->cfg;
+    size_t size;
+    switch (cfg->dist) {
+    case SIZE_UNIFORM:
+        size = cfg->size_min + rng_next(&t->rng) % (cfg->size_max - cfg->size_min + 1);
+        break;
+    case SIZE_EXP: {
+        double u = (rng_next(&t->rng) >> 11) * (1.0 / 9007199254740992.0);
+        size = (size_t)(-log(1.0 - u) * cfg->size_min);
+        break;
+    }
+    default:
+        size = cfg->size_min;
+        break;
+    }
+    if (size < TAG_LEN + 1) size = TAG_LEN + 1;
+    if (size > cfg->size_max) size = cfg->size_max;
+    return size;
+}
+
+static void conn_set_want(struct bench_conn *c) {
+    if (c->q_len > 0) {
+        char tag[TAG_LEN + 1];
+        snprintf(tag, sizeof(tag), "#%016llx ", (unsigned long long)c->queue[c->q_head].tag);
+        memcpy(c->want, tag, TAG_LEN);
+    }
+}
+
+/**
+ * Push whatever is buffered for @param c into the socket
+ * @return 0 on success (possibly partial), -1 on error.
+ */
+static int conn_flush(struct bench_conn *c) {
+    while (c->out_len > 0) {
+        ssize_t n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        c->thread->bytes_out += n;
+        memmove(c->out, c->out + n, c->out_len - n);
+        c->out_len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Queue one packet on @param c whose latency is measured from
+ * @param start_ns
+ */
+static int conn_send_packet(struct bench_conn *c, uint64_t start_ns) {
+    struct bench_thread *t = c->thread;
+    size_t size = pick_size(t);
+    uint64_t tag = t->next_tag++;
+
+    snprintf(t->packet, TAG_LEN + 1, "#%016llx ", (unsigned long long)tag);
+    memset(t->packet + TAG_LEN, 'a' + tag % 26, size - TAG_LEN - 1);
+    t->packet[size - 1] = '\n';
+
+    if (c->out_len + size > c->out_cap) {
+        size_t cap = (c->out_len + size) * 2;
+        char *out = realloc(c->out, cap);
+        if (!out) return -1;
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, t->packet, size);
+    c->out_len += size;
+
+    int slot = (c->q_head + c->q_len) % t->cfg->pipeline;
+    c->queue[slot].tag = tag;
+    c->queue[slot].start_ns = start_ns;
+    c->q_len++;
+    if (c->q_len == 1) {
+        conn_set_want(c);
+    }
+    return conn_flush(c);
+}
+
+/**
+ * Scan received bytes for the line that completes the oldest packet
+ */
+static void conn_scan(struct bench_conn *c, const char *p, size_t len, uint64_t now) {
+    struct bench_thread *t = c->thread;
+    const char *end = p + len;
+    while (p < end) {
+        if (c->match_pos >= 0 && c->match_pos < TAG_LEN && c->q_len > 0) {
+            size_t n = TAG_LEN - c->match_pos;
+            if (n > (size_t)(end - p)) n = end - p;
+            if (memcmp(p, c->want + c->match_pos, n) == 0) {
+                c->match_pos += n;
+            } else {
+                c->match_pos = -1;
+            }
+        }
+        const char *nl = memchr(p, '\n', end - p);
+        if (!nl) {
+            return;
+        }
+        if (c->match_pos == TAG_LEN && c->q_len > 0) {
+            hist_record(&t->hist, now - c->queue[c->q_head].start_ns);
+            t->requests++;
+            c->q_head = (c->q_head + 1) % t->cfg->pipeline;
+            c->q_len--;
+            conn_set_want(c);
+        }
+        c->match_pos = 0;
+        p = nl + 1;
+    }
+}
+
+static int conn_open(struct bench_conn *c, const struct bench_config *cfg, int epfd) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cfg->port);
+    if (inet_pton(AF_INET, cfg->host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address %s\n", cfg->host);
+        return -1;
+    }
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+
+    c->queue = calloc(cfg->pipeline, sizeof(*c->queue));
+    if (!c->queue) {
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Worker threads                                                           */
+/* ------------------------------------------------------------------------ */
+
+/**
+ * Issue packets due at @param now: keep every pipeline full in closed-loop
+ * mode, follow the schedule in *@param next_due in open-loop mode.
+ */
+static void issue_packets(struct bench_thread *t, uint64_t now, uint64_t *next_due, uint64_t interval_ns) {
+    const struct bench_config *cfg = t->cfg;
+    if (interval_ns == 0) {
+        for (int i = 0; i < t->nconns; i++) {
+            struct bench_conn *c = &t->conns[i];
+            while (c->fd >= 0 && c->q_len < cfg->pipeline) {
+                if (conn_send_packet(c, now) < 0) {
+                    t->errors++;
+                    close(c->fd);
+                    c->fd = -1;
+                }
+            }
+        }
+        return;
+    }
+
+    // Open loop: a packet that finds every pipeline full waits, and its
+    // latency still counts from when it was due
+    static __thread int rr;
+    while (*next_due <= now) {
+        struct bench_conn *c = NULL;
+        for (int k = 0; k < t->nconns; k++) {
+            struct bench_conn *cand = &t->conns[(rr + k) % t->nconns];
+            if (cand->fd >= 0 && cand->q_len < cfg->pipeline) {
+                c = cand;
+                rr = (rr + k + 1) % t->nconns;
+                break;
+            }
+        }
+        if (!c) {
+            return;
+        }
+        if (conn_send_packet(c, *next_due) < 0) {
+            t->errors++;
+            close(c->fd);
+            c->fd = -1;
+        }
+        *next_due += interval_ns;
+    }
+}
+
+static void *bench_thread_main(void *arg) {
+    struct bench_thread *t = arg;
+    const struct bench_config *cfg = t->cfg;
+    char *buf = malloc(RECV_CHUNK);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!buf || epfd < 0) {
+        perror("bench thread setup");
+        free(buf);
+        return NULL;
+    }
+
+    for (int i = 0; i < t->nconns; i++) {
+        t->conns[i].fd = -1;
+        t->conns[i].thread = t;
+        if (conn_open(&t->conns[i], cfg, epfd) < 0) {
+            t->errors++;
+        }
+    }
+
+    uint64_t start = now_ns();
+    uint64_t stop = start + (uint64_t)(cfg->duration_s * 1e9);
+    uint64_t interval_ns = 0;
+    if (cfg->rate > 0) {
+        interval_ns = (uint64_t)(1e9 * cfg->threads / cfg->rate);
+        if (interval_ns == 0) interval_ns = 1;
+    }
+    uint64_t next_due = start;
+
+    struct epoll_event events[64];
+    uint64_t now = start;
+    while (now < stop) {
+        issue_packets(t, now, &next_due, interval_ns);
+
+        int timeout_ms = 10;
+        if (interval_ns && next_due > now) {
+            uint64_t wait = (next_due - now) / 1000000;
+            timeout_ms = wait < 10 ? (int)wait : 10;
+        } else if (interval_ns) {
+            timeout_ms = 0;
+        }
+        int nfds = epoll_wait(epfd, events, 64, timeout_ms);
+        now = now_ns();
+        for (int i = 0; i < nfds; i++) {
+            struct bench_conn *c = events[i].data.ptr;
+            if (c->fd < 0) continue;
+            if (events[i].events & EPOLLOUT && conn_flush(c) < 0) {
+                t->errors++;
+                close(c->fd);
+                c->fd = -1;
+                continue;
+            }
+            while (1) {
+                ssize_t n = recv(c->fd, buf, RECV_CHUNK, 0);
+                if (n > 0) {
+                    t->bytes_in += n;
+                    conn_scan(c, buf, n, now);
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                if (n < 0 && errno == EINTR) continue;
+                // EOF or error: the server dropped us
+                t->errors++;
+                close(c->fd);
+                c->fd = -1;
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < t->nconns; i++) {
+        if (t->conns[i].fd >= 0) close(t->conns[i].fd);
+        free(t->conns[i].out);
+        free(t->conns[i].queue);
+    }
+    close(epfd);
+    free(buf);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Reporting                                                                */
+/* ------------------------------------------------------------------------ */
+
+static const char *dist_name(enum size_dist dist) {
+    switch (dist) {
+    case SIZE_UNIFORM: return "uniform";
+    case SIZE_EXP: return "exp";
+    default: return "fixed";
+    }
+}
+
+static void write_json(FILE *out, const struct bench_config *cfg, const struct histogram *h,
+                       uint64_t requests, uint64_t errors, uint64_t bytes_out, uint64_t bytes_in,
+                       double elapsed_s) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"mode\": \"%s\",\n", cfg->rate > 0 ? "open" : "closed");
+    fprintf(out, "  \"threads\": %d,\n", cfg->threads);
+    fprintf(out, "  \"connections\": %d,\n", cfg->connections);
+    fprintf(out, "  \"pipeline\": %d,\n", cfg->pipeline);
+    fprintf(out, "  \"target_rate\": %.1f,\n", cfg->rate);
+    fprintf(out, "  \"size\": { \"dist\": \"%s\", \"min\": %zu, \"max\": %zu },\n",
+            dist_name(cfg->dist), cfg->size_min, cfg->size_max);
+    fprintf(out, "  \"duration_s\": %.3f,\n", elapsed_s);
+    fprintf(out, "  \"requests\": %llu,\n", (unsigned long long)requests);
+    fprintf(out, "  \"errors\": %llu,\n", (unsigned long long)errors);
+    fprintf(out, "  \"throughput_rps\": %.1f,\n", elapsed_s > 0 ? requests / elapsed_s : 0.0);
+    fprintf(out, "  \"bytes_out\": %llu,\n", (unsigned long long)bytes_out);
+    fprintf(out, "  \"bytes_in\": %llu,\n", (unsigned long long)bytes_in);
+    fprintf(out, "  \"latency_us\": { \"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+                 "\"p99\": %.3f, \"p999\": %.3f, \"max\": %.3f }\n",
+            h->min / 1000.0, h->total ? h->sum / h->total / 1000.0 : 0.0,
+            hist_percentile(h, 50) / 1000.0, hist_percentile(h, 90) / 1000.0,
+            hist_percentile(h, 99) / 1000.0, hist_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+    fprintf(out, "}\n");
+}
+
+/**
+ * Parse a packet size spec: N, MIN-MAX (uniform) or exp:MEAN
+ */
+static int parse_size(const char *spec, struct bench_config *cfg) {
+    char *end;
+    if (strncmp(spec, "exp:", 4) == 0) {
+        cfg->dist = SIZE_EXP;
+        cfg->size_min = strtoul(spec + 4, &end, 10);
+        cfg->size_max = cfg->size_min * 16;
+        return *end == '\0' && cfg->size_min > 0 ? 0 : -1;
+    }
+    cfg->size_min = strtoul(spec, &end, 10);
+    if (*end == '-') {
+        cfg->dist = SIZE_UNIFORM;
+        cfg->size_max = strtoul(end + 1, &end, 10);
+    } else {
+        cfg->dist = SIZE_FIXED;
+        cfg->size_max = cfg->size_min;
+    }
+    if (*end != '\0' || cfg->size_max < cfg->size_min) {
+        return -1;
+    }
+    if (cfg->size_min < TAG_LEN + 1) cfg->size_min = TAG_LEN + 1;
+    if (cfg->size_max < cfg->size_min) cfg->size_max = cfg->size_min;
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-H host] [-p port] [-t threads] [-c connections] [-P pipeline]\n"
+            "          [-d seconds] [-r rate] [-s size] [-o histogram] [-j json]\n"
+            "  -r rate   packets/s over all threads (open loop), 0 for closed loop\n"
+            "  -s size   N, MIN-MAX (uniform) or exp:MEAN bytes per packet\n"
+            "  -o file   HdrHistogram percentile output (default stdout)\n"
+            "  -j file   machine-readable JSON summary\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    struct bench_config cfg = {
+        .host = "127.0.0.1",
+        .port = DEFAULT_PORT,
+        .threads = 2,
+        .connections = 16,
+        .pipeline = 1,
+        .duration_s = 10,
+        .rate = 0,
+        .dist = SIZE_FIXED,
+        .size_min = 64,
+        .size_max = 64,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:t:c:P:d:r:s:o:j:h")) != -1) {
+        switch (opt) {
+        case 'H': cfg.host = optarg; break;
+        case 'p': cfg.port = atoi(optarg); break;
+        case 't': cfg.threads = atoi(optarg); break;
+        case 'c': cfg.connections = atoi(optarg); break;
+        case 'P': cfg.pipeline = atoi(optarg); break;
+        case 'd': cfg.duration_s = atof(optarg); break;
+        case 'r': cfg.rate = atof(optarg); break;
+        case 's':
+            if (parse_size(optarg, &cfg) < 0) {
+                fprintf(stderr, "Invalid size spec %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o': cfg.hist_path = optarg; break;
+        case 'j': cfg.json_path = optarg; break;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (cfg.threads < 1 || cfg.threads > MAX_THREADS || cfg.connections < cfg.threads ||
+        cfg.pipeline < 1 || cfg.duration_s <= 0 || cfg.rate < 0) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    struct bench_thread *threads = calloc(cfg.threads, sizeof(*threads));
+    if (!threads) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t seed = now_ns();
+    for (int i = 0; i < cfg.threads; i++) {
+        struct bench_thread *t = &threads[i];
+        t->id = i;
+        t->cfg = &cfg;
+        t->nconns = cfg.connections / cfg.threads + (i < cfg.connections % cfg.threads);
+        t->conns = calloc(t->nconns, sizeof(*t->conns));
+        t->packet = malloc(cfg.size_max + 1);
+        t->rng = seed ^ (0x9E3779B97F4A7C15ull * (i + 1));
+        // Tags are unique across threads and runs against the same data file
+        t->next_tag = (seed << 8) + ((uint64_t)i << 40);
+        if (!t->conns || !t->packet) {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < cfg.threads; i++) {
+        if (pthread_create(&threads[i].tid, NULL, bench_thread_main, &threads[i]) != 0) {
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct histogram *total = calloc(1, sizeof(*total));
+    uint64_t requests = 0, errors = 0, bytes_out = 0, bytes_in = 0;
+    for (int i = 0; i < cfg.threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        hist_merge(total, &threads[i].hist);
+        requests += threads[i].requests;
+        errors += threads[i].errors;
+        bytes_out += threads[i].bytes_out;
+        bytes_in += threads[i].bytes_in;
+        free(threads[i].conns);
+        free(threads[i].packet);
+    }
+    double elapsed_s = (now_ns() - start) / 1e9;
+
+    FILE *hist_out = stdout;
+    if (cfg.hist_path && !(hist_out = fopen(cfg.hist_path, "w"))) {
+        perror(cfg.hist_path);
+        hist_out = stdout;
+    }
+    hist_print(total, hist_out);
+    if (hist_out != stdout) fclose(hist_out);
+
+    fprintf(stderr, "%llu requests in %.2fs, %.1f req/s, %llu errors, p50 %.1fus p99 %.1fus p999 %.1fus\n",
+            (unsigned long long)requests, elapsed_s, requests / elapsed_s, (unsigned long long)errors,
+            hist_percentile(total, 50) / 1000.0, hist_percentile(total, 99) / 1000.0,
+            hist_percentile(total, 99.9) / 1000.0);
+
+    if (cfg.json_path) {
+        FILE *json = fopen(cfg.json_path, "w");
+        if (!json) {
+            perror(cfg.json_path);
+        } else {
+            write_json(json, &cfg, total, requests, errors, bytes_out, bytes_in, elapsed_s);
+            fclose(json);
+        }
+    }
+
+    free(total);
+    free(threads);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
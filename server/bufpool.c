@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "bufpool.h"
+
+// One count per live pool, so that workers never write a shared line
+static struct {
+    size_t bytes;
+    int used;
+} __attribute__((aligned(64))) pool_slots[BUFPOOL_MAX_POOLS];
+// Slots ever claimed, bounding the bufpool_in_use() scan
+static int pool_slots_hi;
+
+/**
+ * @return the size in bytes of class @param size_class
+ */
+static size_t class_size(int size_class) {
+    return (size_t)1 << (BUFPOOL_MIN_SHIFT + 2 * size_class);
+}
+
+void bufpool_init(struct bufpool *pool) {
+    memset(pool, 0, sizeof(*pool));
+    pool->slot = -1;
+    for (int i = 0; i < BUFPOOL_MAX_POOLS; i++) {
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&pool_slots[i].used, &unused, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            pool->slot = i;
+            int hi = __atomic_load_n(&pool_slots_hi, __ATOMIC_RELAXED);
+            while (hi < i + 1 &&
+                   !__atomic_compare_exchange_n(&pool_slots_hi, &hi, i + 1, 0,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * Add @param delta bytes (may wrap, to subtract) to the count of
+ * @param pool, which only its own thread writes
+ */
+static void count_in_use(struct bufpool *pool, size_t delta) {
+    if (pool->slot >= 0) {
+        size_t *bytes = &pool_slots[pool->slot].bytes;
+        __atomic_store_n(bytes, *bytes + delta, __ATOMIC_RELAXED);
+    }
+}
+
+size_t bufpool_in_use(void) {
+    size_t total = 0;
+    int hi = __atomic_load_n(&pool_slots_hi, __ATOMIC_RELAXED);
+    for (int i = 0; i < hi; i++) {
+        total += __atomic_load_n(&pool_slots[i].bytes, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+void bufpool_destroy(struct bufpool *pool) {
+    for (int c = 0; c < BUFPOOL_CLASSES; c++) {
+        struct buf_seg *seg = pool->free_list[c];
+        while (seg) {
+            struct buf_seg *next = seg->next;
+            free(seg);
+            seg = next;
+        }
+        pool->free_list[c] = NULL;
+        pool->free_count[c] = 0;
+    }
+    if (pool->slot >= 0) {
+        __atomic_store_n(&pool_slots[pool->slot].bytes, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&pool_slots[pool->slot].used, 0, __ATOMIC_RELEASE);
+        pool->slot = -1;
+    }
+}
+
+struct buf_seg *bufpool_get(struct bufpool *pool, size_t hint) {
+    int c = 0;
+    while (c < BUFPOOL_CLASSES - 1 && class_size(c) < hint) {
+        c++;
+    }
+
+    struct buf_seg *seg = pool->free_list[c];
+    if (seg) {
+        pool->free_list[c] = seg->next;
+        pool->free_count[c]--;
+        pool->reuses++;
+    } else {
+        seg = malloc(sizeof(*seg) + class_size(c));
+        if (!seg) {
+            return NULL;
+        }
+        seg->cap = class_size(c);
+        seg->size_class = c;
+        pool->allocs++;
+    }
+    seg->next = NULL;
+    seg->len = 0;
+    count_in_use(pool, seg->cap);
+    return seg;
+}
+
+void bufpool_put(struct bufpool *pool, struct buf_seg *seg) {
+    int c = seg->size_class;
+    count_in_use(pool, -seg->cap);
+    if (pool->free_count[c] >= BUFPOOL_MAX_FREE) {
+        free(seg);
+        return;
+    }
+    seg->next = pool->free_list[c];
+    pool->free_list[c] = seg;
+    pool->free_count[c]++;
+}
+
+struct buf_seg *buf_chain_reserve(struct bufpool *pool, struct buf_chain *chain) {
+    if (chain->tail && chain->tail->len < chain->tail->cap) {
+        return chain->tail;
+    }
+
+    // Grow geometrically: 1 KiB first, then the next class up each time
+    int next_class = chain->tail ? chain->tail->size_class + 1 : 0;
+    if (next_class >= BUFPOOL_CLASSES) {
+        next_class = BUFPOOL_CLASSES - 1;
+    }
+    struct buf_seg *seg = bufpool_get(pool, class_size(next_class));
+    if (!seg) {
+        return NULL;
+    }
+    if (chain->tail) chain->tail->next = seg;
+    else chain->head = seg;
+    chain->tail = seg;
+    chain->nsegs++;
+    return seg;
+}
+
+int buf_chain_iov(const struct buf_chain *chain, struct iovec *iov, int max) {
+    int n = 0;
+    for (struct buf_seg *seg = chain->head; seg && n < max; seg = seg->next) {
+        if (seg->len == 0) continue;
+        iov[n].iov_base = seg->data;
+        iov[n].iov_len = seg->len;
+        n++;
+    }
+    return n;
+}
+
+size_t buf_chain_peek(const struct buf_chain *chain, size_t off, void *dst, size_t len) {
+    size_t copied = 0;
+    for (struct buf_seg *seg = chain->head; seg && copied < len; seg = seg->next) {
+        if (off >= seg->len) {
+            off -= seg->len;
+            continue;
+        }
+        size_t n = seg->len - off;
+        if (n > len - copied) n = len - copied;
+        memcpy((char *)dst + copied, seg->data + off, n);
+        copied += n;
+        off = 0;
+    }
+    return copied;
+}
+
+int buf_chain_split(struct bufpool *pool, struct buf_chain *chain, size_t at, struct buf_chain *rest) {
+    memset(rest, 0, sizeof(*rest));
+    if (at >= chain->len) {
+        return 0;
+    }
+    if (at == 0) {
+        *rest = *chain;
+        memset(chain, 0, sizeof(*chain));
+        return 0;
+    }
+
+    // Find the segment holding the last kept byte and how many of its bytes stay
+    struct buf_seg *seg = chain->head;
+    size_t before = 0;
+    int kept_segs = 1;
+    while (before + seg->len < at) {
+        before += seg->len;
+        seg = seg->next;
+        kept_segs++;
+    }
+    size_t keep = at - before;
+
+    struct buf_seg *first_rest = seg->next;
+    int rest_segs = chain->nsegs - kept_segs;
+    if (keep < seg->len) {
+        struct buf_seg *copy = bufpool_get(pool, seg->len - keep);
+        if (!copy) {
+            return -1;
+        }
+        memcpy(copy->data, seg->data + keep, seg->len - keep);
+        copy->len = seg->len - keep;
+        copy->next = first_rest;
+        first_rest = copy;
+        rest_segs++;
+        seg->len = keep;
+    }
+
+    rest->head = first_rest;
+    rest->tail = first_rest ? (seg->next ? chain->tail : first_rest) : NULL;
+    rest->len = chain->len - at;
+    rest->nsegs = rest_segs;
+
+    seg->next = NULL;
+    chain->tail = seg;
+    chain->len = at;
+    chain->nsegs = kept_segs;
+    return 0;
+}
+
+void buf_chain_release(struct bufpool *pool, struct buf_chain *chain) {
+    struct buf_seg *seg = chain->head;
+    while (seg) {
+        struct buf_seg *next = seg->next;
+        bufpool_put(pool, seg);
+        seg = next;
+    }
+    memset(chain, 0, sizeof(*chain));
+}
@@ -0,0 +1,103 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * Slab-style receive buffer pool.
+ * Segments come in a few fixed size classes and are kept on per-class free
+ * lists when released, so a busy worker reaches a steady state where no
+ * packet touches malloc.  A packet is a chain of segments that is handed to
+ * writev as-is instead of being copied into one contiguous buffer.
+ * A pool belongs to one worker thread and is not locked.
+ */
+
+#define BUFPOOL_CLASSES     4
+#define BUFPOOL_MIN_SHIFT   10  // smallest class is 1 KiB, then 4, 16, 64 KiB
+#define BUFPOOL_MAX_FREE    256 // segments cached per class, the rest go to free()
+#define BUFPOOL_MAX_POOLS   256 // pools counted by bufpool_in_use()
+
+struct buf_seg {
+    struct buf_seg *next;
+    size_t cap;       // usable bytes in data[]
+    size_t len;       // bytes filled so far
+    int size_class;
+    char data[];
+};
+
+struct bufpool {
+    struct buf_seg *free_list[BUFPOOL_CLASSES];
+    int free_count[BUFPOOL_CLASSES];
+    unsigned long allocs;     // segments that had to come from malloc
+    unsigned long reuses;     // segments served from a free list
+    int slot;                 // where bufpool_in_use() counts this pool, -1: not counted
+};
+
+// A packet under assembly: segments in arrival order
+struct buf_chain {
+    struct buf_seg *head;
+    struct buf_seg *tail;
+    size_t len;
+    int nsegs;
+};
+
+void bufpool_init(struct bufpool *pool);
+
+/**
+ * Release every cached segment back to the system
+ */
+void bufpool_destroy(struct bufpool *pool);
+
+/**
+ * @return the bytes of segments handed out and not yet put back, over
+ * every pool.  Safe to call from any thread; each pool only writes its
+ * own count.
+ */
+size_t bufpool_in_use(void);
+
+/**
+ * @return an empty segment of the smallest class holding @param hint bytes
+ * (the largest class if none does), or NULL if allocation failed.
+ */
+struct buf_seg *bufpool_get(struct bufpool *pool, size_t hint);
+
+/**
+ * Give @param seg back to the pool
+ */
+void bufpool_put(struct bufpool *pool, struct buf_seg *seg);
+
+/**
+ * @return a segment at the tail of @param chain with free space, adding a
+ * new one if needed.  Each new segment is one class larger than the
+ * previous one so that big packets need few segments.  NULL on failure.
+ */
+struct buf_seg *buf_chain_reserve(struct bufpool *pool, struct buf_chain *chain);
+
+/**
+ * Fill @param iov with up to @param max entries describing @param chain
+ * @return the number of entries used
+ */
+int buf_chain_iov(const struct buf_chain *chain, struct iovec *iov, int max);
+
+/**
+ * Copy up to @param len bytes of @param chain, starting @param off bytes
+ * in, to @param dst
+ * @return the number of bytes copied
+ */
+size_t buf_chain_peek(const struct buf_chain *chain, size_t off, void *dst, size_t len);
+
+/**
+ * Cut @param chain after its first @param at bytes, moving the rest into
+ * the empty chain @param rest.  Whole segments are moved; only the tail of
+ * the segment straddling the cut is copied into a fresh segment.
+ * @return 0 on success, -1 if that segment could not be allocated.
+ */
+int buf_chain_split(struct bufpool *pool, struct buf_chain *chain, size_t at, struct buf_chain *rest);
+
+/**
+ * Return every segment of @param chain to the pool and reset it
+ */
+void buf_chain_release(struct bufpool *pool, struct buf_chain *chain);
+
+#endif // BUFPOOL_H
@@ -0,0 +1,1776 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#include "datalog.h"
+#include "metrics.h"
+#include "lz4.h"
+#include "handoff.h"
+#include "aesdlog.h"
+
+#define SCAN_CHUNK  (64 * 1024)
+#define MAX_WATCHERS 64
+// Longest suffix seg_path() and packed_path() append, NUL included
+#define SEG_SUFFIX_MAX sizeof(".00000000000000000000.lz4.tmp")
+// Holds any segment file name; open() refuses those longer than PATH_MAX
+#define SEG_PATH_MAX (PATH_MAX + SEG_SUFFIX_MAX)
+
+/**
+ * On-disk index entry: packet number @param packet starts at log offset
+ * @param offset.  A sealed segment's index ends with a trailer entry
+ * holding the first packet and offset past the segment.
+ */
+struct idx_entry {
+    uint64_t packet;
+    uint64_t offset;
+};
+
+struct datalog_seg {
+    off_t base;             // log offset of the first byte
+    off_t size;             // committed bytes
+    uint64_t first_packet;
+    uint64_t packets;       // packets starting in this segment
+    int fd;
+    int idxfd;              // open for appending on the tail only
+    time_t mtime;           // last append, for age-based retention
+    struct idx_entry *idx;
+    int nidx;
+    int idx_cap;
+    int refs;               // readers between datalog_seg_get() and _put()
+    int dead;               // dropped by retention, freed with the last ref
+    // Compressed segments: file offset of every block, then the file size
+    off_t *blocks;
+    int nblocks;
+    int old_fd;             // plain file replaced by fd, closed with the last ref
+    int pack_failed;        // compression failed, the segment stays plain
+};
+
+// The log as datalog_export() sends it, followed by its segments
+struct log_wire {
+    int64_t size;
+    uint64_t packets;
+    int32_t nsegs;
+    int32_t open_packet;
+};
+
+// One segment on the wire, followed by its index entries and, if packed,
+// its block table; the descriptors ride along with it
+struct seg_wire {
+    int64_t base;
+    int64_t size;
+    uint64_t first_packet;
+    uint64_t packets;
+    int64_t mtime;
+    int32_t nidx;
+    int32_t nblocks;
+    int32_t packed;
+    int32_t pack_failed;
+    int32_t nfds;           // the data file, and the index on the tail
+    int32_t pad;
+};
+
+static char log_path[PATH_MAX];
+static struct datalog_options log_opts;
+
+// Guards the segment table, log_size, log_packets and the request queue below
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct datalog_seg **segs;   // oldest first; the last one is the tail
+static int nsegs;
+static int segs_cap;
+static off_t log_size = 0;
+static uint64_t log_packets = 0;
+static pthread_cond_t queue_cond;
+static struct datalog_req *queue_head, *queue_tail;
+static size_t queue_bytes;
+static int committer_stop;
+static int committer_running;
+static pthread_t committer;
+static int watch_fds[MAX_WATCHERS];
+static int nwatch;
+// Compactor: compresses sealed segments, woken when one is sealed
+static pthread_cond_t compact_cond;
+static int compactor_stop;
+static int compactor_running;
+static pthread_t compactor;
+
+// Committer-only: flattened iovec of the current batch, reused across batches
+static struct iovec *batch_iov;
+static int batch_iov_cap;
+static struct metrics_shard *committer_metrics;
+// Committer-only: the tail does not end in a newline, so the next record
+// continues its last packet
+static int open_packet;
+
+// Last block this thread decompressed: log bytes are never rewritten, so a
+// block is known by its log offset for the life of the process
+static __thread struct {
+    off_t key;              // log offset of the block plus one, 0 if none
+    size_t len;
+    char data[DATALOG_BLOCK_BYTES];
+    char packed[DATALOG_FRAME_HEADER + DATALOG_BLOCK_BYTES];
+} block_cache;
+
+/**
+ * @return the CLOCK_MONOTONIC time @param us microseconds from now
+ */
+static struct timespec deadline_after(long us) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec += us / 1000000;
+    ts.tv_nsec += (us % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return ts;
+}
+
+/**
+ * Name of the data file (@param index 0) or index file of a segment
+ * starting at @param base; the tail lives at the log path itself
+ */
+static void seg_path(char *buf, size_t len, off_t base, int sealed, int index) {
+    if (sealed) {
+        snprintf(buf, len, "%s.%020lld%s", log_path, (long long)base, index ? ".idx" : "");
+    } else {
+        snprintf(buf, len, "%s%s", log_path, index ? ".idx" : "");
+    }
+}
+
+/**
+ * Name of the compressed form of the sealed segment at @param base, or of
+ * the temporary file it is written to first if @param tmp is set
+ */
+static void packed_path(char *buf, size_t len, off_t base, int tmp) {
+    snprintf(buf, len, "%s.%020lld.lz4%s", log_path, (long long)base, tmp ? ".tmp" : "");
+}
+
+static void put_le32(char *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (char)(v >> (8 * i));
+    }
+}
+
+static uint32_t get_le32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+/**
+ * pread exactly @param len bytes
+ * @return 0, or -1 on an error or a short file.
+ */
+static int read_full(int fd, void *buf, size_t len, off_t off) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @return the file to read @param seg's log bytes from directly, or -1 if
+ * it is compressed.  Called with log_lock held, or before the compactor
+ * runs: the answer only changes under the lock.
+ */
+static int seg_plain_fd(const struct datalog_seg *seg) {
+    return seg->blocks ? -1 : seg->fd;
+}
+
+/**
+ * Decompress the block of the compressed segment @param seg holding log
+ * offset @param offset into this thread's block cache
+ * @return the bytes from @param offset to the end of the block (count in
+ * @param avail), or NULL if the block could not be read (already logged).
+ */
+static const char *seg_block(struct datalog_seg *seg, off_t offset, size_t *avail) {
+    int i = (offset - seg->base) / DATALOG_BLOCK_BYTES;
+    off_t start = seg->base + (off_t)i * DATALOG_BLOCK_BYTES;
+    size_t raw = seg->base + seg->size - start;
+    if (raw > DATALOG_BLOCK_BYTES) raw = DATALOG_BLOCK_BYTES;
+
+    if (block_cache.key != start + 1) {
+        block_cache.key = 0;
+        size_t wire = seg->blocks[i + 1] - seg->blocks[i];
+        if (wire < DATALOG_FRAME_HEADER || wire > sizeof(block_cache.packed) ||
+            read_full(seg->fd, block_cache.packed, wire, seg->blocks[i]) < 0) {
+            aesdlog(LOG_ERR, "Log block read at %lld failed: %s", (long long)start, strerror(errno));
+            return NULL;
+        }
+        const char *payload = block_cache.packed + DATALOG_FRAME_HEADER;
+        size_t plen = wire - DATALOG_FRAME_HEADER;
+        long len = raw;
+        if (get_le32(block_cache.packed) != raw || get_le32(block_cache.packed + 4) != plen) {
+            len = -1;
+        } else if (plen == raw) {
+            memcpy(block_cache.data, payload, raw);
+        } else {
+            len = lz4_decompress(payload, plen, block_cache.data, sizeof(block_cache.data));
+        }
+        if (len != (long)raw) {
+            aesdlog(LOG_ERR, "Log block at %lld is damaged", (long long)start);
+            return NULL;
+        }
+        block_cache.len = raw;
+        block_cache.key = start + 1;
+    }
+    *avail = raw - (offset - start);
+    return block_cache.data + (offset - start);
+}
+
+/**
+ * Read up to @param want log bytes from @param pos in @param seg, through
+ * @param fd as returned by seg_plain_fd(), like pread()
+ */
+static ssize_t seg_read(struct datalog_seg *seg, int fd, char *buf, size_t want, off_t pos) {
+    if (fd >= 0) {
+        return pread(fd, buf, want, pos - seg->base);
+    }
+    size_t avail;
+    const char *p = seg_block(seg, pos, &avail);
+    if (!p) {
+        errno = EIO;
+        return -1;
+    }
+    if (want > avail) want = avail;
+    memcpy(buf, p, want);
+    return want;
+}
+
+/**
+ * Send up to @param count log bytes from @param offset in @param seg,
+ * through @param fd as returned by seg_plain_fd(), to @param out
+ */
+static ssize_t seg_send(int out, struct datalog_seg *seg, int fd, off_t offset, size_t count) {
+    if (fd >= 0) {
+        off_t file_off = offset - seg->base;
+        return sendfile(out, fd, &file_off, count);
+    }
+    size_t avail;
+    const char *p = seg_block(seg, offset, &avail);
+    if (!p) {
+        errno = EIO;
+        return -1;
+    }
+    if (count > avail) count = avail;
+    return write(out, p, count);
+}
+
+static int seg_push_idx(struct datalog_seg *seg, uint64_t packet, off_t offset) {
+    if (seg->nidx == seg->idx_cap) {
+        int cap = seg->idx_cap ? seg->idx_cap * 2 : 64;
+        struct idx_entry *idx = realloc(seg->idx, cap * sizeof(*idx));
+        if (!idx) {
+            return -1;
+        }
+        seg->idx = idx;
+        seg->idx_cap = cap;
+    }
+    seg->idx[seg->nidx].packet = packet;
+    seg->idx[seg->nidx].offset = offset;
+    seg->nidx++;
+    return 0;
+}
+
+static void seg_free(struct datalog_seg *seg) {
+    if (seg->fd >= 0) close(seg->fd);
+    if (seg->idxfd >= 0) close(seg->idxfd);
+    if (seg->old_fd >= 0) close(seg->old_fd);
+    free(seg->idx);
+    free(seg->blocks);
+    free(seg);
+}
+
+/**
+ * Append @param n index entries to @param fd
+ */
+static void write_idx(int fd, const struct idx_entry *idx, int n) {
+    size_t len = n * sizeof(*idx);
+    const char *p = (const char *)idx;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            aesdlog(LOG_ERR, "Index write failed: %s", strerror(errno));
+            return;
+        }
+        p += w;
+        len -= w;
+    }
+}
+
+/**
+ * fsync the directory holding the log, so renames and new files survive
+ * a crash
+ */
+static void sync_dir(void) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", log_path);
+    int fd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/**
+ * Walk the packet starts of @param seg, read through @param fd as returned
+ * by seg_plain_fd(), from @param from (a packet start, numbered
+ * *@param packet) to @param end.  A packet starts at the segment's
+ * first byte and after every newline that is not the last byte.  Every
+ * start numbered a multiple of DATALOG_INDEX_EVERY is indexed if
+ * @param index is set; the walk stops early at packet number @param stop.
+ * *packet is left at the last packet started.
+ * @return the offset of packet @param stop, @param end if it was not
+ * reached, or -1 on a read error.
+ */
+static off_t seg_scan(struct datalog_seg *seg, int fd, off_t from, off_t end, uint64_t *packet,
+                      uint64_t stop, int index) {
+    char chunk[SCAN_CHUNK];
+    if (*packet == stop) {
+        return from;
+    }
+    off_t pos = from;
+    while (pos < end) {
+        size_t want = end - pos < SCAN_CHUNK ? (size_t)(end - pos) : SCAN_CHUNK;
+        ssize_t n = seg_read(seg, fd, chunk, want, pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            aesdlog(LOG_ERR, "Log read failed: %s", n < 0 ? strerror(errno) : "short file");
+            return -1;
+        }
+        const char *p = chunk, *stop_at = chunk + n;
+        while ((p = memchr(p, '\n', stop_at - p)) != NULL) {
+            p++;
+            off_t start = pos + (p - chunk);
+            if (start >= end) break;
+            (*packet)++;
+            if (index && *packet % DATALOG_INDEX_EVERY == 0 && seg_push_idx(seg, *packet, start) < 0) {
+                aesdlog(LOG_ERR, "Memory allocation failed");
+                return -1;
+            }
+            if (*packet == stop) {
+                return start;
+            }
+        }
+        pos += n;
+    }
+    return end;
+}
+
+/**
+ * Count the packets of @param seg past its last index entry, indexing
+ * them as it goes and appending the new entries to @param idxfd (-1: none)
+ * @return 0 on success, -1 on failure.
+ */
+static int seg_recover(struct datalog_seg *seg, int idxfd) {
+    seg->packets = 0;
+    if (seg->size == 0) {
+        seg->nidx = 0;
+        return 0;
+    }
+    int old = seg->nidx;
+    if (seg->nidx == 0 && seg_push_idx(seg, seg->first_packet, seg->base) < 0) {
+        return -1;
+    }
+    struct idx_entry last = seg->idx[seg->nidx - 1];
+    uint64_t packet = last.packet;
+    if (seg_scan(seg, seg_plain_fd(seg), last.offset, seg->base + seg->size, &packet, UINT64_MAX, 1) < 0) {
+        return -1;
+    }
+    seg->packets = packet - seg->first_packet + 1;
+    if (idxfd >= 0 && seg->nidx > old) {
+        write_idx(idxfd, seg->idx + old, seg->nidx - old);
+    }
+    return 0;
+}
+
+/**
+ * Read the index at @param path into @param seg, keeping the entries
+ * that are consistent with its data.
+ * @return 1 if it ended in a valid trailer (dropped from memory), 0 if
+ * not, -1 if memory ran out.
+ */
+static int seg_load_idx(struct datalog_seg *seg, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    struct idx_entry e;
+    int trailer = 0;
+    while (read(fd, &e, sizeof(e)) == sizeof(e)) {
+        off_t prev = seg->nidx ? (off_t)seg->idx[seg->nidx - 1].offset : -1;
+        uint64_t prev_packet = seg->nidx ? seg->idx[seg->nidx - 1].packet : 0;
+        if ((off_t)e.offset <= prev || (seg->nidx && e.packet <= prev_packet) ||
+            (off_t)e.offset < seg->base || (seg->nidx == 0 && (off_t)e.offset != seg->base)) {
+            break;
+        }
+        if ((off_t)e.offset >= seg->base + seg->size) {
+            trailer = (off_t)e.offset == seg->base + seg->size;
+            if (trailer) {
+                seg->packets = e.packet - seg->first_packet;
+            }
+            break;
+        }
+        if (seg->nidx == 0) {
+            seg->first_packet = e.packet;
+        }
+        if (seg_push_idx(seg, e.packet, e.offset) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return trailer;
+}
+
+/**
+ * Index the start of the empty segment @param seg, so that its place in
+ * the log survives a restart even if nothing is sealed before it
+ */
+static int seg_anchor(struct datalog_seg *seg) {
+    if (seg_push_idx(seg, seg->first_packet, seg->base) < 0) {
+        aesdlog(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    write_idx(seg->idxfd, seg->idx, 1);
+    return 0;
+}
+
+static struct datalog_seg *seg_new(off_t base, int fd) {
+    struct datalog_seg *seg = calloc(1, sizeof(*seg));
+    if (!seg) {
+        return NULL;
+    }
+    seg->base = base;
+    seg->fd = fd;
+    seg->idxfd = -1;
+    seg->old_fd = -1;
+    seg->mtime = time(NULL);
+    return seg;
+}
+
+static int segs_push(struct datalog_seg *seg) {
+    if (nsegs == segs_cap) {
+        int cap = segs_cap ? segs_cap * 2 : 16;
+        struct datalog_seg **grown = realloc(segs, cap * sizeof(*grown));
+        if (!grown) {
+            return -1;
+        }
+        segs = grown;
+        segs_cap = cap;
+    }
+    segs[nsegs++] = seg;
+    return 0;
+}
+
+/**
+ * @return the index of the first segment ending past @param offset, or
+ * nsegs if there is none.  Called with log_lock held.
+ */
+static int segs_find(off_t offset) {
+    int lo = 0, hi = nsegs;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (segs[mid]->base + segs[mid]->size > offset) hi = mid;
+        else lo = mid + 1;
+    }
+    return lo;
+}
+
+static int cmp_base(const void *a, const void *b) {
+    off_t x = *(const off_t *)a, y = *(const off_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Find the sealed segments "<path>.<20-digit offset>[.lz4]" next to the
+ * log, deleting compressed files a crash left half written
+ * @return their bases in ascending order (count in @param count), or NULL
+ */
+static off_t *list_sealed(int *count) {
+    char dir[PATH_MAX], name[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", log_path);
+    snprintf(name, sizeof(name), "%s", log_path);
+    const char *prefix = basename(name);
+    size_t prefix_len = strlen(prefix);
+
+    *count = 0;
+    const char *dirpath = dirname(dir);
+    DIR *d = opendir(dirpath);
+    if (!d) {
+        return NULL;
+    }
+    off_t *bases = NULL;
+    int cap = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        const char *s = ent->d_name;
+        if (strncmp(s, prefix, prefix_len) != 0 || s[prefix_len] != '.' ||
+            strspn(s + prefix_len + 1, "0123456789") != 20) {
+            continue;
+        }
+        const char *suffix = s + prefix_len + 21;
+        if (strcmp(suffix, ".lz4.tmp") == 0) {
+            char tmp[PATH_MAX];
+            snprintf(tmp, sizeof(tmp), "%s/%s", dirpath, s);
+            unlink(tmp);
+            continue;
+        }
+        if (*suffix && strcmp(suffix, ".lz4") != 0) {
+            continue;
+        }
+        if (*count == cap) {
+            cap = cap ? cap * 2 : 16;
+            off_t *grown = realloc(bases, cap * sizeof(*bases));
+            if (!grown) {
+                break;
+            }
+            bases = grown;
+        }
+        bases[(*count)++] = strtoll(s + prefix_len + 1, NULL, 10);
+    }
+    closedir(d);
+    qsort(bases, *count, sizeof(*bases), cmp_base);
+    // A segment whose compression was not cleaned up shows up twice
+    int n = 0;
+    for (int i = 0; i < *count; i++) {
+        if (n == 0 || bases[n - 1] != bases[i]) {
+            bases[n++] = bases[i];
+        }
+    }
+    *count = n;
+    return bases;
+}
+
+/**
+ * Read the block table of the compressed segment @param seg from its
+ * frame headers, setting its size
+ * @return 0, or -1 if the file is damaged.
+ */
+static int seg_load_blocks(struct datalog_seg *seg, off_t file_size) {
+    off_t at = 0;
+    int cap = 0;
+    seg->size = 0;
+    seg->nblocks = 0;
+    while (1) {
+        if (seg->nblocks + 1 >= cap) {
+            cap = cap ? cap * 2 : 64;
+            off_t *grown = realloc(seg->blocks, cap * sizeof(*grown));
+            if (!grown) {
+                return -1;
+            }
+            seg->blocks = grown;
+        }
+        seg->blocks[seg->nblocks] = at;
+        if (at == file_size) {
+            return 0;
+        }
+        char hdr[DATALOG_FRAME_HEADER];
+        // Only the last block may be short
+        if ((seg->nblocks && seg->size % DATALOG_BLOCK_BYTES) || read_full(seg->fd, hdr, sizeof(hdr), at) < 0) {
+            return -1;
+        }
+        uint32_t raw = get_le32(hdr), plen = get_le32(hdr + 4);
+        if (raw == 0 || raw > DATALOG_BLOCK_BYTES || plen > raw) {
+            return -1;
+        }
+        at += DATALOG_FRAME_HEADER + plen;
+        seg->size += raw;
+        seg->nblocks++;
+        if (at > file_size) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Open the sealed segment at @param base, which must start at or after
+ * @param min_base.  A missing or damaged index is rebuilt by scanning,
+ * numbering from @param next_packet.
+ * @return the segment, or NULL if it is unusable (already logged).
+ */
+static struct datalog_seg *open_sealed(off_t base, off_t min_base, uint64_t next_packet) {
+    char path[SEG_PATH_MAX], packed[SEG_PATH_MAX];
+    seg_path(path, sizeof(path), base, 1, 0);
+    if (base < min_base) {
+        aesdlog(LOG_WARNING, "Ignoring overlapping log segment %s", path);
+        return NULL;
+    }
+    // A complete compressed file replaces the plain one
+    packed_path(packed, sizeof(packed), base, 0);
+    int is_packed = 1;
+    int fd = open(packed, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        is_packed = 0;
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        aesdlog(LOG_ERR, "Opening log segment %s failed: %s", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    struct datalog_seg *seg = seg_new(base, fd);
+    if (!seg) {
+        close(fd);
+        return NULL;
+    }
+    seg->size = st.st_size;
+    seg->mtime = st.st_mtime;
+    seg->first_packet = next_packet;
+    if (is_packed) {
+        if (seg_load_blocks(seg, st.st_size) < 0) {
+            aesdlog(LOG_ERR, "Compressed log segment %s is damaged", packed);
+            seg_free(seg);
+            return NULL;
+        }
+        unlink(path);
+    }
+
+    seg_path(path, sizeof(path), base, 1, 1);
+    int trailer = seg_load_idx(seg, path);
+    if (trailer < 0) {
+        seg_free(seg);
+        return NULL;
+    }
+    if (!trailer && seg->size > 0) {
+        // Sealed without a complete index: rebuild it from the data
+        aesdlog(LOG_WARNING, "Rebuilding index of log segment at %lld", (long long)base);
+        seg->nidx = 0;
+        seg->first_packet = next_packet;
+        int idxfd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (seg_recover(seg, idxfd) < 0) {
+            if (idxfd >= 0) close(idxfd);
+            seg_free(seg);
+            return NULL;
+        }
+        if (idxfd >= 0) {
+            struct idx_entry end = { seg->first_packet + seg->packets, seg->base + seg->size };
+            write_idx(idxfd, &end, 1);
+            close(idxfd);
+        }
+    }
+    return seg;
+}
+
+/**
+ * Open the tail segment, which follows the sealed ones at @param base,
+ * and scan what its index does not cover
+ */
+static struct datalog_seg *open_tail(off_t base, uint64_t next_packet, int have_sealed) {
+    char path[SEG_PATH_MAX];
+    seg_path(path, sizeof(path), 0, 0, 0);
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        aesdlog(LOG_ERR, "File open failed: %s", strerror(errno));
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    struct datalog_seg *seg = seg_new(base, fd);
+    if (!seg) {
+        close(fd);
+        return NULL;
+    }
+    seg->size = st.st_size;
+    seg->first_packet = next_packet;
+
+    seg_path(path, sizeof(path), 0, 0, 1);
+    if (!have_sealed) {
+        // Nothing sealed left to place the tail: its index knows where it starts
+        struct idx_entry first;
+        int idxfd = open(path, O_RDONLY | O_CLOEXEC);
+        if (idxfd >= 0 && read(idxfd, &first, sizeof(first)) == sizeof(first)) {
+            seg->base = first.offset;
+            seg->first_packet = first.packet;
+        }
+        if (idxfd >= 0) close(idxfd);
+    }
+    if (seg_load_idx(seg, path) < 0) {
+        seg_free(seg);
+        return NULL;
+    }
+
+    // Entries past the data (written before a crash lost the data) are cut
+    seg->idxfd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (seg->idxfd < 0 || ftruncate(seg->idxfd, seg->nidx * sizeof(struct idx_entry)) < 0) {
+        aesdlog(LOG_ERR, "Opening log index failed: %s", strerror(errno));
+        seg_free(seg);
+        return NULL;
+    }
+    if (seg_recover(seg, seg->idxfd) < 0) {
+        seg_free(seg);
+        return NULL;
+    }
+    if (seg->size == 0 && seg_anchor(seg) < 0) {
+        seg_free(seg);
+        return NULL;
+    }
+
+    char last = '\n';
+    if (seg->size > 0 && pread(fd, &last, 1, seg->size - 1) != 1) {
+        last = '\n';
+    }
+    open_packet = last != '\n';
+    return seg;
+}
+
+/**
+ * Seal the tail under its "<path>.<base>" name and start a new, empty one
+ * @return 0 on success, -1 if the old tail stays in use (already logged).
+ */
+static int rotate_tail(void) {
+    struct datalog_seg *tail = segs[nsegs - 1];
+    char from[SEG_PATH_MAX], to[SEG_PATH_MAX];
+
+    struct idx_entry end = { tail->first_packet + tail->packets, tail->base + tail->size };
+    write_idx(tail->idxfd, &end, 1);
+    if (log_opts.sync != DATALOG_SYNC_NONE) {
+        metrics_add(committer_metrics, MC_FSYNCS, 1);
+        if (fdatasync(tail->fd) < 0 || fdatasync(tail->idxfd) < 0) {
+            aesdlog(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+        }
+    }
+
+    // Index first: a data file without its index is rebuilt, the reverse is not noticed
+    seg_path(from, sizeof(from), 0, 0, 1);
+    seg_path(to, sizeof(to), tail->base, 1, 1);
+    if (rename(from, to) < 0) {
+        aesdlog(LOG_ERR, "Sealing log index failed: %s", strerror(errno));
+        goto fail;
+    }
+    seg_path(from, sizeof(from), 0, 0, 0);
+    seg_path(to, sizeof(to), tail->base, 1, 0);
+    if (rename(from, to) < 0) {
+        aesdlog(LOG_ERR, "Sealing log segment failed: %s", strerror(errno));
+        seg_path(to, sizeof(to), tail->base, 1, 1);
+        seg_path(from, sizeof(from), 0, 0, 1);
+        rename(to, from);
+        goto fail;
+    }
+
+    seg_path(from, sizeof(from), 0, 0, 0);
+    int fd = open(from, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    seg_path(from, sizeof(from), 0, 0, 1);
+    int idxfd = open(from, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    struct datalog_seg *seg = fd >= 0 && idxfd >= 0 ? seg_new(tail->base + tail->size, fd) : NULL;
+    if (!seg) {
+        // The sealed file keeps taking appends until the next attempt
+        aesdlog(LOG_ERR, "Creating log segment failed: %s", strerror(errno));
+        if (fd >= 0) close(fd);
+        if (idxfd >= 0) close(idxfd);
+        return -1;
+    }
+    seg->idxfd = idxfd;
+    seg->first_packet = tail->first_packet + tail->packets;
+    if (seg_anchor(seg) < 0) {
+        seg_free(seg);
+        return -1;
+    }
+    if (log_opts.sync != DATALOG_SYNC_NONE) {
+        sync_dir();
+    }
+
+    pthread_mutex_lock(&log_lock);
+    int rc = segs_push(seg);
+    if (rc == 0) {
+        close(tail->idxfd);
+        tail->idxfd = -1;
+        tail->mtime = time(NULL);
+        if (compactor_running) {
+            pthread_cond_signal(&compact_cond);
+        }
+    }
+    pthread_mutex_unlock(&log_lock);
+    if (rc < 0) {
+        aesdlog(LOG_ERR, "Memory allocation failed");
+        seg_free(seg);
+        return -1;
+    }
+    open_packet = 0;
+    return 0;
+
+fail:
+    // Undo the trailer so the tail's index stays appendable
+    if (ftruncate(tail->idxfd, tail->nidx * sizeof(struct idx_entry)) < 0) {
+        aesdlog(LOG_ERR, "Index truncate failed: %s", strerror(errno));
+    }
+    return -1;
+}
+
+/**
+ * Drop the oldest sealed segments beyond the retention limits
+ */
+static void apply_retention(void) {
+    if (log_opts.retain_bytes <= 0 && log_opts.retain_secs <= 0) {
+        return;
+    }
+    time_t now = time(NULL);
+    while (1) {
+        pthread_mutex_lock(&log_lock);
+        struct datalog_seg *seg = nsegs > 1 ? segs[0] : NULL;
+        if (seg && !((log_opts.retain_bytes > 0 && log_size - seg->base > log_opts.retain_bytes) ||
+                     (log_opts.retain_secs > 0 && now - seg->mtime > log_opts.retain_secs))) {
+            seg = NULL;
+        }
+        int free_now = 0;
+        off_t base = 0;
+        if (seg) {
+            memmove(segs, segs + 1, (nsegs - 1) * sizeof(*segs));
+            nsegs--;
+            seg->dead = 1;
+            free_now = seg->refs == 0;
+            base = seg->base;
+        }
+        pthread_mutex_unlock(&log_lock);
+        if (!seg) {
+            break;
+        }
+
+        char path[SEG_PATH_MAX];
+        seg_path(path, sizeof(path), base, 1, 0);
+        unlink(path);
+        seg_path(path, sizeof(path), base, 1, 1);
+        unlink(path);
+        packed_path(path, sizeof(path), base, 0);
+        unlink(path);
+        if (free_now) {
+            seg_free(seg);
+        }
+    }
+}
+
+/**
+ * Write all @param iovcnt buffers in @param iov to @param fd, looping over
+ * IOV_MAX-sized slices and short writes.
+ * @return bytes written, which is short of the total only on failure.
+ */
+static size_t write_all(int fd, const struct iovec *iov, int iovcnt) {
+    struct iovec cur[IOV_MAX];
+    int idx = 0;
+    size_t skip = 0; // bytes of iov[idx] already written
+    size_t total = 0;
+
+    while (idx < iovcnt) {
+        // Rebuild at most IOV_MAX entries starting where the last writev stopped
+        int n = 0;
+        for (int i = idx; i < iovcnt && n < IOV_MAX; i++, n++) {
+            size_t off = (i == idx) ? skip : 0;
+            cur[n].iov_base = (char *)iov[i].iov_base + off;
+            cur[n].iov_len = iov[i].iov_len - off;
+        }
+
+        ssize_t written = writev(fd, cur, n);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            aesdlog(LOG_ERR, "Write to file failed: %s", strerror(errno));
+            return total;
+        }
+        if (written == 0) {
+            aesdlog(LOG_ERR, "Write to file made no progress");
+            return total;
+        }
+        total += written;
+
+        // Advance past the bytes that made it to the file
+        size_t left = written;
+        while (idx < iovcnt && left >= iov[idx].iov_len - skip) {
+            left -= iov[idx].iov_len - skip;
+            skip = 0;
+            idx++;
+        }
+        skip += left;
+    }
+    return total;
+}
+
+/**
+ * @return the last byte of @param req's record
+ */
+static char req_last_byte(const struct datalog_req *req) {
+    for (int i = req->iovcnt - 1; i >= 0; i--) {
+        if (req->iov[i].iov_len > 0) {
+            return ((const char *)req->iov[i].iov_base)[req->iov[i].iov_len - 1];
+        }
+    }
+    return '\n';
+}
+
+/**
+ * Account the packets of @param req, written at @param at in @param tail,
+ * and index them.  Called with log_lock held.
+ */
+static void index_record(struct datalog_seg *tail, const struct datalog_req *req, off_t at) {
+    int nstarts = req->ends ? req->nends : 1;
+    for (int i = 0; i < nstarts; i++) {
+        off_t start = at + (i ? req->ends[i - 1] : 0);
+        if (i == 0 && open_packet && start != tail->base) {
+            continue; // the record finishes the packet left open before it
+        }
+        uint64_t packet = log_packets++;
+        tail->packets++;
+        // The segment's first packet is already anchored
+        if ((packet % DATALOG_INDEX_EVERY == 0 || tail->nidx == 0) &&
+            !(tail->nidx && tail->idx[tail->nidx - 1].packet == packet) &&
+            seg_push_idx(tail, packet, start) < 0) {
+            aesdlog(LOG_ERR, "Memory allocation failed");
+        }
+    }
+    open_packet = req_last_byte(req) != '\n';
+}
+
+/**
+ * Tell every watching worker that the log grew
+ */
+static void notify_watchers(void) {
+    int fds[MAX_WATCHERS];
+    pthread_mutex_lock(&log_lock);
+    int n = nwatch;
+    memcpy(fds, watch_fds, n * sizeof(*fds));
+    pthread_mutex_unlock(&log_lock);
+
+    uint64_t one = 1;
+    for (int i = 0; i < n; i++) {
+        if (write(fds[i], &one, sizeof(one)) < 0 && errno != EAGAIN) {
+            aesdlog(LOG_ERR, "eventfd write failed: %s", strerror(errno));
+        }
+    }
+}
+
+/**
+ * Write one batch of requests, sync it as the mode requires and complete
+ * every request in it.
+ */
+static void commit_batch(struct datalog_req *batch, struct timespec *last_sync) {
+    struct datalog_seg *tail = segs[nsegs - 1];
+    if (log_opts.segment_bytes > 0 && tail->size >= log_opts.segment_bytes && rotate_tail() == 0) {
+        tail = segs[nsegs - 1];
+        apply_retention();
+    }
+
+    int iovcnt = 0;
+    size_t want = 0;
+    for (struct datalog_req *req = batch; req; req = req->next) {
+        iovcnt += req->iovcnt;
+        want += req->len;
+    }
+    if (iovcnt > batch_iov_cap) {
+        struct iovec *iov = realloc(batch_iov, iovcnt * sizeof(*iov));
+        if (iov) {
+            batch_iov = iov;
+            batch_iov_cap = iovcnt;
+        }
+    }
+
+    size_t written;
+    if (iovcnt <= batch_iov_cap) {
+        int n = 0;
+        for (struct datalog_req *req = batch; req; req = req->next) {
+            memcpy(batch_iov + n, req->iov, req->iovcnt * sizeof(*req->iov));
+            n += req->iovcnt;
+        }
+        written = write_all(tail->fd, batch_iov, iovcnt);
+    } else {
+        // No memory for the merged vector: fall back to one write per request
+        aesdlog(LOG_ERR, "Memory allocation failed");
+        written = 0;
+        for (struct datalog_req *req = batch; req; req = req->next) {
+            size_t n = write_all(tail->fd, req->iov, req->iovcnt);
+            written += n;
+            if (n < req->len) break;
+        }
+    }
+
+    int synced = 1;
+    if (written > 0 && log_opts.sync != DATALOG_SYNC_NONE) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long since_ms = (now.tv_sec - last_sync->tv_sec) * 1000 +
+                        (now.tv_nsec - last_sync->tv_nsec) / 1000000;
+        if (log_opts.sync == DATALOG_SYNC_BATCH || since_ms >= DATALOG_SYNC_PERIOD_MS) {
+            metrics_add(committer_metrics, MC_FSYNCS, 1);
+            if (fdatasync(tail->fd) < 0) {
+                aesdlog(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+                synced = log_opts.sync != DATALOG_SYNC_BATCH;
+            }
+            *last_sync = now;
+        }
+    }
+
+    metrics_add(committer_metrics, MC_BATCHES, 1);
+    pthread_mutex_lock(&log_lock);
+    off_t base = log_size;
+    int old_nidx = tail->nidx;
+    off_t at = base;
+    for (struct datalog_req *req = batch; req && at + (off_t)req->len <= base + (off_t)written; req = req->next) {
+        index_record(tail, req, at);
+        at += req->len;
+    }
+    if (at < base + (off_t)written) {
+        open_packet = 1; // part of a failed record made it to the file
+    }
+    log_size += written;
+    tail->size += written;
+    pthread_mutex_unlock(&log_lock);
+    if (tail->nidx > old_nidx) {
+        write_idx(tail->idxfd, tail->idx + old_nidx, tail->nidx - old_nidx);
+    }
+    apply_retention();
+
+    // Requests that did not make it to the file in full are failed
+    off_t end = base;
+    struct datalog_req *req = batch;
+    while (req) {
+        struct datalog_req *next = req->next; // complete() may reuse the link
+        end += req->len;
+        req->end = (synced && end <= base + (off_t)written) ? end : -1;
+        req->complete(req);
+        req = next;
+    }
+    if (written > 0 && __atomic_load_n(&nwatch, __ATOMIC_RELAXED) > 0) {
+        notify_watchers();
+    }
+}
+
+/**
+ * Committer thread: take everything queued, optionally wait out the
+ * group-commit window, and commit it as one batch.
+ */
+static void *committer_thread(void *arg) {
+    (void)arg;
+    // Kept when the committer is restarted after a failed handoff
+    if (!committer_metrics) committer_metrics = metrics_register();
+    struct timespec last_sync;
+    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+    int dirty = 0; // written since the last periodic sync
+
+    pthread_mutex_lock(&log_lock);
+    while (1) {
+        while (!queue_head && !committer_stop) {
+            if (log_opts.sync == DATALOG_SYNC_PERIODIC && dirty) {
+                struct timespec ts = deadline_after(DATALOG_SYNC_PERIOD_MS * 1000L);
+                if (pthread_cond_timedwait(&queue_cond, &log_lock, &ts) == ETIMEDOUT && !queue_head) {
+                    // Idle after a burst: make it durable without waiting for more traffic
+                    int fd = segs[nsegs - 1]->fd;
+                    pthread_mutex_unlock(&log_lock);
+                    metrics_add(committer_metrics, MC_FSYNCS, 1);
+                    if (fdatasync(fd) < 0) {
+                        aesdlog(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+                    }
+                    clock_gettime(CLOCK_MONOTONIC, &last_sync);
+                    dirty = 0;
+                    pthread_mutex_lock(&log_lock);
+                }
+            } else {
+                pthread_cond_wait(&queue_cond, &log_lock);
+            }
+        }
+        if (!queue_head) {
+            break; // stopping and nothing left
+        }
+
+        if (log_opts.window_us > 0 && !committer_stop) {
+            struct timespec ts = deadline_after(log_opts.window_us);
+            while (queue_bytes < DATALOG_BATCH_BYTES && !committer_stop) {
+                if (pthread_cond_timedwait(&queue_cond, &log_lock, &ts) == ETIMEDOUT) break;
+            }
+        }
+
+        struct datalog_req *batch = queue_head;
+        queue_head = queue_tail = NULL;
+        queue_bytes = 0;
+        pthread_mutex_unlock(&log_lock);
+
+        commit_batch(batch, &last_sync);
+        dirty = 1;
+
+        pthread_mutex_lock(&log_lock);
+    }
+    int fd = segs[nsegs - 1]->fd;
+    pthread_mutex_unlock(&log_lock);
+
+    if (log_opts.sync != DATALOG_SYNC_NONE && fdatasync(fd) < 0) {
+        aesdlog(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+    }
+    return NULL;
+}
+
+/**
+ * Write the sealed segment @param seg, read through its plain file
+ * @param fd, as compressed blocks to its ".lz4" file.  The file is written
+ * under a temporary name, so that only complete ones carry the final name.
+ * @return the compressed file, with its block table in @param blocks
+ * (@param nblocks entries and the file size), or -1 (already logged).
+ */
+static int pack_segment(struct datalog_seg *seg, int fd, off_t **blocks, int *nblocks) {
+    char tmp[SEG_PATH_MAX], path[SEG_PATH_MAX];
+    packed_path(tmp, sizeof(tmp), seg->base, 1);
+    packed_path(path, sizeof(path), seg->base, 0);
+    int n = (seg->size + DATALOG_BLOCK_BYTES - 1) / DATALOG_BLOCK_BYTES;
+    *blocks = malloc((n + 1) * sizeof(**blocks));
+    int out = *blocks ? open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (out < 0) {
+        aesdlog(LOG_ERR, "Creating %s failed: %s", tmp, strerror(errno));
+        goto fail;
+    }
+
+    char raw[DATALOG_BLOCK_BYTES];
+    char packed[DATALOG_FRAME_HEADER + DATALOG_BLOCK_BYTES];
+    off_t at = 0;
+    for (int i = 0; i < n; i++) {
+        off_t pos = (off_t)i * DATALOG_BLOCK_BYTES;
+        size_t len = seg->size - pos < DATALOG_BLOCK_BYTES ? (size_t)(seg->size - pos) : DATALOG_BLOCK_BYTES;
+        if (read_full(fd, raw, len, pos) < 0) {
+            aesdlog(LOG_ERR, "Log read failed: %s", strerror(errno));
+            goto fail;
+        }
+        // Blocks that do not shrink are stored as they are
+        size_t plen = lz4_compress(raw, len, packed + DATALOG_FRAME_HEADER, len - 1);
+        put_le32(packed, len);
+        put_le32(packed + 4, plen ? plen : len);
+        struct iovec iov[2] = {
+            { packed, DATALOG_FRAME_HEADER },
+            { plen ? packed + DATALOG_FRAME_HEADER : raw, plen ? plen : len },
+        };
+        size_t want = iov[0].iov_len + iov[1].iov_len;
+        if (write_all(out, iov, 2) != want) {
+            goto fail;
+        }
+        (*blocks)[i] = at;
+        at += want;
+    }
+    (*blocks)[n] = at;
+    *nblocks = n;
+
+    // Keep the segment's age for retention
+    struct timespec times[2] = { { seg->mtime, 0 }, { seg->mtime, 0 } };
+    futimens(out, times);
+    if (log_opts.sync != DATALOG_SYNC_NONE && fdatasync(out) < 0) {
+        aesdlog(LOG_ERR, "fdatasync failed: %s", strerror(errno));
+        goto fail;
+    }
+    if (rename(tmp, path) < 0) {
+        aesdlog(LOG_ERR, "Renaming %s failed: %s", tmp, strerror(errno));
+        goto fail;
+    }
+    if (log_opts.sync != DATALOG_SYNC_NONE) {
+        sync_dir();
+    }
+    return out;
+
+fail:
+    if (out >= 0) {
+        close(out);
+        unlink(tmp);
+    }
+    free(*blocks);
+    *blocks = NULL;
+    return -1;
+}
+
+/**
+ * Compactor thread: compress every sealed segment that is still plain,
+ * oldest first, and swap each one in once it is complete.  Readers of the
+ * plain file keep it open until they release the segment.
+ */
+static void *compactor_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&log_lock);
+    while (!compactor_stop) {
+        struct datalog_seg *seg = NULL;
+        for (int i = 0; i < nsegs - 1 && !seg; i++) {
+            if (!segs[i]->blocks && !segs[i]->pack_failed) {
+                seg = segs[i];
+            }
+        }
+        if (!seg) {
+            pthread_cond_wait(&compact_cond, &log_lock);
+            continue;
+        }
+        seg->refs++;
+        int fd = seg->fd;
+        pthread_mutex_unlock(&log_lock);
+
+        off_t *blocks;
+        int nblocks;
+        int packed = pack_segment(seg, fd, &blocks, &nblocks);
+
+        pthread_mutex_lock(&log_lock);
+        int swapped = packed >= 0 && !seg->dead;
+        if (swapped) {
+            seg->old_fd = seg->fd;
+            seg->fd = packed;
+            seg->blocks = blocks;
+            seg->nblocks = nblocks;
+        } else {
+            seg->pack_failed = packed < 0;
+        }
+        pthread_mutex_unlock(&log_lock);
+
+        char path[SEG_PATH_MAX];
+        if (swapped) {
+            seg_path(path, sizeof(path), seg->base, 1, 0);
+        } else if (packed >= 0) {
+            // Dropped by retention meanwhile, which may have missed this file
+            close(packed);
+            free(blocks);
+            packed_path(path, sizeof(path), seg->base, 0);
+        }
+        if (packed >= 0) {
+            unlink(path);
+        }
+        datalog_seg_put(seg);
+        pthread_mutex_lock(&log_lock);
+    }
+    pthread_mutex_unlock(&log_lock);
+    return NULL;
+}
+
+/**
+ * Open every segment: sealed ones through their index, the tail by
+ * scanning what its index does not cover
+ * @return 0 on success, -1 on failure (already logged).
+ */
+static int open_segments(void) {
+    int count;
+    off_t *bases = list_sealed(&count);
+    off_t next_base = 0;
+    uint64_t next_packet = 0;
+    for (int i = 0; i < count; i++) {
+        struct datalog_seg *seg = open_sealed(bases[i], next_base, next_packet);
+        if (!seg) {
+            continue;
+        }
+        if (segs_push(seg) < 0) {
+            seg_free(seg);
+            free(bases);
+            return -1;
+        }
+        next_base = seg->base + seg->size;
+        next_packet = seg->first_packet + seg->packets;
+    }
+    free(bases);
+
+    struct datalog_seg *tail = open_tail(next_base, next_packet, nsegs > 0);
+    if (!tail || segs_push(tail) < 0) {
+        if (tail) seg_free(tail);
+        return -1;
+    }
+    log_size = tail->base + tail->size;
+    log_packets = tail->first_packet + tail->packets;
+    return 0;
+}
+
+static void close_segments(int remove) {
+    for (int i = 0; i < nsegs; i++) {
+        struct datalog_seg *seg = segs[i];
+        if (remove) {
+            char path[SEG_PATH_MAX];
+            int sealed = i < nsegs - 1;
+            seg_path(path, sizeof(path), seg->base, sealed, 0);
+            unlink(path);
+            seg_path(path, sizeof(path), seg->base, sealed, 1);
+            unlink(path);
+            packed_path(path, sizeof(path), seg->base, 0);
+            unlink(path);
+        }
+        seg_free(seg);
+    }
+    free(segs);
+    segs = NULL;
+    nsegs = segs_cap = 0;
+}
+
+int datalog_open(const char *path, const struct datalog_options *opts) {
+    if (committer_running) {
+        return 0; // a handoff failed before the log was stopped
+    }
+    snprintf(log_path, sizeof(log_path), "%s", path);
+    log_opts = *opts;
+    // Segments taken over by datalog_import(), or kept by datalog_export()
+    if (nsegs == 0 && open_segments() < 0) {
+        close_segments(0);
+        return -1;
+    }
+    apply_retention();
+
+    // Timed waits use the monotonic clock so wall-clock jumps do not matter
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    committer_stop = 0;
+    if (pthread_create(&committer, NULL, committer_thread, NULL) != 0) {
+        aesdlog(LOG_ERR, "Failed to create committer thread");
+        pthread_cond_destroy(&queue_cond);
+        close_segments(0);
+        return -1;
+    }
+    committer_running = 1;
+
+    if (opts->compress) {
+        pthread_cond_init(&compact_cond, NULL);
+        compactor_stop = 0;
+        if (pthread_create(&compactor, NULL, compactor_thread, NULL) != 0) {
+            // Everything still works, the log just stays plain
+            aesdlog(LOG_ERR, "Failed to create compactor thread");
+            pthread_cond_destroy(&compact_cond);
+        } else {
+            pthread_mutex_lock(&log_lock);
+            compactor_running = 1;
+            pthread_mutex_unlock(&log_lock);
+        }
+    }
+    return 0;
+}
+
+void datalog_submit(struct datalog_req *req) {
+    req->next = NULL;
+    pthread_mutex_lock(&log_lock);
+    if (queue_tail) queue_tail->next = req;
+    else queue_head = req;
+    queue_tail = req;
+    queue_bytes += req->len;
+    // Wake the committer for the first request and when the batch is full
+    if (req == queue_head || queue_bytes >= DATALOG_BATCH_BYTES) {
+        pthread_cond_signal(&queue_cond);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+off_t datalog_size(void) {
+    pthread_mutex_lock(&log_lock);
+    off_t size = log_size;
+    pthread_mutex_unlock(&log_lock);
+    return size;
+}
+
+off_t datalog_disk_size(void) {
+    pthread_mutex_lock(&log_lock);
+    off_t disk = 0;
+    for (int i = 0; i < nsegs; i++) {
+        disk += segs[i]->blocks ? segs[i]->blocks[segs[i]->nblocks] : segs[i]->size;
+    }
+    pthread_mutex_unlock(&log_lock);
+    return disk;
+}
+
+off_t datalog_start(void) {
+    pthread_mutex_lock(&log_lock);
+    off_t start = nsegs ? segs[0]->base : 0;
+    pthread_mutex_unlock(&log_lock);
+    return start;
+}
+
+uint64_t datalog_packets(void) {
+    pthread_mutex_lock(&log_lock);
+    uint64_t packets = log_packets;
+    pthread_mutex_unlock(&log_lock);
+    return packets;
+}
+
+off_t datalog_packet_offset(uint64_t packet) {
+    pthread_mutex_lock(&log_lock);
+    if (packet >= log_packets || nsegs == 0) {
+        off_t size = log_size;
+        pthread_mutex_unlock(&log_lock);
+        return size;
+    }
+    // Last segment whose first packet is at or before the one wanted
+    int lo = 0, hi = nsegs;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (segs[mid]->first_packet > packet) hi = mid;
+        else lo = mid + 1;
+    }
+    if (lo == 0) {
+        off_t start = segs[0]->base;
+        pthread_mutex_unlock(&log_lock);
+        return start;
+    }
+    struct datalog_seg *seg = segs[lo - 1];
+    if (packet >= seg->first_packet + seg->packets || seg->nidx == 0) {
+        // In a gap left by a damaged segment: resume after it
+        off_t next = seg->base + seg->size;
+        pthread_mutex_unlock(&log_lock);
+        return next;
+    }
+
+    // Then the last index entry at or before it, and scan from there
+    lo = 0;
+    hi = seg->nidx;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (seg->idx[mid].packet > packet) hi = mid;
+        else lo = mid + 1;
+    }
+    struct idx_entry e = seg->idx[lo - 1];
+    off_t end = seg->base + seg->size;
+    int fd = seg_plain_fd(seg);
+    seg->refs++;
+    pthread_mutex_unlock(&log_lock);
+
+    uint64_t at = e.packet;
+    off_t offset = seg_scan(seg, fd, e.offset, end, &at, packet, 0);
+    datalog_seg_put(seg);
+    return offset;
+}
+
+struct datalog_seg *datalog_seg_get(off_t *offset, int *fd, off_t *file_off, size_t *avail) {
+    pthread_mutex_lock(&log_lock);
+    int i = segs_find(*offset);
+    if (i == nsegs) {
+        pthread_mutex_unlock(&log_lock);
+        return NULL;
+    }
+    struct datalog_seg *seg = segs[i];
+    if (*offset < seg->base) {
+        *offset = seg->base; // dropped by retention
+    }
+    seg->refs++;
+    *fd = seg_plain_fd(seg);
+    *file_off = *offset - seg->base;
+    *avail = seg->base + seg->size - *offset;
+    pthread_mutex_unlock(&log_lock);
+    return seg;
+}
+
+void datalog_seg_put(struct datalog_seg *seg) {
+    pthread_mutex_lock(&log_lock);
+    int free_now = --seg->refs == 0 && seg->dead;
+    int old_fd = -1;
+    if (seg->refs == 0 && !free_now) {
+        // Nobody reads the plain file a compressed one replaced any more
+        old_fd = seg->old_fd;
+        seg->old_fd = -1;
+    }
+    pthread_mutex_unlock(&log_lock);
+    if (old_fd >= 0) {
+        close(old_fd);
+    }
+    if (free_now) {
+        seg_free(seg);
+    }
+}
+
+/**
+ * Choose the frame of a framed reply that starts at *@param offset: the
+ * end-of-reply frame at @param end, a compressed block as stored if it
+ * starts there and ends by @param end, else the log bytes up to the next
+ * block boundary, stored
+ * @return 0, or -1 if the log ends before @param end.
+ */
+static int frame_start(struct datalog_frame *frame, off_t *offset, off_t end) {
+    memset(frame, 0, sizeof(*frame));
+    frame->len = DATALOG_FRAME_HEADER;
+    if (*offset >= end) {
+        return 0;
+    }
+    int fd;
+    off_t file_off;
+    size_t avail;
+    struct datalog_seg *seg = datalog_seg_get(offset, &fd, &file_off, &avail);
+    if (!seg) {
+        return -1;
+    }
+    if (*offset < end) {
+        if ((off_t)avail > end - *offset) avail = end - *offset;
+        if (avail > DATALOG_BLOCK_BYTES) avail = DATALOG_BLOCK_BYTES;
+        if (fd < 0) {
+            int i = file_off / DATALOG_BLOCK_BYTES;
+            size_t block = seg->size - (off_t)i * DATALOG_BLOCK_BYTES;
+            if (block > DATALOG_BLOCK_BYTES) block = DATALOG_BLOCK_BYTES;
+            size_t into = file_off - (off_t)i * DATALOG_BLOCK_BYTES;
+            if (into == 0 && avail == block) {
+                frame->packed = 1;
+                frame->len = seg->blocks[i + 1] - seg->blocks[i];
+            } else if (avail > block - into) {
+                avail = block - into;
+            }
+        }
+        frame->raw = avail;
+        if (!frame->packed) {
+            frame->len += avail;
+        }
+    }
+    datalog_seg_put(seg);
+    return 0;
+}
+
+/**
+ * Send more of @param frame, which starts at log offset @param offset, to
+ * @param out, at most @param max bytes
+ * @return as datalog_send(), 0 if the frame's log bytes were dropped by
+ * retention before it was out.
+ */
+static ssize_t frame_send(int out, struct datalog_frame *frame, off_t offset, size_t max) {
+    size_t count = frame->len - frame->sent;
+    if (count > max) count = max;
+    if (!frame->packed && frame->sent < DATALOG_FRAME_HEADER) {
+        char hdr[DATALOG_FRAME_HEADER];
+        put_le32(hdr, frame->raw);
+        put_le32(hdr + 4, frame->raw);
+        if (count > DATALOG_FRAME_HEADER - frame->sent) count = DATALOG_FRAME_HEADER - frame->sent;
+        return write(out, hdr + frame->sent, count);
+    }
+
+    off_t at = frame->packed ? offset : offset + (off_t)(frame->sent - DATALOG_FRAME_HEADER);
+    off_t want = at;
+    int fd;
+    off_t file_off;
+    size_t avail;
+    struct datalog_seg *seg = datalog_seg_get(&at, &fd, &file_off, &avail);
+    if (!seg) {
+        return 0;
+    }
+    ssize_t sent = 0;
+    if (at == want && frame->packed && fd < 0) {
+        off_t pos = seg->blocks[file_off / DATALOG_BLOCK_BYTES] + frame->sent;
+        sent = sendfile(out, seg->fd, &pos, count);
+    } else if (at == want && !frame->packed) {
+        sent = seg_send(out, seg, fd, at, count);
+    }
+    int saved = errno;
+    datalog_seg_put(seg);
+    errno = saved;
+    return sent;
+}
+
+/**
+ * datalog_send() for clients that take frames
+ */
+static ssize_t send_frames(int out, off_t *offset, off_t end, size_t max, struct datalog_frame *frame) {
+    size_t total = 0;
+    while (total < max && !frame->done) {
+        if (frame->len == 0 && frame_start(frame, offset, end) < 0) {
+            break;
+        }
+        ssize_t n = frame_send(out, frame, *offset, max - total);
+        if (n <= 0) {
+            return total ? (ssize_t)total : n;
+        }
+        total += n;
+        frame->sent += n;
+        if (frame->sent == frame->len) {
+            *offset += frame->raw;
+            frame->done = frame->raw == 0;
+            frame->len = 0;
+        }
+    }
+    return total;
+}
+
+ssize_t datalog_send(int sockfd, off_t *offset, off_t end, size_t max, struct datalog_frame *frame) {
+    if (frame) {
+        return send_frames(sockfd, offset, end, max, frame);
+    }
+    if (*offset >= end) {
+        return 0;
+    }
+    int fd;
+    off_t file_off;
+    size_t count;
+    struct datalog_seg *seg = datalog_seg_get(offset, &fd, &file_off, &count);
+    if (!seg) {
+        return 0;
+    }
+    if (*offset >= end) {
+        datalog_seg_put(seg);
+        return 0;
+    }
+    if ((off_t)count > end - *offset) count = end - *offset;
+    if (count > max) count = max;
+    if (count > INT_MAX) count = INT_MAX;
+
+    ssize_t sent = seg_send(sockfd, seg, fd, *offset, count);
+    int saved = errno;
+    datalog_seg_put(seg);
+    if (sent > 0) {
+        *offset += sent;
+    }
+    errno = saved;
+    return sent;
+}
+
+void datalog_watch(int fd, int on) {
+    pthread_mutex_lock(&log_lock);
+    int i = 0;
+    while (i < nwatch && watch_fds[i] != fd) i++;
+    if (on && i == nwatch && nwatch < MAX_WATCHERS) {
+        watch_fds[nwatch] = fd;
+        __atomic_store_n(&nwatch, nwatch + 1, __ATOMIC_RELAXED);
+    } else if (!on && i < nwatch) {
+        watch_fds[i] = watch_fds[nwatch - 1];
+        __atomic_store_n(&nwatch, nwatch - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&log_lock);
+}
+
+/**
+ * Commit whatever is still queued and stop the committer and the compactor
+ */
+static void stop_threads(void) {
+    if (committer_running) {
+        pthread_mutex_lock(&log_lock);
+        committer_stop = 1;
+        pthread_cond_signal(&queue_cond);
+        pthread_mutex_unlock(&log_lock);
+        pthread_join(committer, NULL);
+        pthread_cond_destroy(&queue_cond);
+        committer_running = 0;
+    }
+    // After the committer, which wakes it on every rotation
+    if (compactor_running) {
+        pthread_mutex_lock(&log_lock);
+        compactor_stop = 1;
+        compactor_running = 0;
+        pthread_cond_signal(&compact_cond);
+        pthread_mutex_unlock(&log_lock);
+        pthread_join(compactor, NULL);
+        pthread_cond_destroy(&compact_cond);
+    }
+}
+
+/**
+ * Receive one segment sent by datalog_export()
+ * @return the segment, or NULL with errno set.
+ */
+static struct datalog_seg *seg_import(int sock) {
+    struct seg_wire w;
+    int fds[2], n;
+    if (handoff_recv(sock, &w, sizeof(w), fds, 2, &n) < 0) {
+        for (int i = 0; i < n; i++) close(fds[i]);
+        return NULL;
+    }
+    struct datalog_seg *seg = NULL;
+    if (n >= 1 && n == w.nfds && w.nidx >= 0 && w.nblocks >= 0) {
+        seg = seg_new(w.base, fds[0]);
+    }
+    if (!seg) {
+        for (int i = 0; i < n; i++) close(fds[i]);
+        errno = n >= 1 && n == w.nfds ? ENOMEM : EPROTO;
+        return NULL;
+    }
+    if (n == 2) seg->idxfd = fds[1];
+    seg->size = w.size;
+    seg->first_packet = w.first_packet;
+    seg->packets = w.packets;
+    seg->mtime = w.mtime;
+    seg->pack_failed = w.pack_failed;
+
+    size_t idx_len = w.nidx * sizeof(*seg->idx);
+    size_t blocks_len = w.packed ? (w.nblocks + 1) * sizeof(*seg->blocks) : 0;
+    seg->idx = w.nidx ? malloc(idx_len) : NULL;
+    seg->blocks = w.packed ? malloc(blocks_len) : NULL;
+    if ((w.nidx && !seg->idx) || (w.packed && !seg->blocks)) {
+        seg_free(seg);
+        errno = ENOMEM;
+        return NULL;
+    }
+    seg->nidx = seg->idx_cap = w.nidx;
+    seg->nblocks = w.nblocks;
+    if (handoff_recv(sock, seg->idx, idx_len, NULL, 0, NULL) < 0 ||
+        handoff_recv(sock, seg->blocks, blocks_len, NULL, 0, NULL) < 0) {
+        seg_free(seg);
+        return NULL;
+    }
+    return seg;
+}
+
+int datalog_export(int sock) {
+    stop_threads();
+
+    struct log_wire log = { log_size, log_packets, nsegs, open_packet };
+    if (handoff_send(sock, &log, sizeof(log), NULL, 0) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < nsegs; i++) {
+        struct datalog_seg *seg = segs[i];
+        struct seg_wire w = {
+            .base = seg->base,
+            .size = seg->size,
+            .first_packet = seg->first_packet,
+            .packets = seg->packets,
+            .mtime = seg->mtime,
+            .nidx = seg->nidx,
+            .nblocks = seg->nblocks,
+            .packed = seg->blocks != NULL,
+            .pack_failed = seg->pack_failed,
+            .nfds = seg->idxfd >= 0 ? 2 : 1,
+        };
+        int fds[2] = { seg->fd, seg->idxfd };
+        size_t blocks_len = seg->blocks ? (seg->nblocks + 1) * sizeof(*seg->blocks) : 0;
+        if (handoff_send(sock, &w, sizeof(w), fds, w.nfds) < 0 ||
+            handoff_send(sock, seg->idx, seg->nidx * sizeof(*seg->idx), NULL, 0) < 0 ||
+            handoff_send(sock, seg->blocks, blocks_len, NULL, 0) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int datalog_import(int sock, const char *path) {
+    snprintf(log_path, sizeof(log_path), "%s", path);
+    struct log_wire log;
+    if (handoff_recv(sock, &log, sizeof(log), NULL, 0, NULL) < 0) {
+        goto fail;
+    }
+    for (int i = 0; i < log.nsegs; i++) {
+        struct datalog_seg *seg = seg_import(sock);
+        if (!seg) {
+            goto fail;
+        }
+        if (segs_push(seg) < 0) {
+            seg_free(seg);
+            errno = ENOMEM;
+            goto fail;
+        }
+    }
+    // Only the tail is appended to, and it needs its index open
+    if (nsegs == 0 || segs[nsegs - 1]->idxfd < 0) {
+        errno = EPROTO;
+        goto fail;
+    }
+    log_size = log.size;
+    log_packets = log.packets;
+    open_packet = log.open_packet;
+    return 0;
+
+fail:
+    aesdlog(LOG_ERR, "Handoff of the data log failed: %s", strerror(errno));
+    close_segments(0);
+    return -1;
+}
+
+void datalog_close(int remove) {
+    stop_threads();
+    free(batch_iov);
+    batch_iov = NULL;
+    batch_iov_cap = 0;
+
+    if (log_path[0]) {
+        close_segments(remove);
+    }
+}
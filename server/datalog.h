@@ -0,0 +1,204 @@
+#ifndef DATALOG_H
+#define DATALOG_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * Persistent append-only log backing /var/tmp/aesdsocketdata.
+ * Offsets are logical: they count every byte ever appended and survive
+ * restarts and retention.  The log is stored as segments; the one being
+ * appended to is the file at the configured path and sealed segments are
+ * renamed to "<path>.<first offset>".  Each segment has a sparse index
+ * ("<segment>.idx") of packet start offsets, so a packet is found by
+ * scanning at most DATALOG_INDEX_EVERY packets, and only the tail segment
+ * is scanned on recovery.
+ * Files stay open for the whole process and their sizes are tracked in
+ * memory, so a replay is a sendfile() of the requested range straight from
+ * the page cache.
+ * Appends are group-committed: workers queue requests and a single
+ * committer thread writes everything queued with one writev, syncs it
+ * according to the durability mode, and only then completes the requests.
+ * With compression on, a compactor thread rewrites every sealed segment as
+ * "<segment>.lz4": a sequence of independently decodable frames, each one
+ * DATALOG_BLOCK_BYTES of log (the last one possibly shorter) behind a
+ * DATALOG_FRAME_HEADER.  The plain file is deleted once that is complete.
+ * The tail is never compressed, so appends and replies of fresh data stay
+ * zero-copy.  Replies from compressed segments are decompressed a block at
+ * a time, or sent as stored to clients that take frames.
+ */
+
+// Queued bytes that end a group-commit window early
+#define DATALOG_BATCH_BYTES     (1024 * 1024)
+// fdatasync interval for DATALOG_SYNC_PERIODIC
+#define DATALOG_SYNC_PERIOD_MS  1000
+// One index entry per this many packets
+#define DATALOG_INDEX_EVERY     64
+// Default segment size; a segment is sealed at the first batch past it
+#define DATALOG_SEGMENT_BYTES   (64 * 1024 * 1024)
+// Default segment size with compression, which only covers sealed segments
+#define DATALOG_PACKED_SEGMENT_BYTES (4 * 1024 * 1024)
+// Log bytes per compressed block
+#define DATALOG_BLOCK_BYTES     (64 * 1024)
+// Frame header: log bytes in the frame, then payload bytes, both 32-bit
+// little endian.  The payload is an LZ4 block (see lz4.h) when the two
+// differ, the log bytes themselves when they are equal.
+#define DATALOG_FRAME_HEADER    8
+
+enum datalog_sync {
+    DATALOG_SYNC_NONE,      // leave flushing to the kernel
+    DATALOG_SYNC_BATCH,     // fdatasync every batch before completing it
+    DATALOG_SYNC_PERIODIC,  // fdatasync at most every DATALOG_SYNC_PERIOD_MS
+};
+
+struct datalog_options {
+    enum datalog_sync sync;
+    // How long the committer waits for more requests after the first one
+    // of a batch (0 takes whatever is queued right away)
+    long window_us;
+    // Segment size (0: never rotate, the log stays a single file)
+    off_t segment_bytes;
+    // Drop the oldest sealed segments while more than this is kept (0: no limit)
+    off_t retain_bytes;
+    // Drop sealed segments last written longer ago than this (0: no limit)
+    long retain_secs;
+    // LZ4-compress sealed segments in the background
+    int compress;
+};
+
+/**
+ * One record to append.  The buffers must stay valid until complete() runs.
+ */
+struct datalog_req {
+    const struct iovec *iov;
+    int iovcnt;
+    size_t len;         // total bytes in iov
+    // Record-relative end of every packet in it, for the index
+    const off_t *ends;
+    int nends;
+    off_t end;          // set on completion: log size right after the record, -1 on failure
+    // Called on the committer thread once the record's batch has committed
+    void (*complete)(struct datalog_req *req);
+    struct datalog_req *next;
+};
+
+/**
+ * Open (creating if needed) the log at @param path and start the committer.
+ * Existing segments are kept, as the original per-connection open did;
+ * sealed ones are trusted through their index and only the tail is scanned.
+ * @param opts selects durability, batching, rotation and retention.
+ * A log that is already open, taken over with datalog_import() or kept
+ * after datalog_export(), is used as it is: only the threads start.
+ * @return 0 on success, -1 on failure (already logged).
+ */
+int datalog_open(const char *path, const struct datalog_options *opts);
+
+/**
+ * Queue @param req.  Records are written contiguously and in submission
+ * order; @param req->iovcnt may exceed IOV_MAX.
+ */
+void datalog_submit(struct datalog_req *req);
+
+/**
+ * @return the offset just past the last committed byte
+ */
+off_t datalog_size(void);
+
+/**
+ * @return the offset of the oldest byte still retained
+ */
+off_t datalog_start(void);
+
+/**
+ * @return the number of packets ever committed
+ */
+uint64_t datalog_packets(void);
+
+/**
+ * @return the offset where packet number @param packet starts, the start
+ * of the log if it has been dropped by retention, datalog_size() if it
+ * is not committed yet, or -1 if the log could not be read
+ */
+off_t datalog_packet_offset(uint64_t packet);
+
+/**
+ * @return the bytes the retained log takes on disk
+ */
+off_t datalog_disk_size(void);
+
+/**
+ * Progress of a reply sent as frames (see AESDSOCKET_COMPRESS in
+ * protocol.h).  Zero it before every reply.
+ */
+struct datalog_frame {
+    size_t len;         // bytes of the frame being sent, 0 before it is chosen
+    size_t sent;        // of which already sent
+    size_t raw;         // log bytes it carries, 0 for the end of the reply
+    int packed;         // a compressed block, sent as stored
+    int done;           // the end-of-reply frame is out
+};
+
+/**
+ * Copy log bytes [*@param offset, @param end) to the socket or pipe
+ * @param sockfd, at most @param max of them.  Plain segments are sent
+ * without going through userspace, compressed ones are decompressed a
+ * block at a time.  With @param frame set the range goes out as frames
+ * instead, compressed blocks as they are stored, followed by an
+ * end-of-reply frame.
+ * *offset is advanced by what was sent (in frame mode, once a frame is
+ * complete), and first past any bytes dropped by retention.
+ * @return bytes sent, 0 when the range is exhausted, or -1 with errno set
+ * (EAGAIN when the socket buffer is full).
+ */
+ssize_t datalog_send(int sockfd, off_t *offset, off_t end, size_t max, struct datalog_frame *frame);
+
+struct datalog_seg;
+
+/**
+ * Pin the segment holding *@param offset, for backends that move replies
+ * with their own splice() calls.  *offset is first advanced past bytes
+ * dropped by retention.  The segment stays readable through @param fd at
+ * @param file_off, for @param avail committed bytes, until it is released
+ * with datalog_seg_put().  *fd is -1 for a compressed segment, which only
+ * datalog_send() can read.
+ * @return the segment, or NULL if *offset is at the end of the log.
+ */
+struct datalog_seg *datalog_seg_get(off_t *offset, int *fd, off_t *file_off, size_t *avail);
+
+void datalog_seg_put(struct datalog_seg *seg);
+
+/**
+ * While @param on is set, write 1 to the eventfd @param fd after every
+ * committed batch, so that a worker can push new appends to the clients
+ * following the log.  One eventfd per worker, however many followers.
+ */
+void datalog_watch(int fd, int on);
+
+/**
+ * Hand the open log to a successor process (see handoff.h) over the Unix
+ * socket @param sock: commit whatever is queued and stop the background
+ * threads, then send every segment's files with SCM_RIGHTS, along with
+ * its index, block table and counters, so that nothing is scanned again.
+ * Nothing may be submitted or read meanwhile.  The log stays open here:
+ * datalog_close(0) once the successor has it, or datalog_open() to carry
+ * on with it.
+ * @return 0 on success, -1 with errno set.
+ */
+int datalog_export(int sock);
+
+/**
+ * Take over the log at @param path that a predecessor sent on
+ * @param sock with datalog_export(), instead of opening its files.  No
+ * thread is started; datalog_open() does that later.
+ * @return 0 on success, -1 on failure (already logged).
+ */
+int datalog_import(int sock, const char *path);
+
+/**
+ * Commit whatever is still queued, stop the committer and close the log,
+ * deleting every segment if @param remove is set
+ */
+void datalog_close(int remove);
+
+#endif // DATALOG_H
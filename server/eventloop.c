@@ -0,0 +1,1038 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <time.h>
+
+#include "eventloop.h"
+#include "datalog.h"
+#include "bufpool.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "admission.h"
+#include "aesdlog.h"
+
+// Reply bytes one connection may send before yielding to the others
+#define CONN_WRITE_BUDGET (256 * 1024)
+// How often a draining loop checks its deadline and exit_flag
+#define DRAIN_POLL_MS 100
+
+/**
+ * Per-connection state machine:
+ *   CONN_READING   - collecting bytes; every newline ends one packet
+ *   CONN_COMMITTING - batch handed to the data log's group commit, waiting
+ *                    for it to be written before anything is answered
+ *   CONN_REPLYING  - sendfile()ing one log range per committed packet,
+ *                    possibly across many EPOLLOUT
+ *   CONN_CLOSING   - peer gone or error, connection is torn down
+ * A connection cycles between READING and REPLYING for as long as the
+ * client keeps it open, so packets can be pipelined on one socket.
+ * Command lines (see protocol.h) are answered in the same cycle: framing
+ * stops at one, the packets before it are committed and answered, and the
+ * command then runs with nothing else queued.
+ */
+enum conn_state {
+    CONN_READING,
+    CONN_COMMITTING,
+    CONN_REPLYING,
+    CONN_CLOSING,
+};
+
+struct event_loop;
+
+struct connection {
+    int fd;
+    enum conn_state state;
+    int peer_closed;   // EOF seen, close once the replies are out
+    int hung_up;       // error or hangup while committing, close after it
+    int corked;        // TCP_CORK set for a multi-packet reply
+    char client_ip[INET_ADDRSTRLEN];
+    uint32_t ip;
+    int ip_counted;    // holds one of its IP's max_per_ip connections
+    // Error line sent on close, when admission control refused it
+    const char *refusal;
+    struct event_loop *loop;
+
+    // Received bytes not committed yet, as pooled segments
+    struct buf_chain inbuf;
+
+    // Complete packets queued in the group commit, and their iovec
+    struct buf_chain batch;
+    struct iovec *iov;
+    int iov_cap;
+    struct datalog_req req;
+
+    // Packet ends: offsets into inbuf while reading, log offsets once
+    // committed.  Packet i is answered with the retained log up to ends[i].
+    off_t *ends;
+    int nends;
+    int ends_cap;
+
+    // Reply progress: packet being answered and offset within its range
+    int reply_idx;
+    off_t reply_off;
+    // Replies go out as frames (AESDSOCKET_COMPRESS), this one so far
+    int framed;
+    struct datalog_frame frame;
+
+    // Where replies start: 0 for the whole retained log, or where the
+    // client seeked to.  A follower's moves along with what it was sent.
+    off_t cursor;
+    int following;
+    struct connection *follow_prev, *follow_next;
+
+    // A command line ending at inbuf offset cmd_end waits for the packets
+    // before it (0: none); rescan is set while inbuf holds unframed bytes
+    struct proto_cmd cmd;
+    off_t cmd_end;
+    int rescan;
+
+    // Timestamps for the append and replay latency histograms
+    uint64_t commit_start;
+    uint64_t reply_start;
+    // Last time a reply byte went out, for the send timeout
+    uint64_t last_progress;
+
+    // Linked into the loop's ready list when its write budget ran out
+    int ready;
+    struct connection *ready_prev, *ready_next;
+
+    struct connection *prev, *next;
+};
+
+// One instance per worker thread, nothing in it is shared
+struct event_loop {
+    int epfd;
+    int listenfd;
+    int wakefd;
+    const struct loop_options *opts;
+    // All live connections, so that shutdown can release them
+    struct connection *conn_list;
+    // Connections with reply bytes left after using their write budget
+    struct connection *ready_list;
+    // Connections following the log; donefd is also poked on every append
+    // while there are any
+    struct connection *follow_list;
+    int nfollowers;
+    uint64_t last_sweep;
+    // When the drain for a successor started, 0 if not draining
+    uint64_t drain_start;
+    // Commit queue delay, for shedding new connections
+    struct codel codel;
+    // Receive segments, recycled across this worker's connections
+    struct bufpool pool;
+
+    // Commits finished by the data log, handed over through donefd
+    int donefd;
+    pthread_mutex_t done_lock;
+    struct datalog_req *done_list;
+    int commits_pending;
+
+    // This worker's counters and histograms
+    struct metrics_shard *metrics;
+
+    // Sampling of per-connection syslog lines
+    time_t log_second;
+    int log_lines;
+    unsigned long log_suppressed;
+};
+
+// Markers for the non-connection entries in the epoll set
+static char listen_tag, wake_tag, done_tag;
+
+/**
+ * Allocate a connection for @param fd and link it into the loop's conn_list
+ */
+static struct connection *conn_new(struct event_loop *loop, int fd, const struct sockaddr_in *addr) {
+    struct connection *conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->loop = loop;
+    conn->state = CONN_READING;
+    conn->ip = addr->sin_addr.s_addr;
+    inet_ntop(AF_INET, &addr->sin_addr, conn->client_ip, sizeof(conn->client_ip));
+    metrics_add(loop->metrics, MC_ACCEPTS, 1);
+
+    conn->next = loop->conn_list;
+    if (loop->conn_list) loop->conn_list->prev = conn;
+    loop->conn_list = conn;
+    return conn;
+}
+
+/**
+ * Close the socket, release the buffers and unlink @param conn
+ */
+static void conn_free(struct event_loop *loop, struct connection *conn) {
+    if (conn->prev) conn->prev->next = conn->next;
+    else loop->conn_list = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    if (conn->ready) {
+        if (conn->ready_prev) conn->ready_prev->ready_next = conn->ready_next;
+        else loop->ready_list = conn->ready_next;
+        if (conn->ready_next) conn->ready_next->ready_prev = conn->ready_prev;
+    }
+    if (conn->following) {
+        if (conn->follow_prev) conn->follow_prev->follow_next = conn->follow_next;
+        else loop->follow_list = conn->follow_next;
+        if (conn->follow_next) conn->follow_next->follow_prev = conn->follow_prev;
+        if (--loop->nfollowers == 0) {
+            datalog_watch(loop->donefd, 0);
+        }
+    }
+
+    // Closing the fd also removes it from the epoll set
+    if (conn->refusal) {
+        admission_refuse(conn->fd, conn->refusal);
+    }
+    close(conn->fd);
+    if (conn->ip_counted) {
+        admission_release(conn->ip);
+    }
+    metrics_add(loop->metrics, MC_CLOSES, 1);
+    buf_chain_release(&loop->pool, &conn->inbuf);
+    buf_chain_release(&loop->pool, &conn->batch);
+    free(conn->iov);
+    free(conn->ends);
+    free(conn);
+}
+
+/**
+ * syslog "@param what connection from <client>" unless this worker already
+ * logged CONN_LOG_PER_SEC such lines this second, so that logging cannot
+ * throttle the accept path.  Dropped lines are counted and summarised.
+ */
+static void conn_log(struct event_loop *loop, const char *what, const struct connection *conn) {
+    time_t now = time(NULL);
+    if (now != loop->log_second) {
+        if (loop->log_suppressed) {
+            aesdlog(LOG_INFO, "Suppressed %lu connection messages", loop->log_suppressed);
+        }
+        loop->log_second = now;
+        loop->log_lines = 0;
+        loop->log_suppressed = 0;
+    }
+    if (loop->log_lines < CONN_LOG_PER_SEC) {
+        loop->log_lines++;
+        aesdlog(LOG_INFO, "%s connection from %s", what, conn->client_ip);
+    } else {
+        loop->log_suppressed++;
+        metrics_add(loop->metrics, MC_LOG_DROPPED, 1);
+    }
+}
+
+/**
+ * Close @param conn with the error line @param line, counted as @param reason
+ */
+static void conn_refuse(struct connection *conn, enum metrics_counter reason, const char *line) {
+    metrics_add(conn->loop->metrics, reason, 1);
+    conn->refusal = line;
+    conn->state = CONN_CLOSING;
+}
+
+/**
+ * Record a packet ending at offset @param end of the input buffer
+ * @return 0 on success, -1 if the array could not grow.
+ */
+static int conn_push_end(struct connection *conn, off_t end) {
+    if (conn->nends == conn->ends_cap) {
+        int cap = conn->ends_cap ? conn->ends_cap * 2 : 16;
+        off_t *ends = realloc(conn->ends, cap * sizeof(*ends));
+        if (!ends) {
+            return -1;
+        }
+        conn->ends = ends;
+        conn->ends_cap = cap;
+    }
+    conn->ends[conn->nends++] = end;
+    return 0;
+}
+
+/**
+ * Runs on the data log's committer thread: queue the finished request for
+ * its worker and wake that worker's loop
+ */
+static void conn_commit_done(struct datalog_req *req) {
+    struct connection *conn = (struct connection *)((char *)req - offsetof(struct connection, req));
+    struct event_loop *loop = conn->loop;
+
+    pthread_mutex_lock(&loop->done_lock);
+    req->next = loop->done_list;
+    loop->done_list = req;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    uint64_t one = 1;
+    if (write(loop->donefd, &one, sizeof(one)) < 0) {
+        aesdlog(LOG_ERR, "eventfd write failed: %s", strerror(errno));
+    }
+}
+
+/**
+ * Queue every complete packet in the input buffer for the data log as one
+ * record and keep the trailing partial packet for later.  The connection
+ * waits in CONN_COMMITTING until the group commit has written it.
+ * @return 0 on success, -1 if the connection should be closed.
+ */
+static int conn_commit_packets(struct connection *conn) {
+    struct bufpool *pool = &conn->loop->pool;
+    off_t complete = conn->ends[conn->nends - 1];
+
+    struct buf_chain rest;
+    if (buf_chain_split(pool, &conn->inbuf, complete, &rest) < 0) {
+        aesdlog(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    conn->batch = conn->inbuf;
+    conn->inbuf = rest;
+    if (conn->cmd_end) {
+        conn->cmd_end -= complete;
+    }
+
+    if (conn->batch.nsegs > conn->iov_cap) {
+        struct iovec *iov = realloc(conn->iov, conn->batch.nsegs * sizeof(*iov));
+        if (!iov) {
+            aesdlog(LOG_ERR, "Memory allocation failed");
+            return -1;
+        }
+        conn->iov = iov;
+        conn->iov_cap = conn->batch.nsegs;
+    }
+
+    // The segments go to writev as they are, no flattening copy
+    conn->req.iov = conn->iov;
+    conn->req.iovcnt = buf_chain_iov(&conn->batch, conn->iov, conn->batch.nsegs);
+    conn->req.len = complete;
+    conn->req.ends = conn->ends;
+    conn->req.nends = conn->nends;
+    conn->req.complete = conn_commit_done;
+    conn->commit_start = metrics_now();
+    conn->state = CONN_COMMITTING;
+    conn->loop->commits_pending++;
+    datalog_submit(&conn->req);
+    return 0;
+}
+
+/**
+ * The batch of @param conn is in the log: prepare one reply per packet.
+ * Each reply covers the log as it was right after that packet, exactly as
+ * if the packets had arrived on separate connections.
+ */
+static void conn_commit_finished(struct connection *conn) {
+    struct metrics_shard *metrics = conn->loop->metrics;
+    buf_chain_release(&conn->loop->pool, &conn->batch);
+    if (conn->req.end < 0 || conn->hung_up) {
+        conn->state = CONN_CLOSING;
+        return;
+    }
+    conn->reply_start = metrics_now();
+    conn->last_progress = conn->reply_start;
+    metrics_observe(metrics, MH_APPEND, conn->reply_start - conn->commit_start);
+    codel_sample(&conn->loop->codel, conn->reply_start, conn->reply_start - conn->commit_start);
+    metrics_add(metrics, MC_PACKETS, conn->nends);
+
+    // The batch landed contiguously, so packet ends map straight to the log
+    off_t base = conn->req.end - conn->ends[conn->nends - 1];
+    for (int i = 0; i < conn->nends; i++) {
+        conn->ends[i] += base;
+    }
+    conn->reply_idx = 0;
+    conn->reply_off = conn->cursor;
+    memset(&conn->frame, 0, sizeof(conn->frame));
+    conn->state = CONN_REPLYING;
+
+    // Hold back partial frames so that back-to-back replies share segments
+    if (conn->nends > 1) {
+        int on = 1;
+        conn->corked = setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0;
+    }
+}
+
+/**
+ * Answer @param conn with the log from its cursor up to @param end
+ * @return 0 on success, -1 if memory ran out.
+ */
+static int conn_start_reply(struct connection *conn, off_t end) {
+    conn->nends = 0;
+    if (conn_push_end(conn, end) < 0) {
+        aesdlog(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    conn->reply_idx = 0;
+    conn->reply_off = conn->cursor;
+    memset(&conn->frame, 0, sizeof(conn->frame));
+    conn->reply_start = metrics_now();
+    conn->last_progress = conn->reply_start;
+    conn->state = CONN_REPLYING;
+    return 0;
+}
+
+/**
+ * Send a follower in CONN_READING whatever was appended since its last reply
+ * @return 1 if a reply was started, 0 if it is up to date.
+ */
+static int conn_follow(struct connection *conn) {
+    off_t size = datalog_size();
+    if (conn->cursor >= size) {
+        return 0;
+    }
+    if (conn_start_reply(conn, size) < 0) {
+        conn->state = CONN_CLOSING;
+    }
+    return 1;
+}
+
+/**
+ * @return 1 if inbuf bytes [@param start, @param end) are a command line,
+ * parsed into conn->cmd.  @param chunk holds the bytes from inbuf offset
+ * @param chunk_off on, so short lines are usually looked at in place.
+ */
+static int conn_is_command(struct connection *conn, off_t start, off_t end, off_t chunk_off, const char *chunk) {
+    size_t len = end - start;
+    if (len > PROTO_MAX_LINE) {
+        return 0;
+    }
+    if (start >= chunk_off) {
+        return proto_parse(chunk + (start - chunk_off), len, &conn->cmd);
+    }
+    char line[PROTO_MAX_LINE];
+    buf_chain_peek(&conn->inbuf, start, line, len);
+    return proto_parse(line, len, &conn->cmd);
+}
+
+/**
+ * Note every packet boundary in the @param len bytes at @param chunk,
+ * which sit at inbuf offset @param chunk_off.  Framing stops after a
+ * command line, leaving it in inbuf for conn_run_command().
+ * @return 1 if it stopped at a command, 0 if all bytes were framed, -1 if
+ * memory ran out or a packet, complete or not, is over max_packet.
+ */
+static int conn_frame(struct connection *conn, off_t chunk_off, const char *chunk, size_t len) {
+    size_t max_packet = conn->loop->opts->max_packet;
+    const char *p = chunk, *chunk_end = chunk + len;
+    while ((p = memchr(p, '\n', chunk_end - p)) != NULL) {
+        p++;
+        off_t end = chunk_off + (p - chunk);
+        off_t start = conn->nends ? conn->ends[conn->nends - 1] : 0;
+        if (max_packet && (size_t)(end - start) > max_packet) {
+            conn_refuse(conn, MC_REJECT_TOO_LONG, PROTO_ERR_TOO_LONG);
+            return -1;
+        }
+        if (conn_is_command(conn, start, end, chunk_off, chunk)) {
+            conn->cmd_end = end;
+            return 1;
+        }
+        if (conn_push_end(conn, end) < 0) {
+            aesdlog(LOG_ERR, "Memory allocation failed");
+            return -1;
+        }
+    }
+    // Refuse an overlong packet before it is all in memory
+    off_t start = conn->nends ? conn->ends[conn->nends - 1] : 0;
+    if (max_packet && (size_t)(chunk_off + len - start) > max_packet) {
+        conn_refuse(conn, MC_REJECT_TOO_LONG, PROTO_ERR_TOO_LONG);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Frame the bytes already in inbuf, left behind by a command
+ * @return as conn_frame().
+ */
+static int conn_rescan(struct connection *conn) {
+    off_t off = 0;
+    for (struct buf_seg *seg = conn->inbuf.head; seg; seg = seg->next) {
+        int rc = conn_frame(conn, off, seg->data, seg->len);
+        if (rc != 0) {
+            return rc;
+        }
+        off += seg->len;
+    }
+    return 0;
+}
+
+/**
+ * Drop the command line at the head of inbuf and carry it out
+ * @return 0 on success, -1 if the connection should be closed.
+ */
+static int conn_run_command(struct connection *conn) {
+    struct bufpool *pool = &conn->loop->pool;
+    struct buf_chain rest;
+    if (buf_chain_split(pool, &conn->inbuf, conn->cmd_end, &rest) < 0) {
+        aesdlog(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    buf_chain_release(pool, &conn->inbuf);
+    conn->inbuf = rest;
+    conn->cmd_end = 0;
+    conn->rescan = conn->inbuf.len > 0;
+
+    if (conn->cmd.compress) {
+        conn->framed = 1;
+        return 0;
+    }
+    if (conn->cmd.seek) {
+        conn->cursor = proto_seek_offset(&conn->cmd);
+    }
+    if (!conn->cmd.follow) {
+        return conn_start_reply(conn, datalog_size());
+    }
+    if (!conn->following) {
+        struct event_loop *loop = conn->loop;
+        conn->following = 1;
+        conn->follow_prev = NULL;
+        conn->follow_next = loop->follow_list;
+        if (loop->follow_list) loop->follow_list->follow_prev = conn;
+        loop->follow_list = conn;
+        if (loop->nfollowers++ == 0) {
+            datalog_watch(loop->donefd, 1);
+        }
+    }
+    conn_follow(conn);
+    return conn->state == CONN_CLOSING ? -1 : 0;
+}
+
+/**
+ * Drain the socket (edge-triggered), receiving straight into pooled
+ * segments and noting every packet boundary.  Complete packets are
+ * committed together once the socket runs dry, the batch grows past
+ * BATCH_BYTES or the peer closes; a partial packet left at EOF is still
+ * written, like before.  A command line ends the batch early.  Once the
+ * memory budget is used up, the packets framed so far are committed and
+ * a connection that still needs another segment is refused.
+ * @return 0 if the socket would block, 1 if the state changed.
+ */
+static int conn_handle_read(struct connection *conn) {
+    if (conn->cmd_end && conn->nends == 0) {
+        if (conn_run_command(conn) < 0) {
+            conn->state = CONN_CLOSING;
+        }
+        return 1;
+    }
+    int framed = 0;
+    if (conn->rescan) {
+        conn->rescan = 0;
+        framed = conn_rescan(conn);
+    }
+
+    while (framed == 0) {
+        struct buf_seg *tail = conn->inbuf.tail;
+        if ((!tail || tail->len == tail->cap) && admission_over_budget(conn->loop->opts)) {
+            if (conn->nends > 0) break;
+            conn_refuse(conn, MC_REJECT_MEMORY, PROTO_ERR_MEMORY);
+            return 1;
+        }
+        struct buf_seg *seg = buf_chain_reserve(&conn->loop->pool, &conn->inbuf);
+        if (!seg) {
+            aesdlog(LOG_ERR, "Memory allocation failed");
+            conn->state = CONN_CLOSING;
+            return 1;
+        }
+
+        char *chunk = seg->data + seg->len;
+        uint64_t t0 = metrics_now();
+        ssize_t bytes_received = recv(conn->fd, chunk, seg->cap - seg->len, 0);
+        metrics_observe(conn->loop->metrics, MH_RECV, metrics_now() - t0);
+        if (bytes_received < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                aesdlog(LOG_ERR, "Receive failed: %s", strerror(errno));
+                conn->state = CONN_CLOSING;
+                return 1;
+            }
+            if (conn->nends == 0) {
+                return conn->following ? conn_follow(conn) : 0;
+            }
+            break;
+        }
+        if (bytes_received == 0) {
+            conn->peer_closed = 1;
+            off_t complete = conn->nends ? conn->ends[conn->nends - 1] : 0;
+            if ((off_t)conn->inbuf.len > complete && conn_push_end(conn, conn->inbuf.len) < 0) {
+                aesdlog(LOG_ERR, "Memory allocation failed");
+                conn->state = CONN_CLOSING;
+                return 1;
+            }
+            if (conn->nends == 0) {
+                // A follower may have only shut down its sending side
+                if (conn->following) return conn_follow(conn);
+                conn->state = CONN_CLOSING;
+                return 1;
+            }
+            break;
+        }
+
+        // Every newline in the new bytes closes one packet
+        metrics_add(conn->loop->metrics, MC_BYTES_IN, bytes_received);
+        off_t chunk_off = conn->inbuf.len;
+        seg->len += bytes_received;
+        conn->inbuf.len += bytes_received;
+        framed = conn_frame(conn, chunk_off, chunk, bytes_received);
+        if (framed != 0) {
+            break;
+        }
+        if (conn->nends >= CONN_MAX_REPLIES ||
+            (conn->nends > 0 && conn->ends[conn->nends - 1] >= BATCH_BYTES)) {
+            break;
+        }
+    }
+
+    if (framed < 0) {
+        conn->state = CONN_CLOSING;
+    } else if (conn->nends == 0) {
+        // Stopped at a command with no packets before it
+        if (conn_run_command(conn) < 0) {
+            conn->state = CONN_CLOSING;
+        }
+    } else if (conn_commit_packets(conn) < 0) {
+        conn->state = CONN_CLOSING;
+    }
+    return 1;
+}
+
+/**
+ * Send as much of the pending replies as the socket accepts, straight
+ * from the page cache, but no more than CONN_WRITE_BUDGET bytes so that a
+ * fast reader of a long history cannot hold up the rest of the worker.
+ * reply_idx and reply_off record where to resume on the next EPOLLOUT or
+ * ready-list pass.
+ * @return 0 if the socket would block, 1 if the state changed, 2 if the
+ * budget ran out with the socket still writable.
+ */
+static int conn_handle_write(struct connection *conn) {
+    struct metrics_shard *metrics = conn->loop->metrics;
+    size_t budget = CONN_WRITE_BUDGET;
+    while (conn->reply_idx < conn->nends) {
+        off_t end = conn->ends[conn->reply_idx];
+        uint64_t t0 = metrics_now();
+        ssize_t bytes_sent = datalog_send(conn->fd, &conn->reply_off, end, budget,
+                                          conn->framed ? &conn->frame : NULL);
+        if (bytes_sent != 0) {
+            conn->last_progress = metrics_now();
+            metrics_observe(metrics, MH_SEND, conn->last_progress - t0);
+        }
+        if (bytes_sent > 0) {
+            metrics_add(metrics, MC_BYTES_OUT, bytes_sent);
+            budget -= bytes_sent;
+            if (budget == 0) {
+                return 2;
+            }
+            continue;
+        }
+        if (bytes_sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            aesdlog(LOG_ERR, "Send to client failed: %s", strerror(errno));
+            conn->state = CONN_CLOSING;
+            return 1;
+        }
+        if (bytes_sent == 0) {
+            if (conn->reply_off < end) {
+                // The log shrank underneath us
+                conn->state = CONN_CLOSING;
+                return 1;
+            }
+            if (conn->following) {
+                conn->cursor = end;
+            }
+            conn->reply_idx++;
+            conn->reply_off = conn->cursor;
+            memset(&conn->frame, 0, sizeof(conn->frame));
+        }
+    }
+
+    if (conn->corked) {
+        int off = 0;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        conn->corked = 0;
+    }
+    metrics_observe(metrics, MH_REPLAY, metrics_now() - conn->reply_start);
+    conn->nends = 0;
+    // Input left behind a command, and followers, outlive the peer's EOF
+    int more = conn->cmd_end || conn->rescan || conn->following;
+    conn->state = conn->peer_closed && !more ? CONN_CLOSING : CONN_READING;
+    return 1;
+}
+
+/**
+ * Queue @param conn to resume its reply once the other connections had a turn
+ */
+static void conn_make_ready(struct connection *conn) {
+    struct event_loop *loop = conn->loop;
+    if (conn->ready) return;
+    conn->ready = 1;
+    conn->ready_prev = NULL;
+    conn->ready_next = loop->ready_list;
+    if (loop->ready_list) loop->ready_list->ready_prev = conn;
+    loop->ready_list = conn;
+}
+
+/**
+ * Alternate between reading and replying until @param conn would block,
+ * used its write budget or is done.  Reading is paused while replies are
+ * pending, which keeps the answers in order and pushes back on clients
+ * that do not read.
+ */
+static void conn_drive(struct connection *conn) {
+    while (1) {
+        if (conn->state == CONN_READING) {
+            if (conn_handle_read(conn) == 0) return;
+        } else if (conn->state == CONN_REPLYING) {
+            int rc = conn_handle_write(conn);
+            if (rc == 0) return;
+            if (rc == 2) {
+                // Edge-triggered: no new EPOLLOUT will come, so remember it
+                conn_make_ready(conn);
+                return;
+            }
+        } else {
+            return;
+        }
+    }
+}
+
+/**
+ * Close @param conn if it reached CONN_CLOSING
+ */
+static void conn_reap(struct event_loop *loop, struct connection *conn) {
+    if (conn->state == CONN_CLOSING) {
+        conn_log(loop, "Closed", conn);
+        conn_free(loop, conn);
+    }
+}
+
+/**
+ * Pick up the commits the data log finished for this loop.  When
+ * @param drive is clear the connections are only settled, not resumed.
+ */
+static void collect_commits(struct event_loop *loop, int drive) {
+    uint64_t count;
+    if (read(loop->donefd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        aesdlog(LOG_ERR, "eventfd read failed: %s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&loop->done_lock);
+    struct datalog_req *req = loop->done_list;
+    loop->done_list = NULL;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    while (req) {
+        struct datalog_req *next = req->next;
+        struct connection *conn = (struct connection *)((char *)req - offsetof(struct connection, req));
+        loop->commits_pending--;
+        conn_commit_finished(conn);
+        if (drive) {
+            conn_drive(conn);
+            conn_reap(loop, conn);
+        }
+        req = next;
+    }
+}
+
+/**
+ * Push what was just appended to every follower that is not busy replying
+ */
+static void feed_followers(struct event_loop *loop) {
+    off_t size = datalog_size();
+    struct connection *conn = loop->follow_list;
+    while (conn) {
+        struct connection *next = conn->follow_next;
+        if (conn->state == CONN_READING && conn->cursor < size) {
+            if (conn_start_reply(conn, size) < 0) {
+                conn->state = CONN_CLOSING;
+            }
+            conn_drive(conn);
+            conn_reap(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+/**
+ * Accept every pending connection on the loop's listener (edge-triggered,
+ * so loop until EAGAIN) and register them with its epoll set.
+ */
+static void accept_connections(struct event_loop *loop) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        uint64_t t0 = metrics_now();
+        int clientfd = accept4(loop->listenfd, (struct sockaddr *)&client_addr, &addr_len,
+                               SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (clientfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            // EMFILE and friends: leave the rest in the backlog for later
+            aesdlog(LOG_ERR, "Accept failed: %s", strerror(errno));
+            return;
+        }
+
+        int counted;
+        const char *refusal = admission_accept(loop->opts, &loop->codel, loop->metrics,
+                                               client_addr.sin_addr.s_addr, &counted);
+        if (refusal) {
+            admission_refuse(clientfd, refusal);
+            close(clientfd);
+            continue;
+        }
+
+        struct connection *conn = conn_new(loop, clientfd, &client_addr);
+        if (!conn) {
+            aesdlog(LOG_ERR, "Memory allocation failed");
+            close(clientfd);
+            if (counted) admission_release(client_addr.sin_addr.s_addr);
+            continue;
+        }
+        conn->ip_counted = counted;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, clientfd, &ev) < 0) {
+            aesdlog(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+            conn_free(loop, conn);
+            continue;
+        }
+
+        metrics_observe(loop->metrics, MH_ACCEPT, metrics_now() - t0);
+
+        // Bound the kernel memory a slow reader can pin
+        if (loop->opts->client_sndbuf > 0) {
+            int sndbuf = (int)loop->opts->client_sndbuf;
+            setsockopt(clientfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+        }
+
+        // Log client connection
+        conn_log(loop, "Accepted", conn);
+    }
+}
+
+/**
+ * Give every connection on the ready list another write budget.  Those
+ * that use it up again go back on the list for the next pass.
+ */
+static void run_ready(struct event_loop *loop) {
+    struct connection *conn = loop->ready_list;
+    loop->ready_list = NULL;
+    while (conn) {
+        struct connection *next = conn->ready_next;
+        conn->ready = 0;
+        conn_drive(conn);
+        conn_reap(loop, conn);
+        conn = next;
+    }
+}
+
+/**
+ * Close connections whose reply has not moved for send_timeout_ms, so a
+ * client that stopped reading does not keep its resources forever
+ */
+static void sweep_stalled(struct event_loop *loop, uint64_t now) {
+    uint64_t timeout_ns = (uint64_t)loop->opts->send_timeout_ms * 1000000;
+    struct connection *conn = loop->conn_list;
+    while (conn) {
+        struct connection *next = conn->next;
+        if (conn->state == CONN_REPLYING && now - conn->last_progress > timeout_ns) {
+            aesdlog(LOG_WARNING, "Send to %s timed out, closing", conn->client_ip);
+            metrics_add(loop->metrics, MC_SEND_TIMEOUTS, 1);
+            conn->state = CONN_CLOSING;
+            conn_reap(loop, conn);
+        }
+        conn = next;
+    }
+    loop->last_sweep = now;
+}
+
+/**
+ * Drain for a successor: stop watching the listener, whose backlog is the
+ * successor's now, and the wake eventfd, which stays readable.  Followers
+ * never finish, so they are closed as soon as they are caught up.
+ * @return 1 once the loop can return: no connection left, or
+ * DRAIN_TIMEOUT_MS passed.
+ */
+static int drain_step(struct event_loop *loop) {
+    uint64_t now = metrics_now();
+    if (!loop->drain_start) {
+        loop->drain_start = now;
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->listenfd, NULL);
+        if (loop->wakefd >= 0) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, loop->wakefd, NULL);
+    }
+
+    off_t size = datalog_size();
+    struct connection *conn = loop->follow_list;
+    while (conn) {
+        struct connection *next = conn->follow_next;
+        if (conn->state == CONN_READING && conn->cursor >= size && !conn->cmd_end && conn->inbuf.len == 0) {
+            conn->state = CONN_CLOSING;
+            conn_reap(loop, conn);
+        }
+        conn = next;
+    }
+
+    if (!loop->conn_list) {
+        return 1;
+    }
+    if (now - loop->drain_start >= DRAIN_TIMEOUT_MS * 1000000ull) {
+        int left = 0;
+        for (conn = loop->conn_list; conn; conn = conn->next) left++;
+        aesdlog(LOG_WARNING, "Drain timed out, closing %d connections", left);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Release everything event_loop_run() set up for @param loop
+ */
+static void event_loop_teardown(struct event_loop *loop) {
+    // Connections in the group commit own buffers the committer still reads
+    while (loop->commits_pending > 0) {
+        struct pollfd pfd = { .fd = loop->donefd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            aesdlog(LOG_ERR, "poll failed: %s", strerror(errno));
+            break;
+        }
+        collect_commits(loop, 0);
+    }
+
+    while (loop->conn_list) {
+        conn_free(loop, loop->conn_list);
+    }
+    bufpool_destroy(&loop->pool);
+    if (loop->epfd >= 0) close(loop->epfd);
+    if (loop->donefd >= 0) close(loop->donefd);
+    pthread_mutex_destroy(&loop->done_lock);
+}
+
+int event_loop_run(int listenfd, int wakefd, const struct loop_options *opts) {
+    struct event_loop loop = { .epfd = -1, .listenfd = listenfd, .wakefd = wakefd, .opts = opts, .conn_list = NULL, .donefd = -1 };
+    loop.metrics = metrics_register();
+    codel_init(&loop.codel, opts->codel_target_ms);
+    bufpool_init(&loop.pool);
+    pthread_mutex_init(&loop.done_lock, NULL);
+
+    int flags = fcntl(listenfd, F_GETFL, 0);
+    if (flags < 0 || fcntl(listenfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        aesdlog(LOG_ERR, "fcntl failed: %s", strerror(errno));
+        event_loop_teardown(&loop);
+        return -1;
+    }
+
+    loop.donefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (loop.donefd < 0) {
+        aesdlog(LOG_ERR, "eventfd failed: %s", strerror(errno));
+        event_loop_teardown(&loop);
+        return -1;
+    }
+
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd < 0) {
+        aesdlog(LOG_ERR, "epoll_create1 failed: %s", strerror(errno));
+        event_loop_teardown(&loop);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &listen_tag;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        aesdlog(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+        event_loop_teardown(&loop);
+        return -1;
+    }
+
+    // Level-triggered and never drained, so every worker sees the shutdown
+    ev.events = EPOLLIN;
+    ev.data.ptr = &wake_tag;
+    if (wakefd >= 0 && epoll_ctl(loop.epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+        aesdlog(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+        event_loop_teardown(&loop);
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &done_tag;
+    if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, loop.donefd, &ev) < 0) {
+        aesdlog(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+        event_loop_teardown(&loop);
+        return -1;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    loop.last_sweep = metrics_now();
+    while (!exit_flag) {
+        if (drain_flag && drain_step(&loop)) {
+            break;
+        }
+        // Do not sleep while budgeted replies are waiting for their next turn
+        int timeout = opts->send_timeout_ms > 0 ? SWEEP_INTERVAL_MS : -1;
+        if (loop.drain_start && (timeout < 0 || timeout > DRAIN_POLL_MS)) timeout = DRAIN_POLL_MS;
+        if (loop.ready_list) timeout = 0;
+        int nfds = epoll_wait(loop.epfd, events, MAX_EVENTS, timeout);
+        if (nfds < 0) {
+            if (errno == EINTR) continue; // exit_flag is re-checked
+            aesdlog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        int commits_ready = 0;
+        for (int i = 0; i < nfds; i++) {
+            void *tag = events[i].data.ptr;
+            if (tag == &wake_tag) {
+                continue;
+            }
+            if (tag == &listen_tag) {
+                accept_connections(&loop);
+                continue;
+            }
+            if (tag == &done_tag) {
+                // Handled after this batch: it may free connections still listed in events[]
+                commits_ready = 1;
+                continue;
+            }
+
+            struct connection *conn = tag;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                // The group commit still holds the buffers; close once it is done
+                if (conn->state == CONN_COMMITTING) conn->hung_up = 1;
+                else conn->state = CONN_CLOSING;
+            }
+            if (conn->state != CONN_CLOSING) {
+                conn_drive(conn);
+            }
+            conn_reap(&loop, conn);
+        }
+        if (commits_ready) {
+            collect_commits(&loop, 1);
+            if (loop.nfollowers > 0) {
+                feed_followers(&loop);
+            }
+        }
+        run_ready(&loop);
+
+        if (opts->send_timeout_ms > 0) {
+            uint64_t now = metrics_now();
+            if (now - loop.last_sweep >= SWEEP_INTERVAL_MS * 1000000ull) {
+                sweep_stalled(&loop, now);
+            }
+        }
+    }
+
+    event_loop_teardown(&loop);
+    return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <signal.h>
+#include <stddef.h>
+
+#define MAX_EVENTS  256
+
+// Per-connection policy, the same for every backend
+// Complete packets buffered before they are committed as one batch
+#define BATCH_BYTES (256 * 1024)
+// Replies one connection may have queued; reading pauses at this many
+#define CONN_MAX_REPLIES 4096
+// Per-connection syslog lines allowed per worker and second, the rest are counted
+#define CONN_LOG_PER_SEC 20
+// How often stalled replies are looked for
+#define SWEEP_INTERVAL_MS 1000
+// How long a drain for a successor may take before the rest is closed
+#define DRAIN_TIMEOUT_MS 5000
+
+// Defaults for struct loop_options
+#define DEFAULT_SEND_TIMEOUT_MS 30000
+#define DEFAULT_CLIENT_SNDBUF   (256 * 1024)
+
+// Set by the signal handler in aesdsocket.c, polled by the event loop
+extern volatile sig_atomic_t exit_flag;
+// Set when a successor takes over (see handoff.h): the loop stops
+// accepting and returns once its connections are done
+extern volatile sig_atomic_t drain_flag;
+
+// Per-client limits, shared read-only by all workers
+struct loop_options {
+    // Close a client whose pending reply made no progress for this long (0: never)
+    int send_timeout_ms;
+    // SO_SNDBUF for client sockets, caps kernel memory per slow reader (0: system default)
+    size_t client_sndbuf;
+    // Longest packet taken, newline included; longer ones close the connection (0: no limit)
+    size_t max_packet;
+    // Connections one client IP may hold open (0: no limit)
+    int max_per_ip;
+    // Receive buffer bytes all connections together may hold (0: no limit)
+    size_t mem_budget;
+    // Queue delay above which new connections are shed, see admission.h (0: never)
+    int codel_target_ms;
+};
+
+/**
+ * Run the non-blocking, edge-triggered epoll loop on the listening socket
+ * @param listenfd until exit_flag is set.  Every connection is driven by a
+ * small state machine so that a slow client never stalls the others.
+ * @param wakefd is an eventfd made readable on shutdown so that workers
+ * blocked in epoll_wait notice exit_flag or drain_flag (-1 if unused).
+ * While draining, the listener is left alone, so that its backlog waits
+ * for the successor, and the connections in flight are served to the
+ * end.  Followers are closed once caught up, and whatever is left after
+ * DRAIN_TIMEOUT_MS.
+ * @param opts holds the per-client limits.  Connections over a limit get
+ * a PROTO_ERR_* line and are closed, see admission.h.
+ * Each worker thread runs its own loop; appends from all of them go
+ * through the data log's group commit, and a connection is answered only
+ * once its packets have been committed.
+ * @return 0 on a clean shutdown, -1 if the loop could not be set up.
+ */
+int event_loop_run(int listenfd, int wakefd, const struct loop_options *opts);
+
+#endif // EVENTLOOP_H
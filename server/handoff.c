@@ -0,0 +1,323 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+#include "eventloop.h"
+#include "datalog.h"
+#include "metrics.h"
+#include "aesdlog.h"
+
+#define HANDOFF_MAGIC 0x61657364 // "aesd"
+
+// First message, successor to running server
+struct handoff_hello {
+    uint32_t magic;
+    uint32_t version;
+};
+
+// First reply, carrying the listening sockets
+struct handoff_header {
+    uint32_t magic;
+    uint32_t nfds;
+};
+
+static char control_path[PATH_MAX];
+static int control_fd = -1;
+static pthread_t control_thread;
+static int control_running;
+static int control_wakefd = -1;
+// Set by the control thread, read by handoff_give() after joining it
+static int successor_fd = -1;
+
+/**
+ * Bound every send and receive on @param fd to @param ms milliseconds
+ */
+static void set_timeout(int fd, int ms) {
+    struct timeval tv = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+int handoff_send(int sock, const void *buf, size_t len, const int *fds, int nfds) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    const char *p = buf;
+    if (nfds > HANDOFF_MAX_FDS) {
+        errno = EINVAL;
+        return -1;
+    }
+    while (len > 0) {
+        struct iovec iov = { .iov_base = (void *)p, .iov_len = len };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+        // Descriptors ride along with the first byte only
+        if (nfds > 0) {
+            memset(&control, 0, sizeof(control));
+            msg.msg_control = control.buf;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+        }
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        nfds = 0;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int handoff_recv(int sock, void *buf, size_t len, int *fds, int maxfds, int *nfds) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    char *p = buf;
+    if (nfds) *nfds = 0;
+    while (len > 0) {
+        struct iovec iov = { .iov_base = p, .iov_len = len };
+        struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                              .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (nfds && *nfds < maxfds) fds[(*nfds)++] = fd;
+                else close(fd);
+            }
+        }
+        if (msg.msg_flags & MSG_CTRUNC) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int handoff_take_over(const char *path, const char *log_path, int *fds, int max, int *nfds) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        aesdlog(LOG_ERR, "Handoff socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        aesdlog(LOG_ERR, "Handoff socket creation failed: %s", strerror(errno));
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(sock);
+        // Nobody there, or a socket left behind by a server that died
+        if (err == ENOENT || err == ECONNREFUSED) {
+            return 0;
+        }
+        aesdlog(LOG_ERR, "Connecting to %s failed: %s", path, strerror(err));
+        return -1;
+    }
+    aesdlog(LOG_INFO, "Taking over from the server on %s", path);
+
+    // The reply only comes once the old server has drained
+    set_timeout(sock, DRAIN_TIMEOUT_MS + HANDOFF_TIMEOUT_MS);
+    struct handoff_hello hello = { HANDOFF_MAGIC, HANDOFF_VERSION };
+    struct handoff_header hdr;
+    struct metrics_shard carried;
+    int n = 0;
+    if (handoff_send(sock, &hello, sizeof(hello), NULL, 0) < 0 ||
+        handoff_recv(sock, &hdr, sizeof(hdr), fds, max, &n) < 0) {
+        aesdlog(LOG_ERR, "Handoff from %s failed: %s", path, strerror(errno));
+        goto fail;
+    }
+    if (hdr.magic != HANDOFF_MAGIC || hdr.nfds != (uint32_t)n || n < 1) {
+        aesdlog(LOG_ERR, "Handoff from %s sent %u listeners, got %d", path, hdr.nfds, n);
+        goto fail;
+    }
+    if (datalog_import(sock, log_path) < 0) {
+        goto fail;
+    }
+    if (handoff_recv(sock, &carried, sizeof(carried), NULL, 0, NULL) < 0) {
+        aesdlog(LOG_ERR, "Handoff of metrics failed: %s", strerror(errno));
+        datalog_close(0);
+        goto fail;
+    }
+
+    // From here on the old server lets go
+    char ack = 1;
+    if (handoff_send(sock, &ack, 1, NULL, 0) < 0) {
+        aesdlog(LOG_ERR, "Handoff acknowledgement failed: %s", strerror(errno));
+        datalog_close(0);
+        goto fail;
+    }
+    close(sock);
+    metrics_carry(&carried);
+    *nfds = n;
+    aesdlog(LOG_INFO, "Took over %d listeners and %lld bytes of log", n, (long long)datalog_size());
+    return 1;
+
+fail:
+    for (int i = 0; i < n; i++) {
+        close(fds[i]);
+    }
+    close(sock);
+    return -1;
+}
+
+int handoff_listen(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        aesdlog(LOG_ERR, "Handoff socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    snprintf(control_path, sizeof(control_path), "%s", path);
+
+    control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (control_fd < 0) {
+        aesdlog(LOG_ERR, "Handoff socket creation failed: %s", strerror(errno));
+        return -1;
+    }
+    // Left behind by the predecessor, or by a server that died
+    unlink(path);
+    if (bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(path, 0600) < 0 || listen(control_fd, 1) < 0) {
+        aesdlog(LOG_ERR, "Handoff listener on %s failed: %s", path, strerror(errno));
+        close(control_fd);
+        control_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Wait for a successor that speaks our handoff version, then start the
+ * drain and exit
+ */
+static void *control_thread_main(void *arg) {
+    (void)arg;
+    while (1) {
+        int fd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break; // socket shut down by handoff_close()
+        }
+        struct handoff_hello hello;
+        set_timeout(fd, HANDOFF_TIMEOUT_MS);
+        if (handoff_recv(fd, &hello, sizeof(hello), NULL, 0, NULL) < 0 ||
+            hello.magic != HANDOFF_MAGIC || hello.version != HANDOFF_VERSION) {
+            aesdlog(LOG_WARNING, "Ignoring a successor that does not speak handoff version %d", HANDOFF_VERSION);
+            close(fd);
+            continue;
+        }
+
+        aesdlog(LOG_INFO, "Successor connected, draining connections");
+        successor_fd = fd;
+        drain_flag = 1;
+        uint64_t one = 1;
+        if (write(control_wakefd, &one, sizeof(one)) < 0) {
+            aesdlog(LOG_ERR, "eventfd write failed: %s", strerror(errno));
+        }
+        break;
+    }
+    return NULL;
+}
+
+int handoff_start(int wakefd) {
+    control_wakefd = wakefd;
+    if (pthread_create(&control_thread, NULL, control_thread_main, NULL) != 0) {
+        aesdlog(LOG_ERR, "Failed to create handoff thread");
+        return -1;
+    }
+    control_running = 1;
+    return 0;
+}
+
+/**
+ * Stop the control thread, if it still runs, and close the listener
+ */
+static void control_stop(void) {
+    if (control_running) {
+        // Makes a blocked accept4() fail so the thread can exit
+        shutdown(control_fd, SHUT_RDWR);
+        pthread_join(control_thread, NULL);
+        control_running = 0;
+    }
+    if (control_fd >= 0) {
+        close(control_fd);
+        control_fd = -1;
+    }
+}
+
+int handoff_give(const int *fds, int nfds) {
+    // The successor binds the path next, leave the file to it
+    control_stop();
+    int sock = successor_fd;
+    successor_fd = -1;
+    if (sock < 0) {
+        return -1;
+    }
+
+    int rc = -1;
+    struct handoff_header hdr = { HANDOFF_MAGIC, nfds };
+    struct metrics_shard total;
+    char ack;
+    if (handoff_send(sock, &hdr, sizeof(hdr), fds, nfds) < 0 || datalog_export(sock) < 0) {
+        aesdlog(LOG_ERR, "Handoff to successor failed: %s", strerror(errno));
+    } else {
+        metrics_snapshot(&total);
+        if (handoff_send(sock, &total, sizeof(total), NULL, 0) < 0 ||
+            handoff_recv(sock, &ack, 1, NULL, 0, NULL) < 0) {
+            aesdlog(LOG_ERR, "Successor did not take over: %s", strerror(errno));
+        } else {
+            aesdlog(LOG_INFO, "Handed over to successor");
+            rc = 0;
+        }
+    }
+    close(sock);
+    return rc;
+}
+
+void handoff_close(int handed_off) {
+    int listening = control_fd >= 0;
+    control_stop();
+    if (successor_fd >= 0) {
+        close(successor_fd);
+        successor_fd = -1;
+    }
+    if (listening && !handed_off) {
+        unlink(control_path);
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+
+/**
+ * Hot restart.  A server started with -H listens on that Unix socket for a
+ * successor.  A new server started with the same -H connects to it instead
+ * of binding the port, and the old one hands over, with SCM_RIGHTS:
+ *   - its listening sockets, which therefore never close: connections
+ *     arriving meanwhile wait in the backlog instead of being refused,
+ *   - the open data log, segment files, index and counters included (see
+ *     datalog_export()), so nothing is scanned again,
+ *   - its metrics, so that counters keep counting up.
+ * Before that the old server stops accepting and drains: connections in
+ * flight are served to the end, for at most DRAIN_TIMEOUT_MS (see
+ * eventloop.h).  It exits once the successor has taken everything, and
+ * goes back to serving if the successor fails before that.
+ */
+
+// Bump on any change to what goes over the socket
+#define HANDOFF_VERSION     2
+// Descriptors one message can carry, at least one per worker
+#define HANDOFF_MAX_FDS     64
+// How long either side waits for the other, on top of the drain
+#define HANDOFF_TIMEOUT_MS  5000
+
+/**
+ * Take over from the server listening on @param path, if there is one,
+ * waiting while it drains.  Its listening sockets are stored in
+ * @param fds (at most @param max, their number in @param nfds), and the
+ * data log at @param log_path and the metrics are taken over as well.
+ * No thread is started, so this can run before daemonizing.
+ * @return 1 if taken over, 0 if no server listens on @param path, or -1
+ * if the handoff failed (already logged).
+ */
+int handoff_take_over(const char *path, const char *log_path, int *fds, int max, int *nfds);
+
+/**
+ * Listen on @param path for a successor, replacing a stale socket file
+ * @return 0 on success, -1 on failure (already logged).
+ */
+int handoff_listen(const char *path);
+
+/**
+ * Wait for a successor on a background thread.  When one connects,
+ * drain_flag is set and @param wakefd written, so that the workers drain
+ * and return; the caller then calls handoff_give().
+ * @return 0 on success, -1 on failure (already logged).
+ */
+int handoff_start(int wakefd);
+
+/**
+ * Hand the @param nfds listening sockets @param fds, the data log and the
+ * metrics to the waiting successor.  The workers must have returned and
+ * the metrics endpoint must be stopped.
+ * @return 0 once the successor has everything: the caller exits without
+ * touching the log.  -1 if it failed (already logged): the caller restarts
+ * the data log with datalog_open() and serves on.
+ */
+int handoff_give(const int *fds, int nfds);
+
+/**
+ * Stop waiting for a successor and close the socket, removing it from
+ * the file system unless it now belongs to a successor (@param handed_off)
+ */
+void handoff_close(int handed_off);
+
+/**
+ * Send the @param len bytes at @param buf on the Unix socket @param sock,
+ * with the @param nfds descriptors @param fds attached
+ * @return 0 on success, -1 on failure with errno set.
+ */
+int handoff_send(int sock, const void *buf, size_t len, const int *fds, int nfds);
+
+/**
+ * Receive exactly @param len bytes into @param buf, storing descriptors
+ * that come with them in @param fds (at most @param maxfds, the rest are
+ * closed) and their number in *@param nfds (NULL: none expected)
+ * @return 0 on success, -1 on failure or EOF with errno set.
+ */
+int handoff_recv(int sock, void *buf, size_t len, int *fds, int maxfds, int *nfds);
+
+#endif // HANDOFF_H
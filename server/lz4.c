@@ -0,0 +1,165 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define MIN_MATCH       4
+// The format requires the last 5 bytes to be literals and the last match
+// to start at least 12 bytes before the end
+#define LAST_LITERALS   5
+#define MF_LIMIT        12
+#define MAX_OFFSET      65535
+#define HASH_LOG        13
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/**
+ * Append the length @param n - 15 continuation bytes of a field that
+ * overflowed its 4 bits
+ */
+static char *put_length(char *op, size_t n) {
+    for (; n >= 255; n -= 255) {
+        *op++ = (char)255;
+    }
+    *op++ = (char)n;
+    return op;
+}
+
+/**
+ * Append one sequence: @param nlit literals from @param lit, then a match
+ * of @param mlen bytes at @param offset back (mlen 0: the last sequence)
+ * @return the new output position, or NULL if it would pass @param end.
+ */
+static char *put_sequence(char *op, char *end, const char *lit, size_t nlit, size_t offset, size_t mlen) {
+    size_t need = 1 + nlit + nlit / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0);
+    if (need > (size_t)(end - op)) {
+        return NULL;
+    }
+    char *token = op++;
+    size_t ml = mlen ? mlen - MIN_MATCH : 0;
+    *token = (char)(((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15));
+    if (nlit >= 15) {
+        op = put_length(op, nlit - 15);
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen) {
+        *op++ = (char)(offset & 0xff);
+        *op++ = (char)(offset >> 8);
+        if (ml >= 15) {
+            op = put_length(op, ml - 15);
+        }
+    }
+    return op;
+}
+
+size_t lz4_compress(const char *src, size_t len, char *dst, size_t cap) {
+    uint32_t table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));
+    char *op = dst, *end = dst + cap;
+    size_t anchor = 0, ip = 0;
+
+    if (len > MF_LIMIT) {
+        size_t match_limit = len - LAST_LITERALS;
+        while (ip + MF_LIMIT <= len) {
+            uint32_t v = read32(src + ip);
+            uint32_t h = hash4(v);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip;
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(src + ref) != v) {
+                // Skip faster through input that does not compress
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+            size_t mlen = MIN_MATCH;
+            while (ip + mlen < match_limit && src[ref + mlen] == src[ip + mlen]) {
+                mlen++;
+            }
+            // Take in literals before the match that match as well
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+                mlen++;
+            }
+            op = put_sequence(op, end, src + anchor, ip - anchor, ip - ref, mlen);
+            if (!op) {
+                return 0;
+            }
+            ip += mlen;
+            anchor = ip;
+            if (ip + MF_LIMIT <= len) {
+                table[hash4(read32(src + ip - 2))] = (uint32_t)(ip - 2);
+            }
+        }
+    }
+    op = put_sequence(op, end, src + anchor, len - anchor, 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+long lz4_decompress(const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + len;
+    size_t op = 0;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15) {
+            unsigned b;
+            do {
+                if (ip == iend) return -1;
+                b = *ip++;
+                nlit += b;
+            } while (b == 255);
+        }
+        if (nlit > (size_t)(iend - ip) || nlit > cap - op) {
+            return -1;
+        }
+        memcpy(dst + op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend) {
+            break; // the last sequence has no match
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            unsigned b;
+            do {
+                if (ip == iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += MIN_MATCH;
+        if (mlen > cap - op) {
+            return -1;
+        }
+        char *out = dst + op;
+        const char *ref = out - offset;
+        if (offset >= mlen) {
+            memcpy(out, ref, mlen);
+        } else {
+            // Overlapping copy repeats the last offset bytes
+            for (size_t i = 0; i < mlen; i++) {
+                out[i] = ref[i];
+            }
+        }
+        op += mlen;
+    }
+    return (long)op;
+}
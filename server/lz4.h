@@ -0,0 +1,30 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include <stddef.h>
+
+/**
+ * LZ4 block format codec (the raw block format, no frame header), small
+ * enough to carry instead of a library dependency.  Its output decodes
+ * with any LZ4 implementation, e.g. LZ4_decompress_safe() from liblz4, and
+ * the decoder accepts any valid LZ4 block.  The compressor is the greedy
+ * single-probe parser: a fraction of the speed of liblz4's, but the same
+ * ratio class on repetitive text such as the data log.
+ * Match offsets are 16 bits, so blocks beyond 64 KiB compress no better.
+ */
+
+/**
+ * Compress the @param len bytes at @param src into @param dst
+ * @return the compressed size, or 0 if it would not fit in @param cap
+ * bytes (store the block uncompressed then).
+ */
+size_t lz4_compress(const char *src, size_t len, char *dst, size_t cap);
+
+/**
+ * Decompress the block of @param len bytes at @param src into @param dst
+ * @return the decompressed size, or -1 if the block is malformed or
+ * decompresses to more than @param cap bytes.
+ */
+long lz4_decompress(const char *src, size_t len, char *dst, size_t cap);
+
+#endif // LZ4_H
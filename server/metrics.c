@@ -0,0 +1,263 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "metrics.h"
+#include "datalog.h"
+#include "aesdlog.h"
+
+static struct metrics_shard shards[METRICS_MAX_SHARDS];
+static int shards_used;
+
+static int metrics_fd = -1;
+static pthread_t metrics_thread;
+static int metrics_running;
+
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} counter_info[MC_COUNT] = {
+    [MC_ACCEPTS]     = { "aesdsocket_connections_accepted_total", "counter", "Connections accepted" },
+    [MC_CLOSES]      = { "aesdsocket_connections_closed_total", "counter", "Connections closed" },
+    [MC_PACKETS]     = { "aesdsocket_packets_total", "counter", "Packets appended to the data file" },
+    [MC_BYTES_IN]    = { "aesdsocket_received_bytes_total", "counter", "Bytes received from clients" },
+    [MC_BYTES_OUT]   = { "aesdsocket_sent_bytes_total", "counter", "Bytes replayed to clients" },
+    [MC_BATCHES]     = { "aesdsocket_commit_batches_total", "counter", "Group commits written" },
+    [MC_FSYNCS]      = { "aesdsocket_fsyncs_total", "counter", "fdatasync calls on the data file" },
+    [MC_LOG_DROPPED] = { "aesdsocket_log_suppressed_total", "counter", "Per-connection log lines dropped by sampling" },
+    [MC_SEND_TIMEOUTS] = { "aesdsocket_send_timeouts_total", "counter", "Clients closed for not reading their reply" },
+    [MC_SHED_BUSY]     = { "aesdsocket_shed_busy_total", "counter", "Connections refused while the queue delay was above target" },
+    [MC_REJECT_PER_IP] = { "aesdsocket_rejected_per_ip_total", "counter", "Connections refused over the per-IP limit" },
+    [MC_REJECT_MEMORY] = { "aesdsocket_rejected_memory_total", "counter", "Connections refused or closed over the memory budget" },
+    [MC_REJECT_TOO_LONG] = { "aesdsocket_rejected_too_long_total", "counter", "Connections closed for a packet over the size limit" },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} hist_info[MH_COUNT] = {
+    [MH_ACCEPT] = { "aesdsocket_accept_seconds", "Time spent in accept4" },
+    [MH_RECV]   = { "aesdsocket_recv_seconds", "Time spent in recv" },
+    [MH_APPEND] = { "aesdsocket_append_seconds", "Packets queued until their group commit finished" },
+    [MH_REPLAY] = { "aesdsocket_replay_seconds", "First to last byte of a batch of replies" },
+    [MH_SEND]   = { "aesdsocket_send_seconds", "Time spent in sendfile" },
+};
+
+struct metrics_shard *metrics_register(void) {
+    int idx = __atomic_fetch_add(&shards_used, 1, __ATOMIC_RELAXED);
+    if (idx >= METRICS_MAX_SHARDS) {
+        return NULL;
+    }
+    return &shards[idx];
+}
+
+void metrics_observe(struct metrics_shard *shard, enum metrics_hist h, uint64_t ns) {
+    if (!shard) return;
+    struct metrics_histogram *hist = &shard->hist[h];
+
+    // Bucket i holds durations up to 2^i microseconds
+    uint64_t us = ns / 1000;
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+    if ((us & (us - 1)) == 0 && us) b--;
+    if (b > METRICS_BUCKETS) b = METRICS_BUCKETS;
+
+    __atomic_store_n(&hist->buckets[b], __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->count, __atomic_load_n(&hist->count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum_ns, __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED) + ns, __ATOMIC_RELAXED);
+}
+
+void metrics_snapshot(struct metrics_shard *total) {
+    int n = __atomic_load_n(&shards_used, __ATOMIC_RELAXED);
+    if (n > METRICS_MAX_SHARDS) n = METRICS_MAX_SHARDS;
+
+    memset(total, 0, sizeof(*total));
+    for (int s = 0; s < n; s++) {
+        for (int c = 0; c < MC_COUNT; c++) {
+            total->counters[c] += __atomic_load_n(&shards[s].counters[c], __ATOMIC_RELAXED);
+        }
+        for (int h = 0; h < MH_COUNT; h++) {
+            const struct metrics_histogram *hist = &shards[s].hist[h];
+            for (int b = 0; b <= METRICS_BUCKETS; b++) {
+                total->hist[h].buckets[b] += __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+            }
+            total->hist[h].count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+            total->hist[h].sum_ns += __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void metrics_carry(const struct metrics_shard *total) {
+    // A shard of its own that nothing else writes to
+    struct metrics_shard *shard = metrics_register();
+    if (shard) {
+        *shard = *total;
+    }
+}
+
+/**
+ * Sum every shard and write the Prometheus text exposition to @param out
+ */
+static void metrics_render(FILE *out) {
+    int n = __atomic_load_n(&shards_used, __ATOMIC_RELAXED);
+    if (n > METRICS_MAX_SHARDS) n = METRICS_MAX_SHARDS;
+
+    uint64_t counters[MC_COUNT] = { 0 };
+    for (int s = 0; s < n; s++) {
+        for (int c = 0; c < MC_COUNT; c++) {
+            counters[c] += __atomic_load_n(&shards[s].counters[c], __ATOMIC_RELAXED);
+        }
+    }
+    for (int c = 0; c < MC_COUNT; c++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", counter_info[c].name, counter_info[c].help,
+                counter_info[c].name, counter_info[c].type, counter_info[c].name,
+                (unsigned long long)counters[c]);
+    }
+
+    fprintf(out, "# HELP aesdsocket_connections_active Connections currently open\n"
+                 "# TYPE aesdsocket_connections_active gauge\naesdsocket_connections_active %llu\n",
+            (unsigned long long)(counters[MC_ACCEPTS] - counters[MC_CLOSES]));
+    off_t start = datalog_start(), size = datalog_size();
+    fprintf(out, "# HELP aesdsocket_data_file_bytes History retained in the data log\n"
+                 "# TYPE aesdsocket_data_file_bytes gauge\naesdsocket_data_file_bytes %lld\n",
+            (long long)(size - start));
+    fprintf(out, "# HELP aesdsocket_data_disk_bytes Bytes the retained history takes on disk\n"
+                 "# TYPE aesdsocket_data_disk_bytes gauge\naesdsocket_data_disk_bytes %lld\n",
+            (long long)datalog_disk_size());
+    fprintf(out, "# HELP aesdsocket_data_log_offset Bytes ever appended to the data log\n"
+                 "# TYPE aesdsocket_data_log_offset counter\naesdsocket_data_log_offset %lld\n",
+            (long long)size);
+    fprintf(out, "# HELP aesdsocket_data_log_packets Packets ever appended to the data log\n"
+                 "# TYPE aesdsocket_data_log_packets counter\naesdsocket_data_log_packets %llu\n",
+            (unsigned long long)datalog_packets());
+    fprintf(out, "# HELP aesdsocket_log_ring_dropped_total Diagnostics dropped because the log ring was full\n"
+                 "# TYPE aesdsocket_log_ring_dropped_total counter\naesdsocket_log_ring_dropped_total %llu\n",
+            (unsigned long long)aesdlog_dropped());
+
+    for (int h = 0; h < MH_COUNT; h++) {
+        uint64_t buckets[METRICS_BUCKETS + 1] = { 0 };
+        uint64_t count = 0, sum_ns = 0;
+        for (int s = 0; s < n; s++) {
+            const struct metrics_histogram *hist = &shards[s].hist[h];
+            for (int b = 0; b <= METRICS_BUCKETS; b++) {
+                buckets[b] += __atomic_load_n(&hist->buckets[b], __ATOMIC_RELAXED);
+            }
+            count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+            sum_ns += __atomic_load_n(&hist->sum_ns, __ATOMIC_RELAXED);
+        }
+
+        const char *name = hist_info[h].name;
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, hist_info[h].help, name);
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            cumulative += buckets[b];
+            fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, (double)(1ull << b) / 1e6,
+                    (unsigned long long)cumulative);
+        }
+        // Shards are read one field at a time, keep +Inf consistent with count
+        cumulative += buckets[METRICS_BUCKETS];
+        if (cumulative > count) count = cumulative;
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)count);
+        fprintf(out, "%s_sum %.9f\n%s_count %llu\n", name, sum_ns / 1e9, name, (unsigned long long)count);
+    }
+}
+
+/**
+ * Answer every connection with the current metrics, HTTP/1.0 style, so
+ * both a scraper and a plain `nc` can read them
+ */
+static void *metrics_thread_main(void *arg) {
+    (void)arg;
+    while (1) {
+        int clientfd = accept4(metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (clientfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break; // socket shut down by metrics_stop()
+        }
+
+        // The request itself does not matter, take what has arrived
+        char req[1024];
+        struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 };
+        setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        ssize_t rc = recv(clientfd, req, sizeof(req), 0);
+        (void)rc;
+
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *out = open_memstream(&body, &body_len);
+        if (!out) {
+            close(clientfd);
+            continue;
+        }
+        metrics_render(out);
+        fclose(out);
+
+        char header[128];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %zu\r\n\r\n", body_len);
+        if (send(clientfd, header, header_len, MSG_NOSIGNAL) == header_len) {
+            size_t sent = 0;
+            while (sent < body_len) {
+                ssize_t n = send(clientfd, body + sent, body_len - sent, MSG_NOSIGNAL);
+                if (n <= 0) break;
+                sent += n;
+            }
+        }
+        free(body);
+        close(clientfd);
+    }
+    return NULL;
+}
+
+int metrics_start(int port) {
+    metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (metrics_fd < 0) {
+        aesdlog(LOG_ERR, "Metrics socket creation failed: %s", strerror(errno));
+        return -1;
+    }
+    int optval = 1;
+    setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+
+    // Loopback only: the endpoint is for local scrapers
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(metrics_fd, 8) < 0) {
+        aesdlog(LOG_ERR, "Metrics listener on port %d failed: %s", port, strerror(errno));
+        close(metrics_fd);
+        metrics_fd = -1;
+        return -1;
+    }
+
+    if (pthread_create(&metrics_thread, NULL, metrics_thread_main, NULL) != 0) {
+        aesdlog(LOG_ERR, "Failed to create metrics thread");
+        close(metrics_fd);
+        metrics_fd = -1;
+        return -1;
+    }
+    metrics_running = 1;
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (metrics_running) {
+        // Makes the blocked accept4() fail so the thread can exit
+        shutdown(metrics_fd, SHUT_RDWR);
+        pthread_join(metrics_thread, NULL);
+        metrics_running = 0;
+    }
+    if (metrics_fd >= 0) {
+        close(metrics_fd);
+        metrics_fd = -1;
+    }
+}
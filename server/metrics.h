@@ -0,0 +1,102 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Hot-path counters and latency histograms.
+ * Every thread that records gets its own cache-line aligned shard and is
+ * the only writer to it, so recording is a relaxed load and store with no
+ * locked instruction.  The metrics endpoint sums all shards on demand and
+ * serves them in the Prometheus text format on a loopback port.
+ */
+
+#define METRICS_MAX_SHARDS  80
+// Histogram buckets are powers of two from 1us up to 2^(N-1)us, plus +Inf
+#define METRICS_BUCKETS     24
+
+enum metrics_counter {
+    MC_ACCEPTS,
+    MC_CLOSES,
+    MC_PACKETS,
+    MC_BYTES_IN,
+    MC_BYTES_OUT,
+    MC_BATCHES,     // group commits written
+    MC_FSYNCS,
+    MC_LOG_DROPPED, // per-connection syslog lines suppressed by sampling
+    MC_SEND_TIMEOUTS,
+    MC_SHED_BUSY,       // refused while the queue delay was above target
+    MC_REJECT_PER_IP,
+    MC_REJECT_MEMORY,
+    MC_REJECT_TOO_LONG,
+    MC_COUNT,
+};
+
+enum metrics_hist {
+    MH_ACCEPT,      // accept4() call
+    MH_RECV,        // recv() call
+    MH_APPEND,      // packets queued until their group commit finished
+    MH_REPLAY,      // first to last byte of one batch of replies
+    MH_SEND,        // sendfile() call
+    MH_COUNT,
+};
+
+struct metrics_histogram {
+    uint64_t buckets[METRICS_BUCKETS + 1];
+    uint64_t count;
+    uint64_t sum_ns;
+};
+
+struct metrics_shard {
+    uint64_t counters[MC_COUNT];
+    struct metrics_histogram hist[MH_COUNT];
+} __attribute__((aligned(64)));
+
+/**
+ * @return a shard for the calling thread to record into, or NULL when all
+ * METRICS_MAX_SHARDS are taken (recording into NULL is a no-op)
+ */
+struct metrics_shard *metrics_register(void);
+
+static inline uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void metrics_add(struct metrics_shard *shard, enum metrics_counter c, uint64_t n) {
+    if (!shard) return;
+    // Single writer: no read-modify-write atomics needed, only untorn access
+    uint64_t v = __atomic_load_n(&shard->counters[c], __ATOMIC_RELAXED);
+    __atomic_store_n(&shard->counters[c], v + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Record a duration of @param ns nanoseconds in histogram @param h
+ */
+void metrics_observe(struct metrics_shard *shard, enum metrics_hist h, uint64_t ns);
+
+/**
+ * Sum every shard into @param total, for a successor to carry on from
+ */
+void metrics_snapshot(struct metrics_shard *total);
+
+/**
+ * Start counting from @param total, a predecessor's metrics_snapshot(),
+ * instead of from zero
+ */
+void metrics_carry(const struct metrics_shard *total);
+
+/**
+ * Serve the metrics on 127.0.0.1:@param port from a background thread
+ * @return 0 on success, -1 on failure (already logged).
+ */
+int metrics_start(int port);
+
+/**
+ * Stop the metrics thread and close its socket
+ */
+void metrics_stop(void);
+
+#endif // METRICS_H
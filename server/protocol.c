@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "protocol.h"
+#include "datalog.h"
+
+/**
+ * Parse the decimal number in [@param p, @param end) into @param value
+ * @return 0 on success, -1 if it is empty or not a number.
+ */
+static int parse_u64(const char *p, const char *end, uint64_t *value) {
+    if (p == end) {
+        return -1;
+    }
+    uint64_t v = 0;
+    for (; p < end; p++) {
+        if (!isdigit((unsigned char)*p) || v > (UINT64_MAX - 9) / 10) {
+            return -1;
+        }
+        v = v * 10 + (*p - '0');
+    }
+    *value = v;
+    return 0;
+}
+
+int proto_parse(const char *line, size_t len, struct proto_cmd *cmd) {
+    size_t prefix_len = sizeof(PROTO_PREFIX) - 1;
+    if (len > PROTO_MAX_LINE || len <= prefix_len || memcmp(line, PROTO_PREFIX, prefix_len) != 0) {
+        return 0;
+    }
+    const char *p = line + prefix_len;
+    const char *end = line + len;
+    if (end > p && end[-1] == '\n') end--;
+    if (end > p && end[-1] == '\r') end--;
+
+    memset(cmd, 0, sizeof(*cmd));
+    if (end - p == 8 && memcmp(p, "COMPRESS", 8) == 0) {
+        cmd->compress = 1;
+        return 1;
+    }
+    if (end - p >= 6 && memcmp(p, "FOLLOW", 6) == 0) {
+        cmd->follow = 1;
+        p += 6;
+        if (p == end) {
+            return 1;
+        }
+    } else if (end - p >= 4 && memcmp(p, "SEEK", 4) == 0) {
+        p += 4;
+    } else {
+        return 0;
+    }
+
+    if (p == end || *p++ != ':') {
+        return 0;
+    }
+    cmd->seek = 1;
+    cmd->pos = PROTO_POS_PACKET;
+    if (p < end && *p == '@') {
+        cmd->pos = PROTO_POS_BYTE;
+        p++;
+    } else if (p < end && *p == '-') {
+        cmd->pos = PROTO_POS_LAST;
+        p++;
+    }
+    return parse_u64(p, end, &cmd->arg) == 0;
+}
+
+off_t proto_seek_offset(const struct proto_cmd *cmd) {
+    switch (cmd->pos) {
+    case PROTO_POS_BYTE: {
+        off_t size = datalog_size();
+        return cmd->arg < (uint64_t)size ? (off_t)cmd->arg : size;
+    }
+    case PROTO_POS_LAST: {
+        uint64_t packets = datalog_packets();
+        off_t off = datalog_packet_offset(cmd->arg < packets ? packets - cmd->arg : 0);
+        return off < 0 ? 0 : off; // unreadable index: fall back to everything
+    }
+    case PROTO_POS_PACKET: {
+        off_t off = datalog_packet_offset(cmd->arg);
+        return off < 0 ? 0 : off;
+    }
+    default:
+        return 0;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * Command lines a client may send in its packet stream.  They are never
+ * appended to the data log; every other line is an ordinary packet.
+ *   AESDSOCKET_SEEK:<pos>    answer from <pos> on, see below
+ *   AESDSOCKET_FOLLOW[:<pos>] stream the log from <pos> (default: where
+ *                            replies start now) and every later append
+ *   AESDSOCKET_COMPRESS      send every later reply as frames (below)
+ * where <pos> is a packet number counting from 0, "@<off>" for a log byte
+ * offset or "-<n>" for the last n packets.
+ * A seek is answered right away with the log from the new start, and
+ * later packets on the connection are answered from there too instead of
+ * from the beginning.  A follower is sent everything other connections
+ * append, as it is committed, and never the same bytes twice.
+ * A framed reply is a sequence of frames, each one a DATALOG_FRAME_HEADER
+ * (log bytes carried, then payload bytes, both 32-bit little endian) and
+ * its payload: an LZ4 block when the two lengths differ, else the log
+ * bytes as they are.  A frame of 0 log bytes ends the reply.  Blocks of a
+ * compressed data log are sent as stored, without being decompressed.
+ * A connection the server will not serve gets one PROTO_ERR_* line and is
+ * closed; nothing it sent was appended after the last full reply.
+ */
+
+#define PROTO_PREFIX    "AESDSOCKET_"
+// Longer lines are never commands
+#define PROTO_MAX_LINE  64
+
+// Sent before closing a connection refused by admission control
+#define PROTO_ERR_BUSY      PROTO_PREFIX "ERROR busy\n"
+#define PROTO_ERR_PER_IP    PROTO_PREFIX "ERROR too many connections\n"
+#define PROTO_ERR_MEMORY    PROTO_PREFIX "ERROR out of memory\n"
+#define PROTO_ERR_TOO_LONG  PROTO_PREFIX "ERROR packet too long\n"
+
+enum proto_pos {
+    PROTO_POS_PACKET,
+    PROTO_POS_BYTE,
+    PROTO_POS_LAST,
+};
+
+struct proto_cmd {
+    int compress;       // AESDSOCKET_COMPRESS, nothing else is set
+    int follow;         // AESDSOCKET_FOLLOW rather than AESDSOCKET_SEEK
+    int seek;           // a <pos> was given
+    enum proto_pos pos;
+    uint64_t arg;
+};
+
+/**
+ * Parse the line @param line of @param len bytes, newline included
+ * @return 1 if it is a command (stored in @param cmd), 0 if it is data.
+ */
+int proto_parse(const char *line, size_t len, struct proto_cmd *cmd);
+
+/**
+ * @return the log offset the <pos> of @param cmd refers to
+ */
+off_t proto_seek_offset(const struct proto_cmd *cmd);
+
+#endif // PROTOCOL_H
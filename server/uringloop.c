@@ -0,0 +1,1430 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+#include "uringloop.h"
+#include "datalog.h"
+#include "bufpool.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "admission.h"
+#include "aesdlog.h"
+
+#define URING_ENTRIES   1024
+#define URING_BUFS      256            // provided receive buffers per worker
+#define URING_BUF_SIZE  (16 * 1024)
+#define URING_BGID      0
+#define URING_PIPE_SIZE (256 * 1024)   // per-connection splice pipe, if allowed
+
+/*
+ * Every submission carries its operation in the low bits of user_data and
+ * the connection (or NULL) in the rest.
+ */
+enum uring_op {
+    OP_CANCEL,
+    OP_ACCEPT,
+    OP_RECV,
+    OP_SPLICE_IN,   // log file -> pipe
+    OP_SPLICE_OUT,  // pipe -> socket
+    OP_DONE,        // read of the group-commit eventfd
+    OP_WAKE,        // poll of the shutdown eventfd
+    OP_TICK,        // send-timeout sweep
+};
+#define OP_MASK 7ull
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;  // SQEs handed out, published to sq_tail on submit
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+};
+
+/**
+ * Same state machine as the epoll loop, see eventloop.c
+ */
+enum uconn_state {
+    UCONN_READING,
+    UCONN_COMMITTING,
+    UCONN_REPLYING,
+    UCONN_CLOSING,
+};
+
+struct uring_loop;
+
+struct uconn {
+    int fd;
+    enum uconn_state state;
+    int peer_closed;
+    int corked;
+    int inflight;       // submissions still referring to this connection
+    int splices;        // of which reply splices
+    int recv_armed;
+    char client_ip[INET_ADDRSTRLEN];
+    uint32_t ip;
+    int ip_counted;     // see struct connection
+    const char *refusal;
+    struct uring_loop *loop;
+
+    struct buf_chain inbuf;
+    struct buf_chain batch;
+    struct iovec *iov;
+    int iov_cap;
+    struct datalog_req req;
+
+    // Packet ends, see struct connection
+    off_t *ends;
+    int nends;
+    int ends_cap;
+    int reply_idx;
+    off_t reply_off;
+    int framed;
+    struct datalog_frame frame;
+
+    // Replies move log -> pipe -> socket; piped is what sits in the pipe
+    // and reply_seg the log segment pinned while a splice reads it.  Frames
+    // and compressed segments are written into the pipe from userspace.
+    int pipefd[2];
+    size_t pipe_chunk;
+    size_t piped;
+    struct datalog_seg *reply_seg;
+
+    // Protocol commands and following, see struct connection
+    off_t cursor;
+    struct proto_cmd cmd;
+    off_t cmd_end;
+    int rescan;         // inbuf holds bytes not framed yet
+    int following;
+    struct uconn *follow_prev, *follow_next;
+
+    uint64_t commit_start;
+    uint64_t reply_start;
+    uint64_t last_progress;
+
+    struct uconn *prev, *next;
+};
+
+struct uring_loop {
+    struct uring ring;
+    int listenfd;
+    int wakefd;
+    const struct loop_options *opts;
+    struct uconn *conn_list;
+    struct uconn *follow_list;
+    int nfollowers;
+    struct bufpool pool;
+    int ops;            // submissions whose final completion is still due
+    int stopping;
+    uint64_t drain_start;   // see drain_step(), 0 if not draining
+    struct codel codel;
+
+    // Provided receive buffers
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    char *bufs;
+    unsigned br_tail;
+
+    // Group-commit completions, as in the epoll loop
+    int donefd;
+    uint64_t done_count;
+    pthread_mutex_t done_lock;
+    struct datalog_req *done_list;
+    int commits_pending;
+
+    struct __kernel_timespec tick;
+
+    struct metrics_shard *metrics;
+    time_t log_second;
+    int log_lines;
+    unsigned long log_suppressed;
+};
+
+/* ------------------------------------------------------------------------ */
+/* Ring plumbing                                                            */
+/* ------------------------------------------------------------------------ */
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_exit(struct uring *r) {
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_len);
+    if (r->fd >= 0) close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+static int ring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                     IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        ring_exit(r);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                         IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            ring_exit(r);
+            return -1;
+        }
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                   IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        ring_exit(r);
+        return -1;
+    }
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sqe_tail = *r->sq_tail;
+
+    // SQEs are always used in ring order, so the index array is the identity
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    return 0;
+}
+
+/**
+ * Publish the SQEs handed out so far and enter the kernel, waiting for
+ * @param wait_nr completions
+ * @return as io_uring_enter, -1 with errno set on failure
+ */
+static int ring_submit(struct uring *r, unsigned wait_nr) {
+    unsigned to_submit = r->sqe_tail - *r->sq_tail;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    return sys_io_uring_enter(r->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+}
+
+/**
+ * @return a zeroed SQE, submitting what is queued first if the ring is
+ * full, or NULL if there is still no room
+ */
+static struct io_uring_sqe *ring_get_sqe(struct uring *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail - head >= r->sq_entries) {
+        if (ring_submit(r, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sqe_tail - head >= r->sq_entries) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+    r->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static uint64_t op_data(void *ptr, enum uring_op op) {
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+/**
+ * Get an SQE for @param op on @param conn and count it as outstanding
+ */
+static struct io_uring_sqe *loop_get_sqe(struct uring_loop *loop, struct uconn *conn, enum uring_op op) {
+    struct io_uring_sqe *sqe = ring_get_sqe(&loop->ring);
+    if (!sqe) {
+        aesdlog(LOG_ERR, "io_uring submission queue full");
+        return NULL;
+    }
+    sqe->user_data = op_data(conn, op);
+    loop->ops++;
+    if (conn) conn->inflight++;
+    return sqe;
+}
+
+/**
+ * Hand receive buffer @param bid back to the kernel
+ */
+static void loop_recycle_buf(struct uring_loop *loop, unsigned bid) {
+    struct io_uring_buf *buf = &loop->br->bufs[loop->br_tail & (URING_BUFS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(loop->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    loop->br_tail++;
+    __atomic_store_n(&loop->br->tail, (uint16_t)loop->br_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Allocate the provided-buffer ring and register it as group URING_BGID
+ */
+static int loop_setup_bufs(struct uring_loop *loop) {
+    loop->br_len = URING_BUFS * sizeof(struct io_uring_buf);
+    loop->br = mmap(NULL, loop->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->br == MAP_FAILED) {
+        loop->br = NULL;
+        return -1;
+    }
+    loop->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    if (!loop->bufs) {
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)loop->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(loop->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        return -1;
+    }
+    for (unsigned bid = 0; bid < URING_BUFS; bid++) {
+        loop_recycle_buf(loop, bid);
+    }
+    return 0;
+}
+
+int uring_loop_supported(void) {
+    struct uring ring;
+    if (ring_init(&ring, 8) < 0) {
+        return 0;
+    }
+
+    size_t probe_len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probe_len);
+    int ok = probe && sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    static const int needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SPLICE, IORING_OP_READ,
+        IORING_OP_POLL_ADD, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL,
+    };
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+
+    // Provided-buffer rings came with multishot accept (5.19): test one
+    if (ok) {
+        struct io_uring_buf_ring *br = mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)br;
+        reg.ring_entries = 1;
+        ok = br != MAP_FAILED && sys_io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+        ring_exit(&ring);
+        if (br != MAP_FAILED) munmap(br, 4096);
+        return ok;
+    }
+    ring_exit(&ring);
+    return 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Connections                                                              */
+/* ------------------------------------------------------------------------ */
+
+static void uconn_close(struct uconn *conn);
+
+static void uconn_log(struct uring_loop *loop, const char *what, struct uconn *conn) {
+    time_t now = time(NULL);
+    if (now != loop->log_second) {
+        if (loop->log_suppressed) {
+            aesdlog(LOG_INFO, "Suppressed %lu connection messages", loop->log_suppressed);
+        }
+        loop->log_second = now;
+        loop->log_lines = 0;
+        loop->log_suppressed = 0;
+    }
+    if (loop->log_lines >= CONN_LOG_PER_SEC) {
+        loop->log_suppressed++;
+        metrics_add(loop->metrics, MC_LOG_DROPPED, 1);
+        return;
+    }
+    loop->log_lines++;
+
+    // Multishot accept does not return the peer address; look it up only for the log
+    if (!conn->client_ip[0]) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        if (getpeername(conn->fd, (struct sockaddr *)&addr, &len) == 0) {
+            inet_ntop(AF_INET, &addr.sin_addr, conn->client_ip, sizeof(conn->client_ip));
+        } else {
+            snprintf(conn->client_ip, sizeof(conn->client_ip), "unknown");
+        }
+    }
+    aesdlog(LOG_INFO, "%s connection from %s", what, conn->client_ip);
+}
+
+static struct uconn *uconn_new(struct uring_loop *loop, int fd) {
+    struct uconn *conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->loop = loop;
+    conn->state = UCONN_READING;
+    conn->pipefd[0] = conn->pipefd[1] = -1;
+    metrics_add(loop->metrics, MC_ACCEPTS, 1);
+
+    conn->next = loop->conn_list;
+    if (loop->conn_list) loop->conn_list->prev = conn;
+    loop->conn_list = conn;
+    return conn;
+}
+
+/**
+ * Free @param conn once it is closing and the kernel no longer refers to it
+ */
+static void uconn_maybe_free(struct uconn *conn) {
+    if (conn->state != UCONN_CLOSING || conn->inflight > 0) {
+        return;
+    }
+    struct uring_loop *loop = conn->loop;
+    if (conn->prev) conn->prev->next = conn->next;
+    else loop->conn_list = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    if (conn->following) {
+        if (conn->follow_prev) conn->follow_prev->follow_next = conn->follow_next;
+        else loop->follow_list = conn->follow_next;
+        if (conn->follow_next) conn->follow_next->follow_prev = conn->follow_prev;
+        if (--loop->nfollowers == 0) {
+            datalog_watch(loop->donefd, 0);
+        }
+    }
+
+    uconn_log(loop, "Closed", conn);
+    close(conn->fd);
+    if (conn->ip_counted) {
+        admission_release(conn->ip);
+    }
+    if (conn->pipefd[0] >= 0) close(conn->pipefd[0]);
+    if (conn->pipefd[1] >= 0) close(conn->pipefd[1]);
+    buf_chain_release(&loop->pool, &conn->inbuf);
+    buf_chain_release(&loop->pool, &conn->batch);
+    free(conn->iov);
+    free(conn->ends);
+    free(conn);
+    metrics_add(loop->metrics, MC_CLOSES, 1);
+}
+
+/**
+ * Start tearing @param conn down.  Submissions still in flight are made
+ * to fail by shutting the socket down; the last completion frees it.
+ */
+static void uconn_close(struct uconn *conn) {
+    if (conn->state == UCONN_COMMITTING) {
+        // The committer still reads the batch, collect_commits() closes it;
+        // the shutdown fails the replies of a follower, which outlives EOF
+        conn->peer_closed = 1;
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+    if (conn->state != UCONN_CLOSING) {
+        conn->state = UCONN_CLOSING;
+        if (conn->inflight > 0) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    uconn_maybe_free(conn);
+}
+
+/**
+ * Mark @param conn refused with the error line @param line, counted as
+ * @param reason; uconn_abort() sends it
+ * @return -1
+ */
+static int uconn_refuse(struct uconn *conn, enum metrics_counter reason, const char *line) {
+    metrics_add(conn->loop->metrics, reason, 1);
+    conn->refusal = line;
+    return -1;
+}
+
+/**
+ * Close @param conn after taking in bytes failed: with its error line if
+ * it was refused, else memory ran out
+ */
+static void uconn_abort(struct uconn *conn) {
+    if (conn->refusal) {
+        admission_refuse(conn->fd, conn->refusal);
+    } else {
+        aesdlog(LOG_ERR, "Memory allocation failed");
+    }
+    uconn_close(conn);
+}
+
+static void uconn_arm_recv(struct uconn *conn) {
+    struct io_uring_sqe *sqe = loop_get_sqe(conn->loop, conn, OP_RECV);
+    if (!sqe) {
+        uconn_close(conn);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->len = URING_BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    conn->recv_armed = 1;
+}
+
+static int uconn_push_end(struct uconn *conn, off_t end) {
+    if (conn->nends == conn->ends_cap) {
+        int cap = conn->ends_cap ? conn->ends_cap * 2 : 16;
+        off_t *ends = realloc(conn->ends, cap * sizeof(*ends));
+        if (!ends) {
+            return -1;
+        }
+        conn->ends = ends;
+        conn->ends_cap = cap;
+    }
+    conn->ends[conn->nends++] = end;
+    return 0;
+}
+
+/**
+ * @return 1 if inbuf bytes [@param start, @param end) are a command line,
+ * see conn_is_command()
+ */
+static int uconn_is_command(struct uconn *conn, off_t start, off_t end, off_t chunk_off, const char *chunk) {
+    size_t len = end - start;
+    if (len > PROTO_MAX_LINE) {
+        return 0;
+    }
+    if (start >= chunk_off) {
+        return proto_parse(chunk + (start - chunk_off), len, &conn->cmd);
+    }
+    char line[PROTO_MAX_LINE];
+    buf_chain_peek(&conn->inbuf, start, line, len);
+    return proto_parse(line, len, &conn->cmd);
+}
+
+/**
+ * Note the packet boundaries in @param len bytes at inbuf offset
+ * @param chunk_off, up to the first command line, see conn_frame()
+ * @return 1 if it stopped at a command, 0 if all bytes were framed, -1 if
+ * memory ran out or a packet is over max_packet (see uconn_abort()).
+ */
+static int uconn_frame(struct uconn *conn, off_t chunk_off, const char *chunk, size_t len) {
+    size_t max_packet = conn->loop->opts->max_packet;
+    const char *p = chunk, *chunk_end = chunk + len;
+    while ((p = memchr(p, '\n', chunk_end - p)) != NULL) {
+        p++;
+        off_t end = chunk_off + (p - chunk);
+        off_t start = conn->nends ? conn->ends[conn->nends - 1] : 0;
+        if (max_packet && (size_t)(end - start) > max_packet) {
+            return uconn_refuse(conn, MC_REJECT_TOO_LONG, PROTO_ERR_TOO_LONG);
+        }
+        if (uconn_is_command(conn, start, end, chunk_off, chunk)) {
+            conn->cmd_end = end;
+            return 1;
+        }
+        if (uconn_push_end(conn, end) < 0) {
+            return -1;
+        }
+    }
+    off_t start = conn->nends ? conn->ends[conn->nends - 1] : 0;
+    if (max_packet && (size_t)(chunk_off + len - start) > max_packet) {
+        return uconn_refuse(conn, MC_REJECT_TOO_LONG, PROTO_ERR_TOO_LONG);
+    }
+    return 0;
+}
+
+/**
+ * Frame the bytes already in inbuf
+ * @return as uconn_frame().
+ */
+static int uconn_rescan(struct uconn *conn) {
+    off_t off = 0;
+    for (struct buf_seg *seg = conn->inbuf.head; seg; seg = seg->next) {
+        int rc = uconn_frame(conn, off, seg->data, seg->len);
+        if (rc != 0) {
+            return rc;
+        }
+        off += seg->len;
+    }
+    return 0;
+}
+
+/**
+ * Copy @param len received bytes into the input chain, noting every
+ * packet boundary.  Bytes that arrive past a command, or while ends[]
+ * belongs to a commit or a reply (a follower keeps a receive armed), are
+ * only stored and framed later.  Once the memory budget is used up,
+ * bytes that need another segment refuse the connection.
+ * @return 0 on success, -1 on failure (see uconn_abort()).
+ */
+static int uconn_ingest(struct uconn *conn, const char *data, size_t len) {
+    int frame = conn->state == UCONN_READING && !conn->cmd_end && !conn->rescan;
+    if (!frame && !conn->cmd_end) {
+        conn->rescan = 1;
+    }
+    struct buf_seg *tail = conn->inbuf.tail;
+    if ((!tail || tail->cap - tail->len < len) && admission_over_budget(conn->loop->opts)) {
+        return uconn_refuse(conn, MC_REJECT_MEMORY, PROTO_ERR_MEMORY);
+    }
+    while (len > 0) {
+        struct buf_seg *seg = buf_chain_reserve(&conn->loop->pool, &conn->inbuf);
+        if (!seg) {
+            return -1;
+        }
+        size_t n = seg->cap - seg->len;
+        if (n > len) n = len;
+        char *chunk = seg->data + seg->len;
+        memcpy(chunk, data, n);
+
+        off_t chunk_off = conn->inbuf.len;
+        seg->len += n;
+        conn->inbuf.len += n;
+        if (frame) {
+            int rc = uconn_frame(conn, chunk_off, chunk, n);
+            if (rc < 0) {
+                return -1;
+            }
+            frame = rc == 0;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void uconn_commit_done(struct datalog_req *req) {
+    struct uconn *conn = (struct uconn *)((char *)req - offsetof(struct uconn, req));
+    struct uring_loop *loop = conn->loop;
+
+    pthread_mutex_lock(&loop->done_lock);
+    req->next = loop->done_list;
+    loop->done_list = req;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    uint64_t one = 1;
+    if (write(loop->donefd, &one, sizeof(one)) < 0) {
+        aesdlog(LOG_ERR, "eventfd write failed: %s", strerror(errno));
+    }
+}
+
+/**
+ * Queue the complete packets for the group commit, see conn_commit_packets()
+ */
+static int uconn_commit_packets(struct uconn *conn) {
+    struct bufpool *pool = &conn->loop->pool;
+    off_t complete = conn->ends[conn->nends - 1];
+
+    struct buf_chain rest;
+    if (buf_chain_split(pool, &conn->inbuf, complete, &rest) < 0) {
+        return -1;
+    }
+    conn->batch = conn->inbuf;
+    conn->inbuf = rest;
+    if (conn->cmd_end) {
+        conn->cmd_end -= complete;
+    }
+
+    if (conn->batch.nsegs > conn->iov_cap) {
+        struct iovec *iov = realloc(conn->iov, conn->batch.nsegs * sizeof(*iov));
+        if (!iov) {
+            return -1;
+        }
+        conn->iov = iov;
+        conn->iov_cap = conn->batch.nsegs;
+    }
+    conn->req.iov = conn->iov;
+    conn->req.iovcnt = buf_chain_iov(&conn->batch, conn->iov, conn->batch.nsegs);
+    conn->req.len = complete;
+    conn->req.ends = conn->ends;
+    conn->req.nends = conn->nends;
+    conn->req.complete = uconn_commit_done;
+    conn->commit_start = metrics_now();
+    conn->state = UCONN_COMMITTING;
+    conn->loop->commits_pending++;
+    datalog_submit(&conn->req);
+    return 0;
+}
+
+static void uconn_resume(struct uconn *conn);
+
+/**
+ * Create the splice pipe of @param conn on its first reply
+ * @return 0 on success, -1 on failure (already logged).
+ */
+static int uconn_open_pipe(struct uconn *conn) {
+    if (conn->pipefd[0] >= 0) {
+        return 0;
+    }
+    if (pipe2(conn->pipefd, O_CLOEXEC) < 0) {
+        aesdlog(LOG_ERR, "pipe2 failed: %s", strerror(errno));
+        return -1;
+    }
+    fcntl(conn->pipefd[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+    int size = fcntl(conn->pipefd[1], F_GETPIPE_SZ);
+    // Half the pipe, so an unaligned file range still fits in its pages
+    conn->pipe_chunk = size > 0 ? size / 2 : 32 * 1024;
+    return 0;
+}
+
+/**
+ * Replies are all out: uncork and go back to reading
+ */
+static void uconn_finish_reply(struct uconn *conn) {
+    if (conn->corked) {
+        int off = 0;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+        conn->corked = 0;
+    }
+    metrics_observe(conn->loop->metrics, MH_REPLAY, metrics_now() - conn->reply_start);
+    conn->nends = 0;
+    conn->state = UCONN_READING;
+    uconn_resume(conn);
+}
+
+/**
+ * Submit the next step of the reply: drain what is left in the pipe, or
+ * splice the next chunk of the log through it as a linked pair
+ */
+static void uconn_reply_step(struct uconn *conn) {
+    struct uring_loop *loop = conn->loop;
+    size_t len = conn->piped;
+    int fd = -1;
+    off_t file_off = 0;
+    while (len == 0 && conn->reply_idx < conn->nends) {
+        off_t end = conn->ends[conn->reply_idx];
+        size_t avail;
+        if (!conn->framed && conn->reply_off < end) {
+            conn->reply_seg = datalog_seg_get(&conn->reply_off, &fd, &file_off, &avail);
+            if (!conn->reply_seg) {
+                uconn_close(conn);
+                return;
+            }
+            if (fd >= 0 && conn->reply_off < end) {
+                len = end - conn->reply_off;
+                if (len > avail) len = avail;
+                if (len > conn->pipe_chunk) len = conn->pipe_chunk;
+                break;
+            }
+            // Skipped past history dropped by retention, or compressed
+            datalog_seg_put(conn->reply_seg);
+            conn->reply_seg = NULL;
+        }
+        if (conn->framed || conn->reply_off < end) {
+            // The pipe is empty and takes pipe_chunk bytes without blocking
+            ssize_t n = datalog_send(conn->pipefd[1], &conn->reply_off, end, conn->pipe_chunk,
+                                     conn->framed ? &conn->frame : NULL);
+            if (n < 0 || (n == 0 && conn->reply_off < end)) {
+                // n == 0: the log shrank underneath us
+                if (n < 0) aesdlog(LOG_ERR, "Reading the log failed: %s", strerror(errno));
+                uconn_close(conn);
+                return;
+            }
+            if (n > 0) {
+                conn->piped = len = n;
+                break;
+            }
+        }
+        if (conn->following) {
+            conn->cursor = end;
+        }
+        conn->reply_idx++;
+        conn->reply_off = conn->cursor;
+        memset(&conn->frame, 0, sizeof(conn->frame));
+    }
+    if (len == 0) {
+        uconn_finish_reply(conn);
+        return;
+    }
+
+    if (conn->piped == 0) {
+        struct io_uring_sqe *in = loop_get_sqe(loop, conn, OP_SPLICE_IN);
+        if (!in) {
+            datalog_seg_put(conn->reply_seg);
+            conn->reply_seg = NULL;
+            uconn_close(conn);
+            return;
+        }
+        in->opcode = IORING_OP_SPLICE;
+        in->splice_fd_in = fd;
+        in->splice_off_in = file_off;
+        in->fd = conn->pipefd[1];
+        in->off = (uint64_t)-1;
+        in->len = len;
+        // A short splice in cancels the splice out, see on_splice()
+        in->flags = IOSQE_IO_LINK;
+        conn->splices++;
+    }
+
+    struct io_uring_sqe *out = loop_get_sqe(loop, conn, OP_SPLICE_OUT);
+    if (!out) {
+        uconn_close(conn);
+        return;
+    }
+    out->opcode = IORING_OP_SPLICE;
+    out->splice_fd_in = conn->pipefd[0];
+    out->splice_off_in = (uint64_t)-1;
+    out->fd = conn->fd;
+    out->off = (uint64_t)-1;
+    out->len = len;
+    conn->splices++;
+}
+
+/**
+ * Answer @param conn with the log from its cursor up to @param end
+ */
+static void uconn_start_reply(struct uconn *conn, off_t end) {
+    conn->nends = 0;
+    if (uconn_push_end(conn, end) < 0 || uconn_open_pipe(conn) < 0) {
+        aesdlog(LOG_ERR, "Memory allocation failed");
+        uconn_close(conn);
+        return;
+    }
+    conn->reply_idx = 0;
+    conn->reply_off = conn->cursor;
+    memset(&conn->frame, 0, sizeof(conn->frame));
+    conn->piped = 0;
+    conn->state = UCONN_REPLYING;
+    conn->reply_start = metrics_now();
+    conn->last_progress = conn->reply_start;
+    uconn_reply_step(conn);
+}
+
+/**
+ * Send a follower in UCONN_READING whatever was appended since its last reply
+ * @return 1 if a reply was started, 0 if it is up to date.
+ */
+static int uconn_follow(struct uconn *conn) {
+    off_t size = datalog_size();
+    if (conn->cursor >= size) {
+        return 0;
+    }
+    uconn_start_reply(conn, size);
+    return 1;
+}
+
+/**
+ * Drop the command line at the head of inbuf and carry it out
+ */
+static void uconn_run_command(struct uconn *conn) {
+    struct bufpool *pool = &conn->loop->pool;
+    struct buf_chain rest;
+    if (buf_chain_split(pool, &conn->inbuf, conn->cmd_end, &rest) < 0) {
+        aesdlog(LOG_ERR, "Memory allocation failed");
+        uconn_close(conn);
+        return;
+    }
+    buf_chain_release(pool, &conn->inbuf);
+    conn->inbuf = rest;
+    conn->cmd_end = 0;
+    conn->rescan = conn->inbuf.len > 0;
+
+    if (conn->cmd.compress) {
+        conn->framed = 1;
+        uconn_resume(conn);
+        return;
+    }
+    if (conn->cmd.seek) {
+        conn->cursor = proto_seek_offset(&conn->cmd);
+    }
+    if (!conn->cmd.follow) {
+        uconn_start_reply(conn, datalog_size());
+        return;
+    }
+    if (!conn->following) {
+        struct uring_loop *loop = conn->loop;
+        conn->following = 1;
+        conn->follow_prev = NULL;
+        conn->follow_next = loop->follow_list;
+        if (loop->follow_list) loop->follow_list->follow_prev = conn;
+        loop->follow_list = conn;
+        if (loop->nfollowers++ == 0) {
+            datalog_watch(loop->donefd, 1);
+        }
+    }
+    if (!uconn_follow(conn)) {
+        uconn_resume(conn);
+    }
+}
+
+/**
+ * Decide what a connection in UCONN_READING does with its framed input:
+ * run a command, commit the complete packets, or receive more first.
+ * @param more is set if the socket already holds more data.
+ */
+static void uconn_process(struct uconn *conn, int more) {
+    if (conn->cmd_end) {
+        // Packets before the command are committed and answered first
+        if (conn->nends == 0) {
+            uconn_run_command(conn);
+            return;
+        }
+    } else if (conn->peer_closed) {
+        off_t complete = conn->nends ? conn->ends[conn->nends - 1] : 0;
+        if ((off_t)conn->inbuf.len > complete && uconn_push_end(conn, conn->inbuf.len) < 0) {
+            uconn_close(conn);
+            return;
+        }
+        if (conn->nends == 0) {
+            // Followers outlive the peer's EOF
+            if (!conn->following) uconn_close(conn);
+            else uconn_follow(conn);
+            return;
+        }
+    } else if (conn->nends == 0 ||
+               (more && conn->nends < CONN_MAX_REPLIES && conn->ends[conn->nends - 1] < BATCH_BYTES)) {
+        // No complete packet yet, or more already waiting to join the batch
+        if (conn->nends == 0 && conn->following && uconn_follow(conn)) {
+            return;
+        }
+        if (!conn->recv_armed) uconn_arm_recv(conn);
+        return;
+    }
+
+    if (uconn_commit_packets(conn) < 0) {
+        aesdlog(LOG_ERR, "Memory allocation failed");
+        uconn_close(conn);
+    }
+}
+
+/**
+ * Back in UCONN_READING after a reply: frame what arrived meanwhile or was
+ * left behind a command, then carry on
+ */
+static void uconn_resume(struct uconn *conn) {
+    if (conn->rescan) {
+        conn->rescan = 0;
+        if (uconn_rescan(conn) < 0) {
+            uconn_abort(conn);
+            return;
+        }
+    }
+    uconn_process(conn, 0);
+}
+
+/**
+ * The batch of @param conn is committed: start the replies
+ */
+static void uconn_commit_finished(struct uconn *conn) {
+    buf_chain_release(&conn->loop->pool, &conn->batch);
+    if (conn->req.end < 0 || conn->peer_closed) {
+        // Peer gone while committing, or the commit failed
+        if (conn->req.end < 0 || conn->nends == 0) {
+            conn->state = UCONN_READING;
+            uconn_close(conn);
+            return;
+        }
+    }
+
+    if (uconn_open_pipe(conn) < 0) {
+        conn->state = UCONN_READING;
+        uconn_close(conn);
+        return;
+    }
+
+    off_t base = conn->req.end - conn->ends[conn->nends - 1];
+    for (int i = 0; i < conn->nends; i++) {
+        conn->ends[i] += base;
+    }
+    conn->reply_idx = 0;
+    conn->reply_off = conn->cursor;
+    memset(&conn->frame, 0, sizeof(conn->frame));
+    conn->piped = 0;
+    conn->state = UCONN_REPLYING;
+    conn->reply_start = metrics_now();
+    conn->last_progress = conn->reply_start;
+    metrics_observe(conn->loop->metrics, MH_APPEND, conn->reply_start - conn->commit_start);
+    codel_sample(&conn->loop->codel, conn->reply_start, conn->reply_start - conn->commit_start);
+    metrics_add(conn->loop->metrics, MC_PACKETS, conn->nends);
+
+    if (conn->nends > 1) {
+        int on = 1;
+        conn->corked = setsockopt(conn->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) == 0;
+    }
+    uconn_reply_step(conn);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Completions                                                              */
+/* ------------------------------------------------------------------------ */
+
+static void on_recv(struct uconn *conn, int res, unsigned flags) {
+    struct uring_loop *loop = conn->loop;
+    conn->recv_armed = 0;
+    if (flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        int failed = 0;
+        if (res > 0 && conn->state != UCONN_CLOSING) {
+            metrics_add(loop->metrics, MC_BYTES_IN, res);
+            failed = uconn_ingest(conn, loop->bufs + (size_t)bid * URING_BUF_SIZE, res) < 0;
+        }
+        loop_recycle_buf(loop, bid);
+        if (failed) {
+            uconn_abort(conn);
+            return;
+        }
+    }
+    if (conn->state == UCONN_CLOSING) {
+        uconn_maybe_free(conn);
+        return;
+    }
+    if (res < 0 && res != -ENOBUFS) {
+        if (res != -ECONNRESET) {
+            aesdlog(LOG_ERR, "Receive failed: %s", strerror(-res));
+        }
+        uconn_close(conn);
+        return;
+    }
+    if (res == 0) {
+        conn->peer_closed = 1;
+    }
+    if (conn->state != UCONN_READING) {
+        // A follower's receive; uconn_resume() picks it up after the reply
+        return;
+    }
+    if (res == -ENOBUFS) {
+        // Every buffer was in use; they have been handed back by now
+        uconn_arm_recv(conn);
+        return;
+    }
+    uconn_process(conn, res > 0 && (flags & IORING_CQE_F_SOCK_NONEMPTY));
+}
+
+static void on_splice(struct uconn *conn, enum uring_op op, int res) {
+    conn->splices--;
+    if (op == OP_SPLICE_IN) {
+        datalog_seg_put(conn->reply_seg);
+        conn->reply_seg = NULL;
+    }
+    if (conn->state == UCONN_REPLYING) {
+        if (op == OP_SPLICE_IN) {
+            if (res > 0) {
+                conn->piped += res;
+                conn->reply_off += res;
+            } else {
+                // res == 0: the log shrank underneath us
+                if (res < 0) aesdlog(LOG_ERR, "Splice from file failed: %s", strerror(-res));
+                uconn_close(conn);
+            }
+        } else if (res > 0) {
+            conn->piped -= res;
+            conn->last_progress = metrics_now();
+            metrics_add(conn->loop->metrics, MC_BYTES_OUT, res);
+        } else if (res != -ECANCELED) {
+            if (res < 0 && res != -EPIPE && res != -ECONNRESET) {
+                aesdlog(LOG_ERR, "Send to client failed: %s", strerror(-res));
+            }
+            uconn_close(conn);
+        }
+    }
+
+    if (conn->splices > 0) {
+        return;
+    }
+    if (conn->state == UCONN_REPLYING) {
+        uconn_reply_step(conn);
+    } else {
+        uconn_maybe_free(conn);
+    }
+}
+
+static void arm_accept(struct uring_loop *loop) {
+    struct io_uring_sqe *sqe = loop_get_sqe(loop, NULL, OP_ACCEPT);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = loop->listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    // Blocking sockets: a splice to a full socket waits in the kernel's worker
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void arm_done_read(struct uring_loop *loop) {
+    struct io_uring_sqe *sqe = loop_get_sqe(loop, NULL, OP_DONE);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = loop->donefd;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->done_count;
+    sqe->len = sizeof(loop->done_count);
+}
+
+static void arm_wake(struct uring_loop *loop) {
+    struct io_uring_sqe *sqe = loop_get_sqe(loop, NULL, OP_WAKE);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = loop->wakefd;
+    sqe->poll32_events = POLLIN;
+}
+
+static void arm_tick(struct uring_loop *loop) {
+    struct io_uring_sqe *sqe = loop_get_sqe(loop, NULL, OP_TICK);
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&loop->tick;
+    sqe->len = 1;
+}
+
+static void on_accept(struct uring_loop *loop, int res) {
+    if (res < 0) {
+        if (res != -ECANCELED && res != -EINTR && res != -ECONNABORTED) {
+            aesdlog(LOG_ERR, "Accept failed: %s", strerror(-res));
+        }
+        return;
+    }
+    if (loop->stopping) {
+        close(res);
+        return;
+    }
+    // Multishot accept does not return the peer address, look it up if limited
+    struct sockaddr_in addr = { .sin_addr.s_addr = 0 };
+    if (loop->opts->max_per_ip > 0) {
+        socklen_t len = sizeof(addr);
+        getpeername(res, (struct sockaddr *)&addr, &len);
+    }
+    int counted;
+    const char *refusal = admission_accept(loop->opts, &loop->codel, loop->metrics,
+                                           addr.sin_addr.s_addr, &counted);
+    if (refusal) {
+        admission_refuse(res, refusal);
+        close(res);
+        return;
+    }
+    struct uconn *conn = uconn_new(loop, res);
+    if (!conn) {
+        aesdlog(LOG_ERR, "Memory allocation failed");
+        close(res);
+        if (counted) admission_release(addr.sin_addr.s_addr);
+        return;
+    }
+    conn->ip = addr.sin_addr.s_addr;
+    conn->ip_counted = counted;
+    if (loop->opts->client_sndbuf > 0) {
+        int sndbuf = (int)loop->opts->client_sndbuf;
+        setsockopt(res, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    }
+    // Replies leave in pipe-sized pieces; do not let Nagle hold back the tail
+    int on = 1;
+    setsockopt(res, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    uconn_log(loop, "Accepted", conn);
+    uconn_arm_recv(conn);
+}
+
+/**
+ * Push what was just appended to every follower that is idle
+ */
+static void feed_followers(struct uring_loop *loop) {
+    struct uconn *conn = loop->follow_list;
+    while (conn) {
+        struct uconn *next = conn->follow_next;
+        if (conn->state == UCONN_READING && conn->nends == 0 && !conn->cmd_end) {
+            uconn_follow(conn);
+        }
+        conn = next;
+    }
+}
+
+/**
+ * Pick up finished group commits, see collect_commits() in eventloop.c
+ */
+static void collect_commits(struct uring_loop *loop) {
+    pthread_mutex_lock(&loop->done_lock);
+    struct datalog_req *req = loop->done_list;
+    loop->done_list = NULL;
+    pthread_mutex_unlock(&loop->done_lock);
+
+    while (req) {
+        struct datalog_req *next = req->next;
+        struct uconn *conn = (struct uconn *)((char *)req - offsetof(struct uconn, req));
+        loop->commits_pending--;
+        if (loop->stopping) {
+            buf_chain_release(&loop->pool, &conn->batch);
+            conn->state = UCONN_READING;
+            uconn_close(conn);
+        } else {
+            uconn_commit_finished(conn);
+        }
+        req = next;
+    }
+}
+
+static void sweep_stalled(struct uring_loop *loop) {
+    uint64_t now = metrics_now();
+    uint64_t timeout_ns = (uint64_t)loop->opts->send_timeout_ms * 1000000;
+    struct uconn *conn = loop->conn_list;
+    while (conn) {
+        struct uconn *next = conn->next;
+        if (conn->state == UCONN_REPLYING && now - conn->last_progress > timeout_ns) {
+            aesdlog(LOG_WARNING, "Send timed out, closing connection");
+            metrics_add(loop->metrics, MC_SEND_TIMEOUTS, 1);
+            uconn_close(conn);
+        }
+        conn = next;
+    }
+}
+
+/**
+ * Start draining for a successor, see event_loop_run(): cancel the
+ * multishot accept, so the backlog waits for the successor, and tick so
+ * that the deadline and exit_flag are looked at
+ */
+static void drain_start(struct uring_loop *loop) {
+    loop->drain_start = metrics_now();
+    struct io_uring_sqe *sqe = loop_get_sqe(loop, NULL, OP_CANCEL);
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = op_data(NULL, OP_ACCEPT);
+    }
+    if (loop->opts->send_timeout_ms == 0) {
+        arm_tick(loop);
+    }
+}
+
+/**
+ * Close the followers that are caught up, they never finish on their own
+ * @return 1 once the loop can return: no connection left, or
+ * DRAIN_TIMEOUT_MS passed.
+ */
+static int drain_step(struct uring_loop *loop) {
+    off_t size = datalog_size();
+    struct uconn *conn = loop->follow_list;
+    while (conn) {
+        struct uconn *next = conn->follow_next;
+        if (conn->state == UCONN_READING && conn->nends == 0 && !conn->cmd_end &&
+            conn->inbuf.len == 0 && conn->cursor >= size) {
+            uconn_close(conn);
+        }
+        conn = next;
+    }
+
+    if (!loop->conn_list) {
+        return 1;
+    }
+    if (metrics_now() - loop->drain_start >= DRAIN_TIMEOUT_MS * 1000000ull) {
+        int left = 0;
+        for (conn = loop->conn_list; conn; conn = conn->next) left++;
+        aesdlog(LOG_WARNING, "Drain timed out, closing %d connections", left);
+        return 1;
+    }
+    return 0;
+}
+
+static void handle_cqe(struct uring_loop *loop, const struct io_uring_cqe *cqe) {
+    enum uring_op op = cqe->user_data & OP_MASK;
+    struct uconn *conn = (struct uconn *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+    int res = cqe->res;
+
+    // Multishot requests stay armed while IORING_CQE_F_MORE is set
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        loop->ops--;
+        if (conn) conn->inflight--;
+    }
+
+    switch (op) {
+    case OP_ACCEPT:
+        on_accept(loop, res);
+        if (!(cqe->flags & IORING_CQE_F_MORE) && !loop->stopping && !loop->drain_start) {
+            arm_accept(loop);
+        }
+        break;
+    case OP_RECV:
+        on_recv(conn, res, cqe->flags);
+        break;
+    case OP_SPLICE_IN:
+    case OP_SPLICE_OUT:
+        on_splice(conn, op, res);
+        break;
+    case OP_DONE:
+        collect_commits(loop);
+        if (loop->nfollowers > 0 && !loop->stopping) feed_followers(loop);
+        if (!loop->stopping) arm_done_read(loop);
+        break;
+    case OP_WAKE:
+        if (drain_flag && !exit_flag) {
+            drain_start(loop);
+        } else {
+            loop->stopping = 1;
+        }
+        break;
+    case OP_TICK:
+        if (!loop->stopping) {
+            if (loop->opts->send_timeout_ms > 0) sweep_stalled(loop);
+            arm_tick(loop);
+        }
+        break;
+    case OP_CANCEL:
+        break;
+    }
+}
+
+/**
+ * Handle every completion currently in the ring
+ */
+static void reap_cqes(struct uring_loop *loop) {
+    struct uring *r = &loop->ring;
+    unsigned head = *r->cq_head;
+    while (1) {
+        unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) break;
+        while (head != tail) {
+            struct io_uring_cqe cqe = r->cqes[head & *r->cq_mask];
+            head++;
+            // Release the slot before handling, handlers may submit more work
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+            handle_cqe(loop, &cqe);
+        }
+    }
+}
+
+/**
+ * Stop every connection and wait until the kernel holds no reference to
+ * the loop's memory, so it can be freed
+ */
+static void uring_loop_drain(struct uring_loop *loop) {
+    loop->stopping = 1;
+
+    // The committer still reads batches of connections in CONN_COMMITTING
+    while (loop->commits_pending > 0) {
+        struct pollfd pfd = { .fd = loop->donefd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            break;
+        }
+        collect_commits(loop);
+    }
+
+    for (struct uconn *conn = loop->conn_list, *next; conn; conn = next) {
+        next = conn->next;
+        uconn_close(conn);
+    }
+
+    struct io_uring_sqe *sqe = loop_get_sqe(loop, NULL, OP_CANCEL);
+    if (sqe) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+    }
+    while (loop->ops > 0) {
+        if (ring_submit(&loop->ring, 1) < 0 && errno != EINTR) {
+            aesdlog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        reap_cqes(loop);
+    }
+}
+
+static void uring_loop_teardown(struct uring_loop *loop) {
+    while (loop->conn_list) {
+        // Only reached with nothing in flight, or after a failed drain
+        loop->conn_list->inflight = 0;
+        loop->conn_list->state = UCONN_CLOSING;
+        uconn_maybe_free(loop->conn_list);
+    }
+    ring_exit(&loop->ring);
+    if (loop->br) munmap(loop->br, loop->br_len);
+    free(loop->bufs);
+    bufpool_destroy(&loop->pool);
+    if (loop->donefd >= 0) close(loop->donefd);
+    pthread_mutex_destroy(&loop->done_lock);
+}
+
+int uring_loop_run(int listenfd, int wakefd, const struct loop_options *opts) {
+    struct uring_loop loop;
+    memset(&loop, 0, sizeof(loop));
+    loop.listenfd = listenfd;
+    loop.wakefd = wakefd;
+    loop.opts = opts;
+    loop.donefd = -1;
+    loop.tick.tv_sec = SWEEP_INTERVAL_MS / 1000;
+    loop.tick.tv_nsec = (SWEEP_INTERVAL_MS % 1000) * 1000000L;
+    bufpool_init(&loop.pool);
+    pthread_mutex_init(&loop.done_lock, NULL);
+
+    if (ring_init(&loop.ring, URING_ENTRIES) < 0) {
+        aesdlog(LOG_ERR, "io_uring setup failed: %s", strerror(errno));
+        loop.ring.fd = -1;
+        uring_loop_teardown(&loop);
+        return -1;
+    }
+    if (loop_setup_bufs(&loop) < 0) {
+        aesdlog(LOG_ERR, "io_uring buffer ring setup failed: %s", strerror(errno));
+        uring_loop_teardown(&loop);
+        return -1;
+    }
+    loop.donefd = eventfd(0, EFD_CLOEXEC);
+    if (loop.donefd < 0) {
+        aesdlog(LOG_ERR, "eventfd failed: %s", strerror(errno));
+        uring_loop_teardown(&loop);
+        return -1;
+    }
+
+    loop.metrics = metrics_register();
+    codel_init(&loop.codel, opts->codel_target_ms);
+    arm_accept(&loop);
+    arm_done_read(&loop);
+    if (wakefd >= 0) arm_wake(&loop);
+    if (opts->send_timeout_ms > 0) arm_tick(&loop);
+
+    while (!exit_flag && !loop.stopping) {
+        if (ring_submit(&loop.ring, 1) < 0 && errno != EINTR && errno != EBUSY) {
+            aesdlog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        reap_cqes(&loop);
+        if (loop.drain_start && drain_step(&loop)) {
+            break;
+        }
+    }
+
+    uring_loop_drain(&loop);
+    uring_loop_teardown(&loop);
+    return 0;
+}
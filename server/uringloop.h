@@ -0,0 +1,32 @@
+#ifndef URINGLOOP_H
+#define URINGLOOP_H
+
+#include "eventloop.h"
+
+/**
+ * io_uring backend for the connection engine, built with HAVE_IO_URING.
+ * Behaves like event_loop_run() towards clients, but the socket I/O is
+ * submitted to a ring instead of being driven by readiness:
+ *   - one multishot accept per listener,
+ *   - recv into a ring of provided buffers, so idle connections hold no
+ *     receive buffer,
+ *   - replies as linked file->pipe->socket splices, straight from the
+ *     page cache.
+ * Appends still go through the data log's group commit; its completions
+ * are read from the loop's eventfd through the ring as well.
+ */
+
+/**
+ * @return 1 if the running kernel supports every operation the backend
+ * uses, 0 if the epoll loop has to be used instead
+ */
+int uring_loop_supported(void);
+
+/**
+ * Serve @param listenfd until exit_flag is set, see event_loop_run().
+ * @return 0 on a clean shutdown, -1 if the ring could not be set up, in
+ * which case nothing was accepted and the caller can fall back to epoll.
+ */
+int uring_loop_run(int listenfd, int wakefd, const struct loop_options *opts);
+
+#endif // URINGLOOP_H
@@ -0,0 +1,102 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+#define BATCH_OUTPUT_FILE "/tmp/aesd-exec-batch-output.txt"
+
+/**
+* Runs more commands than may run at once and checks every job's wait status
+* is reported back on the job it belongs to, whatever order they finish in.
+*/
+void test_exec_batch_exit_status()
+{
+    char *const exit_0[] = { "/bin/sh", "-c", "sleep 0.2; exit 0", NULL };
+    char *const exit_3[] = { "/bin/sh", "-c", "exit 3", NULL };
+    char *const exit_7[] = { "/bin/sh", "-c", "sleep 0.1; exit 7", NULL };
+    char *const true_cmd[] = { "/bin/true", NULL };
+    struct exec_job jobs[] = {
+        { .argv = exit_0 },
+        { .argv = exit_3 },
+        { .argv = exit_7 },
+        { .argv = true_cmd },
+        { .argv = exit_3 },
+    };
+    int count = sizeof(jobs) / sizeof(jobs[0]);
+    int expected[] = { 0, 3, 7, 0, 3 };
+
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_batch(jobs, count, 2),
+            "do_exec_batch should return false when any command exits non-zero");
+    for (int i = 0; i < count; i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, jobs[i].error,
+                "Every command of the batch should have started");
+        TEST_ASSERT_TRUE_MESSAGE(WIFEXITED(jobs[i].status),
+                "Every command of the batch should have been reaped");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(expected[i], WEXITSTATUS(jobs[i].status),
+                "Each job should hold the exit code of its own command");
+    }
+}
+
+/**
+* Checks a batch of successful commands succeeds, with and without a limit
+* on the commands running at once, and that redirection applies per job.
+*/
+void test_exec_batch_success()
+{
+    char *const true_cmd[] = { "/bin/true", NULL };
+    char *const echo_cmd[] = { "/bin/echo", "batch output", NULL };
+    struct exec_job jobs[] = {
+        { .argv = true_cmd },
+        { .argv = echo_cmd, .outputfile = BATCH_OUTPUT_FILE },
+        { .argv = true_cmd },
+    };
+    int count = sizeof(jobs) / sizeof(jobs[0]);
+
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_batch(jobs, count, 1),
+            "do_exec_batch should return true when every command exits 0, one at a time");
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_batch(jobs, count, 0),
+            "do_exec_batch should return true when every command exits 0, one per CPU");
+    for (int i = 0; i < count; i++) {
+        TEST_ASSERT_EQUAL_INT(0, jobs[i].error);
+        TEST_ASSERT_TRUE(WIFEXITED(jobs[i].status) && WEXITSTATUS(jobs[i].status) == 0);
+    }
+
+    char line[64] = "";
+    FILE *file = fopen(BATCH_OUTPUT_FILE, "r");
+    TEST_ASSERT_NOT_NULL_MESSAGE(file, "The job's output file should exist");
+    TEST_ASSERT_NOT_NULL(fgets(line, sizeof(line), file));
+    fclose(file);
+    remove(BATCH_OUTPUT_FILE);
+    TEST_ASSERT_EQUAL_STRING_MESSAGE("batch output\n", line,
+            "The job's output file should hold its command's standard out");
+}
+
+/**
+* Checks a command that cannot be started fails its job without stopping
+* the rest of the batch.
+*/
+void test_exec_batch_start_failure()
+{
+    char *const missing_cmd[] = { "/nonexistent/aesd-command", NULL };
+    char *const relative_cmd[] = { "echo", "relative", NULL };
+    char *const true_cmd[] = { "/bin/true", NULL };
+    struct exec_job jobs[] = {
+        { .argv = missing_cmd },
+        { .argv = relative_cmd },
+        { .argv = true_cmd },
+    };
+
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_batch(jobs, 3, 2),
+            "do_exec_batch should return false when a command cannot be started");
+    TEST_ASSERT_NOT_EQUAL_MESSAGE(0, jobs[0].error,
+            "A command that does not exist should report why it did not start");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(-1, jobs[0].status,
+            "A command that did not start has no wait status");
+    TEST_ASSERT_NOT_EQUAL_MESSAGE(0, jobs[1].error,
+            "A command without an absolute path should not be started");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, jobs[2].error,
+            "The rest of the batch should still run");
+    TEST_ASSERT_TRUE(WIFEXITED(jobs[2].status) && WEXITSTATUS(jobs[2].status) == 0);
+}
@@ -0,0 +1,92 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+#define PIPELINE_OUTPUT_FILE "/tmp/aesd-exec-pipeline-output.txt"
+
+/**
+* Runs echo | tr | cat and checks the last command's output is captured
+* into the caller's buffer, or written to the output file instead.
+*/
+void test_exec_pipeline_capture()
+{
+    char *const echo_cmd[] = { "/bin/echo", "hello pipeline", NULL };
+    char *const tr_cmd[] = { "/usr/bin/tr", "a-z", "A-Z", NULL };
+    char *const cat_cmd[] = { "/bin/cat", NULL };
+    char *const *stages[] = { echo_cmd, tr_cmd, cat_cmd };
+    char buf[64];
+    struct exec_capture capture = { .buf = buf, .size = sizeof(buf) };
+
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_pipeline(3, stages, NULL, &capture),
+            "do_exec_pipeline should return true when every command exits 0");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(strlen("HELLO PIPELINE\n"), capture.len,
+            "The capture should hold all of the last command's output");
+    TEST_ASSERT_EQUAL_STRING_LEN_MESSAGE("HELLO PIPELINE\n", buf, capture.len,
+            "The output should have passed through every command in order");
+    TEST_ASSERT_FALSE(capture.truncated);
+
+    char line[64] = "";
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_pipeline(2, stages, PIPELINE_OUTPUT_FILE, NULL),
+            "do_exec_pipeline should return true writing to an output file");
+    FILE *file = fopen(PIPELINE_OUTPUT_FILE, "r");
+    TEST_ASSERT_NOT_NULL_MESSAGE(file, "The pipeline's output file should exist");
+    TEST_ASSERT_NOT_NULL(fgets(line, sizeof(line), file));
+    fclose(file);
+    remove(PIPELINE_OUTPUT_FILE);
+    TEST_ASSERT_EQUAL_STRING("HELLO PIPELINE\n", line);
+
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_pipeline(3, stages, PIPELINE_OUTPUT_FILE, &capture),
+            "do_exec_pipeline should refuse an output file and a capture together");
+}
+
+/**
+* Checks output beyond the capture buffer is discarded and flagged, while
+* the pipeline still runs to completion.
+*/
+void test_exec_pipeline_truncated()
+{
+    char *const yes_cmd[] = { "/usr/bin/yes", NULL };
+    char *const head_cmd[] = { "/usr/bin/head", "-n", "100000", NULL };
+    char *const *stages[] = { yes_cmd, head_cmd };
+    char buf[8];
+    struct exec_capture capture = { .buf = buf, .size = sizeof(buf) };
+
+    // yes itself dies of SIGPIPE once head is done, so only the output counts
+    do_exec_pipeline(2, stages, NULL, &capture);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(sizeof(buf), capture.len,
+            "The capture should be filled up to its size");
+    TEST_ASSERT_EQUAL_STRING_LEN("y\ny\ny\ny\n", buf, sizeof(buf));
+    TEST_ASSERT_TRUE_MESSAGE(capture.truncated,
+            "Output that did not fit should be flagged as truncated");
+}
+
+/**
+* Checks a failing command in the middle of the pipeline fails the whole
+* pipeline, like pipefail in bash, even though the last command exits 0.
+*/
+void test_exec_pipeline_middle_failure()
+{
+    char *const echo_cmd[] = { "/bin/echo", "lost", NULL };
+    char *const false_cmd[] = { "/bin/false", NULL };
+    char *const missing_cmd[] = { "/nonexistent/aesd-command", NULL };
+    char *const relative_cmd[] = { "cat", NULL };
+    char *const cat_cmd[] = { "/bin/cat", NULL };
+    char buf[64];
+    struct exec_capture capture = { .buf = buf, .size = sizeof(buf) };
+
+    char *const *failing[] = { echo_cmd, false_cmd, cat_cmd };
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_pipeline(3, failing, NULL, &capture),
+            "do_exec_pipeline should return false when a middle command exits non-zero");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, capture.len,
+            "Nothing should pass the failed command");
+
+    char *const *missing[] = { echo_cmd, missing_cmd, cat_cmd };
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_pipeline(3, missing, NULL, &capture),
+            "do_exec_pipeline should return false when a middle command cannot be started");
+
+    char *const *relative[] = { echo_cmd, relative_cmd, cat_cmd };
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_pipeline(3, relative, NULL, &capture),
+            "do_exec_pipeline should refuse commands without an absolute path");
+}
@@ -0,0 +1,86 @@
+#include "unity.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "../../threadpool/threadpool.h"
+
+#define POOL_THREADS        4
+#define POOL_SPAWNERS       2   // fewer than workers, so some are idle
+#define POOL_CHILDREN       512
+#define POOL_TASKS          (POOL_SPAWNERS * POOL_CHILDREN)
+
+static struct threadpool *pool;
+static atomic_int runs[POOL_TASKS];
+static pthread_t runners[POOL_TASKS];
+static pthread_t spawners[POOL_SPAWNERS];
+
+static void *child_task(void *arg)
+{
+    intptr_t task = (intptr_t) arg;
+    atomic_fetch_add(&runs[task], 1);
+    runners[task] = pthread_self();
+    // Long enough for idle workers to come looking for work to steal
+    usleep(50);
+    return arg;
+}
+
+/**
+* Runs on a worker, so its children go on that worker's own deque, where
+* the other workers only reach them by stealing.
+*/
+static void *spawner_task(void *arg)
+{
+    intptr_t spawner = (intptr_t) arg;
+    struct tp_future *children[POOL_CHILDREN];
+    spawners[spawner] = pthread_self();
+    for (intptr_t i = 0; i < POOL_CHILDREN; i++) {
+        children[i] = threadpool_submit(pool, child_task, (void *) (spawner * POOL_CHILDREN + i));
+    }
+    intptr_t returned = 1;
+    for (intptr_t i = 0; i < POOL_CHILDREN; i++) {
+        if (children[i] == NULL
+                || tp_future_get(children[i]) != (void *) (spawner * POOL_CHILDREN + i)) {
+            returned = 0;
+        }
+    }
+    return (void *) returned;
+}
+
+/**
+* Submits tasks from outside the pool, which submit tasks from inside it,
+* and checks every task ran exactly once and returned its own result,
+* whichever worker took it from its deque or stole it.
+*/
+void test_threadpool_runs_each_task_once()
+{
+    struct tp_future *futures[POOL_SPAWNERS];
+
+    for (int i = 0; i < POOL_TASKS; i++) {
+        atomic_store(&runs[i], 0);
+    }
+    pool = threadpool_create(POOL_THREADS);
+    TEST_ASSERT_NOT_NULL_MESSAGE(pool, "threadpool_create should start the pool");
+    for (intptr_t i = 0; i < POOL_SPAWNERS; i++) {
+        futures[i] = threadpool_submit(pool, spawner_task, (void *) i);
+        TEST_ASSERT_NOT_NULL(futures[i]);
+    }
+    for (int i = 0; i < POOL_SPAWNERS; i++) {
+        TEST_ASSERT_TRUE_MESSAGE(tp_future_get(futures[i]) == (void *) 1,
+                "Every future should return what its own task returned");
+    }
+    threadpool_destroy(pool);
+    pool = NULL;
+
+    int stolen = 0;
+    for (int i = 0; i < POOL_TASKS; i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(1, atomic_load(&runs[i]),
+                "Every submitted task should run exactly once");
+        if (!pthread_equal(runners[i], spawners[i / POOL_CHILDREN])) {
+            stolen++;
+        }
+    }
+    TEST_ASSERT_TRUE_MESSAGE(stolen > 0,
+            "Idle workers should have stolen tasks from the busy workers' deques");
+}
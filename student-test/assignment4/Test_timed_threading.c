@@ -0,0 +1,61 @@
+#include "unity.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../../examples/threading/timed_threading.h"
+
+#define TIMED_TASKS         16
+#define TIMED_OBTAIN_MS     2       // between the tasks' requests for the mutex
+#define TIMED_RELEASE_MS    10      // each task holds the mutex this long
+
+/**
+* Starts many timed tasks on one mutex, requesting it in turn while the
+* first still holds it, and checks they got it in request order: each
+* releases, and so completes, before the next one obtains it.  Then checks
+* every future resolves to its thread_data, as pthread_join() would, with
+* thread_complete_success set.
+*/
+void test_timed_threading_fifo_handover()
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct tp_future *futures[TIMED_TASKS];
+    bool done[TIMED_TASKS] = { false };
+    int order[TIMED_TASKS];
+    int ndone = 0;
+
+    struct timerwheel *wheel = timerwheel_create(2);
+    TEST_ASSERT_NOT_NULL_MESSAGE(wheel, "timerwheel_create should start the wheel");
+    for (int i = 0; i < TIMED_TASKS; i++) {
+        futures[i] = start_timed_obtaining_mutex(wheel, &mutex, i * TIMED_OBTAIN_MS, TIMED_RELEASE_MS);
+        TEST_ASSERT_NOT_NULL_MESSAGE(futures[i], "start_timed_obtaining_mutex should start the task");
+    }
+
+    while (ndone < TIMED_TASKS) {
+        for (int i = 0; i < TIMED_TASKS; i++) {
+            if (!done[i] && tp_future_done(futures[i])) {
+                done[i] = true;
+                order[ndone++] = i;
+            }
+        }
+        usleep(500);
+    }
+    for (int i = 0; i < TIMED_TASKS; i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(i, order[i],
+                "The mutex should be handed over in the order it was requested");
+    }
+
+    for (int i = 0; i < TIMED_TASKS; i++) {
+        struct thread_data *data = (struct thread_data *) tp_future_get(futures[i]);
+        TEST_ASSERT_NOT_NULL_MESSAGE(data, "tp_future_get should return the task's thread_data");
+        TEST_ASSERT_TRUE_MESSAGE(data->mutex == &mutex, "The thread_data should name the task's mutex");
+        TEST_ASSERT_TRUE_MESSAGE(data->thread_complete_success,
+                "thread_complete_success should be set once the mutex was released");
+        free(data);
+    }
+    timerwheel_destroy(wheel);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, pthread_mutex_trylock(&mutex),
+            "The mutex should be free once every task completed");
+    pthread_mutex_unlock(&mutex);
+}
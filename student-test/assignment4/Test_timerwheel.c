@@ -0,0 +1,72 @@
+#include "unity.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include "../../examples/threading/timerwheel.h"
+
+/**
+* Delays in ms, in the order the timers must fire.  They start in the first
+* wheel, straddle its span (TW_SLOTS ticks) and go well past it, so most are
+* filed in the second wheel and cascaded into the first as they come due.
+* Two ticks apart at least, so adding them a tick late cannot swap them.
+*/
+static const unsigned delays[] = { 2, 20, 62, 64, 66, 90, 100, 126, 128, 130, 200, 300, 640, 1000 };
+#define WHEEL_TIMERS    (sizeof(delays) / sizeof(delays[0]))
+
+struct test_timer {
+    struct tw_timer timer;
+    int index;
+    struct timespec added;
+    int64_t elapsed_ms;
+};
+
+static struct test_timer timers[WHEEL_TIMERS];
+static int fired[WHEEL_TIMERS];
+static atomic_int nfired;
+
+static int64_t elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void record_timer(struct tw_timer *timer)
+{
+    struct test_timer *t = (struct test_timer *) timer;
+    t->elapsed_ms = elapsed_ms(&t->added);
+    int n = atomic_fetch_add(&nfired, 1);
+    if (n < (int) WHEEL_TIMERS) {
+        fired[n] = t->index;
+    }
+}
+
+/**
+* Adds timers in reverse order of their deadlines, all on one shard, and
+* checks each fires once, not before its delay, and in deadline order
+* across the cascade from the second wheel into the first.
+*/
+void test_timerwheel_cascade_order()
+{
+    struct timerwheel *wheel = timerwheel_create(2);
+    TEST_ASSERT_NOT_NULL_MESSAGE(wheel, "timerwheel_create should start the wheel");
+
+    atomic_store(&nfired, 0);
+    for (int i = WHEEL_TIMERS - 1; i >= 0; i--) {
+        timers[i].timer.fn = record_timer;
+        timers[i].index = i;
+        timers[i].elapsed_ms = -1;
+        clock_gettime(CLOCK_MONOTONIC, &timers[i].added);
+        timerwheel_add(wheel, &timers[i].timer, delays[i], 1);
+    }
+    timerwheel_destroy(wheel);
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(WHEEL_TIMERS, atomic_load(&nfired),
+            "Every timer should fire exactly once before timerwheel_destroy returns");
+    for (int i = 0; i < (int) WHEEL_TIMERS; i++) {
+        TEST_ASSERT_EQUAL_INT_MESSAGE(i, fired[i],
+                "Timers should fire in the order of their deadlines");
+        TEST_ASSERT_TRUE_MESSAGE(timers[i].elapsed_ms >= (int64_t) delays[i] - TW_TICK_MS,
+                "No timer should fire before its delay");
+    }
+}
@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include "threadpool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Optional: use these functions to add debug or error prints to your application
+#define DEBUG_LOG(msg,...)
+//#define DEBUG_LOG(msg,...) printf("threadpool: " msg "\n" , ##__VA_ARGS__)
+#define ERROR_LOG(msg,...) printf("threadpool ERROR: " msg "\n" , ##__VA_ARGS__)
+
+#define TP_DEQUE_SIZE   256     // initial deque capacity, doubled when full
+#define TP_SPIN_ROUNDS  64      // empty find_task() rounds before a worker sleeps
+#define TP_CACHE_LINE   64
+
+struct tp_future {
+    tp_func fn;
+    void *arg;
+    void *result;
+    struct threadpool *pool;
+    atomic_int refs;            // the pool (or promise) until completion, and the submitter
+    atomic_bool done;
+    bool waiting;               // a thread blocks on cond, under lock
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct tp_future *next;     // injection queue link
+};
+
+/**
+ * Ring of a deque.  A grown deque keeps its old rings on the retired list
+ * until the pool is freed, as a thief may still be reading them.
+ */
+struct tp_array {
+    int64_t size;               // power of two
+    struct tp_array *retired;
+    _Atomic(struct tp_future *) buf[];
+};
+
+/**
+ * Chase-Lev work-stealing deque: the owner pushes and takes at bottom,
+ * thieves take at top, and only the last task is ever raced for.
+ */
+struct tp_deque {
+    _Alignas(TP_CACHE_LINE) atomic_int_fast64_t top;
+    _Alignas(TP_CACHE_LINE) atomic_int_fast64_t bottom;
+    _Atomic(struct tp_array *) array;
+};
+
+struct tp_worker {
+    struct tp_deque deque;
+    struct threadpool *pool;
+    pthread_t thread;
+    unsigned rng;               // picks steal victims
+};
+
+struct threadpool {
+    int nworkers;
+    struct tp_worker *workers;
+    atomic_bool stopping;
+
+    // Tasks submitted from outside the pool
+    pthread_mutex_t inject_lock;
+    struct tp_future *inject_head, *inject_tail;
+    atomic_int ninjected;
+
+    // Idle workers sleep on wake
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    atomic_int sleepers;
+};
+
+// The worker running on this thread, if any
+static __thread struct tp_worker *tp_self;
+
+static struct tp_array *array_new(int64_t size) {
+    struct tp_array *a = malloc(sizeof(*a) + size * sizeof(a->buf[0]));
+    if (a == NULL) {
+        return NULL;
+    }
+    a->size = size;
+    a->retired = NULL;
+    return a;
+}
+
+/**
+ * Push @param task at the bottom of @param d, owner only
+ * @return 0 on success, -1 if the deque could not grow.
+ */
+static int deque_push(struct tp_deque *d, struct tp_future *task) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    struct tp_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    if (b - t > a->size - 1) {
+        struct tp_array *grown = array_new(a->size * 2);
+        if (grown == NULL) {
+            return -1;
+        }
+        for (int64_t i = t; i < b; i++) {
+            struct tp_future *x = atomic_load_explicit(&a->buf[i & (a->size - 1)], memory_order_relaxed);
+            atomic_store_explicit(&grown->buf[i & (grown->size - 1)], x, memory_order_relaxed);
+        }
+        grown->retired = a;
+        atomic_store_explicit(&d->array, grown, memory_order_release);
+        a = grown;
+    }
+    atomic_store_explicit(&a->buf[b & (a->size - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * Take the newest task of @param d, owner only
+ * @return the task, or NULL if the deque is empty.
+ */
+static struct tp_future *deque_take(struct tp_deque *d) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    struct tp_array *a = atomic_load_explicit(&d->array, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+    struct tp_future *task = NULL;
+    if (t <= b) {
+        task = atomic_load_explicit(&a->buf[b & (a->size - 1)], memory_order_relaxed);
+        if (t == b) {
+            // Last task: race the thieves for it
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                    memory_order_seq_cst, memory_order_relaxed)) {
+                task = NULL;
+            }
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/**
+ * Take the oldest task of @param d, from any thread
+ * @return the task, or NULL if the deque is empty or another thread won it.
+ */
+static struct tp_future *deque_steal(struct tp_deque *d) {
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+    struct tp_array *a = atomic_load_explicit(&d->array, memory_order_acquire);
+    struct tp_future *task = atomic_load_explicit(&a->buf[t & (a->size - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+static bool deque_empty(struct tp_deque *d) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_seq_cst);
+    return b <= t;
+}
+
+static void inject_push(struct threadpool *pool, struct tp_future *task) {
+    task->next = NULL;
+    pthread_mutex_lock(&pool->inject_lock);
+    if (pool->inject_tail) pool->inject_tail->next = task;
+    else pool->inject_head = task;
+    pool->inject_tail = task;
+    atomic_fetch_add(&pool->ninjected, 1);
+    pthread_mutex_unlock(&pool->inject_lock);
+}
+
+static struct tp_future *inject_pop(struct threadpool *pool) {
+    if (atomic_load_explicit(&pool->ninjected, memory_order_relaxed) == 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&pool->inject_lock);
+    struct tp_future *task = pool->inject_head;
+    if (task) {
+        pool->inject_head = task->next;
+        if (pool->inject_head == NULL) pool->inject_tail = NULL;
+        atomic_fetch_sub(&pool->ninjected, 1);
+    }
+    pthread_mutex_unlock(&pool->inject_lock);
+    return task;
+}
+
+/**
+ * @return true if any task is queued anywhere in @param pool
+ */
+static bool pool_has_work(struct threadpool *pool) {
+    if (atomic_load(&pool->ninjected) > 0) {
+        return true;
+    }
+    for (int i = 0; i < pool->nworkers; i++) {
+        if (!deque_empty(&pool->workers[i].deque)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Wake a sleeping worker for a task that was just queued
+ */
+static void pool_notify(struct threadpool *pool) {
+    // Pairs with the sleepers increment in worker_main(): either the
+    // sleeper sees the task, or this sees the sleeper
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->sleepers, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * Find the next task for @param w: its own deque first, then the
+ * injection queue, then a steal from the other workers starting at a
+ * random one
+ */
+static struct tp_future *find_task(struct tp_worker *w) {
+    struct threadpool *pool = w->pool;
+    struct tp_future *task = deque_take(&w->deque);
+    if (task) {
+        return task;
+    }
+    task = inject_pop(pool);
+    if (task) {
+        return task;
+    }
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 17;
+    w->rng ^= w->rng << 5;
+    int start = w->rng % pool->nworkers;
+    for (int i = 0; i < pool->nworkers; i++) {
+        struct tp_worker *victim = &pool->workers[(start + i) % pool->nworkers];
+        if (victim == w) {
+            continue;
+        }
+        task = deque_steal(&victim->deque);
+        if (task) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void future_put(struct tp_future *future) {
+    if (atomic_fetch_sub_explicit(&future->refs, 1, memory_order_acq_rel) == 1) {
+        pthread_cond_destroy(&future->cond);
+        pthread_mutex_destroy(&future->lock);
+        free(future);
+    }
+}
+
+static void future_complete(struct tp_future *future, void *result) {
+    future->result = result;
+    pthread_mutex_lock(&future->lock);
+    atomic_store_explicit(&future->done, true, memory_order_release);
+    if (future->waiting) {
+        pthread_cond_broadcast(&future->cond);
+    }
+    pthread_mutex_unlock(&future->lock);
+    future_put(future);
+}
+
+static void run_task(struct tp_future *task) {
+    future_complete(task, task->fn(task->arg));
+}
+
+static void* worker_main(void* worker_param)
+{
+    struct tp_worker *w = (struct tp_worker *) worker_param;
+    struct threadpool *pool = w->pool;
+    tp_self = w;
+
+    int idle = 0;
+    while (1) {
+        struct tp_future *task = find_task(w);
+        if (task) {
+            run_task(task);
+            idle = 0;
+            continue;
+        }
+        if (++idle < TP_SPIN_ROUNDS) {
+            sched_yield();
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        atomic_fetch_add(&pool->sleepers, 1);
+        while (!pool_has_work(pool) && !atomic_load(&pool->stopping)) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        atomic_fetch_sub(&pool->sleepers, 1);
+        bool stop = atomic_load(&pool->stopping) && !pool_has_work(pool);
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) {
+            break;
+        }
+        idle = 0;
+    }
+    DEBUG_LOG("worker exiting");
+    return NULL;
+}
+
+static void pool_free(struct threadpool *pool, int started) {
+    atomic_store(&pool->stopping, true);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < started; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (int i = 0; i < pool->nworkers; i++) {
+        struct tp_array *a = atomic_load(&pool->workers[i].deque.array);
+        while (a) {
+            struct tp_array *retired = a->retired;
+            free(a);
+            a = retired;
+        }
+    }
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->inject_lock);
+    free(pool->workers);
+    free(pool);
+}
+
+struct threadpool *threadpool_create(int nthreads)
+{
+    if (nthreads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? (int) cpus : 1;
+    }
+    struct threadpool *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        ERROR_LOG("Failed to allocate memory for threadpool");
+        return NULL;
+    }
+    if (posix_memalign((void **) &pool->workers, TP_CACHE_LINE, nthreads * sizeof(struct tp_worker)) != 0) {
+        ERROR_LOG("Failed to allocate memory for workers");
+        free(pool);
+        return NULL;
+    }
+    memset(pool->workers, 0, nthreads * sizeof(struct tp_worker));
+    pool->nworkers = nthreads;
+    pthread_mutex_init(&pool->inject_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        struct tp_worker *w = &pool->workers[i];
+        struct tp_array *a = array_new(TP_DEQUE_SIZE);
+        if (a == NULL) {
+            ERROR_LOG("Failed to allocate memory for deque");
+            pool_free(pool, 0);
+            return NULL;
+        }
+        atomic_init(&w->deque.array, a);
+        w->pool = pool;
+        w->rng = 2654435761u * (i + 1);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0) {
+            ERROR_LOG("Failed to create worker thread.");
+            pool_free(pool, i);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+static struct tp_future *future_new(struct threadpool *pool, tp_func fn, void *arg) {
+    struct tp_future *future = malloc(sizeof(*future));
+    if (future == NULL) {
+        ERROR_LOG("Failed to allocate memory for task");
+        return NULL;
+    }
+    future->fn = fn;
+    future->arg = arg;
+    future->result = NULL;
+    future->pool = pool;
+    atomic_init(&future->refs, 2);
+    atomic_init(&future->done, false);
+    future->waiting = false;
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_cond_init(&future->cond, NULL);
+    return future;
+}
+
+struct tp_future *threadpool_submit(struct threadpool *pool, tp_func fn, void *arg)
+{
+    struct tp_future *task = future_new(pool, fn, arg);
+    if (task == NULL) {
+        return NULL;
+    }
+
+    struct tp_worker *w = tp_self;
+    if (w == NULL || w->pool != pool || deque_push(&w->deque, task) < 0) {
+        inject_push(pool, task);
+    }
+    pool_notify(pool);
+    return task;
+}
+
+bool tp_future_done(struct tp_future *future)
+{
+    return atomic_load_explicit(&future->done, memory_order_acquire);
+}
+
+void *tp_future_get(struct tp_future *future)
+{
+    struct tp_worker *w = tp_self;
+    if (w && w->pool == future->pool) {
+        // Blocking here could leave the task with no worker to run it
+        while (!tp_future_done(future)) {
+            struct tp_future *task = find_task(w);
+            if (task) run_task(task);
+            else sched_yield();
+        }
+    } else {
+        pthread_mutex_lock(&future->lock);
+        while (!tp_future_done(future)) {
+            future->waiting = true;
+            pthread_cond_wait(&future->cond, &future->lock);
+        }
+        pthread_mutex_unlock(&future->lock);
+    }
+    void *result = future->result;
+    future_put(future);
+    return result;
+}
+
+void tp_future_detach(struct tp_future *future)
+{
+    future_put(future);
+}
+
+struct tp_future *tp_promise_create(void)
+{
+    return future_new(NULL, NULL, NULL);
+}
+
+void tp_promise_set(struct tp_future *future, void *result)
+{
+    future_complete(future, result);
+}
+
+void threadpool_destroy(struct threadpool *pool)
+{
+    pool_free(pool, pool->nworkers);
+}
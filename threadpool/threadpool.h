@@ -0,0 +1,74 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdbool.h>
+
+/**
+ * Fixed set of worker threads running submitted tasks, instead of one
+ * pthread_create() per unit of work.
+ * Every worker owns a deque: tasks it submits itself are pushed and taken
+ * at the bottom (LIFO, cache-warm), idle workers steal from the top of the
+ * others' deques.  Tasks submitted from outside the pool go through a
+ * shared injection queue.  Workers with nothing to run or steal sleep.
+ */
+struct threadpool;
+
+/**
+ * Join handle of a submitted task, holding its result once it has run
+ */
+struct tp_future;
+
+typedef void *(*tp_func)(void *arg);
+
+/**
+ * Start a pool of @param nthreads workers (0 for one per online CPU)
+ * @return the pool, or NULL on failure.
+ */
+struct threadpool *threadpool_create(int nthreads);
+
+/**
+ * Queue @param fn to run with @param arg on one of the workers of @param pool.
+ * Every future must be collected with tp_future_get() or dropped with
+ * tp_future_detach().
+ * @return the task's future, or NULL if memory ran out.
+ */
+struct tp_future *threadpool_submit(struct threadpool *pool, tp_func fn, void *arg);
+
+/**
+ * @return true if the task of @param future has finished
+ */
+bool tp_future_done(struct tp_future *future);
+
+/**
+ * Wait for the task of @param future and release the future, like
+ * pthread_join().  Called from a worker of the same pool, the wait runs
+ * other queued tasks instead of blocking, so tasks may wait on tasks.
+ * @return what the task returned.
+ */
+void *tp_future_get(struct tp_future *future);
+
+/**
+ * Release @param future without waiting; the task still runs
+ */
+void tp_future_detach(struct tp_future *future);
+
+/**
+ * Create a future that is not backed by a pool task but completed by
+ * tp_promise_set(), for work that finishes elsewhere (e.g. on a timer).
+ * It is collected like any other future.
+ * @return the future, or NULL if memory ran out.
+ */
+struct tp_future *tp_promise_create(void);
+
+/**
+ * Complete @param future, created by tp_promise_create(), with @param result
+ * and wake its waiter.  Must be called exactly once.
+ */
+void tp_promise_set(struct tp_future *future, void *result);
+
+/**
+ * Run every task still queued, then stop and free @param pool
+ */
+void threadpool_destroy(struct threadpool *pool);
+
+#endif // THREADPOOL_H